@@ -15,4 +15,7 @@
 #undef  static_inline
 #define static_inline  static __inline
 
+#undef  thread_var
+#define thread_var  __declspec(thread)
+
 #endif
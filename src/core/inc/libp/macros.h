@@ -24,5 +24,27 @@
  */
 #define static_inline  static inline
 
+/*
+ *	Thread-local storage class, e.g. "static thread_var int foo;"
+ */
+#define thread_var  __thread
+
+/*
+ *	A function that runs once before main(), for setting up
+ *	what is then read from several threads without locking,
+ *	e.g. "run_at_startup(foo_init) { ... }"
+ */
+#if defined(_MSC_VER)
+#pragma section(".CRT$XCU", read)
+#define run_at_startup(f) \
+	static void f(void); \
+	__declspec(allocate(".CRT$XCU")) void (* f##_at_startup)(void) = f; \
+	static void f(void)
+#else
+#define run_at_startup(f) \
+	static void f(void) __attribute__((constructor)); \
+	static void f(void)
+#endif
+
 #endif
 
@@ -35,6 +35,8 @@ void * heap_realloc(void * ptr, size_t size)
 
 void heap_free(void * p)
 {
-	heap_realloc(p, 0);
+	/* realloc(NULL, 0) is malloc(0), which need not be NULL */
+	if (p)
+		heap_realloc(p, 0);
 }
 
@@ -0,0 +1,51 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_AEAD_H_
+#define _LIBP_AEAD_H_
+
+#include "libp/types.h"
+
+/*
+ *	ChaCha20-Poly1305 AEAD as per RFC 8439.
+ *
+ *	ChaCha20 runs 8 blocks at a time with AVX2 or 4 at a time
+ *	with SSE2, whichever the CPU has, and one at a time in
+ *	plain C otherwise. Poly1305 is plain C.
+ *
+ *	seal() encrypts 'len' bytes from 'src' into 'dst' and
+ *	produces the tag. open() checks the tag and, only if it
+ *	matches, decrypts 'src' into 'dst'. It returns 0 if all
+ *	is well and -1 if the tag doesn't match. In either case
+ *	'dst' can be the same as 'src', i.e. it works in place,
+ *	or it can be another buffer, in which case it costs no
+ *	more than doing it in place.
+ *
+ *	A nonce must never be used twice with the same key.
+ */
+#define AEAD_KEY_SIZE    32
+#define AEAD_NONCE_SIZE  12
+#define AEAD_TAG_SIZE    16
+
+void aead_seal(const uint8_t * key, const uint8_t * nonce,
+               const void * ad, size_t ad_len,
+               void * dst, const void * src, size_t len,
+               uint8_t * tag);
+
+int  aead_open(const uint8_t * key, const uint8_t * nonce,
+               const void * ad, size_t ad_len,
+               void * dst, const void * src, size_t len,
+               const uint8_t * tag);
+
+/*
+ *	The primitives
+ */
+void chacha20_xor(const uint8_t * key, uint32_t counter, const uint8_t * nonce,
+                  void * dst, const void * src, size_t len);
+
+void poly1305(const uint8_t * key, const void * msg, size_t len, uint8_t * tag);
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_CRC32C_H_
+#define _LIBP_CRC32C_H_
+
+#include "libp/types.h"
+
+/*
+ *	CRC-32C (Castagnoli), same as in iSCSI, SCTP, ext4, etc.
+ *
+ *	Uses SSE 4.2 crc32 instruction if the CPU has it and a
+ *	slicing-by-8 table lookup if not.
+ *
+ *	Start with 'crc' of 0 and pass the result back in to
+ *	checksum the data in pieces. For "123456789" it's
+ *	0xE3069283.
+ */
+uint32_t crc32c(uint32_t crc, const void * buf, size_t len);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_HISTOGRAM_H_
+#define _LIBP_HISTOGRAM_H_
+
+#include "libp/types.h"
+#include "libp/macros.h"
+
+/*
+ *	Log-linear histogram, a la HdrHistogram.
+ *
+ *	Each power of two is split into 2^HIST_SUB_BITS linear
+ *	sub-buckets, so the values are recorded with a relative
+ *	error of at most 1/16, i.e. ~6%. The values from 0 to 15
+ *	are recorded exactly. Values above 2^HIST_MAX_BITS are
+ *	lumped together into the last bucket.
+ *
+ *	hist_add() is meant for hot paths, it is a handful of
+ *	instructions with no branches to speak of.
+ */
+#define HIST_SUB_BITS   4
+#define HIST_MAX_BITS   40
+#define HIST_BUCKETS    ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct histogram histogram;
+
+struct histogram
+{
+	uint64_t  count;
+	uint64_t  total;
+	uint64_t  max;
+
+	uint32_t  bucket[HIST_BUCKETS];
+};
+
+/*
+ *
+ */
+static_inline
+uint hist_log2(uint64_t v)
+{
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(v | 1);
+#else
+	uint r = 0;
+	while (v >>= 1)
+		r++;
+	return r;
+#endif
+}
+
+static_inline
+uint hist_index(uint64_t v)
+{
+	const uint64_t top = (uint64_t)1 << HIST_MAX_BITS;
+	uint e;
+
+	if (v >= top)
+		v = top - 1;
+
+	if (v < (1 << HIST_SUB_BITS))
+		return (uint)v;
+
+	e = hist_log2(v);
+
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+	       (uint)((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static_inline
+void hist_add(histogram * h, uint64_t v)
+{
+	h->bucket[ hist_index(v) ]++;
+	h->count++;
+	h->total += v;
+
+	if (h->max < v)
+		h->max = v;
+}
+
+/*
+ *	percentile() returns the lowest value of the bucket
+ *	that the p-th percentile falls into, 'p' is [0..1]
+ */
+void     hist_reset(histogram * h);
+void     hist_merge(histogram * to, const histogram * from);
+uint64_t hist_percentile(const histogram * h, double p);
+uint64_t hist_bucket_value(uint index);
+
+#endif
+
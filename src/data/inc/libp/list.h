@@ -7,6 +7,8 @@
 #ifndef _LIBP_LIST_H_
 #define _LIBP_LIST_H_
 
+#include "libp/macros.h"
+
 /*
  *	slist, qlist, hlist, dlist containers
  *	as per http://swapped.cc/on-linked-lists
@@ -32,20 +34,20 @@ struct hlist_item
 /*
  *
  */
-static inline
+static_inline
 void hlist_init(hlist_head * h)
 {
 	h->first = NULL;
 }
 
-static inline
+static_inline
 void hlist_init_item(hlist_item * i)
 {
 	i->pprev = NULL;
 	i->next = NULL;
 }
 
-static inline
+static_inline
 void hlist_add_front(hlist_head * h, hlist_item * i)
 {
 	i->next = h->first;
@@ -55,7 +57,7 @@ void hlist_add_front(hlist_head * h, hlist_item * i)
 	h->first = i;
 }
 
-static inline
+static_inline
 void hlist_del(hlist_item * i)
 {
 	if (! i->pprev)
@@ -68,11 +70,119 @@ void hlist_del(hlist_item * i)
 	hlist_init_item(i);
 }
 
-static inline
+static_inline
 hlist_item * hlist_walk(hlist_head * head, hlist_item * now)
 {
 	return now ? now->next : head->first;
 }
 
+/*
+ *	dlist
+ *
+ *	Circular doubly-linked list with the head acting as a
+ *	sentinel item, i.e. an empty list is a head that points
+ *	at itself.
+ */
+typedef struct dlist_item dlist_item;
+typedef struct dlist_item dlist_head;
+
+struct dlist_item
+{
+	dlist_item * next;
+	dlist_item * prev;
+};
+
+/*
+ *
+ */
+static_inline
+void dlist_init(dlist_head * h)
+{
+	h->next = h;
+	h->prev = h;
+}
+
+static_inline
+void dlist_init_item(dlist_item * i)
+{
+	i->next = NULL;
+	i->prev = NULL;
+}
+
+static_inline
+int dlist_empty(const dlist_head * h)
+{
+	return h->next == h;
+}
+
+static_inline
+int dlist_linked(const dlist_item * i)
+{
+	return i->next != NULL;
+}
+
+static_inline
+void dlist_insert_after(dlist_item * pos, dlist_item * i)
+{
+	i->prev = pos;
+	i->next = pos->next;
+	pos->next->prev = i;
+	pos->next = i;
+}
+
+static_inline
+void dlist_insert_before(dlist_item * pos, dlist_item * i)
+{
+	dlist_insert_after(pos->prev, i);
+}
+
+static_inline
+void dlist_add_front(dlist_head * h, dlist_item * i)
+{
+	dlist_insert_after(h, i);
+}
+
+static_inline
+void dlist_add_back(dlist_head * h, dlist_item * i)
+{
+	dlist_insert_before(h, i);
+}
+
+static_inline
+void dlist_del(dlist_item * i)
+{
+	if (! i->next)
+		return;
+
+	i->prev->next = i->next;
+	i->next->prev = i->prev;
+
+	dlist_init_item(i);
+}
+
+/*
+ *	Moves all items from 'from' to the back of 'to'
+ */
+static_inline
+void dlist_splice(dlist_head * to, dlist_head * from)
+{
+	if (dlist_empty(from))
+		return;
+
+	from->next->prev = to->prev;
+	from->prev->next = to;
+	to->prev->next = from->next;
+	to->prev = from->prev;
+
+	dlist_init(from);
+}
+
+static_inline
+dlist_item * dlist_walk(dlist_head * head, dlist_item * now)
+{
+	now = now ? now->next : head->next;
+	return (now == head) ? NULL : now;
+}
+
 #endif
 
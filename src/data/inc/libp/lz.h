@@ -0,0 +1,51 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_LZ_H_
+#define _LIBP_LZ_H_
+
+#include "libp/types.h"
+
+/*
+ *	A fast LZ77 block compressor, the output is in the LZ4
+ *	block format, so it can be checked against the reference
+ *	implementation if needed.
+ *
+ *	LZ_FAST looks matches up through a single hash table and
+ *	skips ahead faster and faster through the data that does
+ *	not compress. LZ_STRONG keeps hash chains, tries several
+ *	candidates at each position and defers a match if the next
+ *	position has a longer one. It is several times slower for
+ *	a noticeably better ratio.
+ *
+ *	The working memory is passed in by the caller, so that it
+ *	is not on the stack, and it needs no initialization. It
+ *	must be LZ_WORK(level) bytes.
+ *
+ *	lz_compress() returns the compressed size or 0 if it
+ *	didn't fit into 'max' bytes. Blocks are limited to 2GB.
+ *
+ *	lz_decompress() returns the decompressed size or -1 if
+ *	the input is malformed or doesn't fit into 'max' bytes.
+ *	It is safe to use with untrusted input.
+ */
+enum lz_level
+{
+	LZ_FAST   = 0,
+	LZ_STRONG = 1
+};
+
+#define LZ_TABLE_BITS  12
+#define LZ_TABLE       (1 << LZ_TABLE_BITS)
+
+#define LZ_WORK(level) ((level) == LZ_STRONG ? 256*1024 : LZ_TABLE * 4)
+
+size_t lz_compress(const void * src, size_t len,
+                   void * dst, size_t max, void * work, int level);
+
+int lz_decompress(const void * src, size_t len, void * dst, size_t max);
+
+#endif
@@ -0,0 +1,837 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/aead.h"
+#include "libp/macros.h"
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <immintrin.h>
+#define AEAD_X86
+#define AEAD_TARGET_SSE2
+#define AEAD_TARGET_AVX2
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define AEAD_X86
+#define AEAD_TARGET_SSE2 __attribute__((target("sse2")))
+#define AEAD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/*
+ *	little-endian loads and stores
+ */
+static_inline
+uint32_t load32(const uint8_t * p)
+{
+	return (uint32_t)p[0]       | (uint32_t)p[1] << 8 |
+	       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static_inline
+void store32(uint8_t * p, uint32_t v)
+{
+	p[0] = (uint8_t)(v);
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+}
+
+static_inline
+void store64(uint8_t * p, uint64_t v)
+{
+	store32(p, (uint32_t)v);
+	store32(p + 4, (uint32_t)(v >> 32));
+}
+
+/*
+ *	ChaCha20
+ *
+ *	The kernels xor 'blocks' 64-byte blocks of the keystream
+ *	into 'src', starting with the counter in state[12], and
+ *	return the number of blocks they did. The vector ones do
+ *	only whole multiples of their width.
+ */
+typedef size_t (* chacha20_fn)(const uint32_t * state, uint8_t * dst,
+                               const uint8_t * src, size_t blocks);
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)                         \
+	a += b; d ^= a; d = ROTL32(d, 16);          \
+	c += d; b ^= c; b = ROTL32(b, 12);          \
+	a += b; d ^= a; d = ROTL32(d, 8);           \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+static
+void chacha20_block(const uint32_t * state, uint32_t counter, uint8_t * out)
+{
+	uint32_t x[16];
+	int i;
+
+	memcpy(x, state, sizeof x);
+	x[12] = counter;
+
+	for (i=0; i<10; i++)
+	{
+		QUARTER(x[0], x[4], x[ 8], x[12]);
+		QUARTER(x[1], x[5], x[ 9], x[13]);
+		QUARTER(x[2], x[6], x[10], x[14]);
+		QUARTER(x[3], x[7], x[11], x[15]);
+
+		QUARTER(x[0], x[5], x[10], x[15]);
+		QUARTER(x[1], x[6], x[11], x[12]);
+		QUARTER(x[2], x[7], x[ 8], x[13]);
+		QUARTER(x[3], x[4], x[ 9], x[14]);
+	}
+
+	for (i=0; i<16; i++)
+		store32(out + 4*i, x[i] + (i == 12 ? counter : state[i]));
+}
+
+size_t chacha20_blocks_ref(const uint32_t * state, uint8_t * dst,
+                           const uint8_t * src, size_t blocks)
+{
+	uint8_t ks[64];
+	size_t n, i;
+
+	for (n=0; n<blocks; n++)
+	{
+		chacha20_block(state, state[12] + (uint32_t)n, ks);
+
+		for (i=0; i<64; i++)
+			dst[64*n + i] = src[64*n + i] ^ ks[i];
+	}
+
+	return blocks;
+}
+
+#ifdef AEAD_X86
+
+/*
+ *	SSE2, 4 blocks side by side, one per lane
+ */
+#define ROTL128(v, n) \
+	_mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define QUARTER128(a, b, c, d)                                                   \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTL128(d, 16);    \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTL128(b, 12);    \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTL128(d, 8);     \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTL128(b, 7);
+
+AEAD_TARGET_SSE2
+static
+void chacha20_xor4_sse2(__m128i * x, uint8_t * dst, const uint8_t * src)
+{
+	__m128i a, b, c, d, t0, t1, t2, t3;
+	int g;
+
+	/* x[4g .. 4g+3] are the same 4 words of each block */
+	for (g=0; g<4; g++)
+	{
+		a = x[4*g + 0];
+		b = x[4*g + 1];
+		c = x[4*g + 2];
+		d = x[4*g + 3];
+
+		t0 = _mm_unpacklo_epi32(a, b);
+		t1 = _mm_unpacklo_epi32(c, d);
+		t2 = _mm_unpackhi_epi32(a, b);
+		t3 = _mm_unpackhi_epi32(c, d);
+
+		a = _mm_unpacklo_epi64(t0, t1);  /* block 0 */
+		b = _mm_unpackhi_epi64(t0, t1);  /* block 1 */
+		c = _mm_unpacklo_epi64(t2, t3);  /* block 2 */
+		d = _mm_unpackhi_epi64(t2, t3);  /* block 3 */
+
+		#define XOR_STORE(blk, v)                                            \
+			_mm_storeu_si128((__m128i *)(dst + 64*blk + 16*g),           \
+				_mm_xor_si128(v, _mm_loadu_si128(                    \
+					(const __m128i *)(src + 64*blk + 16*g))));
+
+		XOR_STORE(0, a);
+		XOR_STORE(1, b);
+		XOR_STORE(2, c);
+		XOR_STORE(3, d);
+
+		#undef XOR_STORE
+	}
+}
+
+AEAD_TARGET_SSE2
+size_t chacha20_blocks_sse2(const uint32_t * state, uint8_t * dst,
+                            const uint8_t * src, size_t blocks)
+{
+	__m128i s[16], x[16];
+	size_t n;
+	int i;
+
+	for (i=0; i<16; i++)
+		s[i] = _mm_set1_epi32((int)state[i]);
+
+	s[12] = _mm_add_epi32(s[12], _mm_set_epi32(3, 2, 1, 0));
+
+	for (n=0; n + 4 <= blocks; n += 4)
+	{
+		for (i=0; i<16; i++)
+			x[i] = s[i];
+
+		for (i=0; i<10; i++)
+		{
+			QUARTER128(x[0], x[4], x[ 8], x[12]);
+			QUARTER128(x[1], x[5], x[ 9], x[13]);
+			QUARTER128(x[2], x[6], x[10], x[14]);
+			QUARTER128(x[3], x[7], x[11], x[15]);
+
+			QUARTER128(x[0], x[5], x[10], x[15]);
+			QUARTER128(x[1], x[6], x[11], x[12]);
+			QUARTER128(x[2], x[7], x[ 8], x[13]);
+			QUARTER128(x[3], x[4], x[ 9], x[14]);
+		}
+
+		for (i=0; i<16; i++)
+			x[i] = _mm_add_epi32(x[i], s[i]);
+
+		chacha20_xor4_sse2(x, dst + 64*n, src + 64*n);
+
+		s[12] = _mm_add_epi32(s[12], _mm_set1_epi32(4));
+	}
+
+	return n;
+}
+
+/*
+ *	AVX2, 8 blocks side by side
+ */
+#define ROTL256(v, n) \
+	_mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+#define QUARTER256(a, b, c, d)                                                                   \
+	a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot16); \
+	c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = ROTL256(b, 12);                \
+	a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot8);  \
+	c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = ROTL256(b, 7);
+
+AEAD_TARGET_AVX2
+static
+void chacha20_xor8_avx2(__m256i * x, uint8_t * dst, const uint8_t * src)
+{
+	__m256i a, b, c, d, t0, t1, t2, t3;
+	__m256i w[4][4]; /* [group][block 0..3 | block 4..7] */
+	int g, k;
+
+	for (g=0; g<4; g++)
+	{
+		a = x[4*g + 0];
+		b = x[4*g + 1];
+		c = x[4*g + 2];
+		d = x[4*g + 3];
+
+		/* same as the SSE2 version, in each 128-bit half */
+		t0 = _mm256_unpacklo_epi32(a, b);
+		t1 = _mm256_unpacklo_epi32(c, d);
+		t2 = _mm256_unpackhi_epi32(a, b);
+		t3 = _mm256_unpackhi_epi32(c, d);
+
+		w[g][0] = _mm256_unpacklo_epi64(t0, t1);
+		w[g][1] = _mm256_unpackhi_epi64(t0, t1);
+		w[g][2] = _mm256_unpacklo_epi64(t2, t3);
+		w[g][3] = _mm256_unpackhi_epi64(t2, t3);
+	}
+
+	for (k=0; k<4; k++)
+	{
+		/* words 0-7 and 8-15 of blocks k and k+4 */
+		__m256i lo_k  = _mm256_permute2x128_si256(w[0][k], w[1][k], 0x20);
+		__m256i hi_k  = _mm256_permute2x128_si256(w[2][k], w[3][k], 0x20);
+		__m256i lo_k4 = _mm256_permute2x128_si256(w[0][k], w[1][k], 0x31);
+		__m256i hi_k4 = _mm256_permute2x128_si256(w[2][k], w[3][k], 0x31);
+
+		#define XOR_STORE(off, v)                                            \
+			_mm256_storeu_si256((__m256i *)(dst + off),                  \
+				_mm256_xor_si256(v, _mm256_loadu_si256(              \
+					(const __m256i *)(src + off))));
+
+		XOR_STORE(64*k,           lo_k);
+		XOR_STORE(64*k + 32,      hi_k);
+		XOR_STORE(64*(k + 4),      lo_k4);
+		XOR_STORE(64*(k + 4) + 32, hi_k4);
+
+		#undef XOR_STORE
+	}
+}
+
+AEAD_TARGET_AVX2
+size_t chacha20_blocks_avx2(const uint32_t * state, uint8_t * dst,
+                            const uint8_t * src, size_t blocks)
+{
+	__m256i s[16], x[16];
+	__m256i rot16, rot8;
+	size_t n;
+	int i;
+
+	rot16 = _mm256_set_epi8(13,12,15,14, 9,8,11,10, 5,4,7,6, 1,0,3,2,
+	                        13,12,15,14, 9,8,11,10, 5,4,7,6, 1,0,3,2);
+	rot8  = _mm256_set_epi8(14,13,12,15, 10,9,8,11, 6,5,4,7, 2,1,0,3,
+	                        14,13,12,15, 10,9,8,11, 6,5,4,7, 2,1,0,3);
+
+	for (i=0; i<16; i++)
+		s[i] = _mm256_set1_epi32((int)state[i]);
+
+	s[12] = _mm256_add_epi32(s[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+
+	for (n=0; n + 8 <= blocks; n += 8)
+	{
+		for (i=0; i<16; i++)
+			x[i] = s[i];
+
+		for (i=0; i<10; i++)
+		{
+			QUARTER256(x[0], x[4], x[ 8], x[12]);
+			QUARTER256(x[1], x[5], x[ 9], x[13]);
+			QUARTER256(x[2], x[6], x[10], x[14]);
+			QUARTER256(x[3], x[7], x[11], x[15]);
+
+			QUARTER256(x[0], x[5], x[10], x[15]);
+			QUARTER256(x[1], x[6], x[11], x[12]);
+			QUARTER256(x[2], x[7], x[ 8], x[13]);
+			QUARTER256(x[3], x[4], x[ 9], x[14]);
+		}
+
+		for (i=0; i<16; i++)
+			x[i] = _mm256_add_epi32(x[i], s[i]);
+
+		chacha20_xor8_avx2(x, dst + 64*n, src + 64*n);
+
+		s[12] = _mm256_add_epi32(s[12], _mm256_set1_epi32(8));
+	}
+
+	return n;
+}
+
+int chacha20_has_avx2()
+{
+	static int has = -1;
+	uint32_t ecx1, ebx7;
+	uint64_t xcr0;
+
+	if (has >= 0)
+		return has;
+
+	has = 0;
+
+#if defined(_M_X64) || defined(_M_IX86)
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return has;
+
+	__cpuid(info, 1);
+	ecx1 = info[2];
+
+	__cpuidex(info, 7, 0);
+	ebx7 = info[1];
+#else
+	uint32_t eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return has;
+
+	if (! __get_cpuid(1, &eax, &ebx, &ecx1, &edx))
+		return has;
+
+	__cpuid_count(7, 0, eax, ebx7, ecx, edx);
+#endif
+
+	/* the OS must be saving the YMM state too */
+	if (! (ecx1 & (1 << 27)))
+		return has;
+
+#if defined(_M_X64) || defined(_M_IX86)
+	xcr0 = _xgetbv(0);
+#else
+	{
+		uint32_t lo, hi;
+		__asm__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		xcr0 = (uint64_t)hi << 32 | lo;
+	}
+#endif
+
+	has = (xcr0 & 6) == 6 && (ebx7 & (1 << 5));
+	return has;
+}
+
+#else
+
+size_t chacha20_blocks_sse2(const uint32_t * state, uint8_t * dst,
+                            const uint8_t * src, size_t blocks)
+{
+	return chacha20_blocks_ref(state, dst, src, blocks);
+}
+
+size_t chacha20_blocks_avx2(const uint32_t * state, uint8_t * dst,
+                            const uint8_t * src, size_t blocks)
+{
+	return chacha20_blocks_ref(state, dst, src, blocks);
+}
+
+int chacha20_has_avx2()
+{
+	return 0;
+}
+
+#endif
+
+/*
+ *	The widest kernel first, the narrower ones do the rest.
+ *	Picked before main(), as xforms run on worker threads,
+ *	and that also leaves chacha20_has_avx2() with its answer
+ *	cached by then.
+ */
+static chacha20_fn chacha20_kernels[3];
+static size_t      chacha20_kernel_count = 0;
+
+run_at_startup(chacha20_pick_kernels)
+{
+	size_t n = 0;
+
+#ifdef AEAD_X86
+	if (chacha20_has_avx2())
+		chacha20_kernels[n++] = chacha20_blocks_avx2;
+
+#if defined(_M_X64) || defined(__x86_64__)
+	chacha20_kernels[n++] = chacha20_blocks_sse2;
+#endif
+#endif
+	chacha20_kernels[n++] = chacha20_blocks_ref;
+
+	chacha20_kernel_count = n;
+}
+
+static
+void chacha20_init(uint32_t * state, const uint8_t * key,
+                   uint32_t counter, const uint8_t * nonce)
+{
+	int i;
+
+	state[0] = 0x61707865;  /* "expand 32-byte k" */
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+
+	for (i=0; i<8; i++)
+		state[4 + i] = load32(key + 4*i);
+
+	state[12] = counter;
+
+	for (i=0; i<3; i++)
+		state[13 + i] = load32(nonce + 4*i);
+}
+
+void chacha20_xor(const uint8_t * key, uint32_t counter, const uint8_t * nonce,
+                  void * dst_, const void * src_, size_t len)
+{
+	uint8_t * dst = (uint8_t *)dst_;
+	const uint8_t * src = (const uint8_t *)src_;
+	uint32_t state[16];
+	uint8_t ks[64];
+	size_t blocks, done, i, k;
+
+	chacha20_init(state, key, counter, nonce);
+
+	blocks = len / 64;
+
+	for (k=0; k<chacha20_kernel_count && blocks; k++)
+	{
+		done = chacha20_kernels[k](state, dst, src, blocks);
+
+		state[12] += (uint32_t)done;
+		dst += 64*done;
+		src += 64*done;
+		blocks -= done;
+	}
+
+	len %= 64;
+	if (! len)
+		return;
+
+	chacha20_block(state, state[12], ks);
+
+	for (i=0; i<len; i++)
+		dst[i] = src[i] ^ ks[i];
+}
+
+/*
+ *	Poly1305
+ *
+ *	With 44-bit limbs where the compiler has 128-bit integers
+ *	and with 26-bit ones elsewhere. The former is about twice
+ *	as fast.
+ */
+#if defined(__SIZEOF_INT128__)
+#define POLY1305_64
+typedef unsigned __int128 uint128_t;
+#endif
+
+typedef struct poly1305_ctx
+{
+#ifdef POLY1305_64
+	uint64_t r[3];
+	uint64_t h[3];
+	uint64_t pad[2];
+#else
+	uint32_t r[5];
+	uint32_t h[5];
+	uint32_t pad[4];
+#endif
+	uint8_t  buf[16];
+	size_t   buf_len;
+
+} poly1305_ctx;
+
+#ifdef POLY1305_64
+
+static_inline
+uint64_t load64(const uint8_t * p)
+{
+	return (uint64_t)load32(p) | (uint64_t)load32(p + 4) << 32;
+}
+
+static
+void poly1305_init(poly1305_ctx * ctx, const uint8_t * key)
+{
+	uint64_t t0 = load64(key);
+	uint64_t t1 = load64(key + 8);
+
+	ctx->r[0] = ( t0                    ) & 0xffc0fffffff;
+	ctx->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+	ctx->r[2] = ( t1 >> 24              ) & 0x00ffffffc0f;
+
+	memset(ctx->h, 0, sizeof ctx->h);
+
+	ctx->pad[0] = load64(key + 16);
+	ctx->pad[1] = load64(key + 24);
+
+	ctx->buf_len = 0;
+}
+
+static
+void poly1305_blocks(poly1305_ctx * ctx, const uint8_t * m, size_t len, int final)
+{
+	const uint64_t hibit = final ? 0 : (uint64_t)1 << 40;
+	const uint64_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+	const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+	uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+	uint128_t d0, d1, d2;
+	uint64_t t0, t1, c;
+
+	for ( ; len >= 16; len -= 16, m += 16)
+	{
+		t0 = load64(m);
+		t1 = load64(m + 8);
+
+		h0 += ( t0                    ) & 0xfffffffffff;
+		h1 += ((t0 >> 44) | (t1 << 20)) & 0xfffffffffff;
+		h2 += ((t1 >> 24              ) & 0x3ffffffffff) | hibit;
+
+		d0 = (uint128_t)h0*r0 + (uint128_t)h1*s2 + (uint128_t)h2*s1;
+		d1 = (uint128_t)h0*r1 + (uint128_t)h1*r0 + (uint128_t)h2*s2;
+		d2 = (uint128_t)h0*r2 + (uint128_t)h1*r1 + (uint128_t)h2*r0;
+
+		c = (uint64_t)(d0 >> 44); h0 = (uint64_t)d0 & 0xfffffffffff;
+		d1 += c; c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & 0xfffffffffff;
+		d2 += c; c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & 0x3ffffffffff;
+		h0 += c * 5; c = h0 >> 44; h0 &= 0xfffffffffff;
+		h1 += c;
+	}
+
+	ctx->h[0] = h0; ctx->h[1] = h1; ctx->h[2] = h2;
+}
+
+static
+void poly1305_finish(poly1305_ctx * ctx, uint8_t * tag)
+{
+	uint64_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+	uint64_t g0, g1, g2, c, t0, t1;
+
+	/* fully carry h */
+	c = h1 >> 44; h1 &= 0xfffffffffff;
+	h2 += c; c = h2 >> 42; h2 &= 0x3ffffffffff;
+	h0 += c * 5; c = h0 >> 44; h0 &= 0xfffffffffff;
+	h1 += c; c = h1 >> 44; h1 &= 0xfffffffffff;
+	h2 += c; c = h2 >> 42; h2 &= 0x3ffffffffff;
+	h0 += c * 5; c = h0 >> 44; h0 &= 0xfffffffffff;
+	h1 += c;
+
+	/* g = h - p, pick it if it doesn't underflow */
+	g0 = h0 + 5; c = g0 >> 44; g0 &= 0xfffffffffff;
+	g1 = h1 + c; c = g1 >> 44; g1 &= 0xfffffffffff;
+	g2 = h2 + c - ((uint64_t)1 << 42);
+
+	c = (g2 >> 63) - 1;
+	g0 &= c; g1 &= c; g2 &= c;
+	c = ~c;
+	h0 = (h0 & c) | g0;
+	h1 = (h1 & c) | g1;
+	h2 = (h2 & c) | g2;
+
+	/* h = h % 2^128 + pad */
+	t0 = ctx->pad[0];
+	t1 = ctx->pad[1];
+
+	h0 += ( t0                    ) & 0xfffffffffff; c = h0 >> 44; h0 &= 0xfffffffffff;
+	h1 += (((t0 >> 44) | (t1 << 20)) & 0xfffffffffff) + c; c = h1 >> 44; h1 &= 0xfffffffffff;
+	h2 += (( t1 >> 24              ) & 0x3ffffffffff) + c; h2 &= 0x3ffffffffff;
+
+	store64(tag,     (h0      ) | (h1 << 44));
+	store64(tag + 8, (h1 >> 20) | (h2 << 24));
+}
+
+#else
+
+static
+void poly1305_init(poly1305_ctx * ctx, const uint8_t * key)
+{
+	ctx->r[0] = (load32(key +  0)     ) & 0x3ffffff;
+	ctx->r[1] = (load32(key +  3) >> 2) & 0x3ffff03;
+	ctx->r[2] = (load32(key +  6) >> 4) & 0x3ffc0ff;
+	ctx->r[3] = (load32(key +  9) >> 6) & 0x3f03fff;
+	ctx->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+
+	memset(ctx->h, 0, sizeof ctx->h);
+
+	ctx->pad[0] = load32(key + 16);
+	ctx->pad[1] = load32(key + 20);
+	ctx->pad[2] = load32(key + 24);
+	ctx->pad[3] = load32(key + 28);
+
+	ctx->buf_len = 0;
+}
+
+static
+void poly1305_blocks(poly1305_ctx * ctx, const uint8_t * m, size_t len, int final)
+{
+	const uint32_t hibit = final ? 0 : 1 << 24;
+	const uint32_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+	const uint32_t r3 = ctx->r[3], r4 = ctx->r[4];
+	const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+	uint32_t h3 = ctx->h[3], h4 = ctx->h[4];
+	uint64_t d0, d1, d2, d3, d4;
+	uint32_t c;
+
+	for ( ; len >= 16; len -= 16, m += 16)
+	{
+		h0 += (load32(m +  0)     ) & 0x3ffffff;
+		h1 += (load32(m +  3) >> 2) & 0x3ffffff;
+		h2 += (load32(m +  6) >> 4) & 0x3ffffff;
+		h3 += (load32(m +  9) >> 6) & 0x3ffffff;
+		h4 += (load32(m + 12) >> 8) | hibit;
+
+		d0 = (uint64_t)h0*r0 + (uint64_t)h1*s4 + (uint64_t)h2*s3 + (uint64_t)h3*s2 + (uint64_t)h4*s1;
+		d1 = (uint64_t)h0*r1 + (uint64_t)h1*r0 + (uint64_t)h2*s4 + (uint64_t)h3*s3 + (uint64_t)h4*s2;
+		d2 = (uint64_t)h0*r2 + (uint64_t)h1*r1 + (uint64_t)h2*r0 + (uint64_t)h3*s4 + (uint64_t)h4*s3;
+		d3 = (uint64_t)h0*r3 + (uint64_t)h1*r2 + (uint64_t)h2*r1 + (uint64_t)h3*r0 + (uint64_t)h4*s4;
+		d4 = (uint64_t)h0*r4 + (uint64_t)h1*r3 + (uint64_t)h2*r2 + (uint64_t)h3*r1 + (uint64_t)h4*r0;
+
+		c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+		d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+		d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+		d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+		d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+		h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+		h1 += c;
+	}
+
+	ctx->h[0] = h0; ctx->h[1] = h1; ctx->h[2] = h2;
+	ctx->h[3] = h3; ctx->h[4] = h4;
+}
+
+static
+void poly1305_finish(poly1305_ctx * ctx, uint8_t * tag)
+{
+	uint32_t h0, h1, h2, h3, h4, c;
+	uint32_t g0, g1, g2, g3, g4, mask;
+	uint64_t f;
+
+	h0 = ctx->h[0]; h1 = ctx->h[1]; h2 = ctx->h[2];
+	h3 = ctx->h[3]; h4 = ctx->h[4];
+
+	/* fully carry h */
+	c = h1 >> 26; h1 &= 0x3ffffff;
+	h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+	h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+	h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+	h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+	h1 += c;
+
+	/* g = h - p, pick it if it doesn't underflow */
+	g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+	g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+	g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+	g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+	g4 = h4 + c - (1 << 26);
+
+	mask = (g4 >> 31) - 1;
+	g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+	mask = ~mask;
+	h0 = (h0 & mask) | g0;
+	h1 = (h1 & mask) | g1;
+	h2 = (h2 & mask) | g2;
+	h3 = (h3 & mask) | g3;
+	h4 = (h4 & mask) | g4;
+
+	/* h = h % 2^128 + pad */
+	h0 = (h0      ) | (h1 << 26);
+	h1 = (h1 >>  6) | (h2 << 20);
+	h2 = (h2 >> 12) | (h3 << 14);
+	h3 = (h3 >> 18) | (h4 <<  8);
+
+	f = (uint64_t)h0 + ctx->pad[0];             h0 = (uint32_t)f;
+	f = (uint64_t)h1 + ctx->pad[1] + (f >> 32); h1 = (uint32_t)f;
+	f = (uint64_t)h2 + ctx->pad[2] + (f >> 32); h2 = (uint32_t)f;
+	f = (uint64_t)h3 + ctx->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+	store32(tag +  0, h0);
+	store32(tag +  4, h1);
+	store32(tag +  8, h2);
+	store32(tag + 12, h3);
+}
+
+#endif
+
+static
+void poly1305_update(poly1305_ctx * ctx, const void * msg, size_t len)
+{
+	const uint8_t * m = (const uint8_t *)msg;
+	size_t n;
+
+	if (ctx->buf_len)
+	{
+		n = 16 - ctx->buf_len;
+		if (n > len)
+			n = len;
+
+		memcpy(ctx->buf + ctx->buf_len, m, n);
+		ctx->buf_len += n;
+		m += n;
+		len -= n;
+
+		if (ctx->buf_len < 16)
+			return;
+
+		poly1305_blocks(ctx, ctx->buf, 16, 0);
+		ctx->buf_len = 0;
+	}
+
+	n = len & ~(size_t)15;
+	poly1305_blocks(ctx, m, n, 0);
+
+	memcpy(ctx->buf, m + n, len - n);
+	ctx->buf_len = len - n;
+}
+
+/*
+ *	Pads the data so far to a multiple of 16, with zeros
+ */
+static
+void poly1305_pad16(poly1305_ctx * ctx)
+{
+	static const uint8_t zeros[16] = { 0 };
+
+	if (ctx->buf_len)
+		poly1305_update(ctx, zeros, 16 - ctx->buf_len);
+}
+
+static
+void poly1305_final(poly1305_ctx * ctx, uint8_t * tag)
+{
+	if (ctx->buf_len)
+	{
+		ctx->buf[ctx->buf_len] = 1;
+		memset(ctx->buf + ctx->buf_len + 1, 0, 15 - ctx->buf_len);
+		poly1305_blocks(ctx, ctx->buf, 16, 1);
+	}
+
+	poly1305_finish(ctx, tag);
+}
+
+void poly1305(const uint8_t * key, const void * msg, size_t len, uint8_t * tag)
+{
+	poly1305_ctx ctx;
+
+	poly1305_init(&ctx, key);
+	poly1305_update(&ctx, msg, len);
+	poly1305_final(&ctx, tag);
+}
+
+/*
+ *	AEAD
+ */
+static
+void aead_tag(const uint8_t * key, const uint8_t * nonce,
+              const void * ad, size_t ad_len,
+              const void * ct, size_t len, uint8_t * tag)
+{
+	static const uint8_t zeros[64] = { 0 };
+	uint8_t otk[64];
+	uint8_t lens[16];
+	poly1305_ctx ctx;
+
+	/* the one-time key is the first half of block 0 */
+	chacha20_xor(key, 0, nonce, otk, zeros, sizeof otk);
+
+	poly1305_init(&ctx, otk);
+
+	poly1305_update(&ctx, ad, ad_len);
+	poly1305_pad16(&ctx);
+
+	poly1305_update(&ctx, ct, len);
+	poly1305_pad16(&ctx);
+
+	store64(lens, ad_len);
+	store64(lens + 8, len);
+	poly1305_update(&ctx, lens, sizeof lens);
+
+	poly1305_final(&ctx, tag);
+
+	memset(otk, 0, sizeof otk);
+}
+
+void aead_seal(const uint8_t * key, const uint8_t * nonce,
+               const void * ad, size_t ad_len,
+               void * dst, const void * src, size_t len,
+               uint8_t * tag)
+{
+	chacha20_xor(key, 1, nonce, dst, src, len);
+	aead_tag(key, nonce, ad, ad_len, dst, len, tag);
+}
+
+int aead_open(const uint8_t * key, const uint8_t * nonce,
+              const void * ad, size_t ad_len,
+              void * dst, const void * src, size_t len,
+              const uint8_t * tag)
+{
+	uint8_t calc[AEAD_TAG_SIZE];
+	uint8_t diff = 0;
+	int i;
+
+	aead_tag(key, nonce, ad, ad_len, src, len, calc);
+
+	/* in constant time */
+	for (i=0; i<AEAD_TAG_SIZE; i++)
+		diff |= calc[i] ^ tag[i];
+
+	if (diff)
+		return -1;
+
+	chacha20_xor(key, 1, nonce, dst, src, len);
+	return 0;
+}
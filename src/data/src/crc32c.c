@@ -0,0 +1,193 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/crc32c.h"
+#include "libp/macros.h"
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CRC32C_HW_TARGET
+#define CRC32C_X86
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define CRC32C_HW_TARGET __attribute__((target("sse4.2")))
+#define CRC32C_X86
+#endif
+
+#define CRC32C_POLY  0x82f63b78  /* reversed 0x1edc6f41 */
+
+/*
+ *	slicing-by-8
+ */
+static uint32_t crc32c_table[8][256];
+
+static
+void crc32c_init_table()
+{
+	uint32_t c;
+	int i, j;
+
+	for (i=0; i<256; i++)
+	{
+		c = i;
+		for (j=0; j<8; j++)
+			c = (c >> 1) ^ (CRC32C_POLY & (0 - (c & 1)));
+
+		crc32c_table[0][i] = c;
+	}
+
+	for (i=0; i<256; i++)
+	{
+		c = crc32c_table[0][i];
+		for (j=1; j<8; j++)
+		{
+			c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+			crc32c_table[j][i] = c;
+		}
+	}
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void * buf, size_t len)
+{
+	const uint8_t * p = (const uint8_t *)buf;
+	uint32_t lo, hi;
+
+	crc = ~crc;
+
+	for ( ; len && ((uintptr_t)p & 7); len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	/* little-endian only, as is the rest of the code */
+	for ( ; len >= 8; len -= 8, p += 8)
+	{
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+
+		lo ^= crc;
+
+		crc = crc32c_table[7][ lo        & 0xff] ^
+		      crc32c_table[6][(lo >>  8) & 0xff] ^
+		      crc32c_table[5][(lo >> 16) & 0xff] ^
+		      crc32c_table[4][ lo >> 24        ] ^
+		      crc32c_table[3][ hi        & 0xff] ^
+		      crc32c_table[2][(hi >>  8) & 0xff] ^
+		      crc32c_table[1][(hi >> 16) & 0xff] ^
+		      crc32c_table[0][ hi >> 24        ];
+	}
+
+	for ( ; len; len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/*
+ *	SSE 4.2
+ */
+#ifdef CRC32C_X86
+
+CRC32C_HW_TARGET
+uint32_t crc32c_hw(uint32_t crc, const void * buf, size_t len)
+{
+	const uint8_t * p = (const uint8_t *)buf;
+#if defined(_M_X64) || defined(__x86_64__)
+	uint64_t c = ~crc;
+	uint64_t v;
+#else
+	uint32_t c = ~crc;
+	uint32_t v;
+#endif
+
+	for ( ; len && ((uintptr_t)p & 7); len--)
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+
+	for ( ; len >= sizeof v; len -= sizeof v, p += sizeof v)
+	{
+		memcpy(&v, p, sizeof v);
+#if defined(_M_X64) || defined(__x86_64__)
+		c = _mm_crc32_u64(c, v);
+#else
+		c = _mm_crc32_u32(c, v);
+#endif
+	}
+
+	for ( ; len; len--)
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+
+	return ~(uint32_t)c;
+}
+
+static int crc32c_hw_there = 0;
+
+static
+void crc32c_probe_hw()
+{
+	uint32_t ecx;
+
+#if defined(_M_X64) || defined(_M_IX86)
+	{
+		int info[4];
+		__cpuid(info, 1);
+		ecx = info[2];
+	}
+#else
+	{
+		uint32_t eax, ebx, edx;
+		if (! __get_cpuid(1, &eax, &ebx, &ecx, &edx))
+			ecx = 0;
+	}
+#endif
+
+	crc32c_hw_there = (ecx >> 20) & 1; /* SSE 4.2 */
+}
+
+int crc32c_has_hw()
+{
+	return crc32c_hw_there;
+}
+
+#else
+
+static
+void crc32c_probe_hw()
+{
+}
+
+uint32_t crc32c_hw(uint32_t crc, const void * buf, size_t len)
+{
+	return crc32c_sw(crc, buf, len);
+}
+
+int crc32c_has_hw()
+{
+	return 0;
+}
+
+#endif
+
+/*
+ *	Both are done up front, as the checksums may be taken
+ *	on several threads at once
+ */
+run_at_startup(crc32c_init)
+{
+	crc32c_init_table();
+	crc32c_probe_hw();
+}
+
+/*
+ *
+ */
+uint32_t crc32c(uint32_t crc, const void * buf, size_t len)
+{
+	return crc32c_has_hw() ?
+		crc32c_hw(crc, buf, len) :
+		crc32c_sw(crc, buf, len);
+}
@@ -0,0 +1,67 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/histogram.h"
+
+#include <string.h>
+
+/*
+ *
+ */
+void hist_reset(histogram * h)
+{
+	memset(h, 0, sizeof *h);
+}
+
+void hist_merge(histogram * to, const histogram * from)
+{
+	uint i;
+
+	for (i=0; i<HIST_BUCKETS; i++)
+		to->bucket[i] += from->bucket[i];
+
+	to->count += from->count;
+	to->total += from->total;
+
+	if (to->max < from->max)
+		to->max = from->max;
+}
+
+uint64_t hist_bucket_value(uint index)
+{
+	const uint sub = 1 << HIST_SUB_BITS;
+	uint e;
+
+	if (index < sub)
+		return index;
+
+	e = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+
+	return (uint64_t)(sub | (index & (sub - 1))) << (e - HIST_SUB_BITS);
+}
+
+uint64_t hist_percentile(const histogram * h, double p)
+{
+	uint64_t want, seen;
+	uint i;
+
+	if (! h->count)
+		return 0;
+
+	want = (uint64_t)(p * h->count);
+	if (want >= h->count)
+		want = h->count - 1;
+
+	for (i=0, seen=0; i<HIST_BUCKETS; i++)
+	{
+		seen += h->bucket[i];
+		if (seen > want)
+			return hist_bucket_value(i);
+	}
+
+	return h->max;
+}
+
@@ -0,0 +1,430 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/lz.h"
+#include "libp/macros.h"
+
+#include <string.h>
+
+/*
+ *	LZ4 block format -
+ *
+ *	  <token> [literals length+] <literals> <offset:le16> [match length+]
+ *
+ *	The token's top nibble is literals length, the bottom one
+ *	is match length less 4. Either being 15 means that more
+ *	length bytes follow, up to and including a non-255 one.
+ *	The last sequence has literals only, it ends the block.
+ *
+ *	Per the format, the last 5 bytes are always literals and
+ *	the last match starts no closer than 12 bytes to the end.
+ */
+#define LZ_MIN_MATCH    4
+#define LZ_LAST_LITS    5
+#define LZ_MATCH_LIMIT  12
+#define LZ_MAX_OFFSET   65535
+#define LZ_CHAIN_BITS   15
+#define LZ_CHAIN_DEPTH  16
+
+static_inline
+uint32_t lz_read32(const uint8_t * p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static_inline
+uint64_t lz_read64(const uint8_t * p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static_inline
+uint32_t lz_hash(uint32_t v, int bits)
+{
+	return (v * 2654435761u) >> (32 - bits);
+}
+
+/*
+ *	Emits a sequence, match_len of 0 means the last one.
+ *	Returns NULL if it doesn't fit.
+ */
+static
+uint8_t * lz_emit(uint8_t * op, const uint8_t * end,
+                  const uint8_t * lit, size_t lit_len,
+                  size_t offset, size_t match_len)
+{
+	uint8_t * token;
+	size_t n;
+
+	if ((size_t)(end - op) < 1 + lit_len + lit_len/255 + 1 + 2 + match_len/255 + 1)
+		return NULL;
+
+	token = op++;
+
+	if (lit_len >= 15)
+	{
+		*token = 15 << 4;
+		for (n = lit_len - 15; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = (uint8_t)n;
+	}
+	else
+	{
+		*token = (uint8_t)(lit_len << 4);
+	}
+
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (! match_len)
+		return op;
+
+	*op++ = (uint8_t)(offset);
+	*op++ = (uint8_t)(offset >> 8);
+
+	match_len -= LZ_MIN_MATCH;
+
+	if (match_len >= 15)
+	{
+		*token |= 15;
+		for (n = match_len - 15; n >= 255; n -= 255)
+			*op++ = 255;
+		*op++ = (uint8_t)n;
+	}
+	else
+	{
+		*token |= (uint8_t)match_len;
+	}
+
+	return op;
+}
+
+static_inline
+size_t lz_match_len(const uint8_t * src, size_t ref, size_t ip, size_t match_end)
+{
+	size_t len = LZ_MIN_MATCH;
+
+	while (ip + len + 8 <= match_end &&
+	       lz_read64(src + ref + len) == lz_read64(src + ip + len))
+		len += 8;
+
+	while (ip + len < match_end && src[ref + len] == src[ip + len])
+		len++;
+
+	return len;
+}
+
+/*
+ *	LZ_FAST, a single candidate per hash bucket
+ */
+static
+size_t lz_compress_fast(const uint8_t * src, size_t len,
+                        uint8_t * dst, size_t max, uint32_t * table)
+{
+	uint8_t * op = dst;
+	const uint8_t * end = dst + max;
+	size_t ip = 0, anchor = 0;
+	size_t limit, match_end;
+	size_t ref, len_m, step;
+	uint32_t v, h;
+
+	if (len < LZ_MATCH_LIMIT + 1)
+		goto last;
+
+	memset(table, 0, LZ_TABLE * sizeof *table);
+
+	limit = len - LZ_MATCH_LIMIT;
+	match_end = len - LZ_LAST_LITS;
+
+	while (ip < limit)
+	{
+		v = lz_read32(src + ip);
+		h = lz_hash(v, LZ_TABLE_BITS);
+		ref = table[h];
+		table[h] = (uint32_t)ip;
+
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(src + ref) != v)
+		{
+			/* speed through the data that doesn't compress */
+			step = 1 + ((ip - anchor) >> 6);
+			ip += step;
+			continue;
+		}
+
+		len_m = lz_match_len(src, ref, ip, match_end);
+
+		/* extend backward */
+		while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+		{
+			ip--;
+			ref--;
+			len_m++;
+		}
+
+		op = lz_emit(op, end, src + anchor, ip - anchor, ip - ref, len_m);
+		if (! op)
+			return 0;
+
+		ip += len_m;
+		anchor = ip;
+
+		/* cheap way to catch the next match sooner */
+		if (ip - 2 < limit)
+			table[lz_hash(lz_read32(src + ip - 2), LZ_TABLE_BITS)] = (uint32_t)(ip - 2);
+	}
+
+last:
+	op = lz_emit(op, end, src + anchor, len - anchor, 0, 0);
+	if (! op)
+		return 0;
+
+	return op - dst;
+}
+
+/*
+ *	LZ_STRONG, hash chains
+ *
+ *	'head' has the last position with a given hash, plus 1,
+ *	so that 0 means none. 'chain' links each position to the
+ *	previous one with the same hash by their distance, 0 ends
+ *	the chain. It is indexed by the position modulo 64K, which
+ *	is also the window size.
+ */
+typedef struct lz_chains
+{
+	uint32_t   head[1 << LZ_CHAIN_BITS];
+	uint16_t   chain[LZ_MAX_OFFSET + 1];
+
+} lz_chains;
+
+static_inline
+void lz_insert_upto(lz_chains * hc, const uint8_t * src, size_t * next, size_t ip)
+{
+	size_t pos, prev;
+	uint32_t h;
+
+	for (pos = *next; pos < ip; pos++)
+	{
+		h = lz_hash(lz_read32(src + pos), LZ_CHAIN_BITS);
+		prev = hc->head[h];
+
+		hc->chain[pos & LZ_MAX_OFFSET] =
+			(prev && pos - (prev - 1) <= LZ_MAX_OFFSET) ? (uint16_t)(pos - (prev - 1)) : 0;
+		hc->head[h] = (uint32_t)(pos + 1);
+	}
+
+	*next = ip;
+}
+
+static
+size_t lz_find(lz_chains * hc, const uint8_t * src,
+               size_t ip, size_t match_end, size_t * ref)
+{
+	uint32_t v = lz_read32(src + ip);
+	size_t pos = hc->head[lz_hash(v, LZ_CHAIN_BITS)];
+	size_t best = 0, len, delta;
+	int depth;
+
+	if (! pos--)
+		return 0;
+
+	for (depth = 0; depth < LZ_CHAIN_DEPTH; depth++)
+	{
+		if (ip - pos > LZ_MAX_OFFSET)
+			break;
+
+		if (lz_read32(src + pos) == v &&
+		    src[pos + best] == src[ip + best])
+		{
+			len = lz_match_len(src, pos, ip, match_end);
+			if (len > best)
+			{
+				best = len;
+				*ref = pos;
+			}
+		}
+
+		delta = hc->chain[pos & LZ_MAX_OFFSET];
+		if (! delta || delta > pos)
+			break;
+
+		pos -= delta;
+	}
+
+	return best;
+}
+
+static
+size_t lz_compress_strong(const uint8_t * src, size_t len,
+                          uint8_t * dst, size_t max, lz_chains * hc)
+{
+	uint8_t * op = dst;
+	const uint8_t * end = dst + max;
+	size_t ip = 0, anchor = 0;
+	size_t limit, match_end;
+	size_t ref = 0, len_m, ref2 = 0, len2;
+	size_t next = 0; /* the first position not in 'hc' yet */
+
+	if (len < LZ_MATCH_LIMIT + 1)
+		goto last;
+
+	memset(hc->head, 0, sizeof hc->head);
+
+	limit = len - LZ_MATCH_LIMIT;
+	match_end = len - LZ_LAST_LITS;
+
+	while (ip < limit)
+	{
+		lz_insert_upto(hc, src, &next, ip);
+
+		len_m = lz_find(hc, src, ip, match_end, &ref);
+		if (! len_m)
+		{
+			ip++;
+			continue;
+		}
+
+		/* see if the next position has a longer match */
+		while (ip + 1 < limit)
+		{
+			lz_insert_upto(hc, src, &next, ip + 1);
+
+			len2 = lz_find(hc, src, ip + 1, match_end, &ref2);
+			if (len2 <= len_m + 1)
+				break;
+
+			ip++;
+			ref = ref2;
+			len_m = len2;
+		}
+
+		/* extend backward */
+		while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+		{
+			ip--;
+			ref--;
+			len_m++;
+		}
+
+		op = lz_emit(op, end, src + anchor, ip - anchor, ip - ref, len_m);
+		if (! op)
+			return 0;
+
+		ip += len_m;
+		anchor = ip;
+	}
+
+last:
+	op = lz_emit(op, end, src + anchor, len - anchor, 0, 0);
+	if (! op)
+		return 0;
+
+	return op - dst;
+}
+
+size_t lz_compress(const void * src, size_t len,
+                   void * dst, size_t max, void * work, int level)
+{
+	if (level == LZ_STRONG)
+		return lz_compress_strong((const uint8_t *)src, len,
+		                          (uint8_t *)dst, max, (lz_chains *)work);
+
+	return lz_compress_fast((const uint8_t *)src, len,
+	                        (uint8_t *)dst, max, (uint32_t *)work);
+}
+
+int lz_decompress(const void * src_, size_t len, void * dst_, size_t max)
+{
+	const uint8_t * ip = (const uint8_t *)src_;
+	const uint8_t * ip_end = ip + len;
+	uint8_t * dst = (uint8_t *)dst_;
+	uint8_t * op = dst;
+	uint8_t * op_end = dst + max;
+	const uint8_t * ref;
+	size_t lit_len, match_len, offset, i;
+	uint token, b;
+
+	if (max > 0x7fffffff)
+		return -1;
+
+	for (;;)
+	{
+		if (ip == ip_end)
+			return -1;
+
+		token = *ip++;
+
+		/* literals */
+		lit_len = token >> 4;
+		if (lit_len == 15)
+			do
+			{
+				if (ip == ip_end)
+					return -1;
+				b = *ip++;
+				lit_len += b;
+			}
+			while (b == 255);
+
+		if (lit_len > (size_t)(ip_end - ip) ||
+		    lit_len > (size_t)(op_end - op))
+			return -1;
+
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+
+		if (ip == ip_end)
+			break; /* the last sequence */
+
+		/* match */
+		if (ip_end - ip < 2)
+			return -1;
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (! offset || offset > (size_t)(op - dst))
+			return -1;
+
+		match_len = token & 15;
+		if (match_len == 15)
+			do
+			{
+				if (ip == ip_end)
+					return -1;
+				b = *ip++;
+				match_len += b;
+			}
+			while (b == 255);
+
+		match_len += LZ_MIN_MATCH;
+
+		if (match_len > (size_t)(op_end - op))
+			return -1;
+
+		ref = op - offset;
+
+		if (offset >= match_len)
+		{
+			memcpy(op, ref, match_len);
+		}
+		else
+		{
+			/* overlapping, i.e. a run */
+			for (i=0; i<match_len; i++)
+				op[i] = ref[i];
+		}
+
+		op += match_len;
+	}
+
+	return (int)(op - dst);
+}
@@ -81,8 +81,11 @@ map_item * map_del(map_head * head, map_item * item)
 		while (q->r)
 			q = q->r;
 
+		/* hang the right subtree off the rightmost
+		   node of the left one, then pull the left
+		   subtree up into the item's place */
 		q->r = item->r;
-		item->p = q;
+		item->r->p = q;
 
 		*p = item->l;
 		item->l->p = item->p;
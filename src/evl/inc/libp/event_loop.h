@@ -8,6 +8,8 @@
 #define _LIBP_EVENT_LOOP_H_
 
 #include "libp/types.h"
+#include "libp/macros.h"
+#include "libp/list.h"
 
 /*
  *	For listening sockets:
@@ -52,23 +54,94 @@ enum socket_event
  *	to timeout_ms milliseconds and it will get you a callback
  *	if an event happens on a socket.
  *
+ *	add() returns -1 if the loop can't take the socket. With
+ *	select() that is any descriptor at FD_SETSIZE or above on
+ *	Linux and more than FD_SETSIZE sockets on Windows.
+ *
  *	Use mod() to change the monitored event mask.
  *
  *	Use del() to remove the socket from the loop.
+ *
+ *	Use set_timer() to get a callback after a delay. See below.
+ *
+ *	Use get_scratch() to get a temporary buffer that is shared
+ *	by everyone running on the loop. It is valid until the next
+ *	get_scratch() call or until the control returns back to the
+ *	loop, whichever comes first. The loop retains the largest
+ *	buffer requested so far, so this is essentially free after
+ *	the first call.
+ *
+ *	Use enable_stats() to have the loop time its polls and
+ *	callbacks, see evl_stats.h. It returns the stats block,
+ *	which is owned by the loop. Calling it again resets the
+ *	stats. Use tag_socket() to attach a name to a socket for
+ *	the stats to report it by.
  */
 typedef void (* event_loop_cb)(void * context, uint events);
 
 typedef struct event_loop event_loop;
+typedef struct evl_timer  evl_timer;
+typedef struct evl_stats  evl_stats;
+
+/*
+ *	evl_timer goes into app's own structure and set_timer()
+ *	merely links it into the loop's timer queue, so there is
+ *	no allocation involved.
+ *
+ *	Fill in 'cb' and 'cb_context', then arm the timer with
+ *	set_timer(). Once it expires, it is disarmed and the cb
+ *	is called with 'events' set to 0.
+ *
+ *	The timeout of 0 means "on the next pass of monitor()",
+ *	which can be used for deferring work to the next loop
+ *	iteration without waiting for a socket event.
+ *
+ *	set_timer() on an armed timer re-arms it, kill_timer()
+ *	on a disarmed timer is a no-op.
+ */
+struct evl_timer
+{
+	event_loop_cb  cb;
+	void *         cb_context;
+
+	/* private */
+	dlist_item     link;
+	uint64_t       due;   /* usec, clock_usec() */
+};
+
+static_inline
+void evl_timer_init(evl_timer * t, event_loop_cb cb, void * cb_context)
+{
+	t->cb = cb;
+	t->cb_context = cb_context;
+	dlist_init_item(&t->link);
+	t->due = 0;
+}
+
+static_inline
+int evl_timer_armed(const evl_timer * t)
+{
+	return dlist_linked(&t->link);
+}
 
 struct event_loop
 {
-	void (* add_socket)(event_loop * self, int sk, uint events,
+	int  (* add_socket)(event_loop * self, int sk, uint events,
 	                    event_loop_cb cb, void * cb_context);
 
 	void (* mod_socket)(event_loop * self, int sk, uint events);
 
 	void (* del_socket)(event_loop * self, int sk);
 
+	void (* tag_socket)(event_loop * self, int sk, const char * tag);
+
+	void (* set_timer)(event_loop * self, evl_timer * t, size_t timeout_ms);
+	void (* kill_timer)(event_loop * self, evl_timer * t);
+
+	void * (* get_scratch)(event_loop * self, size_t size);
+
+	evl_stats * (* enable_stats)(event_loop * self);
+
 	int  (* monitor)(event_loop * self, size_t timeout_ms);
 
 	void (* discard)(event_loop * self);
@@ -0,0 +1,69 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_EVL_STATS_H_
+#define _LIBP_EVL_STATS_H_
+
+#include "libp/event_loop.h"
+#include "libp/histogram.h"
+
+/*
+ *	Event loop stats, see event_loop.enable_stats()
+ *
+ *	'wait_usec' is how long each poll blocked for, 'ready'
+ *	is the number of sockets reported by each poll (0 for
+ *	timeouts), 'callback_usec' is the run time of socket and
+ *	timer callbacks and 'timer_lag_usec' is how late timers
+ *	were fired relative to their due time.
+ *
+ *	'slowest' holds the slowest callbacks seen so far, the
+ *	slowest first. 'sk' is -1 for timers. 'tag' is whatever
+ *	was passed to tag_socket(), so it should be a string
+ *	that outlives the loop, e.g. a literal.
+ */
+#define EVL_SLOWEST  8
+
+typedef struct evl_slow_cb evl_slow_cb;
+
+struct evl_slow_cb
+{
+	uint64_t      usec;
+	uint64_t      when;   /* clock_usec() */
+	int           sk;
+	uint          events;
+	const char  * tag;
+};
+
+struct evl_stats
+{
+	uint64_t      polls;
+	uint64_t      waited_usec;
+	uint64_t      busy_usec;   /* in callbacks */
+	uint64_t      callbacks;
+	uint64_t      timers;
+
+	histogram     wait_usec;
+	histogram     ready;
+	histogram     callback_usec;
+	histogram     timer_lag_usec;
+
+	evl_slow_cb   slowest[EVL_SLOWEST];
+};
+
+/*
+ *	A one-line text summary
+ */
+const char * evl_stats_to_str(const evl_stats * s, char * buf, size_t max);
+
+/*
+ *	For use by event loop implementations
+ */
+void evl_stats_on_poll(evl_stats * s, uint64_t waited, size_t ready);
+void evl_stats_on_callback(evl_stats * s, uint64_t started, 
+                           int sk, uint events, const char * tag);
+
+#endif
+
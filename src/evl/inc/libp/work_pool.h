@@ -0,0 +1,70 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_WORK_POOL_H_
+#define _LIBP_WORK_POOL_H_
+
+#include "libp/event_loop.h"
+
+/*
+ *	A pool of worker threads for an event loop to hand off
+ *	CPU-heavy work to, e.g. compression or encryption.
+ *
+ *	Work is submitted through a work_queue. Each queue has
+ *	its items done in parallel across all workers, but the
+ *	results are handed back to the queue's on_done() in the
+ *	same order the items were submitted in.
+ *
+ *	on_done() is called from the event loop and it gets all
+ *	items that are done so far in one go, as a list linked
+ *	through 'next'. Same as with io_pipe's on_activity(),
+ *	this call MUST be the last thing on_done() does.
+ *
+ *	Items go to the workers through per-worker single-producer
+ *	single-consumer rings and come back through another set of
+ *	such rings plus an eventfd that is watched by the loop, so
+ *	there are no locks and next to no syscalls under load.
+ *
+ *	If the rings are full, submit() runs the item right away
+ *	on the loop's own thread, so it never fails, but it may
+ *	take a while to return.
+ *
+ *	A queue can be discarded only once it has no items in
+ *	flight, see work_queue_pending(). A pool can be discarded
+ *	only once all its queues are gone.
+ *
+ *	On Windows there are no threads for now and all items are
+ *	run by submit(), though they are still handed back to
+ *	on_done() from the loop.
+ */
+typedef struct work_pool  work_pool;
+typedef struct work_queue work_queue;
+typedef struct work_item  work_item;
+
+struct work_item
+{
+	/* on a worker thread, must not touch any loop state */
+	void (* run)(work_item * w);
+
+	work_item * next;
+
+	/* private */
+	work_queue * queue;
+	int          done;
+};
+
+typedef void (* work_done_cb)(void * context, work_item * list);
+
+work_pool  * new_work_pool(event_loop * evl, size_t threads);
+void         work_pool_discard(work_pool * wp);
+
+work_queue * new_work_queue(work_pool * wp, work_done_cb on_done, void * context);
+void         work_queue_discard(work_queue * q);
+
+void         work_queue_submit(work_queue * q, work_item * w);
+size_t       work_queue_pending(const work_queue * q);
+
+#endif
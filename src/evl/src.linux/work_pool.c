@@ -0,0 +1,400 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/work_pool.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+#include "libp/list.h"
+
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ *	Single-producer single-consumer ring. The indices only
+ *	ever grow and each is written by one side only, so all
+ *	it takes is an acquire/release pair.
+ */
+#define WP_RING  256  /* items, a power of 2 */
+
+typedef struct wp_ring
+{
+	work_item * item[WP_RING];
+
+	size_t head __attribute__((aligned(64)));  /* consumer's */
+	size_t tail __attribute__((aligned(64)));  /* producer's */
+
+} wp_ring;
+
+static
+int ring_push(wp_ring * r, work_item * w)
+{
+	size_t tail = r->tail;
+
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == WP_RING)
+		return -1;
+
+	r->item[tail & (WP_RING-1)] = w;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static
+work_item * ring_pop(wp_ring * r)
+{
+	size_t head = r->head;
+	work_item * w;
+
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	w = r->item[head & (WP_RING-1)];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return w;
+}
+
+static
+int ring_empty(wp_ring * r)
+{
+	return r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+ *
+ */
+typedef struct wp_worker
+{
+	work_pool * wp;
+	pthread_t   thread;
+	int         efd;       /* to wake it up */
+	int         sleeping;
+	size_t      inflight;  /* the loop's, <= WP_RING, so 'out' never fills up */
+
+	wp_ring     in;
+	wp_ring     out;
+
+} wp_worker;
+
+struct work_pool
+{
+	event_loop * evl;
+	int          efd;       /* workers -> loop */
+	int          notified;  /* efd is written to and not yet read */
+	int          stop;
+
+	wp_worker  * workers;
+	size_t       count;
+	size_t       next;      /* round-robin */
+
+	dlist_head   ready;     /* queues with their first item done */
+	size_t       queues;
+};
+
+struct work_queue
+{
+	work_pool    * wp;
+	work_done_cb   on_done;
+	void         * context;
+
+	work_item    * head;    /* in order of submission */
+	work_item    * tail;
+	size_t         pending;
+
+	dlist_item     ready;
+};
+
+/*
+ *
+ */
+static
+void efd_write(int efd)
+{
+	uint64_t one = 1;
+
+	while (write(efd, &one, sizeof one) < 0 && errno == EINTR);
+}
+
+static
+void efd_read(int efd)
+{
+	uint64_t val;
+
+	while (read(efd, &val, sizeof val) < 0 && errno == EINTR);
+}
+
+static
+void wp_notify(work_pool * wp)
+{
+	if (! __atomic_exchange_n(&wp->notified, 1, __ATOMIC_SEQ_CST))
+		efd_write(wp->efd);
+}
+
+/*
+ *	worker thread
+ */
+static
+void * wp_worker_main(void * arg)
+{
+	wp_worker * wk = (wp_worker *)arg;
+	work_pool * wp = wk->wp;
+	work_item * w;
+	int r;
+
+	for (;;)
+	{
+		w = ring_pop(&wk->in);
+		if (w)
+		{
+			w->run(w);
+
+			r = ring_push(&wk->out, w);
+			assert(r == 0);
+
+			wp_notify(wp);
+			continue;
+		}
+
+		if (__atomic_load_n(&wp->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		/* pairs with the fence in wp_wake() */
+		__atomic_store_n(&wk->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (ring_empty(&wk->in) && ! __atomic_load_n(&wp->stop, __ATOMIC_ACQUIRE))
+			efd_read(wk->efd);
+
+		__atomic_store_n(&wk->sleeping, 0, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+static
+void wp_wake(wp_worker * wk)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&wk->sleeping, __ATOMIC_RELAXED))
+		efd_write(wk->efd);
+}
+
+/*
+ *	loop's side
+ */
+static
+void wp_item_done(work_pool * wp, work_item * w)
+{
+	work_queue * q = w->queue;
+
+	w->done = 1;
+
+	if (q->head == w && ! dlist_linked(&q->ready))
+		dlist_add_back(&wp->ready, &q->ready);
+}
+
+static
+void wp_deliver(work_pool * wp)
+{
+	work_queue * q;
+	work_item * list, * last;
+
+	while (! dlist_empty(&wp->ready))
+	{
+		q = struct_of(wp->ready.next, work_queue, ready);
+		dlist_del(&q->ready);
+
+		/* cut off the done ones */
+		list = last = q->head;
+		q->pending--;
+
+		while (last->next && last->next->done)
+		{
+			last = last->next;
+			q->pending--;
+		}
+
+		q->head = last->next;
+		if (! q->head)
+			q->tail = NULL;
+
+		last->next = NULL;
+
+		q->on_done(q->context, list);
+	}
+}
+
+static
+void wp_on_notify(void * context, uint events)
+{
+	work_pool * wp = (work_pool *)context;
+	work_item * w;
+	size_t i;
+
+	efd_read(wp->efd);
+
+	/* pairs with the exchange in wp_notify() */
+	__atomic_store_n(&wp->notified, 0, __ATOMIC_SEQ_CST);
+
+	for (i=0; i<wp->count; i++)
+	{
+		wp_worker * wk = wp->workers + i;
+
+		while ( (w = ring_pop(&wk->out)) )
+		{
+			wk->inflight--;
+			wp_item_done(wp, w);
+		}
+	}
+
+	wp_deliver(wp);
+}
+
+/*
+ *
+ */
+work_pool * new_work_pool(event_loop * evl, size_t threads)
+{
+	work_pool * wp;
+	size_t i;
+
+	wp = heap_zalloc(sizeof *wp);
+	if (! wp)
+		return NULL;
+
+	wp->evl = evl;
+	dlist_init(&wp->ready);
+
+	wp->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wp->efd < 0)
+	{
+		heap_free(wp);
+		return NULL;
+	}
+
+	wp->workers = heap_zalloc((threads ? threads : 1) * sizeof *wp->workers);
+
+	for (i=0; i<threads; i++)
+	{
+		wp_worker * wk = wp->workers + i;
+
+		wk->wp = wp;
+		wk->efd = eventfd(0, EFD_CLOEXEC);
+		if (wk->efd < 0)
+			break;
+
+		if (pthread_create(&wk->thread, NULL, wp_worker_main, wk) != 0)
+		{
+			close(wk->efd);
+			break;
+		}
+	}
+
+	/* make do with what we've got */
+	wp->count = i;
+
+	evl->add_socket(evl, wp->efd, SK_EV_readable, wp_on_notify, wp);
+
+	return wp;
+}
+
+void work_pool_discard(work_pool * wp)
+{
+	size_t i;
+
+	assert(! wp->queues);
+
+	__atomic_store_n(&wp->stop, 1, __ATOMIC_SEQ_CST);
+
+	for (i=0; i<wp->count; i++)
+		efd_write(wp->workers[i].efd);
+
+	for (i=0; i<wp->count; i++)
+	{
+		pthread_join(wp->workers[i].thread, NULL);
+		close(wp->workers[i].efd);
+	}
+
+	wp->evl->del_socket(wp->evl, wp->efd);
+	close(wp->efd);
+
+	heap_free(wp->workers);
+	heap_free(wp);
+}
+
+work_queue * new_work_queue(work_pool * wp, work_done_cb on_done, void * context)
+{
+	work_queue * q;
+
+	q = heap_zalloc(sizeof *q);
+	if (! q)
+		return NULL;
+
+	q->wp = wp;
+	q->on_done = on_done;
+	q->context = context;
+	dlist_init_item(&q->ready);
+
+	wp->queues++;
+	return q;
+}
+
+void work_queue_discard(work_queue * q)
+{
+	assert(! q->pending);
+
+	dlist_del(&q->ready);
+	q->wp->queues--;
+	heap_free(q);
+}
+
+void work_queue_submit(work_queue * q, work_item * w)
+{
+	work_pool * wp = q->wp;
+	wp_worker * wk;
+	size_t i;
+
+	w->queue = q;
+	w->next = NULL;
+	w->done = 0;
+
+	if (q->tail)
+		q->tail->next = w;
+	else
+		q->head = w;
+
+	q->tail = w;
+	q->pending++;
+
+	for (i=0; i<wp->count; i++)
+	{
+		wk = wp->workers + wp->next;
+
+		if (++wp->next == wp->count)
+			wp->next = 0;
+
+		if (wk->inflight == WP_RING)
+			continue;
+
+		wk->inflight++;
+		ring_push(&wk->in, w);
+		wp_wake(wk);
+		return;
+	}
+
+	/* no threads or they are all busy */
+	w->run(w);
+	wp_item_done(wp, w);
+	wp_notify(wp);
+}
+
+size_t work_queue_pending(const work_queue * q)
+{
+	return q->pending;
+}
@@ -10,8 +10,12 @@
 #include "libp/macros.h"
 #include "libp/alloc.h"
 #include "libp/map.h"
+#include "libp/list.h"
+#include "libp/clock.h"
+#include "libp/evl_stats.h"
 
 #include "libp/socket.h"
+#include <string.h>
 
 /*
  *	Rudimentary select()-based event loop
@@ -25,6 +29,8 @@ struct select_sk
 
 	map_item       by_sk;
 	uint           have;
+
+	const char *   tag;
 };
 
 typedef struct select_sk  select_sk;
@@ -42,6 +48,13 @@ struct evl_select
 	fd_set      fds_x;
 
 	map_head    sockets;
+	dlist_head  timers;  /* sorted by 'due' */
+
+	void *      scratch;
+	size_t      scratch_size;
+
+	evl_stats * stats;   /* optional */
+
 	int         map_touched : 1;
 	int         in_callback : 1;
 	int         dead : 1;
@@ -85,6 +98,8 @@ select_sk * alloc_select_sk(int sk, uint events,
 	foo->events = events;
 	foo->cb = cb;
 	foo->cb_context = cb_context;
+	foo->have = 0; /* may be added from a callback */
+	foo->tag = NULL;
 
 	return foo;
 }
@@ -102,6 +117,11 @@ void evl_select_dispose(evl_select * evl)
 		heap_free(ssk);
 	}
 
+	while (! dlist_empty(&evl->timers))
+		dlist_del(evl->timers.next);
+
+	heap_free(evl->scratch);
+	heap_free(evl->stats);
 	heap_free(evl);
 }
 
@@ -109,16 +129,20 @@ void evl_select_dispose(evl_select * evl)
  *
  */
 static
-void evl_select_add_socket(event_loop * self, int sk, uint events,
-                           event_loop_cb cb, void * cb_context)
+int evl_select_add_socket(event_loop * self, int sk, uint events,
+                          event_loop_cb cb, void * cb_context)
 {
 	evl_select * evl = struct_of(self, evl_select, api);
 	select_sk  * ssk;
 	map_item   * mi;
 
+	/* fd_set is an array of sockets and it's full */
+	if (evl->fds_x.fd_count >= FD_SETSIZE)
+		return -1;
+
 	ssk = alloc_select_sk(sk, events, cb, cb_context);
 	if (! ssk)
-		return; /* out of memory */
+		return -1; /* out of memory */
 
 	mi = map_add(&evl->sockets, &ssk->by_sk);
 	assert(! mi);   /* duplicate sk */
@@ -135,6 +159,7 @@ void evl_select_add_socket(event_loop * self, int sk, uint events,
 		evl->nfds = sk+1;
 
 	evl->map_touched = 1;
+	return 0;
 }
 
 static
@@ -221,6 +246,167 @@ void evl_select_del_socket(event_loop * self, int sk)
 	evl->map_touched = 1;
 }
 
+static
+void evl_select_tag_socket(event_loop * self, int sk, const char * tag)
+{
+	evl_select * evl = struct_of(self, evl_select, api);
+	select_sk  * ssk;
+
+	ssk = find_select_sk(evl, sk);
+	assert(ssk);
+
+	ssk->tag = tag;
+}
+
+static
+void evl_select_set_timer(event_loop * self, evl_timer * t, size_t timeout_ms)
+{
+	evl_select * evl = struct_of(self, evl_select, api);
+	dlist_item * pos;
+
+	assert(t->cb);
+
+	dlist_del(&t->link);
+
+	t->due = clock_usec() + 1000 * (uint64_t)timeout_ms;
+
+	/*
+	 *	Timers tend to be set with similar timeouts, so
+	 *	look for the spot starting from the back
+	 */
+	for (pos = evl->timers.prev; pos != &evl->timers; pos = pos->prev)
+		if (struct_of(pos, evl_timer, link)->due <= t->due)
+			break;
+
+	dlist_insert_after(pos, &t->link);
+}
+
+static
+void evl_select_kill_timer(event_loop * self, evl_timer * t)
+{
+	dlist_del(&t->link);
+}
+
+static
+void * evl_select_get_scratch(event_loop * self, size_t size)
+{
+	evl_select * evl = struct_of(self, evl_select, api);
+
+	if (evl->scratch_size < size)
+	{
+		/* no realloc(), the contents is not needed */
+		heap_free(evl->scratch);
+
+		evl->scratch = heap_malloc(size);
+		evl->scratch_size = evl->scratch ? size : 0;
+	}
+
+	return evl->scratch;
+}
+
+static
+evl_stats * evl_select_enable_stats(event_loop * self)
+{
+	evl_select * evl = struct_of(self, evl_select, api);
+
+	if (! evl->stats)
+		evl->stats = heap_malloc(sizeof *evl->stats);
+
+	if (evl->stats)
+		memset(evl->stats, 0, sizeof *evl->stats);
+
+	return evl->stats;
+}
+
+/*
+ *	Returns -1 if the loop was discarded from a callback
+ */
+static
+int evl_select_run_timers(evl_select * evl)
+{
+	dlist_head expired;
+	dlist_item * pos;
+	uint64_t now;
+
+	if (dlist_empty(&evl->timers))
+		return 0;
+
+	/*
+	 *	Move expired timers onto a separate list, so that
+	 *	the timers that are (re)armed from the callbacks 
+	 *	with zero timeout are not fired until next pass
+	 */
+	now = clock_usec();
+	dlist_init(&expired);
+
+	while ( (pos = dlist_walk(&evl->timers, NULL)) )
+	{
+		if (struct_of(pos, evl_timer, link)->due > now)
+			break;
+
+		dlist_del(pos);
+		dlist_add_back(&expired, pos);
+	}
+
+	while ( (pos = dlist_walk(&expired, NULL)) )
+	{
+		evl_timer * t = struct_of(pos, evl_timer, link);
+		uint64_t started;
+
+		dlist_del(pos);
+
+		evl->in_callback = 1;
+
+		if (! evl->stats)
+		{
+			t->cb(t->cb_context, 0);
+		}
+		else
+		{
+			started = clock_usec();
+
+			evl->stats->timers++;
+			hist_add(&evl->stats->timer_lag_usec, started - t->due);
+
+			t->cb(t->cb_context, 0);
+			evl_stats_on_callback(evl->stats, started, -1, 0, "timer");
+		}
+
+		evl->in_callback = 0;
+
+		if (evl->dead)
+		{
+			/* the rest is unlinked by dispose() */
+			dlist_splice(&evl->timers, &expired);
+			evl_select_dispose(evl);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static
+size_t evl_select_adjust_timeout(evl_select * evl, size_t timeout_ms)
+{
+	evl_timer * t;
+	uint64_t now;
+	uint64_t wait_ms;
+
+	if (dlist_empty(&evl->timers))
+		return timeout_ms;
+
+	t = struct_of(evl->timers.next, evl_timer, link);
+	now = clock_usec();
+
+	if (t->due <= now)
+		return 0;
+
+	wait_ms = (t->due - now + 999) / 1000;
+
+	return (wait_ms < timeout_ms) ? (size_t)wait_ms : timeout_ms;
+}
+
 static
 int evl_select_monitor(event_loop * self, size_t timeout_ms)
 {
@@ -230,6 +416,7 @@ int evl_select_monitor(event_loop * self, size_t timeout_ms)
 	int r;
 	map_item  * mi;
 	int active;
+	uint64_t started = 0;
 
 	/*
 	 *	Don't recurse, i.e. don't call evl->select() from
@@ -242,9 +429,14 @@ int evl_select_monitor(event_loop * self, size_t timeout_ms)
 	/*
 	 *	OK, select
 	 */
+	timeout_ms = evl_select_adjust_timeout(evl, timeout_ms);
+
 	tv.tv_sec = timeout_ms / 1000;
 	tv.tv_usec = 1000 * (timeout_ms % 1000);
 
+	if (evl->stats)
+		started = clock_usec();
+
 	if (! evl->nfds)
 	{
 		r = select(0, NULL, NULL, NULL, &tv);
@@ -262,7 +454,12 @@ int evl_select_monitor(event_loop * self, size_t timeout_ms)
 		return -1;
 
 	if (r == 0)
-		return 0;
+	{
+		if (evl->stats)
+			evl_stats_on_poll(evl->stats, clock_usec() - started, 0);
+
+		return evl_select_run_timers(evl);
+	}
 
 	/*
 	 *	Got some activity
@@ -290,6 +487,9 @@ int evl_select_monitor(event_loop * self, size_t timeout_ms)
 
 	assert(active); /* otherwise r should've been 0 */
 
+	if (evl->stats)
+		evl_stats_on_poll(evl->stats, clock_usec() - started, active);
+
 	/*
 	 *	Dispatch callbacks
 	 */
@@ -308,7 +508,22 @@ again:
 		ssk->have = 0;
 
 		evl->in_callback = 1;
-		ssk->cb(ssk->cb_context, have);
+
+		if (! evl->stats)
+		{
+			ssk->cb(ssk->cb_context, have);
+		}
+		else
+		{
+			/* 'ssk' may be gone after the callback */
+			int sk = ssk->sk;
+			const char * tag = ssk->tag;
+
+			started = clock_usec();
+			ssk->cb(ssk->cb_context, have);
+			evl_stats_on_callback(evl->stats, started, sk, have, tag);
+		}
+
 		evl->in_callback = 0;
 
 		if (evl->dead)
@@ -325,7 +540,7 @@ again:
 			goto again;
 	}
 
-	return 0;
+	return evl_select_run_timers(evl);
 }
 
 static
@@ -355,11 +570,16 @@ event_loop * new_event_loop_select()
 	if (! evl)
 		return NULL;
 
-	evl->api.add_socket = evl_select_add_socket;
-	evl->api.mod_socket = evl_select_mod_socket;
-	evl->api.del_socket = evl_select_del_socket;
-	evl->api.monitor    = evl_select_monitor;
-	evl->api.discard    = evl_select_discard;
+	evl->api.add_socket   = evl_select_add_socket;
+	evl->api.mod_socket   = evl_select_mod_socket;
+	evl->api.del_socket   = evl_select_del_socket;
+	evl->api.tag_socket   = evl_select_tag_socket;
+	evl->api.set_timer    = evl_select_set_timer;
+	evl->api.kill_timer   = evl_select_kill_timer;
+	evl->api.get_scratch  = evl_select_get_scratch;
+	evl->api.enable_stats = evl_select_enable_stats;
+	evl->api.monitor      = evl_select_monitor;
+	evl->api.discard      = evl_select_discard;
 
 	evl->nfds = 0;
 	FD_ZERO(&evl->fds_r);
@@ -367,7 +587,16 @@ event_loop * new_event_loop_select()
 	FD_ZERO(&evl->fds_x);
 
 	map_init(&evl->sockets, select_sk_comp);
+	dlist_init(&evl->timers);
+
+	evl->scratch = NULL;
+	evl->scratch_size = 0;
+
+	evl->stats = NULL;
+
 	evl->map_touched = 0;
+	evl->in_callback = 0;
+	evl->dead = 0;
 
 	return &evl->api;
 }
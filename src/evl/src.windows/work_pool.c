@@ -0,0 +1,141 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/work_pool.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+#include "libp/list.h"
+
+/*
+ *	No threads for now, see work_pool.h. Items are run by
+ *	submit() and handed back on the next pass of the loop.
+ */
+struct work_pool
+{
+	event_loop * evl;
+	evl_timer    deliver;
+
+	dlist_head   ready;     /* queues with their first item done */
+	size_t       queues;
+};
+
+struct work_queue
+{
+	work_pool    * wp;
+	work_done_cb   on_done;
+	void         * context;
+
+	work_item    * head;    /* in order of submission */
+	work_item    * tail;
+	size_t         pending;
+
+	dlist_item     ready;
+};
+
+/*
+ *
+ */
+static
+void wp_deliver(void * context, uint unused)
+{
+	work_pool * wp = (work_pool *)context;
+	work_queue * q;
+	work_item * list;
+
+	while (! dlist_empty(&wp->ready))
+	{
+		q = struct_of(wp->ready.next, work_queue, ready);
+		dlist_del(&q->ready);
+
+		/* all of them are done */
+		list = q->head;
+		q->head = q->tail = NULL;
+		q->pending = 0;
+
+		q->on_done(q->context, list);
+	}
+}
+
+work_pool * new_work_pool(event_loop * evl, size_t threads)
+{
+	work_pool * wp;
+
+	wp = heap_zalloc(sizeof *wp);
+	if (! wp)
+		return NULL;
+
+	wp->evl = evl;
+	evl_timer_init(&wp->deliver, wp_deliver, wp);
+	dlist_init(&wp->ready);
+
+	return wp;
+}
+
+void work_pool_discard(work_pool * wp)
+{
+	assert(! wp->queues);
+
+	wp->evl->kill_timer(wp->evl, &wp->deliver);
+	heap_free(wp);
+}
+
+work_queue * new_work_queue(work_pool * wp, work_done_cb on_done, void * context)
+{
+	work_queue * q;
+
+	q = heap_zalloc(sizeof *q);
+	if (! q)
+		return NULL;
+
+	q->wp = wp;
+	q->on_done = on_done;
+	q->context = context;
+	dlist_init_item(&q->ready);
+
+	wp->queues++;
+	return q;
+}
+
+void work_queue_discard(work_queue * q)
+{
+	assert(! q->pending);
+
+	dlist_del(&q->ready);
+	q->wp->queues--;
+	heap_free(q);
+}
+
+void work_queue_submit(work_queue * q, work_item * w)
+{
+	work_pool * wp = q->wp;
+
+	w->queue = q;
+	w->next = NULL;
+
+	w->run(w);
+	w->done = 1;
+
+	if (q->tail)
+		q->tail->next = w;
+	else
+		q->head = w;
+
+	q->tail = w;
+	q->pending++;
+
+	if (! dlist_linked(&q->ready))
+		dlist_add_back(&wp->ready, &q->ready);
+
+	if (! evl_timer_armed(&wp->deliver))
+		wp->evl->set_timer(wp->evl, &wp->deliver, 0);
+}
+
+size_t work_queue_pending(const work_queue * q)
+{
+	return q->pending;
+}
@@ -0,0 +1,75 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/evl_stats.h"
+
+#include "libp/clock.h"
+#include "libp/stdio.h"
+
+/*
+ *
+ */
+void evl_stats_on_poll(evl_stats * s, uint64_t waited, size_t ready)
+{
+	s->polls++;
+	s->waited_usec += waited;
+
+	hist_add(&s->wait_usec, waited);
+	hist_add(&s->ready, ready);
+}
+
+void evl_stats_on_callback(evl_stats * s, uint64_t started,
+                           int sk, uint events, const char * tag)
+{
+	uint64_t now = clock_usec();
+	uint64_t usec = now - started;
+	size_t i;
+
+	s->callbacks++;
+	s->busy_usec += usec;
+
+	hist_add(&s->callback_usec, usec);
+
+	/*
+	 *	insert into 'slowest', keeping it sorted
+	 */
+	if (usec <= s->slowest[EVL_SLOWEST-1].usec)
+		return;
+
+	for (i = EVL_SLOWEST-1; i && s->slowest[i-1].usec < usec; i--)
+		s->slowest[i] = s->slowest[i-1];
+
+	s->slowest[i].usec = usec;
+	s->slowest[i].when = now;
+	s->slowest[i].sk = sk;
+	s->slowest[i].events = events;
+	s->slowest[i].tag = tag;
+}
+
+const char * evl_stats_to_str(const evl_stats * s, char * buf, size_t max)
+{
+	snprintf(buf, max,
+		"%llu polls, waited %llu ms (p50 %llu, p99 %llu us), "
+		"ready p50 %llu, p99 %llu | "
+		"%llu callbacks, busy %llu ms (p50 %llu, p99 %llu, max %llu us) | "
+		"%llu timers, lag p99 %llu us",
+		(unsigned long long)s->polls,
+		(unsigned long long)s->waited_usec / 1000,
+		(unsigned long long)hist_percentile(&s->wait_usec, 0.50),
+		(unsigned long long)hist_percentile(&s->wait_usec, 0.99),
+		(unsigned long long)hist_percentile(&s->ready, 0.50),
+		(unsigned long long)hist_percentile(&s->ready, 0.99),
+		(unsigned long long)s->callbacks,
+		(unsigned long long)s->busy_usec / 1000,
+		(unsigned long long)hist_percentile(&s->callback_usec, 0.50),
+		(unsigned long long)hist_percentile(&s->callback_usec, 0.99),
+		(unsigned long long)s->callback_usec.max,
+		(unsigned long long)s->timers,
+		(unsigned long long)hist_percentile(&s->timer_lag_usec, 0.99));
+
+	return buf;
+}
+
@@ -18,6 +18,23 @@
  *	between the pipes, meaning that if it cannot send() data
  *	received from one pipe into another, then it temporarily
  *	stops reading data from former until send() goes through.
+ *
+ *	To keep a single busy stream from hogging the event loop,
+ *	each relaying pass is capped at 'quota_bytes' and at
+ *	'quota_reads' recv() calls. Once either is exhausted,
+ *	the rest of the relaying is deferred until the next pass
+ *	of the event loop, letting other bridges have their go.
+ *	Zero means no limit.
+ *
+ *	If recv_min < recv_max, the bridge will keep adjusting
+ *	recv_size within this range based on how much data each
+ *	recv() actually yields and how often the other side gets
+ *	congested, so that quiet streams are read with smaller
+ *	buffers and bulk ones - with larger. Otherwise recv_size
+ *	is used as is, which is the default. Note that datagram
+ *	pipes need recv_size to be no smaller than the largest
+ *	datagram they can get, so these should be read with a
+ *	fixed recv_size.
  */
 typedef struct br_pipe    br_pipe;
 typedef struct io_bridge  io_bridge;
@@ -29,11 +46,16 @@ struct br_pipe
 
 	/* config */
 	size_t    recv_size;
+	size_t    recv_min;
+	size_t    recv_max;
+	size_t    quota_bytes;
+	size_t    quota_reads;
 
 	/* stats */
 	uint64_t  tx;
 	uint64_t  rx;
 	size_t    congestions;
+	size_t    deferrals;
 };
 
 struct io_bridge
@@ -0,0 +1,47 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_IO_CONNECT_H_
+#define _LIBP_IO_CONNECT_H_
+
+#include "libp/event_loop.h"
+#include "libp/socket_utils.h"
+
+/*
+ *	io_connect races non-blocking connects over a set of paths,
+ *	RFC 8305 style, aka "happy eyeballs".
+ *
+ *	Attempts are started 'stagger_ms' apart, or right away once
+ *	the previous one fails, with address families interleaved.
+ *	Each attempt is given up on after 'timeout_ms'. The first
+ *	one to connect wins, the rest are cancelled and the winning
+ *	socket is passed to the callback, ready for new_tcp_pipe().
+ *	If none succeeds, the callback gets -1.
+ *
+ *	The callback is always called from the event loop and never
+ *	from new_io_connect() itself. The io_connect is gone by the
+ *	time the callback runs. Before that it can be cancelled with
+ *	io_connect_cancel(), in which case there is no callback.
+ */
+typedef struct io_connect      io_connect;
+typedef struct io_connect_path io_connect_path;
+
+typedef void (* io_connect_cb)(void * context, int sk);
+
+struct io_connect_path
+{
+	sockaddr_any  remote;
+	sockaddr_any  local;   /* bind to this first, if it's set */
+};
+
+io_connect * new_io_connect(event_loop * evl,
+                            const io_connect_path * path, size_t count,
+                            size_t stagger_ms, size_t timeout_ms,
+                            io_connect_cb cb, void * cb_context);
+
+void io_connect_cancel(io_connect * conn);
+
+#endif
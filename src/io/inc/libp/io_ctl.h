@@ -0,0 +1,50 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_IO_CTL_H_
+#define _LIBP_IO_CTL_H_
+
+#include "libp/event_loop.h"
+
+/*
+ *	io_ctl is a local control endpoint - a Unix socket that
+ *	accepts line-oriented text requests and passes each line
+ *	to the app's callback. Whatever the callback writes with
+ *	io_ctl_printf() is sent back followed by an empty line,
+ *	so that the client knows where the reply ends.
+ *
+ *	Clients may send any number of requests and close the
+ *	connection whenever they like, e.g.
+ *
+ *		echo stats | socat - UNIX-CONNECT:/run/tcp-proxy.sock
+ *
+ *	The sockets are non-blocking and run on the app's event
+ *	loop, so a client that doesn't read its replies merely
+ *	has them queued up and it won't stall anything else.
+ *	Once there's 256K of these, its further requests are not
+ *	read until it catches up.
+ */
+typedef struct io_ctl        io_ctl;
+typedef struct io_ctl_reply  io_ctl_reply;
+
+typedef void (* io_ctl_cb)(void * context, const char * request,
+                           io_ctl_reply * reply);
+
+/*
+ *	Returns NULL if the socket cannot be set up, including
+ *	when 'path' is taken by something that isn't a socket.
+ *	A stale socket file is removed before binding and the
+ *	new one on discard.
+ */
+io_ctl * new_io_ctl(event_loop * evl, const char * path,
+                    io_ctl_cb cb, void * cb_context);
+
+void io_ctl_discard(io_ctl * ctl);
+
+void io_ctl_printf(io_ctl_reply * reply, const char * format, ...);
+
+#endif
+
@@ -0,0 +1,95 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_IO_MUX_H_
+#define _LIBP_IO_MUX_H_
+
+#include "libp/io_pipe.h"
+
+/*
+ *	io_mux carries any number of logical streams over a single
+ *	datagram pipe, the carrier. Each stream is an io_pipe of
+ *	its own, with its own readable/writable/FIN state, so it
+ *	can be bridged, layered, etc. like any other pipe.
+ *
+ *	The carrier must deliver datagrams of up to IO_MUX_MTU
+ *	bytes, i.e. it is typically new_dgm_pipe(tcp, IO_MUX_MTU).
+ *	Each datagram is a single frame -
+ *
+ *		<type> <stream id> [payload]
+ *
+ *	where the id is a varint, odd for streams opened by the
+ *	initiator side of the mux and even for the other side.
+ *
+ *	open() creates a stream and announces it to the other side
+ *	that gets it in the on_stream() callback. The callback is
+ *	expected to set the stream's on_activity and init() it,
+ *	or just discard() it. Either side may open streams.
+ *
+ *	Stream's FIN maps onto a FIN frame. Discarding a stream
+ *	before both FINs are through resets the stream on the
+ *	other end, same as with TCP.
+ *
+ *	Flow control is per stream and credit-based. The receiving
+ *	end buffers up to 'window' bytes of stream's data that the
+ *	app hasn't read yet and the sender may not send more than
+ *	that. As the app reads the data, it is credited back to the
+ *	sender with WINDOW frames. A stream that is out of credit
+ *	clears its 'writable' bit until more credit comes in. So a
+ *	slow reader on one stream holds up only that stream and
+ *	never the carrier or the other streams on it.
+ *
+ *	Each side starts off with IO_MUX_WINDOW of credit for each
+ *	stream. 'window' can be raised above that, before opening
+ *	or accepting streams, but not lowered.
+ *
+ *	While the carrier is blocked, WINDOW credit adds up into a
+ *	single frame per stream. If there are still over a thousand
+ *	control frames waiting, the mux stops reading the carrier,
+ *	and with it taking new streams, until they are out.
+ *
+ *	If the carrier fails or gets closed, all streams break
+ *	and the mux issues on_shutdown(). The mux is discarded
+ *	by the app, after which its streams stay around in the
+ *	broken state until they are discarded as well.
+ *
+ *	on_stream() must not discard the mux, on_shutdown() may.
+ */
+typedef struct io_mux io_mux;
+
+#define IO_MUX_MTU     (16*1024 + 16)
+#define IO_MUX_WINDOW  (256*1024)
+
+struct io_mux
+{
+	/* config */
+	size_t    window;
+
+	/* stats */
+	size_t    streams;     /* open right now */
+	uint64_t  opened;
+	uint64_t  frames_tx;
+	uint64_t  frames_rx;
+	size_t    blocked;     /* times a stream ran out of credit */
+
+	/* The API */
+	void      (* init)(io_mux * self, event_loop * evl);
+	io_pipe * (* open)(io_mux * self);
+	void      (* discard)(io_mux * self);
+
+	/* The callbacks */
+	void (* on_stream)(void * context, io_pipe * stream);
+	void (* on_shutdown)(void * context);
+	void  * on_context;
+};
+
+/*
+ *	'initiator' is set on one side of the carrier and cleared
+ *	on the other, it is what keeps stream ids apart.
+ */
+io_mux * new_io_mux(io_pipe * carrier, int initiator);
+
+#endif
@@ -8,6 +8,7 @@
 #define _LIBP_IO_PIPE_H_
 
 #include "libp/event_loop.h"
+#include "libp/work_pool.h"
 
 /*
  *	-- In short --
@@ -99,8 +100,18 @@
  *	To recap - the on_activity() callback is issued by the 
  *	pipe when a respective state bit is changed from 0 to 1. 
  *
+ *	-- Send buffers --
+ *
+ *	A pipe may also provide get_buffer(), which returns 'len'
+ *	bytes of its own memory to put the data for the next send()
+ *	in. The buffer stays valid until that send() or until the
+ *	next get_buffer() call. Sending out of it lets the pipe
+ *	skip copying the data. NULL means that there's no buffer
+ *	to spare and that the data should be sent as usual.
+ *
  */
-typedef struct io_pipe io_pipe;
+typedef struct io_pipe  io_pipe;
+typedef struct io_stats io_stats;
 
 enum io_event
 {
@@ -138,14 +149,84 @@ struct io_pipe
 	void (* on_activity)(void * context, uint io_event_mask);
 	void  * on_context;
 
+	/* Optional, see io_stats.h */
+	io_stats * stats;
+
+	/* Optional, see above */
+	void * (* get_buffer)(io_pipe * p, size_t len);
+
 	const char * _tag;
 };
 
 /*
  *	TCP socket wrapper
+ *
+ *	By default the pipe is writable for as long as there's room
+ *	in the socket's send buffer, which may be megabytes, so the
+ *	data can sit in there for a while. set_lowat() caps that at
+ *	about 'bytes' of data that is not sent yet, with the help of
+ *	TCP_NOTSENT_LOWAT, so that 'writable' follows the rate at
+ *	which the connection actually drains. Returns -1 if it's not
+ *	supported. unsent() returns the number of bytes that are not
+ *	sent yet, or -1 if it's not known.
+ *
+ *	Keep 'bytes' well above the MSS, which is 64K over loopback.
+ *	Otherwise Nagle may hold back a partial segment that keeps
+ *	the pipe from going writable until the delayed ACK.
+ *
+ *	set_zerocopy() makes the pipe send with MSG_ZEROCOPY all
+ *	chunks of 'min_size' or more bytes that come out of its
+ *	get_buffer(). It keeps a few buffers for these and each
+ *	is put back in use only once the kernel reports that it
+ *	is done with the data. Returns -1 if the platform has no
+ *	zero-copy sends, in which case nothing changes.
+ *
+ *	Note that the kernel falls back to copying when sending
+ *	over the loopback, and 'copied' counts such sends.
  */
+typedef struct tcp_zc_stats tcp_zc_stats;
+
+struct tcp_zc_stats
+{
+	uint64_t  sends;      /* with MSG_ZEROCOPY */
+	uint64_t  bytes;
+	uint64_t  completed;
+	uint64_t  copied;     /* ... yet copied by the kernel */
+	uint64_t  no_buffer;  /* get_buffer() calls that had none to spare */
+};
+
 io_pipe * new_tcp_pipe(int sk);
 
+int  tcp_pipe_set_lowat(io_pipe * tcp, size_t bytes);
+int  tcp_pipe_unsent(io_pipe * tcp);
+
+int  tcp_pipe_set_zerocopy(io_pipe * tcp, size_t min_size);
+void tcp_pipe_zc_stats(io_pipe * tcp, tcp_zc_stats * stats);
+
+/*
+ *	In-memory pipe pair
+ *
+ *	Two pipes connected back to back, so that what is sent
+ *	into one comes out of the other. Each direction is backed
+ *	by a ring buffer of 'capacity' bytes, so send() may be
+ *	partial and may fail with 'writable' cleared once it is
+ *	full, same as with a socket.
+ *
+ *	The pair emulates a freshly connected socket - the pipes
+ *	become 'ready' and 'writable' in the first event loop pass
+ *	after init(). FIN works as with TCP and discarding either
+ *	pipe before its FIN goes out or with unread data in it
+ *	breaks the other one, same as a TCP reset would.
+ *
+ *	All on_activity() callbacks are issued from the event loop
+ *	and never from within send/recv calls. Both pipes must be
+ *	initialized with the same event loop.
+ *
+ *	Meant for running the rest of the pipe stack without any
+ *	kernel involvement, e.g. for profiling and testing.
+ */
+void new_mem_pipe_pair(size_t capacity, io_pipe ** a, io_pipe ** b);
+
 /*
  *	Atomic-send pipe
  *
@@ -161,26 +242,248 @@ io_pipe * new_atx_pipe(io_pipe * io);
  *	datagram. The receiving end reassembles the datagram, 
  *	strips off the size header and delivers the original
  *	payload. See UDP for details.
+ *
+ *	With set_crc() on, each datagram also carries CRC-32C of
+ *	its payload and the receiving end breaks the pipe if it
+ *	doesn't match. Both ends must have it on, and it must be
+ *	set before the first send/recv.
  */
 io_pipe * new_dgm_pipe(io_pipe * io, size_t max_size);
 
+void dgm_pipe_set_crc(io_pipe * dgm, int on);
+
+/*
+ *	Transforming pipe
+ *
+ *	Passes each datagram through an io_xform on its way out
+ *	and on its way in, e.g. to encrypt or to checksum it. The
+ *	xform's tx() may grow a datagram by up to 'overhead' bytes
+ *	and its rx() may not grow it at all. Either returns -1 if
+ *	the datagram is no good, which breaks the pipe. 'dst' is
+ *	either the same as 'src' or it doesn't overlap it.
+ *
+ *	Without a pool the xform is done inline, as the data is
+ *	copied into and out of the datagram.
+ *
+ *	With set_pool() it is done by the pool's worker threads
+ *	instead and the loop's thread only moves the data around.
+ *	Datagrams are still delivered in order in each direction
+ *	and the pipe queues up to 64 of them each way. 'max_size'
+ *	is that of the largest datagram the app is going to send.
+ *	set_pool() must be called before init().
+ *
+ *	Either way, datagrams are numbered by 'seq' from 0 in each
+ *	direction and the first one is done on the loop's thread
+ *	before any other, so that the xform can set itself up in
+ *	it. Other than that, tx() and rx() may run in parallel and
+ *	must not touch shared state.
+ *
+ *	An xform with a non-zero 'hello_size' also has each end
+ *	send a hello of that size, made by hello(), ahead of any
+ *	data and pass the one it gets from the other end to its
+ *	peer_hello(). The pipe is neither readable nor writable
+ *	until both of these are done, and either of them failing
+ *	breaks it. Hellos are not numbered.
+ *
+ *	The pipe owns the xform and discards it with itself.
+ */
+typedef struct io_xform  io_xform;
+
+struct io_xform
+{
+	size_t  overhead;
+	size_t  hello_size;
+
+	int  (* tx)(io_xform * x, uint64_t seq, uint8_t * dst, const uint8_t * src, size_t len);
+	int  (* rx)(io_xform * x, uint64_t seq, uint8_t * dst, const uint8_t * src, size_t len);
+
+	int  (* hello)(io_xform * x, uint8_t * buf);
+	int  (* peer_hello)(io_xform * x, const uint8_t * buf, size_t len);
+
+	void (* discard)(io_xform * x);
+};
+
+io_pipe * new_xform_pipe(io_pipe * dgm, io_xform * x);
+
+void xform_pipe_set_pool(io_pipe * xform, work_pool * wp, size_t max_size);
+
+/*
+ *	Encrypting pipe
+ *
+ *	An xform pipe that seals each datagram with ChaCha20-Poly1305
+ *	(see aead.h) under a pre-shared 32-byte key and opens it on
+ *	the other end, breaking the pipe if it was tampered with,
+ *	replayed, reordered or dropped. Both ends must use the same
+ *	key.
+ *
+ *	The ends swap random hellos first and every datagram is tied
+ *	to both of them and to its direction, so nothing recorded
+ *	from one connection passes on another or on the way back.
+ *
+ *	Datagrams grow by up to AEAD_OVERHEAD bytes, so 'io' is a
+ *	dgm pipe with max_size that much larger than what the app
+ *	sends.
+ */
+#define AEAD_OVERHEAD  16
+
+io_xform * new_aead_xform(const uint8_t * key);
+
+io_pipe * new_aead_pipe(io_pipe * dgm, const uint8_t * key);
+
+/*
+ *	Rate-limiting pipe
+ *
+ *	Caps the throughput of 'io' in either direction with a
+ *	token bucket. When the bucket runs dry, the pipe clears
+ *	its 'writable' (or 'readable') bit and raises it again,
+ *	with a matching on_activity() call, once the bucket has
+ *	been refilled. Either of buckets can be NULL.
+ *
+ *	send() may be partial, so this should go under atx/dgm
+ *	pipes, not over them.
+ *
+ *	Buckets are reference-counted and can be shared between
+ *	several pipes to cap their aggregate throughput, e.g.
+ *	of all sessions accepted from a listener. Each pipe holds
+ *	a reference to its buckets, so the app can release its
+ *	own right after creating the pipes.
+ *
+ *	'rate' is in bytes per second, 'burst' is the size of the
+ *	bucket in bytes.
+ */
+typedef struct rl_bucket rl_bucket;
+
+rl_bucket * new_rl_bucket(size_t rate, size_t burst);
+void rl_bucket_hold(rl_bucket * b);
+void rl_bucket_release(rl_bucket * b);
+
+io_pipe * new_ratelimit_pipe(io_pipe * io, rl_bucket * tx, rl_bucket * rx);
+
+/*
+ *	Compressing pipe
+ *
+ *	Compresses the outbound byte stream in blocks of up to 64K
+ *	with a fast LZ codec (see lz.h) and decompresses the inbound
+ *	one. Both ends of the connection must be zip pipes.
+ *
+ *	A partial block is sent out on the next pass of the event
+ *	loop, so small writes are still coalesced, but don't sit
+ *	around waiting for more data.
+ *
+ *	Blocks that don't compress are sent as is. After a few of
+ *	those in a row the pipe stops trying for a while, backing
+ *	off exponentially, so incompressible traffic costs next to
+ *	nothing in CPU.
+ *
+ *	The level is ZIP_FAST by default. With ZIP_AUTO the pipe
+ *	starts off with ZIP_NONE and moves between the levels based
+ *	on how congested 'io' is and on what each level costs in CPU
+ *	and saves in bytes, see io_pipe_zip.c for details. It still
+ *	trails the best fixed level by 15-25%, so it is opt-in. The
+ *	other end needs no setup, it takes any mix of levels.
+ *
+ *	send() may be partial, so this should go under atx/dgm
+ *	pipes, not over them.
+ */
+enum zip_level
+{
+	ZIP_NONE   = 0,
+	ZIP_FAST   = 1,
+	ZIP_STRONG = 2,
+	ZIP_AUTO   = 3
+};
+
+typedef struct zip_stats
+{
+	uint64_t  raw_tx;      /* bytes, as sent by the app */
+	uint64_t  zip_tx;      /* bytes, as passed to io */
+	uint64_t  blocks;
+	uint64_t  stored;      /* blocks sent as is */
+	uint64_t  skipped;     /* ... without trying to compress */
+	uint64_t  fast;        /* blocks compressed with ZIP_FAST */
+	uint64_t  strong;      /* ... and ZIP_STRONG */
+	uint64_t  switches;    /* of levels, by ZIP_AUTO */
+	uint64_t  congested_usec;
+	uint64_t  zip_usec;
+
+	uint64_t  zip_rx;
+	uint64_t  raw_rx;
+	uint64_t  unzip_usec;
+
+} zip_stats;
+
+io_pipe * new_zip_pipe(io_pipe * io);
+
+void zip_pipe_set_level(io_pipe * zip, int level);
+
+const zip_stats * zip_pipe_stats(const io_pipe * zip);
+
 /*
  *	Trunking pipe
  *
- *	Aggregates 1+ atx/dgm pipes into a single meta pipe
+ *	Aggregates 1+ dgm pipes into a single meta pipe
  *	that distributes outbound traffic across given pipes
  *	in round-robin (rr) or until-congested (uc) fashion.
+ *	The default is rr.
  *
  *	Each sent packet is prepended with a sequence number
  *	to allow for the packet stream to be ordered properly
  *	on the receiving end.
+ *
+ *	The meta pipe is a byte stream, cut into packets of up to
+ *	AGG_MTU bytes, so the carriers are dgm pipes with max_size
+ *	of AGG_MTU + AGG_OVERHEAD. Up to AGG_PIPES_MAX of them, all
+ *	added before init(). The receiving end must have the same
+ *	number of carriers, but not necessarily the same mode.
+ *
+ *	Since the packets are delivered in order, a carrier that
+ *	stalls holds up the whole pipe until it recovers. With
+ *	set_fec() each group of up to 'group' packets is followed
+ *	by a parity packet, which is their XOR and which goes on a
+ *	carrier other than the ones that carry the group. Each of
+ *	the group's packets goes on a different carrier, so if one
+ *	of them stalls, the receiving end rebuilds its packet from
+ *	the rest instead of waiting for it. 'group' is capped at
+ *	the number of carriers less one, and it is what it costs -
+ *	one parity packet per 'group' ones, about 1/group extra
+ *	bytes.
+ *
+ *	A partial group is sealed at the end of the event loop pass,
+ *	so sparse traffic is protected too, but at a higher cost, up
+ *	to a parity packet per packet. If no suitable carrier is
+ *	writable when a group is sealed, its parity is held back
+ *	until one is, and it is dropped if it is still held when
+ *	the next group is sealed.
+ *
+ *	set_fec() must be called after all carriers are added and
+ *	only on the sending end, the receiving end needs no setup.
  */
 typedef struct agg_pipe agg_pipe;
 
+#define AGG_MTU        (64*1024)
+#define AGG_OVERHEAD   16
+#define AGG_PIPES_MAX  8
+
+typedef struct agg_stats
+{
+	uint64_t  data_tx;     /* packets */
+	uint64_t  parity_tx;
+	uint64_t  unprotected; /* groups whose parity was dropped */
+
+	uint64_t  data_rx;
+	uint64_t  parity_rx;
+	uint64_t  recovered;   /* packets rebuilt from parity */
+	uint64_t  late;        /* ... that then came in anyway */
+
+} agg_stats;
+
 io_pipe * new_agg_pipe(io_pipe * carrier, agg_pipe ** api);
 
 void agg_pipe_add_pipe(agg_pipe * api, io_pipe * carrier);
 void agg_pipe_set_mode(agg_pipe * api, int round_robin);
+void agg_pipe_set_fec(agg_pipe * api, size_t group);
+
+const agg_stats * agg_pipe_stats(const agg_pipe * api);
 
 #endif
 
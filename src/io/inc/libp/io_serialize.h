@@ -23,5 +23,33 @@
 int io_store_size(uint8_t * buf, size_t size, size_t value);
 int io_parse_size(const uint8_t * buf, size_t size, size_t * value);
 
+/*
+ *	Same encoding as size, but for full 64-bit values,
+ *	takes up to 10 bytes.
+ */
+int io_store_u64(uint8_t * buf, size_t size, uint64_t value);
+int io_parse_u64(const uint8_t * buf, size_t size, uint64_t * value);
+
+/*
+ *	Fixed-size, in network byte order
+ */
+int io_store_be16(uint8_t * buf, size_t size, uint16_t value);
+int io_store_be32(uint8_t * buf, size_t size, uint32_t value);
+int io_store_be64(uint8_t * buf, size_t size, uint64_t value);
+
+int io_parse_be16(const uint8_t * buf, size_t size, uint16_t * value);
+int io_parse_be32(const uint8_t * buf, size_t size, uint32_t * value);
+int io_parse_be64(const uint8_t * buf, size_t size, uint64_t * value);
+
+/*
+ *	Sequence numbers, stored as a varint delta from the previous
+ *	one in the same stream, '*prev'. This keeps them at 1-2 bytes
+ *	for as long as they go up in small steps. Both functions
+ *	update '*prev' on success, so each side needs to keep its
+ *	own copy, starting with 0.
+ */
+int io_store_seq(uint8_t * buf, size_t size, uint64_t seq, uint64_t * prev);
+int io_parse_seq(const uint8_t * buf, size_t size, uint64_t * seq, uint64_t * prev);
+
 #endif
 
@@ -0,0 +1,72 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_IO_STATS_H_
+#define _LIBP_IO_STATS_H_
+
+#include "libp/io_pipe.h"
+#include "libp/histogram.h"
+
+/*
+ *	Per-pipe counters.
+ *
+ *	These are off by default and, once enabled, are updated
+ *	on every send/recv call and every callback. Pipes with
+ *	no stats pay nothing on send/recv, see io_stats.c.
+ *	Each pipe in a stack keeps its own, so enabling them on
+ *	all layers shows how calls, bytes and congestions at the
+ *	top translate into those at the bottom.
+ *
+ *	For tcp_pipe the send/recv calls are the syscalls.
+ *
+ *	'again' is a call that failed for the lack of data or
+ *	space, 'partial' is a send() that took some, but not all
+ *	of the data. Congestions are counted and timed from the
+ *	moment 'writable' goes down in send() to the moment the
+ *	pipe reports IO_EV_writable.
+ */
+struct io_stats
+{
+	uint64_t  send_calls;
+	uint64_t  send_bytes;
+	uint64_t  send_again;
+	uint64_t  send_partial;
+
+	uint64_t  recv_calls;
+	uint64_t  recv_bytes;
+	uint64_t  recv_again;
+
+	uint64_t  congestions;
+	uint64_t  congested_usec;
+	uint64_t  congested_since; /* 0 if not congested */
+
+	uint64_t  callbacks;
+
+	histogram send_size;
+	histogram recv_size;
+	histogram congestion_usec;
+};
+
+/*
+ *	enable() allocates the stats block, it is then released
+ *	together with the pipe. Calling it again resets the stats.
+ */
+io_stats * io_pipe_enable_stats(io_pipe * p);
+
+/*
+ *	A one-line text summary
+ */
+const char * io_stats_to_str(const io_stats * s, char * buf, size_t max);
+
+/*
+ *	Number and total capacity of io_buffers that are currently
+ *	allocated by all pipes and bridges, and the peak capacity.
+ *	Any argument can be NULL.
+ */
+void io_buffer_usage(size_t * count, size_t * bytes, size_t * peak);
+
+#endif
+
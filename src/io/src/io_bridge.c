@@ -27,6 +27,12 @@ struct br_stream  /* : br_pipe */
 	io_pipe   * pipe; /* a shortcut for base.pipe */
 
 	io_buffer * pending;
+	evl_timer   resume; /* deferred relaying from this stream */
+
+	/* recv_size adaptation, see br_stream_adapt() */
+	size_t      adapt_reads;
+	uint64_t    adapt_rx;
+	size_t      adapt_congestions;
 };
 
 struct br_bridge  /* : io_bridge */
@@ -46,6 +52,11 @@ struct br_bridge  /* : io_bridge */
 static
 void br_stream_cleanup(br_stream * st)
 {
+	event_loop * evl = st->bridge->evl;
+
+	if (evl)
+		evl->kill_timer(evl, &st->resume);
+
 	st->pipe->discard(st->pipe);
 	free_io_buffer(st->pending);
 }
@@ -57,6 +68,15 @@ void br_bridge_dispose(br_bridge * br)
 	br_stream_cleanup(&br->r);
 }
 
+static
+void br_bridge_shutdown(br_bridge * br, int graceful)
+{
+	br->dead = 1;
+
+	/* this may discard the bridge, so it MUST be a tail call */
+	br->base.on_shutdown(br->base.on_context, graceful);
+}
+
 /*
  *	relaying
  */
@@ -98,22 +118,38 @@ int br_stream_flush(br_stream * dst)
 	return 0;
 }
 
+/*
+ *	Data is read into the event loop's scratch space, or into
+ *	dst's own buffer if it has one, and it stays there if it's
+ *	sent out in full, which is the case unless 'dst' is
+ *	congested. So we only need a buffer of our own for the
+ *	unsent tail, if any.
+ */
 static
-int br_bridge_rx_tx(br_stream * src, br_stream * dst, io_buffer ** space)
+int br_bridge_rx_tx(br_stream * src, br_stream * dst)
 {
-	io_buffer * buf = *space;
+	event_loop * evl = src->bridge->evl;
 	size_t recv_size = src->base.recv_size;
+	uint8_t * buf;
 	int bytes;
+	int sent;
 
 	assert(src->pipe->readable && dst->pipe->writable);
 	assert(! dst->pending);
 
-	assert(buf && recv_size <= buf->capacity);
+	buf = dst->pipe->get_buffer ?
+		dst->pipe->get_buffer(dst->pipe, recv_size) : NULL;
+
+	if (! buf)
+		buf = evl->get_scratch(evl, recv_size);
+
+	if (! buf)
+		return -1;
 
 	/*
 	 *	rx
 	 */
-	bytes = src->pipe->recv(src->pipe, buf->data, recv_size);
+	bytes = src->pipe->recv(src->pipe, buf, recv_size);
 
 	if (bytes < 0)
 		return src->pipe->broken ? -1 : 0;
@@ -133,72 +169,121 @@ int br_bridge_rx_tx(br_stream * src, br_stream * dst, io_buffer ** space)
 	/*
 	 *	tx
 	 */
-	buf->size = bytes;
-	bytes = dst->pipe->send(dst->pipe, buf->data, buf->size);
+	sent = dst->pipe->send(dst->pipe, buf, bytes);
 
-	if (bytes < (int)buf->size || ! dst->pipe->writable)
+	if (sent < bytes || ! dst->pipe->writable)
 		dst->base.congestions++;
 
-	if (bytes > 0)
-		dst->base.tx += bytes;
+	if (sent > 0)
+		dst->base.tx += sent;
 
-	if (bytes == buf->size)
+	if (sent == bytes)
 		return 0;
 
-	if (bytes < 0)
+	if (sent < 0)
 	{
 		if (dst->pipe->broken)
 			return -1;
-		bytes = 0;
+		sent = 0;
 	}
 
 	/*
 	 *	congested
 	 */
-	assert(0 <= bytes && bytes < (int)buf->size);
+	assert(0 <= sent && sent < bytes);
 	assert(! dst->pipe->writable);
 
-	buf->head += bytes;
-	buf->size -= bytes;
+	dst->pending = alloc_io_buffer(bytes - sent, buf + sent, bytes - sent);
+	if (! dst->pending)
+		return -1;
 
-	/* appropriate the buffer */
-	dst->pending = buf;
-	*space = NULL;
 	return 0;
 }
 
+/*
+ *	Revisit src's recv_size after every few recv() calls.
+ *
+ *	If the reads keep filling up the buffer, double it. If
+ *	they keep coming back mostly empty, or if 'dst' can't
+ *	keep up and most of the sends leave some data pending,
+ *	then halve it.
+ */
 static
-int br_bridge_relay(br_stream * src, br_stream * dst)
+void br_stream_adapt(br_stream * src, br_stream * dst)
 {
-	io_buffer * buf;
-	size_t buf_size;
+	const size_t window = 4;
+	br_pipe * bp = &src->base;
+	uint64_t  avg;
+	size_t    congestions;
 
-	buf_size = src->peer->base.recv_size;
-	if (buf_size < src->base.recv_size)
-		buf_size = src->base.recv_size;
+	if (bp->recv_min >= bp->recv_max)
+		return;
 
-	buf = alloc_io_buffer(buf_size, NULL, 0);
-	if (! buf)
-		return -1;
+	if (++src->adapt_reads < window)
+		return;
+
+	avg = (bp->rx - src->adapt_rx) / src->adapt_reads;
+	congestions = dst->base.congestions - src->adapt_congestions;
+
+	if (congestions > src->adapt_reads / 2 ||
+	    avg < bp->recv_size / 4)
+	{
+		bp->recv_size /= 2;
+	}
+	else
+	if (avg >= bp->recv_size - bp->recv_size / 4)
+	{
+		bp->recv_size *= 2;
+	}
+
+	if (bp->recv_size < bp->recv_min)
+		bp->recv_size = bp->recv_min;
+
+	if (bp->recv_size > bp->recv_max)
+		bp->recv_size = bp->recv_max;
+
+	src->adapt_reads = 0;
+	src->adapt_rx = bp->rx;
+	src->adapt_congestions = dst->base.congestions;
+}
+
+static
+int br_bridge_relay(br_stream * src, br_stream * dst)
+{
+	uint64_t rx_quota;
+	size_t reads;
+
+	rx_quota = src->base.quota_bytes ?
+		src->base.rx + src->base.quota_bytes : (uint64_t)-1;
+	reads = 0;
 
 	while (src->pipe->readable && dst->pipe->writable)
 	{
-		if (br_bridge_rx_tx(src, dst, &buf) < 0)
+		if (src->base.rx >= rx_quota ||
+		    (src->base.quota_reads && reads == src->base.quota_reads))
 		{
-			free_io_buffer(buf);
-			return -1;
+			/*
+			 *	Used up our share for this pass, so
+			 *	let others have a go and pick up from
+			 *	here on the next one. Note that there
+			 *	won't be any new IO_EV_readable from
+			 *	'src' until we drain it, so this is
+			 *	the only way to resume.
+			 */
+			src->base.deferrals++;
+			src->bridge->evl->set_timer(src->bridge->evl,
+			                            &src->resume, 0);
+			break;
 		}
 
-		/*
-		 *	We either still have the buf or it was
-		 *	taken away by dst, because it got clogged
-		 *	and so it's no longer writable (and we'll
-		 *	break out of the loop in a moment).
-		 */
-		assert(buf || ! dst->pipe->writable);
+		reads++;
+
+		if (br_bridge_rx_tx(src, dst) < 0)
+			return -1;
+
+		br_stream_adapt(src, dst);
 	}
 
-	free_io_buffer(buf);
 	return 0;
 }
 
@@ -256,16 +341,36 @@ void br_stream_on_activity(void * context, uint events)
 	 *
 	 */
 	if (peer->pipe->fin_sent && peer->pipe->fin_rcvd)
-	{
-		br->dead = 1;
-		br->base.on_shutdown(br->base.on_context, 1);
-	}
+		br_bridge_shutdown(br, 1);
 
 	return;
 
 err:
-	br->dead = 1;
-	br->base.on_shutdown(br->base.on_context, 0);
+	br_bridge_shutdown(br, 0);
+}
+
+/*
+ *	a callback from the event loop, see br_bridge_relay()
+ */
+static
+void br_stream_on_resume(void * context, uint events)
+{
+	br_stream * self = (br_stream *)context;
+	br_stream * peer = self->peer;
+	br_bridge * br = self->bridge;
+
+	if (br->dead)
+		return;
+
+	if (self->pipe->readable && peer->pipe->writable &&
+	    br_bridge_relay(self, peer) < 0)
+	{
+		br_bridge_shutdown(br, 0);
+		return;
+	}
+
+	if (peer->pipe->fin_sent && peer->pipe->fin_rcvd)
+		br_bridge_shutdown(br, 1);
 }
 
 /*
@@ -294,6 +399,7 @@ void br_bridge_discard(io_bridge * self)
 	br_bridge * br = struct_of(self, br_bridge, base);
 
 	br_bridge_dispose(br);
+	heap_free(br);
 }
 
 /*
@@ -307,9 +413,16 @@ void br_setup_stream(br_bridge * br, br_stream * st, io_pipe * io)
 
 	st->base.pipe = io;
 	st->base.recv_size = 1024*1024;
+	st->base.recv_min = st->base.recv_size;
+	st->base.recv_max = st->base.recv_size;
+	st->base.quota_bytes = 1024*1024;
+	st->base.quota_reads = 16;
 	st->base.tx = 0;
 	st->base.rx = 0;
 	st->base.congestions = 0;
+	st->base.deferrals = 0;
+
+	evl_timer_init(&st->resume, br_stream_on_resume, st);
 
 	st->pipe = io;
 	st->pipe->on_activity = br_stream_on_activity;
@@ -5,12 +5,20 @@
  *	http://swapped.cc/bsd-license
  */
 #include "io_buffer.h"
+#include "libp/io_stats.h"
 
 #include "libp/alloc.h"
 #include "libp/assert.h"
 
 #include <string.h>
 
+/*
+ *	memory accounting, see io_buffer_usage()
+ */
+static size_t buffers_count = 0;
+static size_t buffers_bytes = 0;
+static size_t buffers_peak  = 0;
+
 /*
  *
  */
@@ -23,6 +31,14 @@ io_buffer * alloc_io_buffer(size_t capacity, const void * data, size_t size)
 
 	need = sizeof(io_buffer) - 1 + capacity;
 	buf = (io_buffer *)heap_zalloc(need);
+	if (! buf)
+		return NULL;
+
+	buffers_count++;
+	buffers_bytes += capacity;
+
+	if (buffers_peak < buffers_bytes)
+		buffers_peak = buffers_bytes;
 
 	buf->capacity = capacity;
 	buf->head = buf->data;
@@ -48,7 +64,46 @@ void reset_io_buffer(io_buffer * buf)
 
 void free_io_buffer(io_buffer * buf)
 {
-	if (buf)
-		heap_free(buf);
+	if (! buf)
+		return;
+
+	assert(buffers_count && buffers_bytes >= buf->capacity);
+
+	buffers_count--;
+	buffers_bytes -= buf->capacity;
+
+	heap_free(buf);
+}
+
+io_buffer * reserve_io_buffer(io_buffer * buf, size_t len)
+{
+	io_buffer * tmp;
+	size_t cap;
+
+	if (! buf)
+		return alloc_io_buffer(len < 4096 ? 4096 : len, NULL, 0);
+
+	if (buf->head + buf->size + len <= buf->data + buf->capacity)
+		return buf;
+
+	if (buf->size + len <= buf->capacity)
+	{
+		memmove(buf->data, buf->head, buf->size);
+		buf->head = buf->data;
+		return buf;
+	}
+
+	for (cap = buf->capacity; cap < buf->size + len; cap *= 2);
+
+	tmp = alloc_io_buffer(cap, buf->head, buf->size);
+	free_io_buffer(buf);
+	return tmp;
+}
+
+void io_buffer_usage(size_t * count, size_t * bytes, size_t * peak)
+{
+	if (count) *count = buffers_count;
+	if (bytes) *bytes = buffers_bytes;
+	if (peak)  *peak  = buffers_peak;
 }
 
@@ -31,5 +31,12 @@ io_buffer * alloc_io_buffer(size_t capacity, const void * data, size_t size);
 void reset_io_buffer(io_buffer * buf);
 void free_io_buffer(io_buffer * buf);
 
+/*
+ *	Makes room for 'len' more bytes after 'size', either by
+ *	moving the data to the front or by reallocating. 'buf' may
+ *	be NULL. Returns the buffer to use from now on.
+ */
+io_buffer * reserve_io_buffer(io_buffer * buf, size_t len);
+
 #endif
 
@@ -0,0 +1,258 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/io_connect.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+#include "libp/socket.h"
+
+/*
+ *
+ */
+typedef struct conn_attempt conn_attempt;
+
+struct conn_attempt
+{
+	io_connect      * conn;
+	io_connect_path   path;
+
+	int               sk;      /* -1 if not running */
+	evl_timer         timeout;
+};
+
+struct io_connect
+{
+	event_loop   * evl;
+
+	size_t         stagger_ms;
+	size_t         timeout_ms;
+
+	io_connect_cb  cb;
+	void         * cb_context;
+
+	evl_timer      stagger;
+	size_t         next;      /* attempt to start next */
+	size_t         pending;   /* attempts in progress */
+
+	size_t         count;
+	conn_attempt   attempt[1];
+};
+
+/*
+ *	attempts
+ */
+static
+void conn_attempt_stop(conn_attempt * a)
+{
+	io_connect * conn = a->conn;
+
+	if (a->sk < 0)
+		return;
+
+	conn->evl->del_socket(conn->evl, a->sk);
+	conn->evl->kill_timer(conn->evl, &a->timeout);
+
+	sk_close(a->sk);
+	a->sk = -1;
+	conn->pending--;
+}
+
+static
+void conn_finish(io_connect * conn, int sk)
+{
+	io_connect_cb cb = conn->cb;
+	void * cb_context = conn->cb_context;
+	size_t i;
+
+	for (i=0; i<conn->count; i++)
+		conn_attempt_stop(conn->attempt + i);
+
+	conn->evl->kill_timer(conn->evl, &conn->stagger);
+	heap_free(conn);
+
+	cb(cb_context, sk);
+}
+
+static void conn_start_next(io_connect * conn);
+
+static
+void conn_attempt_on_activity(void * context, uint events)
+{
+	conn_attempt * a = (conn_attempt *)context;
+	io_connect * conn = a->conn;
+	int sk = a->sk;
+
+	if ( (events & SK_EV_error) || sk_error(sk) != 0 )
+	{
+		conn_attempt_stop(a);
+		conn_start_next(conn);
+		return;
+	}
+
+	/* the winner, keep the socket */
+	conn->evl->del_socket(conn->evl, sk);
+	conn->evl->kill_timer(conn->evl, &a->timeout);
+	a->sk = -1;
+	conn->pending--;
+
+	conn_finish(conn, sk);
+}
+
+static
+void conn_attempt_on_timeout(void * context, uint unused)
+{
+	conn_attempt * a = (conn_attempt *)context;
+	io_connect * conn = a->conn;
+
+	conn_attempt_stop(a);
+	conn_start_next(conn);
+}
+
+static
+int conn_attempt_start(conn_attempt * a)
+{
+	io_connect * conn = a->conn;
+	int sk;
+
+	sk = sk_create(a->path.remote.sa.sa_family, SOCK_STREAM, 0);
+	if (sk < 0)
+		return -1;
+
+	if (sk_unblock(sk) < 0)
+		goto err;
+
+	if (a->path.local.sa.sa_family &&
+	    sk_bind_any(sk, &a->path.local) < 0)
+		goto err;
+
+	if (sk_connect_any(sk, &a->path.remote) < 0 &&
+	    sk_conn_fatal(sk_errno()))
+		goto err;
+
+	if (conn->evl->add_socket(conn->evl, sk, SK_EV_writable,
+	                          conn_attempt_on_activity, a) < 0)
+		goto err;
+
+	a->sk = sk;
+	conn->pending++;
+
+	conn->evl->tag_socket(conn->evl, sk, "connect");
+	conn->evl->set_timer(conn->evl, &a->timeout, conn->timeout_ms);
+	return 0;
+
+err:
+	sk_close(sk);
+	return -1;
+}
+
+/*
+ *	Start the next attempt, skipping over those that fail
+ *	right away, and see if there's anything left to wait on.
+ */
+static
+void conn_start_next(io_connect * conn)
+{
+	while (conn->next < conn->count)
+	{
+		if (conn_attempt_start(conn->attempt + conn->next++) < 0)
+			continue;
+
+		if (conn->next < conn->count)
+			conn->evl->set_timer(conn->evl, &conn->stagger, conn->stagger_ms);
+		else
+			conn->evl->kill_timer(conn->evl, &conn->stagger);
+
+		return;
+	}
+
+	conn->evl->kill_timer(conn->evl, &conn->stagger);
+
+	if (! conn->pending)
+		conn_finish(conn, -1);
+}
+
+static
+void conn_on_stagger(void * context, uint unused)
+{
+	conn_start_next( (io_connect *)context );
+}
+
+/*
+ *
+ */
+io_connect * new_io_connect(event_loop * evl,
+                            const io_connect_path * path, size_t count,
+                            size_t stagger_ms, size_t timeout_ms,
+                            io_connect_cb cb, void * cb_context)
+{
+	io_connect * conn;
+	conn_attempt * a;
+	io_connect_path tmp;
+	size_t i, j, k;
+	int family;
+
+	assert(cb);
+
+	conn = heap_zalloc(sizeof *conn + count * sizeof *a);
+	if (! conn)
+		return NULL;
+
+	conn->evl = evl;
+	conn->stagger_ms = stagger_ms;
+	conn->timeout_ms = timeout_ms;
+	conn->cb = cb;
+	conn->cb_context = cb_context;
+	conn->count = count;
+
+	for (i=0; i<count; i++)
+	{
+		a = conn->attempt + i;
+		a->conn = conn;
+		a->path = path[i];
+		a->sk = -1;
+		evl_timer_init(&a->timeout, conn_attempt_on_timeout, a);
+	}
+
+	/*
+	 *	Interleave the families, keeping the order otherwise,
+	 *	by pulling the next path of a different family forward
+	 *	whenever two of the same family are next to each other.
+	 */
+	for (i=1; i<count; i++)
+	{
+		family = conn->attempt[i-1].path.remote.sa.sa_family;
+
+		for (j=i; j<count; j++)
+			if (conn->attempt[j].path.remote.sa.sa_family != family)
+				break;
+
+		if (j == i || j == count)
+			continue;
+
+		tmp = conn->attempt[j].path;
+		for (k=j; k>i; k--)
+			conn->attempt[k].path = conn->attempt[k-1].path;
+		conn->attempt[i].path = tmp;
+	}
+
+	evl_timer_init(&conn->stagger, conn_on_stagger, conn);
+	evl->set_timer(evl, &conn->stagger, 0);
+
+	return conn;
+}
+
+void io_connect_cancel(io_connect * conn)
+{
+	size_t i;
+
+	for (i=0; i<conn->count; i++)
+		conn_attempt_stop(conn->attempt + i);
+
+	conn->evl->kill_timer(conn->evl, &conn->stagger);
+	heap_free(conn);
+}
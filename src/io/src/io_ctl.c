@@ -0,0 +1,400 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/io_ctl.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+#include "libp/list.h"
+#include "libp/socket.h"
+#include "libp/socket_utils.h"
+#include "libp/stdio.h"
+
+#include "io_buffer.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+/*
+ *
+ */
+#define CTL_MAX_CLIENTS   16
+#define CTL_MAX_REQUEST   256
+#define CTL_MAX_QUEUED    (256*1024)  /* reply bytes per client */
+
+typedef struct ctl_client ctl_client;
+
+struct io_ctl_reply
+{
+	io_buffer  * buf;    /* queued up for sending */
+};
+
+struct ctl_client
+{
+	io_ctl     * ctl;
+	dlist_item   link;
+
+	int          sk;
+	uint         sk_mask;
+
+	char         req[CTL_MAX_REQUEST];
+	size_t       req_size;
+
+	io_ctl_reply reply;
+
+	int          eof : 1;
+};
+
+struct io_ctl
+{
+	event_loop * evl;
+	int          sk;
+	char       * path;
+
+	io_ctl_cb    cb;
+	void       * cb_context;
+
+	dlist_head   clients;
+	size_t       count;
+};
+
+/*
+ *	reply
+ */
+static
+int ctl_reply_reserve(io_ctl_reply * reply, size_t len)
+{
+	io_buffer * buf = reply->buf;
+	io_buffer * tmp;
+	size_t size = buf ? buf->size : 0;
+	size_t capacity;
+
+	if (buf && len <= buf->capacity - size)
+	{
+		/* fits, just needs compacting */
+		if (buf->data + buf->capacity - buf->head - size < len)
+		{
+			memmove(buf->data, buf->head, size);
+			buf->head = buf->data;
+		}
+		return 0;
+	}
+
+	capacity = buf ? 2 * buf->capacity : 4096;
+	if (capacity < size + len)
+		capacity = size + len;
+
+	tmp = alloc_io_buffer(capacity, buf ? buf->head : NULL, size);
+	if (! tmp)
+		return -1;
+
+	free_io_buffer(buf);
+	reply->buf = tmp;
+	return 0;
+}
+
+void io_ctl_printf(io_ctl_reply * reply, const char * format, ...)
+{
+	io_buffer * buf;
+	va_list m;
+	size_t space;
+	int r;
+
+	for (;;)
+	{
+		buf = reply->buf;
+		space = buf ? buf->data + buf->capacity - buf->head - buf->size : 0;
+
+		va_start(m, format);
+		r = space ? vsnprintf((char*)buf->head + buf->size, space, format, m) : -1;
+		va_end(m);
+
+		if (0 <= r && (size_t)r < space)
+		{
+			buf->size += r;
+			return;
+		}
+
+		/* older msvcrt returns -1 when out of space */
+		if (ctl_reply_reserve(reply, (r < 0) ? space + 256 : r + 1) < 0)
+			return;
+	}
+}
+
+/*
+ *	client
+ */
+static
+void ctl_client_close(ctl_client * c)
+{
+	io_ctl * ctl = c->ctl;
+
+	ctl->evl->del_socket(ctl->evl, c->sk);
+	sk_close(c->sk);
+
+	dlist_del(&c->link);
+	ctl->count--;
+
+	free_io_buffer(c->reply.buf);
+	heap_free(c);
+}
+
+static
+size_t ctl_client_queued(const ctl_client * c)
+{
+	return c->reply.buf ? c->reply.buf->size : 0;
+}
+
+/*
+ *	Processes complete lines for as long as the client keeps
+ *	reading its replies, so that one that doesn't can't make
+ *	us queue up an unbounded amount of them.
+ *
+ *	Returns -1 if the client should be dropped
+ */
+static
+int ctl_client_process(ctl_client * c)
+{
+	io_ctl * ctl = c->ctl;
+	char * req, * eol;
+	size_t left;
+
+	req = c->req;
+	left = c->req_size;
+
+	while (ctl_client_queued(c) < CTL_MAX_QUEUED &&
+	       (eol = memchr(req, '\n', left)) )
+	{
+		size_t len = eol - req;
+
+		*eol = 0;
+		if (len && eol[-1] == '\r')
+			eol[-1] = 0;
+
+		ctl->cb(ctl->cb_context, req, &c->reply);
+		io_ctl_printf(&c->reply, "\n");
+
+		req  += len + 1;
+		left -= len + 1;
+	}
+
+	if (left == sizeof c->req && ! memchr(req, '\n', left))
+		return -1; /* request too long */
+
+	memmove(c->req, req, left);
+	c->req_size = left;
+
+	return 0;
+}
+
+static
+int ctl_client_recv(ctl_client * c)
+{
+	int r;
+
+	r = sk_recv(c->sk, c->req + c->req_size, sizeof c->req - c->req_size);
+	if (r < 0)
+		return sk_recv_fatal( sk_errno(c->sk) ) ? -1 : 0;
+
+	if (r == 0)
+	{
+		c->eof = 1;
+		return 0;
+	}
+
+	c->req_size += r;
+
+	return ctl_client_process(c);
+}
+
+static
+int ctl_client_send(ctl_client * c)
+{
+	io_buffer * buf = c->reply.buf;
+	int r;
+
+	if (! buf || ! buf->size)
+		return 0;
+
+	r = sk_send(c->sk, buf->head, buf->size);
+	if (r < 0)
+		return sk_send_fatal( sk_errno(c->sk) ) ? -1 : 0;
+
+	buf->head += r;
+	buf->size -= r;
+
+	if (! buf->size)
+		reset_io_buffer(buf);
+
+	return 0;
+}
+
+static
+void ctl_client_on_activity(void * context, uint events)
+{
+	ctl_client * c = (ctl_client *)context;
+	uint sk_mask;
+
+	if (events & SK_EV_error)
+		goto drop;
+
+	if ( (events & SK_EV_readable) && ctl_client_recv(c) < 0 )
+		goto drop;
+
+	if (ctl_client_send(c) < 0)
+		goto drop;
+
+	/* lines held back by the cap, if any */
+	if (ctl_client_process(c) < 0)
+		goto drop;
+
+	sk_mask = 0;
+
+	if (! c->eof && ctl_client_queued(c) < CTL_MAX_QUEUED &&
+	    c->req_size < sizeof c->req)
+		sk_mask |= SK_EV_readable;
+
+	if (ctl_client_queued(c))
+		sk_mask |= SK_EV_writable;
+	else
+	if (c->eof && ! memchr(c->req, '\n', c->req_size))
+		goto drop; /* all said and done */
+
+	if (c->sk_mask != sk_mask)
+	{
+		c->sk_mask = sk_mask;
+		c->ctl->evl->mod_socket(c->ctl->evl, c->sk, sk_mask);
+	}
+
+	return;
+
+drop:
+	ctl_client_close(c);
+}
+
+/*
+ *	listener
+ */
+static
+void io_ctl_on_accept(void * context, uint events)
+{
+	io_ctl * ctl = (io_ctl *)context;
+	ctl_client * c;
+	int sk;
+
+	for (;;)
+	{
+		sk = sk_accept(ctl->sk, NULL, NULL);
+		if (sk < 0)
+			break;
+
+		if (ctl->count == CTL_MAX_CLIENTS ||
+		    sk_unblock(sk) < 0 ||
+		    ! (c = heap_zalloc(sizeof *c)) )
+		{
+			sk_close(sk);
+			continue;
+		}
+
+		c->ctl = ctl;
+		c->sk = sk;
+		c->sk_mask = SK_EV_readable;
+
+		if (ctl->evl->add_socket(ctl->evl, sk, c->sk_mask,
+		                         ctl_client_on_activity, c) < 0)
+		{
+			heap_free(c);
+			sk_close(sk);
+			continue;
+		}
+
+		dlist_add_back(&ctl->clients, &c->link);
+		ctl->count++;
+
+		ctl->evl->tag_socket(ctl->evl, sk, "ctl");
+	}
+}
+
+/*
+ *
+ */
+io_ctl * new_io_ctl(event_loop * evl, const char * path,
+                    io_ctl_cb cb, void * cb_context)
+{
+	io_ctl * ctl;
+	sockaddr_un sa;
+	int sk;
+
+	assert(cb);
+
+	if (sockaddr_un_init(&sa, path) < 0)
+		return NULL;
+
+	/* stale from a previous run, but nothing else */
+	if (sk_unlink(path) < 0)
+		return NULL;
+
+	sk = sk_create(AF_UNIX, SOCK_STREAM, 0);
+	if (sk < 0)
+		return NULL;
+
+	if (sk_unblock(sk) < 0 ||
+	    sk_bind_unix(sk, &sa) < 0 ||
+	    sk_listen(sk, 8) < 0)
+		goto err;
+
+	ctl = heap_zalloc(sizeof *ctl);
+	if (! ctl)
+		goto err;
+
+	ctl->path = heap_malloc(strlen(path) + 1);
+	if (! ctl->path)
+	{
+		heap_free(ctl);
+		goto err;
+	}
+
+	strcpy(ctl->path, path);
+
+	if (evl->add_socket(evl, sk, SK_EV_readable, io_ctl_on_accept, ctl) < 0)
+	{
+		heap_free(ctl->path);
+		heap_free(ctl);
+		goto err;
+	}
+
+	ctl->evl = evl;
+	ctl->sk = sk;
+	ctl->cb = cb;
+	ctl->cb_context = cb_context;
+	dlist_init(&ctl->clients);
+
+	evl->tag_socket(evl, sk, "ctl");
+
+	return ctl;
+
+err:
+	sk_close(sk);
+	return NULL;
+}
+
+void io_ctl_discard(io_ctl * ctl)
+{
+	dlist_item * pos;
+
+	while ( (pos = dlist_walk(&ctl->clients, NULL)) )
+		ctl_client_close( struct_of(pos, ctl_client, link) );
+
+	ctl->evl->del_socket(ctl->evl, ctl->sk);
+	sk_close(ctl->sk);
+
+	sk_unlink(ctl->path);
+
+	heap_free(ctl->path);
+	heap_free(ctl);
+}
+
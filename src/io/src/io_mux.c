@@ -0,0 +1,878 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/io_mux.h"
+#include "libp/io_serialize.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+#include "libp/list.h"
+
+#include "io_buffer.h"
+#include "pipe_misc.h"
+
+#include <string.h>
+
+/*
+ *
+ */
+enum mux_frame_type
+{
+	MUX_DATA = 0,
+	MUX_OPEN = 1,
+	MUX_FIN  = 2,
+	MUX_RST  = 3,
+	MUX_WINDOW = 4
+};
+
+#define MUX_HDR_MAX  11   /* type + 64-bit varint */
+#define MUX_CTL_MAX  21   /* ditto + WINDOW's credit */
+#define MUX_BUCKETS  256
+#define MUX_QUOTA    64   /* frames to read per pass */
+#define MUX_CTL_CAP  1024 /* control frames to queue, see mux_run() */
+
+typedef struct mux_impl   mux_impl;
+typedef struct mux_stream mux_stream;
+
+struct mux_stream
+{
+	io_pipe      base;
+
+	mux_impl   * mux;     /* NULL once the mux is discarded */
+	uint64_t     id;
+
+	hlist_item   by_id;
+	dlist_item   link;    /* mux->streams */
+	dlist_item   wait;    /* mux->waiting, while not writable */
+	dlist_item   owed;    /* mux->owed, while 'grant' is */
+
+	event_loop * evl;
+	evl_timer    notify;
+
+	io_buffer  * rx;
+	size_t       window;       /* rx, ours */
+	uint64_t     rx_credit;    /* what the peer may still send */
+	uint64_t     rx_unacked;   /* read, but not yet credited back */
+	uint64_t     tx_credit;    /* what we may still send */
+	uint64_t     grant;        /* credit yet to go out in WINDOW */
+
+	int          rx_fin  : 1;  /* FIN frame is in, after rx */
+	int          rst     : 1;  /* RST frame is in */
+};
+
+struct mux_impl
+{
+	io_mux       api;
+	io_pipe    * io;
+
+	event_loop * evl;
+	evl_timer    kick;
+
+	uint64_t     next_id;     /* for our next stream */
+	uint64_t     peer_id;     /* the last stream opened by the peer */
+
+	io_buffer  * ctl;         /* control frames waiting to go out */
+	dlist_head   owed;        /* streams with WINDOW waiting, ditto */
+	size_t       ctl_count;   /* frames in both */
+	uint8_t    * tx_frame;    /* IO_MUX_MTU bytes */
+	uint8_t    * rx_frame;    /* ditto */
+
+	hlist_head   by_id[MUX_BUCKETS];
+	dlist_head   streams;
+	dlist_head   waiting;
+
+	int          initiator : 1;
+	int          ready     : 1;
+	int          down      : 1;
+};
+
+/*
+ *	mux
+ */
+static
+size_t mux_frame_hdr(uint8_t * buf, uint type, uint64_t id)
+{
+	int r;
+
+	buf[0] = (uint8_t)type;
+
+	r = io_store_u64(buf + 1, MUX_HDR_MAX - 1, id);
+	assert(r > 0);
+
+	return 1 + r;
+}
+
+static
+int mux_is_ours(mux_impl * m, uint64_t id)
+{
+	return (id & 1) == (m->initiator ? 1 : 0);
+}
+
+static
+int mux_writable(mux_impl * m)
+{
+	return ! m->down && m->ready && ! m->ctl_count && m->io->writable;
+}
+
+static
+void mux_kick(mux_impl * m)
+{
+	if (m->evl && ! evl_timer_armed(&m->kick))
+		m->evl->set_timer(m->evl, &m->kick, 0);
+}
+
+static
+mux_stream * mux_find(mux_impl * m, uint64_t id)
+{
+	hlist_head * bucket = m->by_id + (id >> 1) % MUX_BUCKETS;
+	hlist_item * pos;
+	mux_stream * s;
+
+	for (pos = NULL; (pos = hlist_walk(bucket, pos)); )
+	{
+		s = struct_of(pos, mux_stream, by_id);
+		if (s->id == id)
+			return s;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Control frames go out in order and ahead of any data,
+ *	so that, for example, OPEN always precedes stream's DATA
+ *	and FIN always follows it.
+ *
+ *	WINDOW frames go last. Each stream has at most one of them
+ *	waiting, with all the credit that built up in the meantime,
+ *	so these don't pile up while the carrier is blocked.
+ */
+static
+int mux_flush_owed(mux_impl * m)
+{
+	uint8_t frame[MUX_CTL_MAX];
+	mux_stream * s;
+	size_t len;
+	int r;
+
+	while (! dlist_empty(&m->owed))
+	{
+		if (! m->io->writable)
+			return -1;
+
+		s = struct_of(m->owed.next, mux_stream, owed);
+
+		len = mux_frame_hdr(frame, MUX_WINDOW, s->id);
+		r = io_store_u64(frame + len, MUX_CTL_MAX - len, s->grant);
+		assert(r > 0);
+		len += r;
+
+		if (m->io->send(m->io, frame, len) < 0)
+			return -1;
+
+		m->api.frames_tx++;
+
+		dlist_del(&s->owed);
+		s->grant = 0;
+		m->ctl_count--;
+	}
+
+	return 0;
+}
+
+static
+int mux_flush(mux_impl * m)
+{
+	io_buffer * ctl = m->ctl;
+	size_t count = m->ctl_count;
+	size_t len;
+	int r;
+
+	while (ctl && ctl->size)
+	{
+		if (! m->io->writable)
+			return -1;
+
+		r = io_parse_size(ctl->head, ctl->size, &len);
+		assert(r > 0 && r + len <= ctl->size);
+
+		if (m->io->send(m->io, ctl->head + r, len) < 0)
+			return -1;
+
+		m->api.frames_tx++;
+
+		ctl->head += r + len;
+		ctl->size -= r + len;
+		m->ctl_count--;
+	}
+
+	free_io_buffer(ctl);
+	m->ctl = NULL;
+
+	r = mux_flush_owed(m);
+
+	/* mux_run() stopped reading at the cap, get it going again */
+	if (count >= MUX_CTL_CAP && m->ctl_count < MUX_CTL_CAP)
+		mux_kick(m);
+
+	return r;
+}
+
+static
+void mux_queue(mux_impl * m, uint type, uint64_t id)
+{
+	uint8_t frame[MUX_HDR_MAX];
+	size_t len;
+	int r;
+
+	len = mux_frame_hdr(frame, type, id);
+
+	m->ctl = reserve_io_buffer(m->ctl, 5 + len);
+
+	r = io_store_size(m->ctl->head + m->ctl->size, 5, len);
+	assert(r > 0);
+
+	memcpy(m->ctl->head + m->ctl->size + r, frame, len);
+	m->ctl->size += r + len;
+	m->ctl_count++;
+
+	mux_flush(m);
+}
+
+static
+void mux_owe(mux_impl * m, mux_stream * s, uint64_t credit)
+{
+	if (! s->grant)
+	{
+		dlist_add_back(&m->owed, &s->owed);
+		m->ctl_count++;
+	}
+
+	s->grant += credit;
+
+	mux_flush(m);
+}
+
+static
+void mux_wait(mux_impl * m, mux_stream * s)
+{
+	if (! dlist_linked(&s->wait))
+		dlist_add_back(&m->waiting, &s->wait);
+}
+
+static void stream_post(mux_stream * s);
+
+static
+void mux_wake(mux_impl * m)
+{
+	dlist_item * pos;
+
+	while (! dlist_empty(&m->waiting))
+	{
+		pos = m->waiting.next;
+		dlist_del(pos);
+		stream_post( struct_of(pos, mux_stream, wait) );
+	}
+}
+
+static
+void mux_post_all(mux_impl * m)
+{
+	dlist_item * pos;
+
+	for (pos = NULL; (pos = dlist_walk(&m->streams, pos)); )
+		stream_post( struct_of(pos, mux_stream, link) );
+}
+
+/*
+ *	stream
+ */
+static
+void stream_post(mux_stream * s)
+{
+	if (s->evl && ! evl_timer_armed(&s->notify))
+		s->evl->set_timer(s->evl, &s->notify, 0);
+}
+
+/*
+ *	Both sides start with IO_MUX_WINDOW of credit, anything
+ *	above that is granted once the stream is announced.
+ */
+static
+void stream_grant(mux_stream * s)
+{
+	mux_impl * m = s->mux;
+
+	if (s->window == s->rx_credit)
+		return;
+
+	mux_owe(m, s, s->window - s->rx_credit);
+	s->rx_credit = s->window;
+}
+
+/*
+ *	Credit the data that the app has read back to the peer,
+ *	in batches of a quarter of the window. Smaller batches mean
+ *	more WINDOW frames, larger - the sender idling on credit.
+ */
+static
+void stream_credit(mux_stream * s, size_t bytes)
+{
+	mux_impl * m = s->mux;
+
+	if (! m || m->down || s->rx_fin)
+		return;
+
+	s->rx_unacked += bytes;
+	if (s->rx_unacked < s->window / 4)
+		return;
+
+	mux_owe(m, s, s->rx_unacked);
+
+	s->rx_credit += s->rx_unacked;
+	s->rx_unacked = 0;
+}
+
+static
+void stream_on_notify(void * context, uint unused)
+{
+	mux_stream * s = (mux_stream *)context;
+	mux_impl * m = s->mux;
+	uint report = 0;
+
+	if (s->base.broken)
+		return;
+
+	if (! m || m->down || s->rst)
+	{
+		tag_pipe_as_broken(&s->base);
+		pipe_on_activity(&s->base, IO_EV_broken);
+		return;
+	}
+
+	if (! s->base.ready)
+	{
+		if (! m->ready)
+			return;
+
+		s->base.ready = 1;
+		report |= IO_EV_ready;
+	}
+
+	if (! s->base.readable && ! s->base.fin_rcvd &&
+	    (s->rx || s->rx_fin))
+	{
+		s->base.readable = 1;
+		report |= IO_EV_readable;
+	}
+
+	if (! s->base.writable && ! s->base.fin_sent && s->tx_credit)
+	{
+		if (mux_writable(m))
+		{
+			s->base.writable = 1;
+			report |= IO_EV_writable;
+		}
+		else
+		{
+			mux_wait(m, s);
+		}
+	}
+
+	if (! report)
+		return;
+
+	/*
+	 *	This MUST be a tail call. See tcp_pipe
+	 *	for the details.
+	 */
+	pipe_on_activity(&s->base, report);
+}
+
+/*
+ *	io_pipe api
+ */
+static
+void stream_init(io_pipe * self, event_loop * evl)
+{
+	mux_stream * s = struct_of(self, mux_stream, base);
+
+	assert(! s->evl);              /* don't initialize twice */
+	assert(  s->base.on_activity); /* must be set */
+	assert(! s->mux || ! s->mux->evl || s->mux->evl == evl);
+
+	s->evl = evl;
+	stream_post(s);
+
+	trace(TR_PIPE_INIT, self, 0, get_pipe_state(self), 0);
+}
+
+static
+int stream_recv(io_pipe * self, void * buf, size_t len)
+{
+	mux_stream * s = struct_of(self, mux_stream, base);
+	io_buffer * rx = s->rx;
+
+	assert(s->evl); /* must be initialized */
+
+	if (! self->ready || self->broken || self->fin_rcvd)
+		return pipe_trace(self, TR_PIPE_RECV, -1);
+
+	if (! rx)
+	{
+		self->readable = 0;
+
+		if (! s->rx_fin)
+			return pipe_trace(self, TR_PIPE_RECV, -1);
+
+		self->fin_rcvd = 1;
+		return pipe_trace(self, TR_PIPE_RECV, 0);
+	}
+
+	if (len > rx->size)
+		len = rx->size;
+
+	memcpy(buf, rx->head, len);
+	rx->head += len;
+	rx->size -= len;
+
+	if (! rx->size)
+	{
+		free_io_buffer(rx);
+		s->rx = NULL;
+	}
+
+	self->readable = (s->rx || s->rx_fin);
+
+	stream_credit(s, len);
+	return pipe_trace(self, TR_PIPE_RECV, (int)len);
+}
+
+static
+int stream_send(io_pipe * self, const void * buf, size_t len)
+{
+	mux_stream * s = struct_of(self, mux_stream, base);
+	mux_impl * m = s->mux;
+	size_t sent = 0;
+	size_t chunk, hdr;
+
+	assert(s->evl);           /* must be initialized  */
+	assert(! self->fin_sent); /* don't send after FIN */
+
+	if (! self->ready || self->broken)
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+
+	if (! m || m->down || s->rst)
+	{
+		tag_pipe_as_broken(self);
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+	}
+
+	mux_flush(m);
+
+	while (sent < len && s->tx_credit && mux_writable(m))
+	{
+		chunk = len - sent;
+		if (chunk > IO_MUX_MTU - MUX_HDR_MAX)
+			chunk = IO_MUX_MTU - MUX_HDR_MAX;
+
+		if (chunk > s->tx_credit)
+			chunk = (size_t)s->tx_credit;
+
+		hdr = mux_frame_hdr(m->tx_frame, MUX_DATA, s->id);
+		memcpy(m->tx_frame + hdr, (const uint8_t *)buf + sent, chunk);
+
+		if (m->io->send(m->io, m->tx_frame, hdr + chunk) < 0)
+			break;
+
+		m->api.frames_tx++;
+		s->tx_credit -= chunk;
+		sent += chunk;
+	}
+
+	if (m->io->broken)
+		mux_kick(m); /* to shut down from the event loop */
+
+	if (sent < len)
+	{
+		self->writable = 0;
+
+		/* out of credit, wait for WINDOW rather than the carrier */
+		if (s->tx_credit)
+			mux_wait(m, s);
+		else
+			m->api.blocked++;
+	}
+
+	return pipe_trace(self, TR_PIPE_SEND, sent ? (int)sent : -1);
+}
+
+static
+int stream_send_fin(io_pipe * self)
+{
+	mux_stream * s = struct_of(self, mux_stream, base);
+	mux_impl * m = s->mux;
+
+	assert(s->evl);           /* must be initialized  */
+	assert(! self->fin_sent); /* don't sent FIN twice */
+
+	if (! m || m->down || s->rst)
+	{
+		tag_pipe_as_broken(self);
+		return pipe_trace(self, TR_PIPE_SEND_FIN, -1);
+	}
+
+	mux_queue(m, MUX_FIN, s->id);
+	dlist_del(&s->wait);
+
+	self->writable = 0;
+	self->fin_sent = 1;
+
+	return pipe_trace(self, TR_PIPE_SEND_FIN, 0);
+}
+
+static
+void stream_discard(io_pipe * self)
+{
+	mux_stream * s = struct_of(self, mux_stream, base);
+	mux_impl * m = s->mux;
+
+	trace(TR_PIPE_DISCARD, self, 0, get_pipe_state(self), 0);
+
+	if (s->evl)
+		s->evl->kill_timer(s->evl, &s->notify);
+
+	if (m)
+	{
+		/* aka RST, unless it's been closed both ways */
+		if (! (self->fin_sent && s->rx_fin) && ! s->rst && ! m->down)
+			mux_queue(m, MUX_RST, s->id);
+
+		if (s->grant)
+		{
+			dlist_del(&s->owed);
+			m->ctl_count--;
+		}
+
+		hlist_del(&s->by_id);
+		dlist_del(&s->link);
+		dlist_del(&s->wait);
+
+		m->api.streams--;
+	}
+
+	free_io_buffer(s->rx);
+	heap_free(s);
+}
+
+static
+mux_stream * new_stream(mux_impl * m, uint64_t id)
+{
+	mux_stream * s;
+
+	s = (mux_stream*)heap_zalloc(sizeof *s);
+
+	s->base.init     = stream_init;
+	s->base.recv     = stream_recv;
+	s->base.send     = stream_send;
+	s->base.send_fin = stream_send_fin;
+	s->base.discard  = stream_discard;
+
+	s->mux = m;
+	s->id = id;
+
+	s->window = (m->api.window > IO_MUX_WINDOW) ? m->api.window : IO_MUX_WINDOW;
+	s->rx_credit = IO_MUX_WINDOW;
+	s->tx_credit = IO_MUX_WINDOW;
+
+	hlist_add_front(m->by_id + (id >> 1) % MUX_BUCKETS, &s->by_id);
+	dlist_add_back(&m->streams, &s->link);
+
+	evl_timer_init(&s->notify, stream_on_notify, s);
+
+	m->api.streams++;
+	m->api.opened++;
+
+	return s;
+}
+
+/*
+ *	inbound frames, returns -1 on protocol errors
+ */
+static
+int mux_on_open(mux_impl * m, uint64_t id)
+{
+	mux_stream * s;
+
+	if (! id || mux_is_ours(m, id) || id <= m->peer_id)
+		return -1;
+
+	m->peer_id = id;
+
+	s = new_stream(m, id);
+
+	if (! m->api.on_stream)
+	{
+		stream_discard(&s->base);
+		return 0;
+	}
+
+	stream_grant(s);
+
+	m->api.on_stream(m->api.on_context, &s->base);
+	return 0;
+}
+
+static
+int mux_on_frame(mux_impl * m, const uint8_t * buf, size_t len)
+{
+	mux_stream * s;
+	uint64_t id, credit;
+	uint type;
+	int r;
+
+	if (len < 2)
+		return -1;
+
+	type = buf[0];
+
+	r = io_parse_u64(buf + 1, len - 1, &id);
+	if (r <= 0)
+		return -1;
+
+	buf += 1 + r;
+	len -= 1 + r;
+
+	if (type == MUX_OPEN)
+		return len ? -1 : mux_on_open(m, id);
+
+	s = mux_find(m, id);
+	if (! s)
+	{
+		/* a stream that we've already discarded ? */
+		if (mux_is_ours(m, id) ? id < m->next_id : id <= m->peer_id)
+			return 0;
+
+		return -1;
+	}
+
+	switch (type)
+	{
+	case MUX_DATA:
+		if (s->rx_fin || ! len || len > s->rx_credit)
+			return -1;
+
+		s->rx = reserve_io_buffer(s->rx, len);
+		memcpy(s->rx->head + s->rx->size, buf, len);
+		s->rx->size += len;
+		s->rx_credit -= len;
+		break;
+
+	case MUX_FIN:
+		if (s->rx_fin || len)
+			return -1;
+
+		s->rx_fin = 1;
+		break;
+
+	case MUX_RST:
+		if (len)
+			return -1;
+
+		s->rst = 1;
+		break;
+
+	case MUX_WINDOW:
+		if (! len || io_parse_u64(buf, len, &credit) != (int)len || ! credit)
+			return -1;
+
+		s->tx_credit += credit;
+		break;
+
+	default:
+		return -1;
+	}
+
+	stream_post(s);
+	return 0;
+}
+
+/*
+ *	the event loop, carrier's and kick's callback
+ */
+static
+void mux_down(mux_impl * m)
+{
+	m->down = 1;
+	mux_post_all(m);
+}
+
+static
+void mux_run(mux_impl * m)
+{
+	size_t n;
+	int r;
+
+	if (m->down)
+		return;
+
+	if (! m->ready && m->io->ready)
+	{
+		m->ready = 1;
+		mux_post_all(m);
+	}
+
+	mux_flush(m);
+
+	/* dgm may return -1 midway through a datagram, so loop
+	   on 'readable' rather than on what recv() returns.
+
+	   Frames coming in may need control frames going out,
+	   so with too many of these queued the peer's frames
+	   are left on the carrier until the queue drains. */
+	for (n=0; m->ready && m->io->readable && m->ctl_count < MUX_CTL_CAP; n++)
+	{
+		if (n == MUX_QUOTA)
+		{
+			/* let others have a go, carry on in a bit */
+			mux_kick(m);
+			break;
+		}
+
+		r = m->io->recv(m->io, m->rx_frame, IO_MUX_MTU);
+		if (r < 0)
+			continue;
+
+		if (r == 0 || mux_on_frame(m, m->rx_frame, r) < 0)
+			goto down;
+
+		m->api.frames_rx++;
+	}
+
+	if (m->io->broken)
+		goto down;
+
+	if (mux_writable(m))
+		mux_wake(m);
+
+	return;
+
+down:
+	mux_down(m);
+
+	if (m->api.on_shutdown)
+		m->api.on_shutdown(m->api.on_context);
+}
+
+static
+void mux_on_activity(void * context, uint events)
+{
+	mux_run( (mux_impl *)context );
+}
+
+static
+void mux_on_kick(void * context, uint unused)
+{
+	mux_run( (mux_impl *)context );
+}
+
+/*
+ *	io_mux api
+ */
+static
+void mux_init(io_mux * self, event_loop * evl)
+{
+	mux_impl * m = struct_of(self, mux_impl, api);
+
+	assert(! m->evl); /* don't initialize twice */
+
+	m->evl = evl;
+	m->io->init(m->io, evl);
+
+	mux_kick(m);
+}
+
+static
+io_pipe * mux_open(io_mux * self)
+{
+	mux_impl * m = struct_of(self, mux_impl, api);
+	mux_stream * s;
+
+	s = new_stream(m, m->next_id);
+	m->next_id += 2;
+
+	if (! m->down)
+	{
+		mux_queue(m, MUX_OPEN, s->id);
+		stream_grant(s);
+	}
+
+	return &s->base;
+}
+
+static
+void mux_discard(io_mux * self)
+{
+	mux_impl * m = struct_of(self, mux_impl, api);
+	dlist_item * pos;
+	mux_stream * s;
+
+	if (m->evl)
+		m->evl->kill_timer(m->evl, &m->kick);
+
+	/* orphan the streams, they'll break and be discarded by the app */
+	for (pos = NULL; (pos = dlist_walk(&m->streams, pos)); )
+	{
+		s = struct_of(pos, mux_stream, link);
+		s->mux = NULL;
+		stream_post(s);
+	}
+
+	m->io->discard(m->io);
+
+	free_io_buffer(m->ctl);
+	heap_free(m->tx_frame);
+	heap_free(m->rx_frame);
+	heap_free(m);
+}
+
+/*
+ *
+ */
+io_mux * new_io_mux(io_pipe * carrier, int initiator)
+{
+	mux_impl * m;
+	size_t i;
+
+	m = (mux_impl*)heap_zalloc(sizeof *m);
+
+	m->api.window  = IO_MUX_WINDOW;
+	m->api.init    = mux_init;
+	m->api.open    = mux_open;
+	m->api.discard = mux_discard;
+
+	m->io = carrier;
+	m->io->on_activity = mux_on_activity;
+	m->io->on_context = m;
+
+	evl_timer_init(&m->kick, mux_on_kick, m);
+
+	m->initiator = initiator ? 1 : 0;
+	m->next_id = initiator ? 1 : 2;
+
+	m->tx_frame = heap_malloc(IO_MUX_MTU);
+	m->rx_frame = heap_malloc(IO_MUX_MTU);
+
+	for (i=0; i<MUX_BUCKETS; i++)
+		hlist_init(m->by_id + i);
+
+	dlist_init(&m->streams);
+	dlist_init(&m->waiting);
+	dlist_init(&m->owed);
+
+	return &m->api;
+}
@@ -0,0 +1,172 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/io_pipe.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+#include "libp/aead.h"
+#include "libp/random.h"
+
+#include <string.h>
+
+/*
+ *	Before anything else each end sends a hello with 12 random
+ *	bytes, its <iv>, that it picks when the pipe is created.
+ *	After that each datagram is
+ *
+ *		<ciphertext> <tag>
+ *
+ *	The nonce of the n-th datagram is the sender's <iv> with n
+ *	xor'ed into its last 8 bytes, so it is never reused by the
+ *	same pipe and the chances of two pipes sharing a key
+ *	colliding are nil.
+ *
+ *	The associated data is the sender's <iv> followed by the
+ *	receiver's. This ties each datagram to both ends of this
+ *	particular connection, so a recorded session replayed to a
+ *	fresh one fails, because the fresh end's <iv> is not the
+ *	same. It also ties it to the direction, so datagrams that
+ *	are bounced back to their sender fail too. The exception is
+ *	the hello itself coming back, which makes both <iv>s the
+ *	same, so such a hello is refused.
+ *
+ *	Since 'io' is reliable and ordered, the receiving end knows
+ *	n too and anything replayed, reordered or dropped within a
+ *	connection fails the tag check.
+ */
+struct aead_xform
+{
+	io_xform    base;
+
+	uint8_t     key[AEAD_KEY_SIZE];
+	int         no_iv;    /* random_bytes() failed */
+
+	/* the sender's <iv> then the receiver's, set by peer_hello() */
+	uint8_t     tx_ad[2 * AEAD_NONCE_SIZE];
+	uint8_t     rx_ad[2 * AEAD_NONCE_SIZE];
+};
+
+typedef struct aead_xform aead_xform;
+
+/*
+ *
+ */
+static
+void make_nonce(uint8_t * nonce, const uint8_t * iv, uint64_t seq)
+{
+	int i;
+
+	memcpy(nonce, iv, 4);
+
+	for (i=0; i<8; i++)
+		nonce[4 + i] = iv[4 + i] ^ (uint8_t)(seq >> 8*i);
+}
+
+/*
+ *	io_xform api
+ */
+static
+int aead_tx(io_xform * self, uint64_t seq, uint8_t * dst, const uint8_t * src, size_t len)
+{
+	aead_xform * x = struct_of(self, aead_xform, base);
+	uint8_t nonce[AEAD_NONCE_SIZE];
+
+	make_nonce(nonce, x->tx_ad, seq);
+	aead_seal(x->key, nonce, x->tx_ad, sizeof x->tx_ad, dst, src, len, dst + len);
+
+	return (int)(len + AEAD_TAG_SIZE);
+}
+
+static
+int aead_rx(io_xform * self, uint64_t seq, uint8_t * dst, const uint8_t * src, size_t len)
+{
+	aead_xform * x = struct_of(self, aead_xform, base);
+	uint8_t nonce[AEAD_NONCE_SIZE];
+
+	if (len < AEAD_TAG_SIZE)
+		return -1; /* too small */
+
+	len -= AEAD_TAG_SIZE;
+
+	/* the tag is checked before 'dst' is touched */
+	make_nonce(nonce, x->rx_ad, seq);
+
+	if (aead_open(x->key, nonce, x->rx_ad, sizeof x->rx_ad, dst, src, len, src + len) < 0)
+		return -1; /* forged, replayed or corrupted */
+
+	return (int)len;
+}
+
+static
+int aead_hello(io_xform * self, uint8_t * buf)
+{
+	aead_xform * x = struct_of(self, aead_xform, base);
+
+	if (x->no_iv)
+		return -1;
+
+	memcpy(buf, x->tx_ad, AEAD_NONCE_SIZE);
+	return 0;
+}
+
+static
+int aead_peer_hello(io_xform * self, const uint8_t * buf, size_t len)
+{
+	aead_xform * x = struct_of(self, aead_xform, base);
+
+	if (len != AEAD_NONCE_SIZE)
+		return -1;
+
+	/* our own hello bounced back */
+	if (! memcmp(buf, x->tx_ad, AEAD_NONCE_SIZE))
+		return -1;
+
+	memcpy(x->tx_ad + AEAD_NONCE_SIZE, buf, AEAD_NONCE_SIZE);
+
+	memcpy(x->rx_ad, buf, AEAD_NONCE_SIZE);
+	memcpy(x->rx_ad + AEAD_NONCE_SIZE, x->tx_ad, AEAD_NONCE_SIZE);
+	return 0;
+}
+
+static
+void aead_discard(io_xform * self)
+{
+	aead_xform * x = struct_of(self, aead_xform, base);
+
+	memset(x->key, 0, sizeof x->key);
+	heap_free(x);
+}
+
+/*
+ *
+ */
+io_xform * new_aead_xform(const uint8_t * key)
+{
+	aead_xform * x;
+
+	x = (aead_xform*)heap_zalloc(sizeof *x);
+
+	x->base.overhead   = AEAD_OVERHEAD;
+	x->base.hello_size = AEAD_NONCE_SIZE;
+	x->base.tx         = aead_tx;
+	x->base.rx         = aead_rx;
+	x->base.hello      = aead_hello;
+	x->base.peer_hello = aead_peer_hello;
+	x->base.discard    = aead_discard;
+
+	memcpy(x->key, key, sizeof x->key);
+
+	x->no_iv = (random_bytes(x->tx_ad, AEAD_NONCE_SIZE) < 0);
+
+	return &x->base;
+}
+
+io_pipe * new_aead_pipe(io_pipe * dgm, const uint8_t * key)
+{
+	return new_xform_pipe(dgm, new_aead_xform(key));
+}
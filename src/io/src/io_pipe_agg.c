@@ -0,0 +1,876 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/io_pipe.h"
+#include "libp/io_serialize.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+
+#include "pipe_misc.h"
+
+#include <string.h>
+
+/*
+ *	Each packet is a single datagram on one of the carriers -
+ *
+ *		DATA    <0> <seq> <payload>
+ *		PARITY  <1> <seq> <count> <xor>
+ *
+ *	where <seq> is a varint. PARITY's <seq> is that of the first
+ *	packet of its group and <xor> is that of each packet's size,
+ *	as be32, followed by its payload, zero-padded to the longest.
+ *
+ *	The receiving end keeps packets in a window indexed by <seq>
+ *	and delivers them in order. Packets that are too far ahead
+ *	to fit are parked, one per carrier, and the carrier isn't
+ *	read until they do. Carriers are ordered, so the missing
+ *	packet is never behind a parked one and the window always
+ *	moves on eventually.
+ *
+ *	A few of the delivered packets are kept around for as long
+ *	as they may be needed to rebuild a later one of the same
+ *	group.
+ */
+enum agg_packet_type
+{
+	AGG_DATA   = 0,
+	AGG_PARITY = 1
+};
+
+#define AGG_HDR_MAX  12  /* type + 64-bit varint + count */
+#define AGG_WINDOW   64  /* packets, a power of 2 */
+#define AGG_QUOTA    64  /* packets to read per carrier per pass */
+
+typedef struct agg_carrier agg_carrier;
+typedef struct agg_slot    agg_slot;
+
+struct agg_carrier
+{
+	agg_pipe  * agg;
+	io_pipe   * io;
+
+	int         eof;
+	uint8_t   * parked;  /* a packet that's too far ahead */
+	size_t      parked_len;
+};
+
+struct agg_slot
+{
+	uint64_t    seq;
+	uint8_t   * data;    /* NULL if empty */
+	size_t      len;
+	size_t      count;   /* parity */
+};
+
+struct agg_pipe
+{
+	io_pipe       base;
+
+	event_loop  * evl;
+	evl_timer     kick;
+
+	agg_carrier   carriers[AGG_PIPES_MAX];
+	size_t        count;
+	int           round_robin;
+	size_t        group;     /* fec, 0 - off */
+
+	uint8_t     * packet;    /* AGG_MTU + AGG_OVERHEAD */
+	int           failed;    /* protocol error */
+
+	/* tx */
+	uint64_t      tx_seq;
+	size_t        current;   /* carrier */
+	int           want_fin;
+
+	uint64_t      g_first;
+	size_t        g_count;
+	uint          g_used;    /* carriers, as a bitmask */
+	uint8_t     * parity;    /* AGG_HDR_MAX + 4 + AGG_MTU */
+	size_t        parity_len;
+
+	uint8_t     * held;      /* a sealed group's, waiting for a carrier */
+	uint8_t     * held_packet;
+	size_t        held_len;
+	uint          held_used;
+
+	/* rx */
+	uint64_t      rx_seq;    /* next to deliver */
+	size_t        rx_off;    /* into it */
+	size_t        eofs;
+
+	agg_slot      data[AGG_WINDOW];
+	agg_slot      fec[AGG_WINDOW];  /* parity, by the group's first seq */
+
+	agg_stats     stats;
+};
+
+/*
+ *
+ */
+static
+void xor_bytes(uint8_t * dst, const uint8_t * src, size_t len)
+{
+	uint64_t a, b;
+
+	for ( ; len >= 8; dst += 8, src += 8, len -= 8)
+	{
+		memcpy(&a, dst, 8);
+		memcpy(&b, src, 8);
+		a ^= b;
+		memcpy(dst, &a, 8);
+	}
+
+	while (len--)
+		*dst++ ^= *src++;
+}
+
+/*
+ *	Folds a packet into a parity buffer of 'parity_len' bytes
+ *	so far, returns the new length
+ */
+static
+size_t xor_packet(uint8_t * parity, size_t parity_len, const uint8_t * data, size_t len)
+{
+	uint8_t size[4];
+
+	if (parity_len < 4 + len)
+	{
+		memset(parity + parity_len, 0, 4 + len - parity_len);
+		parity_len = 4 + len;
+	}
+
+	io_store_be32(size, 4, (uint32_t)len);
+
+	xor_bytes(parity, size, 4);
+	xor_bytes(parity + 4, data, len);
+
+	return parity_len;
+}
+
+static
+void slot_put(agg_slot * slot, uint64_t seq, const uint8_t * data, size_t len)
+{
+	heap_free(slot->data);
+
+	slot->seq = seq;
+	slot->data = heap_malloc(len ? len : 1);
+	slot->len = len;
+
+	memcpy(slot->data, data, len);
+}
+
+static
+void slot_free(agg_slot * slot)
+{
+	heap_free(slot->data);
+	slot->data = NULL;
+}
+
+static
+agg_slot * data_slot(agg_pipe * p, uint64_t seq)
+{
+	agg_slot * slot = p->data + seq % AGG_WINDOW;
+
+	return (slot->data && slot->seq == seq) ? slot : NULL;
+}
+
+static
+int is_writable(agg_pipe * p, size_t i)
+{
+	io_pipe * io = p->carriers[i].io;
+
+	return io->writable && ! io->fin_sent;
+}
+
+/*
+ *	tx
+ */
+static
+int agg_pick(agg_pipe * p, uint skip)
+{
+	size_t i, n;
+
+	for (i=0; i<p->count; i++)
+	{
+		n = (p->current + i) % p->count;
+
+		if (is_writable(p, n) && ! (skip & (1u << n)))
+			return (int)n;
+	}
+
+	return -1;
+}
+
+static
+int agg_send_to(agg_pipe * p, size_t n, const uint8_t * packet, size_t len)
+{
+	io_pipe * io = p->carriers[n].io;
+
+	if (io->send(io, packet, len) < 0)
+		return -1;
+
+	/* rr moves on after each packet, uc - only once congested */
+	p->current = (p->round_robin || ! io->writable) ? (n + 1) % p->count : n;
+	return 0;
+}
+
+/*
+ *	Parity goes on a carrier that carries none of its group.
+ *	If there's no such one that is writable right now, it is
+ *	held back until there is, and the next group goes ahead
+ *	in the meantime. Parity that is still held by the time
+ *	the next one is sealed is dropped, it's late anyway.
+ */
+static
+void agg_flush(agg_pipe * p)
+{
+	int n;
+
+	if (! p->held_packet)
+		return;
+
+	n = agg_pick(p, p->held_used);
+	if (n < 0)
+		return;
+
+	if (agg_send_to(p, n, p->held_packet, p->held_len) == 0)
+		p->stats.parity_tx++;
+
+	p->held_packet = NULL;
+}
+
+static
+void agg_seal(agg_pipe * p)
+{
+	uint8_t hdr[AGG_HDR_MAX];
+	uint8_t * swap;
+	size_t len;
+
+	if (! p->g_count)
+		return;
+
+	agg_flush(p);
+
+	if (p->held_packet)
+		p->stats.unprotected++;
+
+	hdr[0] = AGG_PARITY;
+	len = 1 + io_store_u64(hdr + 1, AGG_HDR_MAX - 2, p->g_first);
+	hdr[len++] = (uint8_t)p->g_count;
+
+	/* the xor is at AGG_HDR_MAX, so the header goes right before it */
+	swap = p->held;
+	p->held = p->parity;
+	p->parity = swap;
+
+	p->held_packet = p->held + AGG_HDR_MAX - len;
+	p->held_len = len + p->parity_len;
+	p->held_used = p->g_used;
+
+	memcpy(p->held_packet, hdr, len);
+
+	p->g_count = 0;
+	p->g_used = 0;
+	p->parity_len = 0;
+
+	agg_flush(p);
+}
+
+static
+int agg_send_data(agg_pipe * p, const uint8_t * buf, size_t len)
+{
+	size_t hdr;
+	int n;
+
+	agg_flush(p);
+
+	n = agg_pick(p, p->g_used);
+	if (n < 0 && p->g_count)
+	{
+		/* the group's carriers are the only writable ones */
+		agg_seal(p);
+		n = agg_pick(p, 0);
+	}
+
+	if (n < 0)
+		return -1;
+
+	p->packet[0] = AGG_DATA;
+	hdr = 1 + io_store_u64(p->packet + 1, AGG_HDR_MAX - 1, p->tx_seq);
+	memcpy(p->packet + hdr, buf, len);
+
+	if (agg_send_to(p, n, p->packet, hdr + len) < 0)
+		return -1;
+
+	p->stats.data_tx++;
+
+	if (! p->group)
+	{
+		p->tx_seq++;
+		return 0;
+	}
+
+	if (! p->g_count)
+	{
+		p->g_first = p->tx_seq;
+
+		/* a partial group is sealed at the end of the pass */
+		if (! evl_timer_armed(&p->kick))
+			p->evl->set_timer(p->evl, &p->kick, 0);
+	}
+
+	p->parity_len = xor_packet(p->parity + AGG_HDR_MAX, p->parity_len, buf, len);
+	p->g_used |= 1u << n;
+	p->tx_seq++;
+
+	if (++p->g_count == p->group)
+		agg_seal(p);
+
+	return 0;
+}
+
+/*
+ *	rx
+ */
+static
+int agg_park(agg_carrier * c, const uint8_t * packet, size_t len)
+{
+	c->parked = heap_malloc(len);
+	c->parked_len = len;
+	memcpy(c->parked, packet, len);
+	return 0;
+}
+
+/*
+ *	Returns -1 on protocol errors
+ */
+static
+int agg_on_packet(agg_pipe * p, agg_carrier * c, const uint8_t * packet, size_t len)
+{
+	uint64_t seq, limit;
+	size_t count;
+	int r;
+
+	if (len < 2)
+		return -1;
+
+	r = io_parse_u64(packet + 1, len - 1, &seq);
+	if (r <= 0)
+		return -1;
+
+	limit = p->rx_seq + AGG_WINDOW - AGG_PIPES_MAX;
+
+	switch (packet[0])
+	{
+	case AGG_DATA:
+
+		if (seq < p->rx_seq)
+		{
+			/* rebuilt from parity and delivered already */
+			p->stats.late++;
+			return 0;
+		}
+
+		if (seq >= limit)
+			return agg_park(c, packet, len);
+
+		p->stats.data_rx++;
+
+		slot_put(p->data + seq % AGG_WINDOW, seq, packet + 1 + r, len - 1 - r);
+		return 0;
+
+	case AGG_PARITY:
+
+		if (len < 1 + r + 1 + 4)
+			return -1;
+
+		count = packet[1 + r];
+		if (! count || count >= AGG_PIPES_MAX)
+			return -1;
+
+		if (seq + count <= p->rx_seq)
+			return 0; /* not needed */
+
+		if (seq >= limit)
+			return agg_park(c, packet, len);
+
+		p->stats.parity_rx++;
+
+		slot_put(p->fec + seq % AGG_WINDOW, seq, packet + 1 + r + 1, len - 1 - r - 1);
+		p->fec[seq % AGG_WINDOW].count = count;
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ *	Rebuilds the next packet from its group's parity and the
+ *	rest of the group, if they are all in
+ */
+static
+int agg_recover(agg_pipe * p)
+{
+	uint64_t seq = p->rx_seq;
+	uint64_t first, i;
+	agg_slot * par = NULL;
+	agg_slot * slot;
+	uint8_t * buf;
+	uint32_t len;
+
+	for (first = seq; first + AGG_PIPES_MAX > seq; first--)
+	{
+		slot = p->fec + first % AGG_WINDOW;
+
+		if (slot->data && slot->seq == first && first + slot->count > seq)
+		{
+			par = slot;
+			break;
+		}
+
+		if (! first)
+			break;
+	}
+
+	if (! par)
+		return -1;
+
+	for (i = first; i < first + par->count; i++)
+		if (i != seq && ! data_slot(p, i))
+			return -1;
+
+	buf = heap_malloc(par->len);
+	memcpy(buf, par->data, par->len);
+
+	for (i = first; i < first + par->count; i++)
+	{
+		if (i == seq)
+			continue;
+
+		slot = data_slot(p, i);
+		if (4 + slot->len > par->len)
+			goto err;
+
+		xor_packet(buf, par->len, slot->data, slot->len);
+	}
+
+	io_parse_be32(buf, 4, &len);
+	if (4 + len > par->len)
+		goto err;
+
+	slot_put(p->data + seq % AGG_WINDOW, seq, buf + 4, len);
+	heap_free(buf);
+
+	p->stats.recovered++;
+	return 0;
+
+err:
+	heap_free(buf);
+	p->failed = 1;
+	return -1;
+}
+
+static
+int agg_rx_ready(agg_pipe * p)
+{
+	return data_slot(p, p->rx_seq) || agg_recover(p) == 0;
+}
+
+/*
+ *	Places parked packets that fit the window now, returns
+ *	the number of carriers that can be read from again
+ */
+static
+size_t agg_unpark(agg_pipe * p)
+{
+	agg_carrier * c;
+	uint8_t * packet;
+	size_t i, n = 0;
+
+	for (i=0; i<p->count; i++)
+	{
+		c = p->carriers + i;
+		if (! (packet = c->parked))
+			continue;
+
+		c->parked = NULL;
+
+		if (agg_on_packet(p, c, packet, c->parked_len) < 0)
+			p->failed = 1;
+
+		if (! c->parked)
+			n++;
+
+		heap_free(packet);
+	}
+
+	return n;
+}
+
+static
+void agg_pull(agg_pipe * p)
+{
+	agg_carrier * c;
+	size_t i, n;
+	int r;
+
+	for (i=0; i<p->count && ! p->failed; i++)
+	{
+		c = p->carriers + i;
+
+		/* dgm may return -1 midway through a datagram, so loop
+		   on 'readable' rather than on what recv() returns */
+		for (n=0; c->io->readable && ! c->eof && ! c->parked; n++)
+		{
+			if (n == AGG_QUOTA)
+			{
+				if (! evl_timer_armed(&p->kick))
+					p->evl->set_timer(p->evl, &p->kick, 0);
+				break;
+			}
+
+			r = c->io->recv(c->io, p->packet, AGG_MTU + AGG_OVERHEAD);
+			if (r < 0)
+				continue;
+
+			if (r == 0)
+			{
+				c->eof = 1;
+				p->eofs++;
+				break;
+			}
+
+			if (agg_on_packet(p, c, p->packet, r) < 0)
+			{
+				p->failed = 1;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ *
+ */
+static
+void agg_pipe_update(agg_pipe * p)
+{
+	io_pipe * self = &p->base;
+	int ready = 1, writable = 0, fin_sent = 1;
+	size_t i;
+
+	for (i=0; i<p->count; i++)
+	{
+		io_pipe * io = p->carriers[i].io;
+
+		if (io->broken)
+			p->failed = 1;
+
+		ready    &= io->ready ? 1 : 0;
+		writable |= is_writable(p, i);
+		fin_sent &= io->fin_sent ? 1 : 0;
+	}
+
+	if (p->failed)
+	{
+		tag_pipe_as_broken(self);
+		return;
+	}
+
+	self->ready    = ready;
+	self->writable = ready && ! p->want_fin && writable;
+	self->fin_sent = fin_sent;
+	self->readable = ready && ! self->fin_rcvd &&
+	                 (agg_rx_ready(p) || p->eofs == p->count);
+
+	if (p->failed)
+		tag_pipe_as_broken(self);
+}
+
+static
+void agg_pipe_run(agg_pipe * p, int seal)
+{
+	uint was, events;
+
+	if (p->base.broken)
+		return;
+
+	was = get_pipe_state(&p->base);
+
+	if (seal)
+		agg_seal(p);
+	else
+		agg_flush(p);
+
+	agg_pull(p);
+	agg_pipe_update(p);
+
+	events = get_pipe_state(&p->base) & ~was & 0x1f;
+	if (! events)
+		return;
+
+	/*
+	 *	This MUST be a tail call. See tcp_pipe
+	 *	for the details.
+	 */
+	pipe_on_activity(&p->base, events);
+}
+
+/*
+ *	carriers' and kick's callbacks
+ */
+static
+void agg_carrier_on_activity(void * context, uint events)
+{
+	agg_carrier * c = (agg_carrier *)context;
+
+	agg_pipe_run(c->agg, 0);
+}
+
+static
+void agg_on_kick(void * context, uint unused)
+{
+	agg_pipe_run( (agg_pipe *)context, 1 );
+}
+
+/*
+ *	io_pipe api
+ */
+static
+void agg_pipe_init(io_pipe * self, event_loop * evl)
+{
+	agg_pipe * p = struct_of(self, agg_pipe, base);
+	size_t i;
+
+	assert(! p->evl);          /* don't initialize twice */
+	assert(self->on_activity); /* must be set */
+
+	p->evl = evl;
+
+	for (i=0; i<p->count; i++)
+		p->carriers[i].io->init(p->carriers[i].io, evl);
+
+	agg_pipe_update(p);
+
+	trace(TR_PIPE_INIT, self, 0, get_pipe_state(self), 0);
+}
+
+static
+int agg_pipe_recv(io_pipe * self, void * buf, size_t len)
+{
+	agg_pipe * p = struct_of(self, agg_pipe, base);
+	agg_slot * slot;
+	size_t i;
+
+	if (! self->ready || self->broken || self->fin_rcvd)
+		return pipe_trace(self, TR_PIPE_RECV, -1);
+
+	if (! agg_rx_ready(p))
+	{
+		if (p->failed)
+			goto err;
+
+		if (p->eofs < p->count)
+		{
+			self->readable = 0;
+			return pipe_trace(self, TR_PIPE_RECV, -1);
+		}
+
+		/* all carriers are done, so nothing is to come after it */
+		for (i=0; i<AGG_WINDOW; i++)
+			if (p->data[i].data && p->data[i].seq > p->rx_seq)
+				goto err;
+
+		self->readable = 0;
+		self->fin_rcvd = 1;
+		return pipe_trace(self, TR_PIPE_RECV, 0);
+	}
+
+	slot = data_slot(p, p->rx_seq);
+
+	if (len > slot->len - p->rx_off)
+		len = slot->len - p->rx_off;
+
+	memcpy(buf, slot->data + p->rx_off, len);
+	p->rx_off += len;
+
+	if (p->rx_off == slot->len)
+	{
+		/* the slot stays in case the group needs it */
+		p->rx_seq++;
+		p->rx_off = 0;
+
+		if (agg_unpark(p) && ! evl_timer_armed(&p->kick))
+			p->evl->set_timer(p->evl, &p->kick, 0);
+	}
+
+	agg_pipe_update(p);
+	return pipe_trace(self, TR_PIPE_RECV, (int)len);
+
+err:
+	p->failed = 1;
+	tag_pipe_as_broken(self);
+	return pipe_trace(self, TR_PIPE_RECV, -1);
+}
+
+static
+int agg_pipe_send(io_pipe * self, const void * buf, size_t len)
+{
+	agg_pipe * p = struct_of(self, agg_pipe, base);
+	size_t sent = 0;
+	size_t chunk;
+
+	if (! self->writable)
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+
+	while (sent < len)
+	{
+		chunk = len - sent;
+		if (chunk > AGG_MTU)
+			chunk = AGG_MTU;
+
+		if (agg_send_data(p, (const uint8_t *)buf + sent, chunk) < 0)
+			break;
+
+		sent += chunk;
+	}
+
+	agg_pipe_update(p);
+	return pipe_trace(self, TR_PIPE_SEND, sent ? (int)sent : -1);
+}
+
+static
+int agg_pipe_send_fin(io_pipe * self)
+{
+	agg_pipe * p = struct_of(self, agg_pipe, base);
+	io_pipe * io;
+	size_t i;
+
+	assert(! p->want_fin); /* don't send FIN twice */
+
+	agg_seal(p);
+
+	if (p->held_packet)
+	{
+		/* nowhere to send it and no more data to follow */
+		p->stats.unprotected++;
+		p->held_packet = NULL;
+	}
+
+	p->want_fin = 1;
+
+	/* IO_EV_fin_sent once it is through on all of them */
+	for (i=0; i<p->count; i++)
+	{
+		io = p->carriers[i].io;
+
+		if (! io->fin_sent)
+			io->send_fin(io);
+	}
+
+	agg_pipe_update(p);
+	return pipe_trace(self, TR_PIPE_SEND_FIN, self->fin_sent ? 0 : -1);
+}
+
+static
+void agg_pipe_discard(io_pipe * self)
+{
+	agg_pipe * p = struct_of(self, agg_pipe, base);
+	size_t i;
+
+	trace(TR_PIPE_DISCARD, self, 0, get_pipe_state(self), 0);
+
+	if (p->evl)
+		p->evl->kill_timer(p->evl, &p->kick);
+
+	for (i=0; i<p->count; i++)
+	{
+		p->carriers[i].io->discard(p->carriers[i].io);
+		heap_free(p->carriers[i].parked);
+	}
+
+	for (i=0; i<AGG_WINDOW; i++)
+	{
+		slot_free(p->data + i);
+		slot_free(p->fec + i);
+	}
+
+	heap_free(p->packet);
+	heap_free(p->parity);
+	heap_free(p->held);
+	heap_free(p);
+}
+
+/*
+ *
+ */
+io_pipe * new_agg_pipe(io_pipe * carrier, agg_pipe ** api)
+{
+	agg_pipe * p;
+
+	p = (agg_pipe*)heap_zalloc(sizeof *p);
+
+	p->base.init     = agg_pipe_init;
+	p->base.recv     = agg_pipe_recv;
+	p->base.send     = agg_pipe_send;
+	p->base.send_fin = agg_pipe_send_fin;
+	p->base.discard  = agg_pipe_discard;
+
+	p->round_robin = 1;
+	p->packet = heap_malloc(AGG_MTU + AGG_OVERHEAD);
+
+	evl_timer_init(&p->kick, agg_on_kick, p);
+
+	agg_pipe_add_pipe(p, carrier);
+
+	if (api)
+		*api = p;
+
+	return &p->base;
+}
+
+void agg_pipe_add_pipe(agg_pipe * p, io_pipe * carrier)
+{
+	agg_carrier * c;
+
+	assert(! p->evl);                  /* before init() only */
+	assert(p->count < AGG_PIPES_MAX);
+
+	c = p->carriers + p->count++;
+	c->agg = p;
+	c->io = carrier;
+
+	carrier->on_activity = agg_carrier_on_activity;
+	carrier->on_context = c;
+}
+
+void agg_pipe_set_mode(agg_pipe * p, int round_robin)
+{
+	p->round_robin = round_robin ? 1 : 0;
+}
+
+void agg_pipe_set_fec(agg_pipe * p, size_t group)
+{
+	assert(! p->evl); /* before init() only */
+
+	if (group >= p->count)
+		group = p->count - 1;
+
+	p->group = group;
+
+	if (group && ! p->parity)
+	{
+		p->parity = heap_malloc(AGG_HDR_MAX + 4 + AGG_MTU);
+		p->held   = heap_malloc(AGG_HDR_MAX + 4 + AGG_MTU);
+	}
+}
+
+const agg_stats * agg_pipe_stats(const agg_pipe * p)
+{
+	return &p->stats;
+}
@@ -51,6 +51,8 @@ void atx_pipe_init(io_pipe * self, event_loop * evl)
 
 	p->io->init(p->io, evl);   /* just pass it through */
 	atx_pipe_clone_state(p);
+
+	trace(TR_PIPE_INIT, self, 0, get_pipe_state(self), 0);
 }
 
 static
@@ -61,7 +63,7 @@ int atx_pipe_recv(io_pipe * self, void * buf, size_t len)
 	
 	r = p->io->recv(p->io, buf, len);
 	atx_pipe_clone_state(p);
-	return r;
+	return pipe_trace(self, TR_PIPE_RECV, r);
 }
 
 static
@@ -71,16 +73,16 @@ int atx_pipe_send(io_pipe * self, const void * buf, size_t len)
 	int r;
 
 	if (p->pending)
-		return -1;
+		return pipe_trace(self, TR_PIPE_SEND, -1);
 
 	r = p->io->send(p->io, buf, len);
 	atx_pipe_clone_state(p);
 
 	if (r < 0)
-		return -1; /* assert(! self->writable); */
+		return pipe_trace(self, TR_PIPE_SEND, -1); /* assert(! self->writable); */
 
 	if (r == len)
-		return len;
+		return pipe_trace(self, TR_PIPE_SEND, len);
 
 	assert(r < (int)len);
 
@@ -90,7 +92,7 @@ int atx_pipe_send(io_pipe * self, const void * buf, size_t len)
 	p->pending = alloc_io_buffer(len-r, (char*)buf+r, len-r);
 	assert(p->pending);
 
-	return len;
+	return pipe_trace(self, TR_PIPE_SEND, len);
 }
 
 static
@@ -104,12 +106,12 @@ int atx_pipe_send_fin(io_pipe * self)
 	if (p->pending)
 	{
 		p->want_fin = 1;
-		return 0;
+		return pipe_trace(self, TR_PIPE_SEND_FIN, 0);
 	}
 
 	r = p->io->send_fin(p->io);
 	atx_pipe_clone_state(p);
-	return r;
+	return pipe_trace(self, TR_PIPE_SEND_FIN, r);
 }
 
 static
@@ -117,6 +119,8 @@ void atx_pipe_discard(io_pipe * self)
 {
 	atx_pipe * p = struct_of(self, atx_pipe, base);
 
+	trace(TR_PIPE_DISCARD, self, 0, get_pipe_state(self), 0);
+
 	p->io->discard(p->io);
 
 	free_io_buffer(p->pending);
@@ -187,7 +191,7 @@ void atx_pipe_on_activity(void * context, uint events)
 	 *	This MUST be a tail call. See tcp_pipe
 	 *	for the details.
 	 */
-	p->base.on_activity(p->base.on_context, events);
+	pipe_on_activity(&p->base, events);
 }
 
 /*
@@ -11,6 +11,7 @@
 #include "libp/macros.h"
 #include "libp/alloc.h"
 #include "libp/socket.h"
+#include "libp/crc32c.h"
 
 #include "io_buffer.h"
 #include "pipe_misc.h"
@@ -27,6 +28,7 @@ struct dgm_pipe
 
 	size_t      max_size;
 	size_t      max_hdr_size;
+	size_t      trailer;  /* 4 with CRC, 0 without */
 
 	io_buffer * rx;
 };
@@ -54,6 +56,17 @@ void dgm_pipe_init(io_pipe * self, event_loop * evl)
 
 	p->io->init(p->io, evl);   /* just pass it through */
 	dgm_pipe_clone_state(p);
+
+	trace(TR_PIPE_INIT, self, 0, get_pipe_state(self), 0);
+}
+
+static
+int crc_ok(const uint8_t * data, size_t len)
+{
+	uint32_t crc;
+
+	io_parse_be32(data + len, 4, &crc);
+	return crc == crc32c(0, data, len);
 }
 
 static
@@ -76,19 +89,27 @@ int process_rx(dgm_pipe * p, void * buf, size_t len, size_t * dgm_size)
 	if (r == 0)
 		return 0;  /* no enough header data */
 
+	if (*dgm_size < p->trailer)
+		return -1; /* too small for CRC */
+
+	*dgm_size -= p->trailer;
+
 	if (*dgm_size > p->max_size)
 		return -1; /* too big */
 
-	if (r + *dgm_size > rx->size)
+	if (r + *dgm_size + p->trailer > rx->size)
 		return 0;  /* no enough payload */
 
+	if (p->trailer && ! crc_ok(rx->head + r, *dgm_size))
+		return -1; /* corrupted */
+
 	/*
 	 *	extract dgm
 	 */
 	memmove(buf, p->rx->head + r, *dgm_size);
 	
-	rx->head += r + *dgm_size;
-	rx->size -= r + *dgm_size;
+	rx->head += r + *dgm_size + p->trailer;
+	rx->size -= r + *dgm_size + p->trailer;
 
 	return r;
 }
@@ -127,7 +148,7 @@ int dgm_pipe_recv(io_pipe * self, void * buf, size_t len)
 	int     r;
 
 	if (p->base.broken)
-		return -1;
+		return pipe_trace(self, TR_PIPE_RECV, -1);
 
 	/* leftovers ? */
 	if (p->rx)
@@ -154,11 +175,11 @@ int dgm_pipe_recv(io_pipe * self, void * buf, size_t len)
 
 		/* move what's left to the front of p->rx
 		   and ensure there's enough head space */
-		adjust_rx(p, p->max_hdr_size + len);
+		adjust_rx(p, p->max_hdr_size + len + p->trailer);
 	}
 	else
 	{
-		p->rx = alloc_io_buffer(p->max_hdr_size + len, NULL, 0);
+		p->rx = alloc_io_buffer(p->max_hdr_size + len + p->trailer, NULL, 0);
 	}
 
 	assert(p->rx && p->rx->head == p->rx->data);
@@ -201,7 +222,7 @@ pass:
 	}
 
 	dgm_pipe_clone_state(p);
-	return r;
+	return pipe_trace(self, TR_PIPE_RECV, r);
 
 err:
 
@@ -209,7 +230,7 @@ err:
 	p->rx = NULL;
 
 	tag_pipe_as_broken(&p->base);
-	return -1;
+	return pipe_trace(self, TR_PIPE_RECV, -1);
 }
 
 static
@@ -220,27 +241,31 @@ int dgm_pipe_send(io_pipe * self, const void * buf, size_t len)
 	int r;
 
 	if (! p->base.writable)
-		return -1;
+		return pipe_trace(self, TR_PIPE_SEND, -1);
 
 	/*
 	 *	format the datagram
 	 */
-	dgm = alloc_io_buffer(len + p->max_hdr_size, NULL, 0);
+	dgm = alloc_io_buffer(len + p->max_hdr_size + p->trailer, NULL, 0);
 	assert(dgm);
 
-	r = io_store_size(dgm->head, dgm->capacity, len);
+	r = io_store_size(dgm->head, dgm->capacity, len + p->trailer);
 	if (r < 0)
 	{
 		tag_pipe_as_broken(&p->base);
 		free_io_buffer(dgm);
-		return -1;
+		return pipe_trace(self, TR_PIPE_SEND, -1);
 	}
 
-	assert(r + len <= dgm->capacity);
+	assert(r + len + p->trailer <= dgm->capacity);
 
 	memcpy(dgm->head + r, buf, len); /* oi vey */
 	dgm->size = r + len;
 
+	if (p->trailer)
+		dgm->size += io_store_be32(dgm->head + dgm->size, 4,
+		                           crc32c(0, buf, len));
+
 	/*
 	 *	send it
 	 */
@@ -250,7 +275,7 @@ int dgm_pipe_send(io_pipe * self, const void * buf, size_t len)
 	assert(r < 0 || r == dgm->size); /* due to p->io being atx_pipe */
 
 	free_io_buffer(dgm);
-	return (r > 0) ? len : -1;
+	return pipe_trace(self, TR_PIPE_SEND, (r > 0) ? len : -1);
 }
 
 static
@@ -261,7 +286,7 @@ int dgm_pipe_send_fin(io_pipe * self)
 
 	r = p->io->send_fin(p->io);
 	dgm_pipe_clone_state(p);
-	return r;
+	return pipe_trace(self, TR_PIPE_SEND_FIN, r);
 }
 
 static
@@ -269,6 +294,8 @@ void dgm_pipe_discard(io_pipe * self)
 {
 	dgm_pipe * p = struct_of(self, dgm_pipe, base);
 
+	trace(TR_PIPE_DISCARD, self, 0, get_pipe_state(self), 0);
+
 	p->io->discard(p->io);
 
 	free_io_buffer(p->rx);
@@ -283,7 +310,7 @@ void dgm_pipe_on_activity(void * context, uint events)
 	dgm_pipe * p = (dgm_pipe *)context;
 
 	dgm_pipe_clone_state(p);
-	p->base.on_activity(p->base.on_context, events);
+	pipe_on_activity(&p->base, events);
 }
 
 /*
@@ -311,3 +338,10 @@ io_pipe * new_dgm_pipe(io_pipe * io, size_t max_size)
 	return &p->base;
 }
 
+void dgm_pipe_set_crc(io_pipe * dgm, int on)
+{
+	dgm_pipe * p = struct_of(dgm, dgm_pipe, base);
+
+	p->trailer = on ? 4 : 0;
+}
+
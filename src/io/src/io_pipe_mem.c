@@ -0,0 +1,346 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/io_pipe.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+
+#include "pipe_misc.h"
+
+#include <string.h>
+
+/*
+ *
+ */
+typedef struct mem_ring mem_ring;
+typedef struct mem_pipe mem_pipe;
+typedef struct mem_pair mem_pair;
+
+struct mem_ring
+{
+	uint8_t    * data;
+	size_t       capacity;
+	size_t       head;
+	size_t       size;
+	int          fin : 1;  /* after the last byte */
+};
+
+struct mem_pipe
+{
+	io_pipe      base;
+
+	mem_pair   * pair;
+	mem_pipe   * peer;
+	mem_ring   * tx;
+	mem_ring   * rx;
+
+	event_loop * evl;
+	evl_timer    notify;
+	uint         events;   /* to be reported by notify */
+
+	int          gone : 1; /* discarded */
+};
+
+struct mem_pair
+{
+	mem_pipe     a;
+	mem_pipe     b;
+
+	mem_ring     a2b;
+	mem_ring     b2a;
+};
+
+/*
+ *	ring
+ */
+static
+size_t mem_ring_put(mem_ring * r, const uint8_t * buf, size_t len)
+{
+	size_t tail, chunk;
+
+	if (len > r->capacity - r->size)
+		len = r->capacity - r->size;
+
+	tail = (r->head + r->size) % r->capacity;
+
+	chunk = r->capacity - tail;
+	if (chunk > len)
+		chunk = len;
+
+	memcpy(r->data + tail, buf, chunk);
+	memcpy(r->data, buf + chunk, len - chunk);
+
+	r->size += len;
+	return len;
+}
+
+static
+size_t mem_ring_get(mem_ring * r, uint8_t * buf, size_t len)
+{
+	size_t chunk;
+
+	if (len > r->size)
+		len = r->size;
+
+	chunk = r->capacity - r->head;
+	if (chunk > len)
+		chunk = len;
+
+	memcpy(buf, r->data + r->head, chunk);
+	memcpy(buf + chunk, r->data, len - chunk);
+
+	r->head = (r->head + len) % r->capacity;
+	r->size -= len;
+	return len;
+}
+
+/*
+ *	events
+ */
+static
+void mem_pipe_post(mem_pipe * p, uint events)
+{
+	if (p->gone)
+		return;
+
+	p->events |= events;
+
+	if (p->evl && ! evl_timer_armed(&p->notify))
+		p->evl->set_timer(p->evl, &p->notify, 0);
+}
+
+static
+void mem_pipe_on_notify(void * context, uint unused)
+{
+	mem_pipe * p = (mem_pipe *)context;
+	uint events = p->events;
+	uint report = 0;
+
+	p->events = 0;
+
+	if ( (events & IO_EV_broken) && ! p->base.broken )
+	{
+		tag_pipe_as_broken(&p->base);
+		report |= IO_EV_broken;
+	}
+
+	if ( (events & IO_EV_ready) && ! p->base.ready && ! p->base.broken )
+	{
+		p->base.ready = 1;
+		report |= IO_EV_ready;
+	}
+
+	if (p->base.ready && ! p->base.broken)
+	{
+		if (! p->base.readable && ! p->base.fin_rcvd &&
+		    (p->rx->size || p->rx->fin))
+		{
+			p->base.readable = 1;
+			report |= IO_EV_readable;
+		}
+
+		if (! p->base.writable && ! p->base.fin_sent &&
+		    p->tx->size < p->tx->capacity)
+		{
+			p->base.writable = 1;
+			report |= IO_EV_writable;
+		}
+	}
+
+	if (! report)
+		return;
+
+	/*
+	 *	This MUST be a tail call. See tcp_pipe
+	 *	for the details.
+	 */
+	pipe_on_activity(&p->base, report);
+}
+
+/*
+ *	io_pipe api
+ */
+static
+void mem_pipe_init(io_pipe * self, event_loop * evl)
+{
+	mem_pipe * p = struct_of(self, mem_pipe, base);
+
+	assert(! p->evl);              /* don't initialize twice */
+	assert(  p->base.on_activity); /* must be set */
+	assert(! p->peer->evl || p->peer->evl == evl);
+
+	p->evl = evl;
+
+	/* as if it just got connected */
+	mem_pipe_post(p, IO_EV_ready | IO_EV_writable);
+
+	trace(TR_PIPE_INIT, self, 0, get_pipe_state(self), 0);
+}
+
+static
+int mem_pipe_recv(io_pipe * self, void * buf, size_t len)
+{
+	mem_pipe * p = struct_of(self, mem_pipe, base);
+	mem_ring * rx = p->rx;
+	int was_full;
+	size_t r;
+
+	assert(p->evl); /* must be initialized */
+
+	if (! self->ready || self->broken || self->fin_rcvd)
+		return pipe_trace(self, TR_PIPE_RECV, -1);
+
+	if (! rx->size)
+	{
+		self->readable = 0;
+
+		if (! rx->fin)
+			return pipe_trace(self, TR_PIPE_RECV, -1);
+
+		self->fin_rcvd = 1;
+		return pipe_trace(self, TR_PIPE_RECV, 0);
+	}
+
+	was_full = (rx->size == rx->capacity);
+
+	r = mem_ring_get(rx, buf, len);
+
+	self->readable = (rx->size || rx->fin);
+
+	if (was_full)
+		mem_pipe_post(p->peer, IO_EV_writable);
+
+	return pipe_trace(self, TR_PIPE_RECV, (int)r);
+}
+
+static
+int mem_pipe_send(io_pipe * self, const void * buf, size_t len)
+{
+	mem_pipe * p = struct_of(self, mem_pipe, base);
+	mem_ring * tx = p->tx;
+	int was_empty;
+	size_t r;
+
+	assert(p->evl);           /* must be initialized  */
+	assert(! self->fin_sent); /* don't send after FIN */
+
+	if (! self->ready || self->broken)
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+
+	if (p->peer->gone)
+	{
+		tag_pipe_as_broken(self);
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+	}
+
+	was_empty = ! tx->size;
+
+	r = mem_ring_put(tx, buf, len);
+
+	self->writable = (r == len);
+
+	if (r && was_empty)
+		mem_pipe_post(p->peer, IO_EV_readable);
+
+	return pipe_trace(self, TR_PIPE_SEND, r ? (int)r : -1);
+}
+
+static
+int mem_pipe_send_fin(io_pipe * self)
+{
+	mem_pipe * p = struct_of(self, mem_pipe, base);
+
+	assert(p->evl);           /* must be initialized  */
+	assert(! self->fin_sent); /* don't sent FIN twice */
+
+	if (p->peer->gone)
+	{
+		tag_pipe_as_broken(self);
+		return pipe_trace(self, TR_PIPE_SEND_FIN, -1);
+	}
+
+	p->tx->fin = 1;
+
+	self->writable = 0;
+	self->fin_sent = 1;
+
+	mem_pipe_post(p->peer, IO_EV_readable);
+	return pipe_trace(self, TR_PIPE_SEND_FIN, 0);
+}
+
+static
+void mem_pipe_discard(io_pipe * self)
+{
+	mem_pipe * p = struct_of(self, mem_pipe, base);
+	mem_pipe * peer = p->peer;
+
+	trace(TR_PIPE_DISCARD, self, 0, get_pipe_state(self), 0);
+
+	assert(! p->gone);
+
+	if (p->evl)
+		p->evl->kill_timer(p->evl, &p->notify);
+
+	p->gone = 1;
+
+	if (! peer->gone)
+	{
+		/* aka RST, otherwise the peer can still drain our FIN */
+		if (! p->base.fin_sent || p->rx->size)
+			mem_pipe_post(peer, IO_EV_broken);
+
+		return;
+	}
+
+	heap_free(p->tx->data);
+	heap_free(p->rx->data);
+	heap_free(p->pair);
+}
+
+/*
+ *
+ */
+static
+void mem_pipe_setup(mem_pair * pair, mem_pipe * p, mem_pipe * peer,
+                    mem_ring * tx, mem_ring * rx)
+{
+	p->base.init     = mem_pipe_init;
+	p->base.recv     = mem_pipe_recv;
+	p->base.send     = mem_pipe_send;
+	p->base.send_fin = mem_pipe_send_fin;
+	p->base.discard  = mem_pipe_discard;
+
+	p->pair = pair;
+	p->peer = peer;
+	p->tx = tx;
+	p->rx = rx;
+
+	evl_timer_init(&p->notify, mem_pipe_on_notify, p);
+}
+
+void new_mem_pipe_pair(size_t capacity, io_pipe ** a, io_pipe ** b)
+{
+	mem_pair * pair;
+
+	assert(capacity);
+
+	pair = (mem_pair*)heap_zalloc(sizeof *pair);
+
+	pair->a2b.data = heap_malloc(capacity);
+	pair->a2b.capacity = capacity;
+
+	pair->b2a.data = heap_malloc(capacity);
+	pair->b2a.capacity = capacity;
+
+	mem_pipe_setup(pair, &pair->a, &pair->b, &pair->a2b, &pair->b2a);
+	mem_pipe_setup(pair, &pair->b, &pair->a, &pair->b2a, &pair->a2b);
+
+	*a = &pair->a.base;
+	*b = &pair->b.base;
+}
+
@@ -0,0 +1,393 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/io_pipe.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+#include "libp/clock.h"
+
+#include "pipe_misc.h"
+
+/*
+ *
+ */
+struct rl_bucket
+{
+	size_t    refs;
+
+	uint64_t  rate;    /* bytes per second */
+	int64_t   burst;   /* bytes */
+
+	int64_t   tokens;
+	uint64_t  refilled;
+};
+
+struct rl_pipe
+{
+	io_pipe      base;
+	io_pipe    * io;
+
+	event_loop * evl;
+	evl_timer    refill;
+
+	rl_bucket  * tx;
+	rl_bucket  * rx;
+
+	int          tx_dry : 1;
+	int          rx_dry : 1;
+};
+
+typedef struct rl_pipe rl_pipe;
+
+/*
+ *	bucket
+ */
+static
+void rl_bucket_refill(rl_bucket * b, uint64_t now)
+{
+	uint64_t gain;
+
+	if (now <= b->refilled)
+		return;
+
+	if (now - b->refilled > 60*1000000)
+		b->refilled = now - 60*1000000; /* avoid overflow below */
+
+	gain = (now - b->refilled) * b->rate / 1000000;
+	if (! gain)
+		return; /* not yet, don't lose the fraction */
+
+	b->refilled = now;
+
+	if (gain > (uint64_t)(b->burst - b->tokens))
+		b->tokens = b->burst;
+	else
+		b->tokens += gain;
+}
+
+/*
+ *	How long till the bucket has enough tokens to make
+ *	waking up worthwhile - either 1/64 of a second worth
+ *	of traffic or the full burst, whichever is smaller.
+ */
+static
+size_t rl_bucket_wait_ms(rl_bucket * b)
+{
+	int64_t want = b->rate / 64;
+	uint64_t ms;
+
+	if (want > b->burst)
+		want = b->burst;
+
+	if (want < 1)
+		want = 1;
+
+	if (b->tokens >= want)
+		return 0;
+
+	ms = (want - b->tokens) * 1000 / b->rate;
+	return (size_t)ms + 1;
+}
+
+/*
+ *	pipe
+ */
+static
+void rl_pipe_clone_state(rl_pipe * p)
+{
+	clone_pipe_state(&p->base, p->io);
+
+	if (p->tx_dry)
+		p->base.writable = 0;
+
+	if (p->rx_dry)
+		p->base.readable = 0;
+}
+
+static
+void rl_pipe_schedule(rl_pipe * p)
+{
+	size_t tx_ms = (size_t)-1;
+	size_t rx_ms = (size_t)-1;
+
+	if (p->tx_dry)
+		tx_ms = rl_bucket_wait_ms(p->tx);
+
+	if (p->rx_dry)
+		rx_ms = rl_bucket_wait_ms(p->rx);
+
+	p->evl->set_timer(p->evl, &p->refill, tx_ms < rx_ms ? tx_ms : rx_ms);
+}
+
+/*
+ *	Take up to 'len' tokens from the bucket, returns 0 and
+ *	marks the direction as 'dry' if there's none left.
+ */
+static
+size_t rl_pipe_take(rl_pipe * p, rl_bucket * b, size_t len)
+{
+	if (! b)
+		return len;
+
+	rl_bucket_refill(b, clock_usec());
+
+	if (b->tokens <= 0)
+		return 0;
+
+	return (len < (uint64_t)b->tokens) ? len : (size_t)b->tokens;
+}
+
+/*
+ *	io_pipe api
+ */
+static
+void rl_pipe_init(io_pipe * self, event_loop * evl)
+{
+	rl_pipe * p = struct_of(self, rl_pipe, base);
+
+	assert(! p->evl);          /* don't initialize twice */
+	assert(self->on_activity); /* must be set */
+
+	p->evl = evl;
+
+	p->io->init(p->io, evl);   /* just pass it through */
+	rl_pipe_clone_state(p);
+
+	trace(TR_PIPE_INIT, self, 0, get_pipe_state(self), 0);
+}
+
+static
+int rl_pipe_recv(io_pipe * self, void * buf, size_t len)
+{
+	rl_pipe * p = struct_of(self, rl_pipe, base);
+	size_t max;
+	int r;
+
+	if (p->rx_dry)
+		return pipe_trace(self, TR_PIPE_RECV, -1);
+
+	max = rl_pipe_take(p, p->rx, len);
+	if (! max)
+	{
+		p->rx_dry = 1;
+		rl_pipe_clone_state(p);
+		rl_pipe_schedule(p);
+		return pipe_trace(self, TR_PIPE_RECV, -1);
+	}
+
+	r = p->io->recv(p->io, buf, max);
+
+	if (r > 0 && p->rx)
+		p->rx->tokens -= r;
+
+	rl_pipe_clone_state(p);
+	return pipe_trace(self, TR_PIPE_RECV, r);
+}
+
+static
+int rl_pipe_send(io_pipe * self, const void * buf, size_t len)
+{
+	rl_pipe * p = struct_of(self, rl_pipe, base);
+	size_t max;
+	int r;
+
+	if (p->tx_dry)
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+
+	max = rl_pipe_take(p, p->tx, len);
+	if (! max)
+	{
+		p->tx_dry = 1;
+		rl_pipe_clone_state(p);
+		rl_pipe_schedule(p);
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+	}
+
+	r = p->io->send(p->io, buf, max);
+
+	if (r > 0 && p->tx)
+		p->tx->tokens -= r;
+
+	if (r == max && max < len)
+	{
+		/* cut short by the bucket */
+		p->tx_dry = 1;
+		rl_pipe_schedule(p);
+	}
+
+	rl_pipe_clone_state(p);
+	return pipe_trace(self, TR_PIPE_SEND, r);
+}
+
+static
+int rl_pipe_send_fin(io_pipe * self)
+{
+	rl_pipe * p = struct_of(self, rl_pipe, base);
+	int r;
+
+	r = p->io->send_fin(p->io);
+	rl_pipe_clone_state(p);
+	return pipe_trace(self, TR_PIPE_SEND_FIN, r);
+}
+
+static
+void rl_pipe_discard(io_pipe * self)
+{
+	rl_pipe * p = struct_of(self, rl_pipe, base);
+
+	trace(TR_PIPE_DISCARD, self, 0, get_pipe_state(self), 0);
+
+	if (p->evl)
+		p->evl->kill_timer(p->evl, &p->refill);
+
+	p->io->discard(p->io);
+
+	if (p->tx) rl_bucket_release(p->tx);
+	if (p->rx) rl_bucket_release(p->rx);
+
+	heap_free(p);
+}
+
+/*
+ *	the event loop's callback
+ */
+static
+void rl_pipe_on_refill(void * context, uint unused)
+{
+	rl_pipe * p = (rl_pipe *)context;
+	uint64_t now = clock_usec();
+	uint events = 0;
+
+	if (p->tx_dry)
+	{
+		rl_bucket_refill(p->tx, now);
+
+		if (p->tx->tokens > 0)
+		{
+			p->tx_dry = 0;
+			if (p->io->writable)
+				events |= IO_EV_writable;
+		}
+	}
+
+	if (p->rx_dry)
+	{
+		rl_bucket_refill(p->rx, now);
+
+		if (p->rx->tokens > 0)
+		{
+			p->rx_dry = 0;
+			if (p->io->readable)
+				events |= IO_EV_readable;
+		}
+	}
+
+	if (p->tx_dry || p->rx_dry)
+		rl_pipe_schedule(p);
+
+	rl_pipe_clone_state(p);
+
+	if (! events)
+		return;
+
+	/*
+	 *	This MUST be a tail call. See tcp_pipe
+	 *	for the details.
+	 */
+	pipe_on_activity(&p->base, events);
+}
+
+/*
+ *	rl_pipe.io's callback
+ */
+static
+void rl_pipe_on_activity(void * context, uint events)
+{
+	rl_pipe * p = (rl_pipe *)context;
+
+	/* these are reported once the bucket is refilled */
+	if (p->tx_dry)
+		events &= ~IO_EV_writable;
+
+	if (p->rx_dry)
+		events &= ~IO_EV_readable;
+
+	rl_pipe_clone_state(p);
+
+	if (! events)
+		return;
+
+	/*
+	 *	This MUST be a tail call. See tcp_pipe
+	 *	for the details.
+	 */
+	pipe_on_activity(&p->base, events);
+}
+
+/*
+ *
+ */
+rl_bucket * new_rl_bucket(size_t rate, size_t burst)
+{
+	rl_bucket * b;
+
+	assert(rate && burst);
+
+	b = (rl_bucket*)heap_zalloc(sizeof *b);
+	if (! b)
+		return NULL;
+
+	b->refs = 1;
+	b->rate = rate;
+	b->burst = burst;
+	b->tokens = burst;
+	b->refilled = clock_usec();
+
+	return b;
+}
+
+void rl_bucket_hold(rl_bucket * b)
+{
+	b->refs++;
+}
+
+void rl_bucket_release(rl_bucket * b)
+{
+	assert(b->refs);
+
+	if (! --b->refs)
+		heap_free(b);
+}
+
+io_pipe * new_ratelimit_pipe(io_pipe * io, rl_bucket * tx, rl_bucket * rx)
+{
+	rl_pipe * p;
+
+	p = (rl_pipe*)heap_zalloc(sizeof *p);
+
+	p->base.init     = rl_pipe_init;
+	p->base.recv     = rl_pipe_recv;
+	p->base.send     = rl_pipe_send;
+	p->base.send_fin = rl_pipe_send_fin;
+	p->base.discard  = rl_pipe_discard;
+
+	p->io = io;
+	p->io->on_activity = rl_pipe_on_activity;
+	p->io->on_context = p;
+
+	evl_timer_init(&p->refill, rl_pipe_on_refill, p);
+
+	p->tx = tx;
+	p->rx = rx;
+
+	if (tx) rl_bucket_hold(tx);
+	if (rx) rl_bucket_hold(rx);
+
+	return &p->base;
+}
+
@@ -16,12 +16,33 @@
 /*
  *
  */
+#define TCP_ZC_BUFS  16
+#define TCP_ZC_POOL  (4*1024*1024)  /* bytes, all buffers */
+
+typedef struct tcp_zc_buf
+{
+	uint8_t    * data;  /* sk_zc_alloc'ed */
+	size_t       size;
+	uint32_t     seq;   /* of the send out of it */
+	int          busy;  /* until the kernel is done with it */
+
+} tcp_zc_buf;
+
 struct tcp_pipe
 {
 	io_pipe      base;
 	event_loop * evl;
 	int          sk;
 	uint         sk_mask;
+	size_t       lowat;    /* TCP_NOTSENT_LOWAT, 0 - not set */
+
+	/* zerocopy */
+	size_t       zc_min;
+	uint32_t     zc_seq;   /* of the next sk_send_zc() */
+	tcp_zc_buf * zc_lent;  /* by get_buffer() */
+	tcp_zc_buf   zc_buf[TCP_ZC_BUFS];
+	size_t       zc_pool;  /* bytes in zc_buf */
+	tcp_zc_stats zc_stats;
 };
 
 typedef struct tcp_pipe tcp_pipe;
@@ -50,6 +71,139 @@ void tcp_pipe_adjust_event_mask(tcp_pipe * p)
 	p->evl->mod_socket(p->evl, p->sk, p->sk_mask);
 }
 
+/*
+ *	zerocopy
+ */
+static
+void tcp_zc_reap(tcp_pipe * p)
+{
+	uint32_t lo, hi;
+	int copied;
+	int r;
+	size_t i;
+
+	while ( (r = sk_zc_done(p->sk, &lo, &hi, &copied)) >= 0 )
+	{
+		if (r == 0)
+			continue;
+
+		p->zc_stats.completed += hi - lo + 1;
+		if (copied)
+			p->zc_stats.copied += hi - lo + 1;
+
+		for (i=0; i<TCP_ZC_BUFS; i++)
+		{
+			tcp_zc_buf * b = p->zc_buf + i;
+
+			if (b->busy &&
+			    (int32_t)(b->seq - lo) >= 0 &&
+			    (int32_t)(hi - b->seq) >= 0)
+			{
+				b->busy = 0;
+			}
+		}
+	}
+}
+
+static
+int tcp_zc_send(tcp_pipe * p, const void * buf, size_t len)
+{
+	tcp_zc_buf * b = p->zc_lent;
+	int r;
+
+	p->zc_lent = NULL;
+
+	if (! b || len < p->zc_min ||
+	    (uint8_t *)buf < b->data ||
+	    (uint8_t *)buf + len > b->data + b->size)
+	{
+		return sk_send(p->sk, buf, len);
+	}
+
+	r = sk_send_zc(p->sk, buf, len);
+
+	if (r > 0)
+	{
+		b->busy = 1;
+		b->seq = p->zc_seq++;
+
+		p->zc_stats.sends++;
+		p->zc_stats.bytes += r;
+	}
+	else
+	if (r < 0 && sk_errno(p->sk) == ENOBUFS)
+	{
+		/* too many sends in flight, see optmem_max */
+		r = sk_send(p->sk, buf, len);
+	}
+
+	return r;
+}
+
+static
+void * tcp_pipe_get_buffer(io_pipe * self, size_t len)
+{
+	tcp_pipe * p = struct_of(self, tcp_pipe, base);
+	tcp_zc_buf * b, * spare = NULL;
+	size_t size;
+	size_t i;
+
+	p->zc_lent = NULL;
+
+	if (len < p->zc_min)
+		return NULL;
+
+	tcp_zc_reap(p);
+
+	for (i=0; i<TCP_ZC_BUFS; i++)
+	{
+		b = p->zc_buf + i;
+
+		if (b->busy)
+			continue;
+
+		if (b->size >= len)
+			goto lend;
+
+		/* rather replace a small one than add one more */
+		if (! spare || (b->data && ! spare->data))
+			spare = b;
+	}
+
+	size = (len + 4095) & ~(size_t)4095;
+
+	if (! spare || p->zc_pool - spare->size + size > TCP_ZC_POOL)
+	{
+		p->zc_stats.no_buffer++;
+		return NULL;
+	}
+
+	b = spare;
+
+	if (b->data)
+		sk_zc_free(b->data, b->size);
+
+	p->zc_pool -= b->size;
+
+	b->size = size;
+	b->data = sk_zc_alloc(size);
+
+	if (! b->data)
+	{
+		b->size = 0;
+		return NULL;
+	}
+
+	p->zc_pool += size;
+
+lend:
+	p->zc_lent = b;
+	return b->data;
+}
+
+/*
+ *
+ */
 static
 void tcp_pipe_on_activity(void * ctx, uint sk_events)
 {
@@ -57,6 +211,10 @@ void tcp_pipe_on_activity(void * ctx, uint sk_events)
 	io_pipe * self = &p->base;
 	uint      io_events = 0;
 
+	/* these also show as readable and writable */
+	if (p->zc_min)
+		tcp_zc_reap(p);
+
 	if (! p->base.ready)
 	{
 		/*
@@ -111,7 +269,7 @@ callback:
 	 *	discard() on us, we won't end up using
 	 *	'self' after it becomes invalid.
 	 */
-	self->on_activity(self->on_context, io_events);
+	pipe_on_activity(self, io_events);
 }
 
 /*
@@ -121,6 +279,7 @@ static
 void tcp_pipe_init(io_pipe * self, event_loop * evl)
 {
 	tcp_pipe * p = struct_of(self, tcp_pipe, base);
+	int r;
 
 	assert(! p->evl);              /* don't initialize twice   */
 	assert(  p->base.on_activity); /* must be set */
@@ -129,7 +288,14 @@ void tcp_pipe_init(io_pipe * self, event_loop * evl)
 	p->evl = evl;
 	p->sk_mask = SK_EV_writable;
 
-	p->evl->add_socket(p->evl, p->sk, p->sk_mask, tcp_pipe_on_activity, p);
+	/* accept and connect paths weed out those the loop can't take */
+	r = p->evl->add_socket(p->evl, p->sk, p->sk_mask, tcp_pipe_on_activity, p);
+	assert(r == 0);
+
+	if (self->_tag)
+		p->evl->tag_socket(p->evl, p->sk, self->_tag);
+
+	trace(TR_PIPE_INIT, self, 0, get_pipe_state(self), 0);
 }
 
 static
@@ -161,7 +327,7 @@ int tcp_pipe_recv(io_pipe * self, void * buf, size_t len)
 	}
 
 	tcp_pipe_adjust_event_mask(p);
-	return r;
+	return pipe_trace(self, TR_PIPE_RECV, r);
 }
 
 static
@@ -172,11 +338,13 @@ int tcp_pipe_send(io_pipe * self, const void * buf, size_t len)
 
 	assert(p->evl); /* must be initialized */
 
-	r = sk_send(p->sk, buf, len);
+	r = p->zc_min ? tcp_zc_send(p, buf, len) :
+	                sk_send(p->sk, buf, len);
 
 	if (r == len)
 	{
-		self->writable = 1;
+		/* send() takes more than 'lowat', it's just poll() that doesn't */
+		self->writable = ! p->lowat || sk_unsent(p->sk) < (int)p->lowat;
 	}
 	else
 	if (r >= 0)
@@ -192,7 +360,7 @@ int tcp_pipe_send(io_pipe * self, const void * buf, size_t len)
 	}
 
 	tcp_pipe_adjust_event_mask(p);
-	return r;
+	return pipe_trace(self, TR_PIPE_SEND, r);
 }
 
 static
@@ -217,19 +385,27 @@ int tcp_pipe_send_fin(io_pipe * self)
 	}
 
 	tcp_pipe_adjust_event_mask(p);
-	return r;
+	return pipe_trace(self, TR_PIPE_SEND_FIN, r);
 }
 
 static
 void tcp_pipe_discard(io_pipe * self)
 {
 	tcp_pipe * p = struct_of(self, tcp_pipe, base);
+	size_t i;
+
+	trace(TR_PIPE_DISCARD, self, 0, get_pipe_state(self), 0);
 
 	if (p->evl)
 		p->evl->del_socket(p->evl, p->sk);
 
 	sk_close(p->sk);
 
+	/* in-flight data stays put, see sk_zc_alloc() */
+	for (i=0; i<TCP_ZC_BUFS; i++)
+		if (p->zc_buf[i].data)
+			sk_zc_free(p->zc_buf[i].data, p->zc_buf[i].size);
+
 	heap_free(p);
 }
 
@@ -253,3 +429,40 @@ io_pipe * new_tcp_pipe(int sk)
 	return &p->base;
 }
 
+int tcp_pipe_set_lowat(io_pipe * tcp, size_t bytes)
+{
+	tcp_pipe * p = struct_of(tcp, tcp_pipe, base);
+
+	if (sk_notsent_lowat(p->sk, (int)bytes) < 0)
+		return -1;
+
+	p->lowat = bytes;
+	return 0;
+}
+
+int tcp_pipe_unsent(io_pipe * tcp)
+{
+	tcp_pipe * p = struct_of(tcp, tcp_pipe, base);
+
+	return sk_unsent(p->sk);
+}
+
+int tcp_pipe_set_zerocopy(io_pipe * tcp, size_t min_size)
+{
+	tcp_pipe * p = struct_of(tcp, tcp_pipe, base);
+
+	if (sk_zerocopy(p->sk) < 0)
+		return -1;
+
+	p->zc_min = min_size ? min_size : 1;
+	p->base.get_buffer = tcp_pipe_get_buffer;
+
+	return 0;
+}
+
+void tcp_pipe_zc_stats(io_pipe * tcp, tcp_zc_stats * stats)
+{
+	tcp_pipe * p = struct_of(tcp, tcp_pipe, base);
+
+	*stats = p->zc_stats;
+}
@@ -0,0 +1,646 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/io_pipe.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+
+#include "pipe_misc.h"
+
+#include <string.h>
+
+/*
+ *	With a pool, each datagram becomes a job that is queued
+ *	to it and, once done, is put on either the 'tx' list to
+ *	go into 'io' or on the 'rx' list for the app to recv().
+ *
+ *	Without one, send() and recv() transform datagrams as they
+ *	pass through, the same way any other pipe would.
+ *
+ *	Either way, hellos are swapped on 'io' directly and ahead
+ *	of all that, see xform_shake().
+ */
+#define XFORM_MAX_JOBS  64  /* per direction */
+
+typedef struct xform_job xform_job;
+typedef struct xform_pipe xform_pipe;
+
+struct xform_job
+{
+	work_item    base;
+	xform_pipe * pipe;
+
+	int          tx;      /* direction */
+	uint64_t     seq;
+	size_t       len;     /* of the input */
+	int          result;  /* of the xform */
+
+	uint8_t      data[1];
+};
+
+typedef struct xform_list
+{
+	xform_job  * head;
+	xform_job  * tail;
+	size_t       count;   /* incl. those still in the pool */
+
+} xform_list;
+
+struct xform_pipe
+{
+	io_pipe      base;
+	io_pipe    * io;
+	io_xform   * x;
+	int          failed;  /* xform did, sticks */
+
+	int          hello_out; /* ours is yet to go */
+	int          hello_in;  /* theirs is yet to come */
+
+	uint64_t     tx_seq;
+	uint64_t     rx_seq;
+
+	uint8_t    * buf;     /* to stage datagrams in */
+	size_t       buf_cap;
+
+	/* with a pool */
+	work_queue * wq;
+	size_t       max_size;
+
+	xform_list   tx;
+	xform_list   rx;
+	int          want_fin;
+	int          eof;
+	int          fin_rcvd;
+	int          zombie;  /* discarded, but the pool still has jobs */
+};
+
+/*
+ *
+ */
+static
+uint8_t * reserve(uint8_t * buf, size_t * cap, size_t len)
+{
+	if (len <= *cap)
+		return buf;
+
+	heap_free(buf);
+	*cap = len;
+	return heap_malloc(len);
+}
+
+static
+void list_add(xform_list * l, xform_job * job)
+{
+	job->base.next = NULL;
+
+	if (l->tail)
+		l->tail->base.next = &job->base;
+	else
+		l->head = job;
+
+	l->tail = job;
+}
+
+static
+xform_job * list_pop(xform_list * l)
+{
+	xform_job * job = l->head;
+
+	l->head = (xform_job *)job->base.next;
+	if (! l->head)
+		l->tail = NULL;
+
+	l->count--;
+	return job;
+}
+
+static
+void list_free(xform_list * l)
+{
+	while (l->head)
+		heap_free(list_pop(l));
+}
+
+static
+void xform_pipe_clone_state(xform_pipe * p)
+{
+	clone_pipe_state(&p->base, p->io);
+
+	if (p->wq)
+	{
+		p->base.writable = p->io->ready && ! p->io->fin_sent && ! p->want_fin &&
+		                   p->tx.count < XFORM_MAX_JOBS;
+
+		/* io's readable only means there's more to pull */
+		p->base.readable = ! p->fin_rcvd &&
+		                   ((p->rx.head) || (p->eof && ! p->rx.count));
+
+		p->base.fin_rcvd = p->fin_rcvd;
+	}
+
+	/* nothing goes either way until the hellos have */
+	if (p->hello_out || p->hello_in)
+	{
+		p->base.writable = 0;
+		p->base.readable = 0;
+	}
+
+	if (p->want_fin)
+		p->base.writable = 0;
+
+	if (p->failed || p->base.broken)
+		tag_pipe_as_broken(&p->base);
+}
+
+/*
+ *	jobs
+ */
+static
+void xform_run(work_item * w)
+{
+	xform_job * job = struct_of(w, xform_job, base);
+	io_xform * x = job->pipe->x;
+
+	/* in place */
+	job->result = job->tx ?
+		x->tx(x, job->seq, job->data, job->data, job->len) :
+		x->rx(x, job->seq, job->data, job->data, job->len);
+}
+
+static
+void xform_submit(xform_pipe * p, int tx, const void * data, size_t len)
+{
+	xform_job * job;
+
+	job = heap_malloc(sizeof *job + len + (tx ? p->x->overhead : 0));
+	assert(job);
+
+	job->base.run = xform_run;
+	job->pipe = p;
+	job->tx = tx;
+	job->seq = tx ? p->tx_seq++ : p->rx_seq++;
+	job->len = len;
+
+	memcpy(job->data, data, len);
+
+	if (tx) p->tx.count++;
+	else    p->rx.count++;
+
+	/* the first one sets things up, see io_pipe.h */
+	if (job->seq == 0)
+	{
+		xform_run(&job->base);
+		list_add(tx ? &p->tx : &p->rx, job);
+		return;
+	}
+
+	work_queue_submit(p->wq, &job->base);
+}
+
+/*
+ *	Passes done tx jobs to 'io', then a pending FIN.
+ *	Returns -1 if either of them or the xform broke.
+ */
+static
+int xform_push(xform_pipe * p)
+{
+	xform_job * job;
+	int r;
+
+	while (p->tx.head && p->io->writable)
+	{
+		job = p->tx.head;
+		if (job->result < 0)
+		{
+			p->failed = 1;
+			return -1;
+		}
+
+		r = p->io->send(p->io, job->data, job->result);
+		if (r < 0)
+			return p->io->broken ? -1 : 0;
+
+		assert(r == job->result); /* due to p->io being dgm_pipe */
+
+		heap_free(list_pop(&p->tx));
+	}
+
+	if (p->want_fin && ! p->tx.count)
+	{
+		p->want_fin = 0;
+
+		/* else it's IO_EV_fin_sent from io later on */
+		if (p->io->send_fin(p->io) < 0 && p->io->broken)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Takes datagrams from 'io' for as long as there is room
+ */
+static
+void xform_pull(xform_pipe * p)
+{
+	size_t cap = p->max_size + p->x->overhead;
+	int r;
+
+	while (! p->hello_in && ! p->eof && p->rx.count < XFORM_MAX_JOBS && p->io->readable)
+	{
+		p->buf = reserve(p->buf, &p->buf_cap, cap);
+
+		/* -1 with 'io' still readable is a partial datagram */
+		r = p->io->recv(p->io, p->buf, cap);
+		if (r < 0)
+			continue;
+
+		if (r == 0)
+		{
+			p->eof = 1;
+			break;
+		}
+
+		xform_submit(p, 0, p->buf, r);
+	}
+}
+
+/*
+ *	Sends our hello as soon as 'io' lets it and then a FIN, if
+ *	it was asked for in the meantime. Takes theirs as soon as
+ *	it is in. The data waits for both.
+ */
+static
+void xform_shake(xform_pipe * p)
+{
+	size_t size = p->x->hello_size;
+	int r;
+
+	if (p->hello_out && p->io->writable)
+	{
+		p->buf = reserve(p->buf, &p->buf_cap, size);
+
+		if (p->x->hello(p->x, p->buf) < 0)
+		{
+			p->failed = 1;
+			return;
+		}
+
+		if (p->io->send(p->io, p->buf, size) < 0)
+			return;
+
+		p->hello_out = 0;
+
+		if (xform_push(p) < 0)
+			return;
+	}
+
+	while (p->hello_in && p->io->readable)
+	{
+		p->buf = reserve(p->buf, &p->buf_cap, size);
+
+		/* -1 with 'io' still readable is a partial datagram */
+		r = p->io->recv(p->io, p->buf, size);
+		if (r < 0)
+			continue;
+
+		/* no FIN before the hello */
+		if (r == 0 || p->x->peer_hello(p->x, p->buf, r) < 0)
+		{
+			p->failed = 1;
+			return;
+		}
+
+		p->hello_in = 0;
+	}
+}
+
+/*
+ *	io_pipe api
+ */
+static
+void xform_pipe_init(io_pipe * self, event_loop * evl)
+{
+	xform_pipe * p = struct_of(self, xform_pipe, base);
+
+	assert(self->on_activity); /* must be set */
+
+	p->io->init(p->io, evl);   /* just pass it through */
+	xform_shake(p);
+	xform_pipe_clone_state(p);
+
+	trace(TR_PIPE_INIT, self, 0, get_pipe_state(self), 0);
+}
+
+static
+int xform_pipe_recv_inline(xform_pipe * p, void * buf, size_t len)
+{
+	size_t cap = len + p->x->overhead;
+	int r, n;
+
+	p->buf = reserve(p->buf, &p->buf_cap, cap);
+
+	r = p->io->recv(p->io, p->buf, cap);
+	if (r <= 0)
+		return r;
+
+	/* straight into 'buf' if it fits, the output is never bigger */
+	if (r <= len)
+	{
+		n = p->x->rx(p->x, p->rx_seq++, buf, p->buf, r);
+	}
+	else
+	{
+		n = p->x->rx(p->x, p->rx_seq++, p->buf, p->buf, r);
+		if (n > (int)len)
+			n = -1;
+
+		if (n > 0)
+			memcpy(buf, p->buf, n);
+	}
+
+	if (n < 0)
+		p->failed = 1;
+
+	return n;
+}
+
+static
+int xform_pipe_recv(io_pipe * self, void * buf, size_t len)
+{
+	xform_pipe * p = struct_of(self, xform_pipe, base);
+	xform_job * job;
+	int r = -1;
+
+	if (self->broken || p->fin_rcvd || p->hello_in)
+		return pipe_trace(self, TR_PIPE_RECV, -1);
+
+	if (! p->wq)
+	{
+		r = xform_pipe_recv_inline(p, buf, len);
+		xform_pipe_clone_state(p);
+		return pipe_trace(self, TR_PIPE_RECV, r);
+	}
+
+	xform_pull(p);
+
+	if (p->rx.head)
+	{
+		job = p->rx.head;
+		if (job->result < 0 || job->result > len)
+			goto err;
+
+		memcpy(buf, job->data, job->result);
+		r = job->result;
+
+		heap_free(list_pop(&p->rx));
+		xform_pull(p);
+	}
+	else
+	if (p->eof && ! p->rx.count)
+	{
+		p->fin_rcvd = 1;
+		r = 0;
+	}
+
+	xform_pipe_clone_state(p);
+	return pipe_trace(self, TR_PIPE_RECV, r);
+
+err:
+	p->failed = 1;
+	tag_pipe_as_broken(self);
+	return pipe_trace(self, TR_PIPE_RECV, -1);
+}
+
+static
+int xform_pipe_send(io_pipe * self, const void * buf, size_t len)
+{
+	xform_pipe * p = struct_of(self, xform_pipe, base);
+	int r;
+
+	if (! self->writable)
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+
+	if (p->wq)
+	{
+		xform_submit(p, 1, buf, len);
+
+		r = (xform_push(p) < 0) ? -1 : (int)len;
+		xform_pipe_clone_state(p);
+		return pipe_trace(self, TR_PIPE_SEND, r);
+	}
+
+	p->buf = reserve(p->buf, &p->buf_cap, len + p->x->overhead);
+
+	/* transforms as it copies, so it's no extra pass */
+	r = p->x->tx(p->x, p->tx_seq, p->buf, buf, len);
+	if (r < 0)
+	{
+		p->failed = 1;
+		tag_pipe_as_broken(self);
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+	}
+
+	r = p->io->send(p->io, p->buf, r);
+	xform_pipe_clone_state(p);
+
+	if (r < 0)
+		/* never went out, so the same seq is still good */
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+
+	p->tx_seq++;
+	return pipe_trace(self, TR_PIPE_SEND, len);
+}
+
+static
+int xform_pipe_send_fin(io_pipe * self)
+{
+	xform_pipe * p = struct_of(self, xform_pipe, base);
+	int r;
+
+	if (p->hello_out || (p->wq && p->tx.count))
+	{
+		/* IO_EV_fin_sent once our hello and all jobs are through */
+		p->want_fin = 1;
+		xform_pipe_clone_state(p);
+		return pipe_trace(self, TR_PIPE_SEND_FIN, -1);
+	}
+
+	r = p->io->send_fin(p->io);
+	xform_pipe_clone_state(p);
+	return pipe_trace(self, TR_PIPE_SEND_FIN, r);
+}
+
+static
+void xform_pipe_free(xform_pipe * p)
+{
+	if (p->wq)
+		work_queue_discard(p->wq);
+
+	p->x->discard(p->x);
+
+	heap_free(p->buf);
+	heap_free(p);
+}
+
+static
+void xform_pipe_discard(io_pipe * self)
+{
+	xform_pipe * p = struct_of(self, xform_pipe, base);
+
+	trace(TR_PIPE_DISCARD, self, 0, get_pipe_state(self), 0);
+
+	p->io->discard(p->io);
+	p->io = NULL;
+
+	list_free(&p->tx);
+	list_free(&p->rx);
+
+	if (p->wq && work_queue_pending(p->wq))
+	{
+		/* xform_pipe_on_done() will finish it off */
+		p->zombie = 1;
+		return;
+	}
+
+	xform_pipe_free(p);
+}
+
+/*
+ *	the pool's callback
+ */
+static
+void xform_pipe_on_done(void * context, work_item * list)
+{
+	xform_pipe * p = (xform_pipe *)context;
+	xform_job * job;
+	uint was, events;
+
+	if (p->zombie)
+	{
+		while (list)
+		{
+			job = struct_of(list, xform_job, base);
+			list = list->next;
+			heap_free(job);
+		}
+
+		if (! work_queue_pending(p->wq))
+			xform_pipe_free(p);
+
+		return;
+	}
+
+	was = get_pipe_state(&p->base);
+
+	while (list)
+	{
+		job = struct_of(list, xform_job, base);
+		list = list->next;
+
+		list_add(job->tx ? &p->tx : &p->rx, job);
+	}
+
+	xform_push(p);
+	xform_pipe_clone_state(p);
+
+	events = get_pipe_state(&p->base) & ~was & 0x1f;
+	if (! events)
+		return;
+
+	/*
+	 *	This MUST be a tail call. See tcp_pipe
+	 *	for the details.
+	 */
+	pipe_on_activity(&p->base, events);
+}
+
+/*
+ *	xform_pipe.io's callback
+ */
+static
+void xform_pipe_on_activity(void * context, uint events)
+{
+	xform_pipe * p = (xform_pipe *)context;
+	int shaking;
+	uint was;
+
+	shaking = p->hello_out || p->hello_in || p->want_fin;
+
+	if (! p->wq && ! shaking)
+	{
+		xform_pipe_clone_state(p);
+		pipe_on_activity(&p->base, events);
+		return;
+	}
+
+	was = get_pipe_state(&p->base);
+
+	xform_shake(p);
+
+	if (p->wq && (events & IO_EV_readable))
+		xform_pull(p);
+
+	if (events & IO_EV_writable)
+		xform_push(p);
+
+	xform_pipe_clone_state(p);
+
+	/* io's readable/writable are not necessarily ours */
+	events &= ~(IO_EV_readable | IO_EV_writable);
+	events |= get_pipe_state(&p->base) & ~was & 0x1f;
+
+	if (! events)
+		return;
+
+	/*
+	 *	This MUST be a tail call. See tcp_pipe
+	 *	for the details.
+	 */
+	pipe_on_activity(&p->base, events);
+}
+
+/*
+ *
+ */
+io_pipe * new_xform_pipe(io_pipe * dgm, io_xform * x)
+{
+	xform_pipe * p;
+
+	p = (xform_pipe*)heap_zalloc(sizeof *p);
+
+	p->base.init     = xform_pipe_init;
+	p->base.recv     = xform_pipe_recv;
+	p->base.send     = xform_pipe_send;
+	p->base.send_fin = xform_pipe_send_fin;
+	p->base.discard  = xform_pipe_discard;
+
+	p->io = dgm;
+	p->io->on_activity = xform_pipe_on_activity;
+	p->io->on_context = p;
+
+	p->x = x;
+
+	p->hello_out = (x->hello_size > 0);
+	p->hello_in  = (x->hello_size > 0);
+
+	return &p->base;
+}
+
+void xform_pipe_set_pool(io_pipe * xform, work_pool * wp, size_t max_size)
+{
+	xform_pipe * p = struct_of(xform, xform_pipe, base);
+
+	assert(! p->wq); /* only once */
+
+	if (! wp)
+		return;
+
+	p->wq = new_work_queue(wp, xform_pipe_on_done, p);
+	p->max_size = max_size;
+}
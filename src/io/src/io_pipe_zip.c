@@ -0,0 +1,805 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/io_pipe.h"
+#include "libp/io_serialize.h"
+
+#include "libp/assert.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+#include "libp/clock.h"
+#include "libp/lz.h"
+
+#include "io_buffer.h"
+#include "pipe_misc.h"
+
+#include <string.h>
+
+/*
+ *	On the wire the stream is a sequence of blocks -
+ *
+ *		<size << 1 | compressed> <data>
+ *
+ *	where the header is a varint and 'size' is that of the
+ *	data as sent. Blocks are up to ZIP_BLOCK raw bytes.
+ */
+#define ZIP_BLOCK       (64*1024)
+#define ZIP_HDR_MAX     5
+#define ZIP_MIN_SIZE    64     /* don't bother compressing less */
+#define ZIP_MAX_SKIP    64     /* blocks */
+
+#define ZIP_PERIOD      250000 /* usec, how often ZIP_AUTO looks around */
+#define ZIP_FORGET      40     /* periods, to re-probe other levels */
+
+/*
+ *	ZIP_AUTO, what it knows about a level
+ */
+typedef struct zip_level_est
+{
+	double   cost;     /* usec per byte, 0 - not known */
+	double   ratio;
+	double   rate;     /* bytes per usec seen going through */
+	int      capped;   /* ... and it wasn't the link that capped it */
+
+	/* in the current period */
+	uint64_t usec;
+	uint64_t raw;
+	uint64_t zip;
+
+} zip_level_est;
+
+struct zip_pipe
+{
+	io_pipe      base;
+	io_pipe    * io;
+
+	event_loop * evl;
+	evl_timer    flush;
+
+	/* tx */
+	io_buffer  * raw;      /* being filled, up to ZIP_BLOCK */
+	io_buffer  * out;      /* blocks that io didn't take yet */
+	size_t       misses;   /* incompressible blocks in a row */
+	size_t       skip;     /* blocks to send as is without trying */
+	void       * work;     /* lz_compress() memory */
+	int          work_level;
+
+	/* level */
+	int          level;    /* ZIP_AUTO or a fixed one */
+	int          current;
+	uint64_t     blocked;  /* since when io isn't taking 'out', 0 if it is */
+
+	/* ZIP_AUTO */
+	uint64_t     period;   /* started at */
+	uint64_t     period_blocked;
+	uint64_t     period_raw;
+	uint64_t     period_wire;
+	double       link;     /* bytes per usec, 0 - not known */
+	uint         periods;
+	zip_level_est est[ZIP_AUTO];
+
+	/* rx */
+	io_buffer  * in;       /* from io, not yet unzipped */
+	io_buffer  * rx;       /* unzipped, not yet read by the app */
+
+	zip_stats    stats;
+
+	int          want_fin;
+	int          eof;       /* got FIN from io */
+	int          fin_rcvd;  /* passed FIN on to the app */
+};
+
+typedef struct zip_pipe zip_pipe;
+
+/*
+ *	ZIP_AUTO
+ *
+ *	Compression pays off only when the link is the bottleneck,
+ *	so the pipe watches for how long io refuses to take more
+ *	data. If it mostly takes everything, there's nothing to
+ *	gain and the pipe goes ZIP_NONE.
+ *
+ *	Otherwise, the rate the link drains at gives an estimate
+ *	of its capacity. Each level then yields at most the link
+ *	capacity over the level's ratio, and at most what the CPU
+ *	can compress with half of its time, so the loop still has
+ *	time for everything else. If the level was tried and the
+ *	link had headroom, then it also yields no more than what
+ *	it did, because something else is holding it back, e.g.
+ *	the other direction of the same pipe.
+ *
+ *	The level with the best yield is used. Levels are tried
+ *	out as needed to learn their costs and ratios, and these
+ *	are forgotten every now and then, so that they get re-
+ *	learned as the data changes.
+ */
+static
+void zip_set_blocked(zip_pipe * p, int blocked, uint64_t now)
+{
+	if (blocked && ! p->blocked)
+	{
+		p->blocked = now;
+	}
+	else
+	if (! blocked && p->blocked)
+	{
+		p->period_blocked += now - p->blocked;
+		p->stats.congested_usec += now - p->blocked;
+		p->blocked = 0;
+	}
+}
+
+static
+double zip_yield(zip_pipe * p, int level)
+{
+	const zip_level_est * e = p->est + level;
+	double cpu, y;
+
+	if (level == ZIP_NONE)
+	{
+		y = p->link;
+	}
+	else
+	{
+		cpu = 0.5 / e->cost;
+		y = p->link / e->ratio;
+		if (y > cpu)
+			y = cpu;
+	}
+
+	if (e->capped && e->rate < y)
+		y = e->rate;
+
+	return y;
+}
+
+static
+int zip_known(zip_pipe * p, int level)
+{
+	return level == ZIP_NONE || p->est[level].cost;
+}
+
+static
+void zip_adapt(zip_pipe * p, uint64_t now)
+{
+	uint64_t elapsed = now - p->period;
+	double busy, wire, raw;
+	zip_level_est * e;
+	int level, best;
+
+	if (p->blocked)
+	{
+		p->period_blocked += now - p->blocked;
+		p->stats.congested_usec += now - p->blocked;
+		p->blocked = now;
+	}
+
+	busy = (double)p->period_blocked / elapsed;
+	wire = (double)p->period_wire / elapsed;
+	raw  = (double)p->period_raw / elapsed;
+
+	/* the link is the bottleneck, so this is its capacity */
+	if (busy > 0.5 || wire > p->link)
+		p->link = wire;
+
+	e = p->est + p->current;
+	e->rate = raw;
+	e->capped = (busy < 0.5);
+
+	if (e->raw && e->usec)
+	{
+		e->cost  = (double)e->usec / e->raw;
+		e->ratio = (double)e->zip / e->raw;
+	}
+
+	if (++p->periods % ZIP_FORGET == 0)
+		for (level = ZIP_NONE; level < ZIP_AUTO; level++)
+			if (level != p->current)
+			{
+				p->est[level].cost = 0;
+				p->est[level].capped = 0;
+			}
+
+	for (level = ZIP_NONE; level < ZIP_AUTO; level++)
+		p->est[level].usec = p->est[level].raw = p->est[level].zip = 0;
+
+	p->period = now;
+	p->period_blocked = p->period_raw = p->period_wire = 0;
+
+	/* plenty of headroom, even with the data as is */
+	if (busy < 0.1 && raw < 0.8 * p->link)
+	{
+		best = ZIP_NONE;
+	}
+	else
+	if (busy >= 0.1 && p->current < ZIP_STRONG &&
+	    ! zip_known(p, p->current + 1) &&
+	    p->est[p->current].cost * raw < 0.25)
+	{
+		/* see what the next level can do, if the CPU can take it */
+		best = p->current + 1;
+	}
+	else
+	{
+		best = p->current;
+
+		for (level = ZIP_NONE; level < ZIP_AUTO; level++)
+			if (zip_known(p, level) &&
+			    zip_yield(p, level) > 1.1 * zip_yield(p, best))
+				best = level;
+	}
+
+	if (best != p->current)
+	{
+		p->current = best;
+		p->stats.switches++;
+	}
+}
+
+/*
+ *	tx
+ */
+static
+void zip_seal(zip_pipe * p)
+{
+	io_buffer * raw = p->raw;
+	io_buffer * out;
+	uint8_t * zbuf;
+	size_t size = 0;
+	uint64_t started, spent;
+	int level, r;
+
+	assert(raw && raw->size);
+
+	started = clock_usec();
+
+	if (p->level == ZIP_AUTO)
+	{
+		if (! p->period)
+			p->period = started;
+
+		if (started - p->period >= ZIP_PERIOD)
+			zip_adapt(p, started);
+	}
+
+	level = p->current;
+
+	/* compress right into 'out', past the largest header */
+	p->out = out = reserve_io_buffer(p->out, ZIP_HDR_MAX + raw->size);
+	zbuf = out->head + out->size + ZIP_HDR_MAX;
+
+	if (level == ZIP_NONE)
+	{
+		/* as is */
+	}
+	else
+	if (p->skip)
+	{
+		p->skip--;
+		p->stats.skipped++;
+	}
+	else
+	if (raw->size >= ZIP_MIN_SIZE)
+	{
+		if (! p->work || p->work_level < level)
+		{
+			heap_free(p->work);
+			p->work = heap_malloc(LZ_WORK(level == ZIP_STRONG ? LZ_STRONG : LZ_FAST));
+			p->work_level = level;
+		}
+
+		/* must save at least 1/16 to be worth it */
+		size = lz_compress(raw->head, raw->size, zbuf,
+		                   raw->size - raw->size / 16, p->work,
+		                   level == ZIP_STRONG ? LZ_STRONG : LZ_FAST);
+
+		spent = clock_usec() - started;
+
+		p->stats.zip_usec += spent;
+		p->est[level].usec += spent;
+		p->est[level].raw  += raw->size;
+		p->est[level].zip  += size ? size : raw->size;
+
+		if (size)
+		{
+			p->misses = 0;
+		}
+		else
+		{
+			/* back off exponentially on incompressible data */
+			p->skip = (p->misses < 6) ? (1 << p->misses) : ZIP_MAX_SKIP;
+			p->misses++;
+		}
+	}
+
+	r = io_store_size(out->head + out->size, ZIP_HDR_MAX,
+	                  size ? (size << 1 | 1) : (raw->size << 1));
+	assert(r > 0);
+
+	if (size)
+	{
+		memmove(out->head + out->size + r, zbuf, size);
+	}
+	else
+	{
+		size = raw->size;
+		memcpy(out->head + out->size + r, raw->head, size);
+		p->stats.stored++;
+	}
+
+	out->size += r + size;
+
+	p->stats.blocks++;
+	p->stats.zip_tx += r + size;
+
+	if (level == ZIP_FAST)   p->stats.fast++;
+	if (level == ZIP_STRONG) p->stats.strong++;
+
+	p->period_raw  += raw->size;
+	p->period_wire += r + size;
+
+	free_io_buffer(raw);
+	p->raw = NULL;
+}
+
+/*
+ *	Returns -1 if io is broken.
+ */
+static
+int zip_push(zip_pipe * p)
+{
+	io_buffer * out = p->out;
+	int r;
+
+	if (! out)
+		return 0;
+
+	r = p->io->send(p->io, out->head, out->size);
+	if (r < 0)
+	{
+		if (p->io->broken)
+			return -1;
+
+		r = 0;
+	}
+
+	out->head += r;
+	out->size -= r;
+
+	if (! out->size)
+	{
+		free_io_buffer(out);
+		p->out = NULL;
+	}
+
+	zip_set_blocked(p, p->out != NULL, clock_usec());
+
+	return 0;
+}
+
+/*
+ *	rx, returns 1 if got a block, 0 if there's not enough
+ *	data yet and -1 if it's malformed.
+ */
+static
+int zip_unseal(zip_pipe * p)
+{
+	io_buffer * in = p->in;
+	uint64_t started;
+	size_t hdr, size;
+	int r, n;
+
+	assert(! p->rx);
+
+	if (! in || ! in->size)
+		return 0;
+
+	r = io_parse_size(in->head, in->size, &hdr);
+	if (r <= 0)
+		return r;
+
+	size = hdr >> 1;
+	if (! size || size > ZIP_BLOCK)
+		return -1;
+
+	if (r + size > in->size)
+		return 0;
+
+	p->rx = alloc_io_buffer(ZIP_BLOCK, NULL, 0);
+
+	if (hdr & 1)
+	{
+		started = clock_usec();
+		n = lz_decompress(in->head + r, size, p->rx->data, ZIP_BLOCK);
+		p->stats.unzip_usec += clock_usec() - started;
+
+		if (n <= 0)
+			return -1;
+	}
+	else
+	{
+		memcpy(p->rx->data, in->head + r, size);
+		n = (int)size;
+	}
+
+	p->rx->size = n;
+
+	in->head += r + size;
+	in->size -= r + size;
+
+	p->stats.zip_rx += r + size;
+	p->stats.raw_rx += n;
+
+	return 1;
+}
+
+static
+int zip_have_block(zip_pipe * p)
+{
+	io_buffer * in = p->in;
+	size_t hdr;
+	int r;
+
+	if (! in || ! in->size)
+		return 0;
+
+	r = io_parse_size(in->head, in->size, &hdr);
+	return r < 0 || (r > 0 && r + (hdr >> 1) <= in->size);
+}
+
+/*
+ *
+ */
+static
+void zip_pipe_clone_state(zip_pipe * p)
+{
+	clone_pipe_state(&p->base, p->io);
+
+	if (p->out || p->want_fin)
+		p->base.writable = 0;
+
+	p->base.readable = (p->rx || zip_have_block(p) || p->io->readable ||
+	                    (p->eof && ! p->fin_rcvd)) && ! p->fin_rcvd;
+	p->base.fin_rcvd = p->fin_rcvd;
+
+	if (p->base.broken)
+		p->base.readable = p->base.writable = 0;
+}
+
+/*
+ *	io_pipe api
+ */
+static
+void zip_pipe_init(io_pipe * self, event_loop * evl)
+{
+	zip_pipe * p = struct_of(self, zip_pipe, base);
+
+	assert(! p->evl);          /* don't initialize twice */
+	assert(self->on_activity); /* must be set */
+
+	p->evl = evl;
+
+	p->io->init(p->io, evl);   /* just pass it through */
+	zip_pipe_clone_state(p);
+
+	trace(TR_PIPE_INIT, self, 0, get_pipe_state(self), 0);
+}
+
+static
+int zip_pipe_recv(io_pipe * self, void * buf, size_t len)
+{
+	zip_pipe * p = struct_of(self, zip_pipe, base);
+	io_buffer * rx;
+	int r;
+
+	if (self->broken || p->fin_rcvd)
+		return pipe_trace(self, TR_PIPE_RECV, -1);
+
+	for (;;)
+	{
+		rx = p->rx;
+		if (rx)
+		{
+			if (len > rx->size)
+				len = rx->size;
+
+			memcpy(buf, rx->head, len);
+			rx->head += len;
+			rx->size -= len;
+
+			if (! rx->size)
+			{
+				free_io_buffer(rx);
+				p->rx = NULL;
+			}
+
+			r = (int)len;
+			break;
+		}
+
+		r = zip_unseal(p);
+		if (r < 0)
+			goto err;
+
+		if (r > 0)
+			continue;
+
+		if (p->eof)
+		{
+			/* EOF halfway through a block ? */
+			if (p->in && p->in->size)
+				goto err;
+
+			p->fin_rcvd = 1;
+			r = 0;
+			break;
+		}
+
+		/* read a bit more */
+		p->in = reserve_io_buffer(p->in, ZIP_HDR_MAX + ZIP_BLOCK);
+
+		r = p->io->recv(p->io, p->in->head + p->in->size,
+		                p->in->capacity - (p->in->head - p->in->data) - p->in->size);
+		if (r < 0)
+			break;
+
+		if (r == 0)
+		{
+			p->eof = 1;
+			continue;
+		}
+
+		p->in->size += r;
+	}
+
+	if (p->in && ! p->in->size)
+	{
+		free_io_buffer(p->in);
+		p->in = NULL;
+	}
+
+	zip_pipe_clone_state(p);
+	return pipe_trace(self, TR_PIPE_RECV, r);
+
+err:
+	tag_pipe_as_broken(self);
+	return pipe_trace(self, TR_PIPE_RECV, -1);
+}
+
+static
+int zip_pipe_send(io_pipe * self, const void * buf, size_t len)
+{
+	zip_pipe * p = struct_of(self, zip_pipe, base);
+	size_t sent = 0;
+	size_t chunk;
+
+	assert(! self->fin_sent && ! p->want_fin); /* don't send after FIN */
+
+	if (self->broken || ! self->writable)
+		return pipe_trace(self, TR_PIPE_SEND, -1);
+
+	while (sent < len && ! p->out)
+	{
+		if (! p->raw)
+			p->raw = alloc_io_buffer(ZIP_BLOCK, NULL, 0);
+
+		chunk = ZIP_BLOCK - p->raw->size;
+		if (chunk > len - sent)
+			chunk = len - sent;
+
+		memcpy(p->raw->head + p->raw->size, (const uint8_t *)buf + sent, chunk);
+		p->raw->size += chunk;
+		sent += chunk;
+
+		if (p->raw->size < ZIP_BLOCK)
+			break;
+
+		zip_seal(p);
+
+		if (zip_push(p) < 0)
+		{
+			zip_pipe_clone_state(p);
+			return pipe_trace(self, TR_PIPE_SEND, -1);
+		}
+	}
+
+	p->stats.raw_tx += sent;
+
+	/* the rest goes out once the loop has nothing else to do */
+	if (p->raw && ! evl_timer_armed(&p->flush))
+		p->evl->set_timer(p->evl, &p->flush, 0);
+
+	zip_pipe_clone_state(p);
+	return pipe_trace(self, TR_PIPE_SEND, sent ? (int)sent : -1);
+}
+
+static
+int zip_pipe_send_fin(io_pipe * self)
+{
+	zip_pipe * p = struct_of(self, zip_pipe, base);
+	int r;
+
+	assert(! self->fin_sent && ! p->want_fin); /* don't call twice */
+
+	if (p->raw)
+		zip_seal(p);
+
+	if (zip_push(p) < 0)
+	{
+		zip_pipe_clone_state(p);
+		return pipe_trace(self, TR_PIPE_SEND_FIN, -1);
+	}
+
+	if (p->out)
+	{
+		/* IO_EV_fin_sent once 'out' is through */
+		p->want_fin = 1;
+		zip_pipe_clone_state(p);
+		return pipe_trace(self, TR_PIPE_SEND_FIN, -1);
+	}
+
+	r = p->io->send_fin(p->io);
+	zip_pipe_clone_state(p);
+	return pipe_trace(self, TR_PIPE_SEND_FIN, r);
+}
+
+static
+void zip_pipe_discard(io_pipe * self)
+{
+	zip_pipe * p = struct_of(self, zip_pipe, base);
+
+	trace(TR_PIPE_DISCARD, self, 0, get_pipe_state(self), 0);
+
+	if (p->evl)
+		p->evl->kill_timer(p->evl, &p->flush);
+
+	p->io->discard(p->io);
+
+	free_io_buffer(p->raw);
+	free_io_buffer(p->out);
+	free_io_buffer(p->in);
+	free_io_buffer(p->rx);
+	heap_free(p->work);
+	heap_free(p);
+}
+
+/*
+ *	Sends out whatever is in 'out' and 'raw', then a pending
+ *	FIN. Returns the events to report.
+ */
+static
+uint zip_pipe_drain(zip_pipe * p)
+{
+	uint events = 0;
+	int r;
+
+	if (zip_push(p) < 0)
+		return IO_EV_broken;
+
+	if (! p->out && p->raw)
+	{
+		zip_seal(p);
+
+		if (zip_push(p) < 0)
+			return IO_EV_broken;
+	}
+
+	if (! p->out && p->want_fin)
+	{
+		p->want_fin = 0;
+
+		r = p->io->send_fin(p->io);
+		if (r < 0 && p->io->broken)
+			return IO_EV_broken;
+
+		/* else it's IO_EV_fin_sent from io later on */
+		if (p->io->fin_sent)
+			events |= IO_EV_fin_sent;
+	}
+
+	return events;
+}
+
+/*
+ *	the event loop's callback
+ */
+static
+void zip_pipe_on_flush(void * context, uint unused)
+{
+	zip_pipe * p = (zip_pipe *)context;
+	uint events;
+	int was_writable = p->base.writable;
+
+	if (p->base.broken)
+		return;
+
+	events = zip_pipe_drain(p);
+	zip_pipe_clone_state(p);
+
+	if (p->base.writable && ! was_writable)
+		events |= IO_EV_writable;
+
+	if (! events)
+		return;
+
+	/*
+	 *	This MUST be a tail call. See tcp_pipe
+	 *	for the details.
+	 */
+	pipe_on_activity(&p->base, events);
+}
+
+/*
+ *	zip_pipe.io's callback
+ */
+static
+void zip_pipe_on_activity(void * context, uint events)
+{
+	zip_pipe * p = (zip_pipe *)context;
+
+	if (events & IO_EV_writable)
+	{
+		events |= zip_pipe_drain(p);
+
+		if (p->out || p->want_fin || ! p->io->writable)
+			events &= ~IO_EV_writable;
+	}
+
+	zip_pipe_clone_state(p);
+
+	if (! events)
+		return;
+
+	/*
+	 *	This MUST be a tail call. See tcp_pipe
+	 *	for the details.
+	 */
+	pipe_on_activity(&p->base, events);
+}
+
+/*
+ *
+ */
+io_pipe * new_zip_pipe(io_pipe * io)
+{
+	zip_pipe * p;
+
+	p = (zip_pipe*)heap_zalloc(sizeof *p);
+
+	p->base.init     = zip_pipe_init;
+	p->base.recv     = zip_pipe_recv;
+	p->base.send     = zip_pipe_send;
+	p->base.send_fin = zip_pipe_send_fin;
+	p->base.discard  = zip_pipe_discard;
+
+	p->io = io;
+	p->io->on_activity = zip_pipe_on_activity;
+	p->io->on_context = p;
+
+	evl_timer_init(&p->flush, zip_pipe_on_flush, p);
+
+	p->level = ZIP_FAST;
+	p->current = ZIP_FAST;
+
+	return &p->base;
+}
+
+void zip_pipe_set_level(io_pipe * zip, int level)
+{
+	zip_pipe * p = struct_of(zip, zip_pipe, base);
+
+	assert(level >= ZIP_NONE && level <= ZIP_AUTO);
+
+	p->level = level;
+	p->current = (level == ZIP_AUTO) ? ZIP_NONE : level;
+	p->blocked = 0;
+	p->period = 0;
+}
+
+const zip_stats * zip_pipe_stats(const io_pipe * zip)
+{
+	return &struct_of(zip, zip_pipe, base)->stats;
+}
@@ -89,7 +89,7 @@ int io_store_size(uint8_t * buf, size_t len, size_t val)
 		return (val & 0xF0000000) ? -1 :
 		       (val & 0x0FE00000) ?  4 : 
 		       (val & 0x001FC000) ?  3 :
-		       (val & 0x00003F10) ?  2 : 1;
+		       (val & 0x00003F80) ?  2 : 1;
 	}
 
 	/*
@@ -134,3 +134,158 @@ int io_parse_size(const uint8_t * buf, size_t len, size_t * ret)
 	return (off < 28) ? 0 : -1;
 }
 
+/*
+ *	64-bit varint
+ */
+int io_store_u64(uint8_t * buf, size_t len, uint64_t val)
+{
+	size_t r;
+
+	if (! buf)
+	{
+		for (r = 1; val >>= 7; r++);
+		return (int)r;
+	}
+
+	for (r = 0; r < len; r++)
+	{
+		if (val & ~(uint64_t)0x7F)
+		{
+			*buf++ = (uint8_t)val | 0x80;
+			val >>= 7;
+			continue;
+		}
+
+		*buf = (uint8_t)val;
+		return (int)r + 1;
+	}
+
+	return -1;
+}
+
+int io_parse_u64(const uint8_t * buf, size_t len, uint64_t * ret)
+{
+	uint64_t val = 0;
+	int      off = 0;
+	uint64_t oct;
+	size_t   r;
+
+	for (r = 0; r < len; off += 7, r++)
+	{
+		oct = *buf++;
+
+		if (off == 63 && oct > 1)
+			return -1; /* 64-bit overflow ! */
+
+		if (oct & 0x80)
+		{
+			val |= (oct & 0x7F) << off;
+			continue;
+		}
+
+		*ret = val | (oct << off);
+		return (int)r + 1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Fixed-size, MSB first
+ */
+static_inline
+int io_store_be(uint8_t * buf, size_t len, uint64_t val, size_t n)
+{
+	size_t i;
+
+	if (! buf)
+		return (int)n;
+
+	if (len < n)
+		return -1;
+
+	for (i = n; i--; val >>= 8)
+		buf[i] = (uint8_t)val;
+
+	return (int)n;
+}
+
+static_inline
+int io_parse_be(const uint8_t * buf, size_t len, uint64_t * val, size_t n)
+{
+	size_t i;
+
+	if (len < n)
+		return 0;
+
+	for (*val = 0, i = 0; i < n; i++)
+		*val = (*val << 8) | buf[i];
+
+	return (int)n;
+}
+
+int io_store_be16(uint8_t * buf, size_t len, uint16_t val)
+{
+	return io_store_be(buf, len, val, 2);
+}
+
+int io_store_be32(uint8_t * buf, size_t len, uint32_t val)
+{
+	return io_store_be(buf, len, val, 4);
+}
+
+int io_store_be64(uint8_t * buf, size_t len, uint64_t val)
+{
+	return io_store_be(buf, len, val, 8);
+}
+
+int io_parse_be16(const uint8_t * buf, size_t len, uint16_t * ret)
+{
+	uint64_t val;
+	int r;
+
+	r = io_parse_be(buf, len, &val, 2);
+	if (r > 0)
+		*ret = (uint16_t)val;
+	return r;
+}
+
+int io_parse_be32(const uint8_t * buf, size_t len, uint32_t * ret)
+{
+	uint64_t val;
+	int r;
+
+	r = io_parse_be(buf, len, &val, 4);
+	if (r > 0)
+		*ret = (uint32_t)val;
+	return r;
+}
+
+int io_parse_be64(const uint8_t * buf, size_t len, uint64_t * ret)
+{
+	return io_parse_be(buf, len, ret, 8);
+}
+
+/*
+ *	Sequence numbers
+ */
+int io_store_seq(uint8_t * buf, size_t len, uint64_t seq, uint64_t * prev)
+{
+	int r;
+
+	r = io_store_u64(buf, len, seq - *prev);
+	if (r > 0 && buf)
+		*prev = seq;
+	return r;
+}
+
+int io_parse_seq(const uint8_t * buf, size_t len, uint64_t * seq, uint64_t * prev)
+{
+	uint64_t delta;
+	int r;
+
+	r = io_parse_u64(buf, len, &delta);
+	if (r > 0)
+		*seq = *prev += delta;
+	return r;
+}
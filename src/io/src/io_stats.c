@@ -0,0 +1,191 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/io_stats.h"
+
+#include "libp/alloc.h"
+#include "libp/clock.h"
+#include "libp/macros.h"
+#include "libp/stdio.h"
+
+#include "pipe_misc.h"
+
+#include <string.h>
+
+/*
+ *	The stats are collected by interposing pipe's recv(),
+ *	send() and discard() with the functions below, so there
+ *	is no overhead whatsoever for pipes that don't have them
+ *	enabled. The callbacks are counted by pipe_on_activity().
+ */
+struct io_stats_ext
+{
+	io_stats  pub;
+
+	int  (* recv)(io_pipe * self, void * buf, size_t len);
+	int  (* send)(io_pipe * self, const void * buf, size_t len);
+	void (* discard)(io_pipe * self);
+};
+
+typedef struct io_stats_ext io_stats_ext;
+
+static
+void io_stats_congestion_over(io_stats * s)
+{
+	uint64_t usec = clock_usec() - s->congested_since;
+
+	s->congested_usec += usec;
+	hist_add(&s->congestion_usec, usec);
+
+	s->congested_since = 0;
+}
+
+static
+int io_stats_recv(io_pipe * self, void * buf, size_t len)
+{
+	io_stats_ext * x = struct_of(self->stats, io_stats_ext, pub);
+	io_stats * s = &x->pub;
+	int r;
+
+	r = x->recv(self, buf, len);
+
+	s->recv_calls++;
+
+	if (r < 0)
+	{
+		if (! self->broken)
+			s->recv_again++;
+	}
+	else
+	{
+		s->recv_bytes += r;
+		hist_add(&s->recv_size, r);
+	}
+
+	return r;
+}
+
+static
+int io_stats_send(io_pipe * self, const void * buf, size_t len)
+{
+	io_stats_ext * x = struct_of(self->stats, io_stats_ext, pub);
+	io_stats * s = &x->pub;
+	int r;
+
+	r = x->send(self, buf, len);
+
+	s->send_calls++;
+
+	if (r < 0)
+	{
+		if (! self->broken)
+			s->send_again++;
+	}
+	else
+	{
+		if (r < (int)len)
+			s->send_partial++;
+
+		s->send_bytes += r;
+		hist_add(&s->send_size, r);
+	}
+
+	if (self->writable || self->broken)
+	{
+		if (s->congested_since)
+			io_stats_congestion_over(s);
+	}
+	else
+	if (! s->congested_since)
+	{
+		s->congestions++;
+		s->congested_since = clock_usec();
+	}
+
+	return r;
+}
+
+static
+void io_stats_discard(io_pipe * self)
+{
+	io_stats_ext * x = struct_of(self->stats, io_stats_ext, pub);
+
+	self->stats = NULL;
+	self->recv = x->recv;
+	self->send = x->send;
+	self->discard = x->discard;
+
+	heap_free(x);
+
+	self->discard(self);
+}
+
+void io_stats_on_activity(io_pipe * self, uint events)
+{
+	io_stats * s = self->stats;
+
+	s->callbacks++;
+
+	if ( (events & (IO_EV_writable | IO_EV_broken)) && s->congested_since )
+		io_stats_congestion_over(s);
+}
+
+/*
+ *	api
+ */
+io_stats * io_pipe_enable_stats(io_pipe * p)
+{
+	io_stats_ext * x;
+
+	if (p->stats)
+	{
+		memset(p->stats, 0, sizeof *p->stats);
+		return p->stats;
+	}
+
+	x = (io_stats_ext*)heap_zalloc(sizeof *x);
+	if (! x)
+		return NULL;
+
+	x->recv = p->recv;
+	x->send = p->send;
+	x->discard = p->discard;
+
+	p->recv = io_stats_recv;
+	p->send = io_stats_send;
+	p->discard = io_stats_discard;
+
+	p->stats = &x->pub;
+	return p->stats;
+}
+
+const char * io_stats_to_str(const io_stats * s, char * buf, size_t max)
+{
+	snprintf(buf, max,
+		"tx %llu B / %llu calls (again %llu, partial %llu, "
+		"p50 %llu, p99 %llu B) | "
+		"rx %llu B / %llu calls (again %llu, p50 %llu, p99 %llu B) | "
+		"congested %llu times, %llu ms (p99 %llu us) | "
+		"callbacks %llu",
+		(unsigned long long)s->send_bytes,
+		(unsigned long long)s->send_calls,
+		(unsigned long long)s->send_again,
+		(unsigned long long)s->send_partial,
+		(unsigned long long)hist_percentile(&s->send_size, 0.50),
+		(unsigned long long)hist_percentile(&s->send_size, 0.99),
+		(unsigned long long)s->recv_bytes,
+		(unsigned long long)s->recv_calls,
+		(unsigned long long)s->recv_again,
+		(unsigned long long)hist_percentile(&s->recv_size, 0.50),
+		(unsigned long long)hist_percentile(&s->recv_size, 0.99),
+		(unsigned long long)s->congestions,
+		(unsigned long long)s->congested_usec / 1000,
+		(unsigned long long)hist_percentile(&s->congestion_usec, 0.99),
+		(unsigned long long)s->callbacks);
+
+	return buf;
+}
+
@@ -10,19 +10,23 @@
 #include "libp/io_pipe.h"
 #include "libp/macros.h"
 #include "libp/stdio.h"
+#include "libp/trace.h"
 
 /*
  *	io_pipe state as bitmask
+ *
+ *	Note that the state bits are signed 1-bit fields, i.e. they
+ *	are -1 when set, so they are tested rather than shifted.
  */
 static_inline
 uint get_pipe_state(const io_pipe * p)
 {
-	return ((p->ready    <<  0) & 0x01) |
-	       ((p->broken   <<  1) & 0x02) |
-	       ((p->readable <<  2) & 0x04) |
-	       ((p->writable <<  4) & 0x08) |
-	       ((p->fin_sent <<  8) & 0x10) |
-	       ((p->fin_rcvd << 16) & 0x20);
+	return (p->ready    ? 0x01 : 0) |
+	       (p->broken   ? 0x02 : 0) |
+	       (p->readable ? 0x04 : 0) |
+	       (p->writable ? 0x08 : 0) |
+	       (p->fin_sent ? 0x10 : 0) |
+	       (p->fin_rcvd ? 0x20 : 0);
 }
 
 static_inline
@@ -46,4 +50,33 @@ void tag_pipe_as_broken(io_pipe * p)
 	p->writable = 0;
 }
 
+/*
+ *	Records a pipe call into the trace, see trace.h.
+ *	Returns 'r' as is, so it can wrap the return value.
+ */
+static_inline
+int pipe_trace(io_pipe * p, uint event, int r)
+{
+	trace(event, p, r, get_pipe_state(p), 0);
+	return r;
+}
+
+/*
+ *	Issues on_activity() callback and counts it if the pipe
+ *	has its stats enabled. This MUST be a tail call for the
+ *	same reasons the callback itself must be.
+ */
+void io_stats_on_activity(io_pipe * p, uint events);
+
+static_inline
+void pipe_on_activity(io_pipe * p, uint events)
+{
+	trace(TR_PIPE_ACTIVITY, p, events, get_pipe_state(p), 0);
+
+	if (p->stats)
+		io_stats_on_activity(p, events);
+
+	p->on_activity(p->on_context, events);
+}
+
 #endif
@@ -7,16 +7,22 @@
 #ifndef _LIBP_SOCKET_H_linux_
 #define _LIBP_SOCKET_H_linux_
 
+#include "libp/types.h"
 #include "libp/macros.h"
 
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
 #include <linux/un.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -27,7 +33,7 @@
  *
  * 		-- constants --
  *
- * 		AF_INET, SOCK_STREAM, SOCK_DGRAM
+ * 		AF_INET, AF_INET6, AF_UNIX, SOCK_STREAM, SOCK_DGRAM
  *
  * 		SOL_SOCKET
  * 			SO_ERROR         int
@@ -39,6 +45,9 @@
  * 		IPPROTO_IP
  * 			IP_TTL           int
  *
+ * 		IPPROTO_IPV6
+ * 			IPV6_V6ONLY      int
+ *
  * 		IPPROTO_TCP
  * 			TCP_NODELAY      int
  *
@@ -52,10 +61,14 @@
  *		socklen_t
  * 		sockaddr
  * 		sockaddr_in
+ * 		sockaddr_in6
+ * 		sockaddr_un
  *		linger
  */
 typedef struct sockaddr  sockaddr;
 typedef struct sockaddr_in  sockaddr_in;
+typedef struct sockaddr_in6 sockaddr_in6;
+typedef struct sockaddr_un  sockaddr_un;
 
 /*		ip4_addr_t
  *
@@ -236,6 +249,91 @@ int sk_error(int sk)
 	return (sk_getsockopt(sk, SOL_SOCKET, SO_ERROR, &e, sizeof e) < 0) ? -1 : e;
 }
 
+/*
+ *		int sk_notsent_lowat(int sk, int bytes);
+ *		int sk_unsent(int sk);
+ */
+
+static_inline
+int sk_notsent_lowat(int sk, int bytes)
+{
+	return sk_setsockopt(sk, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof bytes);
+}
+
+static_inline
+int sk_unsent(int sk)
+{
+	int n;
+	return (ioctl(sk, SIOCOUTQNSD, &n) < 0) ? -1 : n;
+}
+
+/*
+ *		int sk_zerocopy(int sk);
+ *		int sk_send_zc(int sk, const void * p, size_t n);
+ *		int sk_zc_done(int sk, uint32_t * lo, uint32_t * hi, int * copied);
+ *
+ *		void * sk_zc_alloc(size_t n);
+ *		void   sk_zc_free(void * p, size_t n);
+ */
+
+static_inline
+int sk_zerocopy(int sk)
+{
+	static const int yes = 1;
+	return sk_setsockopt(sk, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof yes);
+}
+
+static_inline
+int sk_send_zc(int sk, const void * buf, size_t len)
+{
+	int r;
+	do { r = send(sk, buf, len, MSG_ZEROCOPY); }
+	while (r < 0 && errno == EINTR);
+	return r;
+}
+
+static_inline
+int sk_zc_done(int sk, uint32_t * lo, uint32_t * hi, int * copied)
+{
+	struct sock_extended_err * ee;
+	struct cmsghdr * cm;
+	struct msghdr msg = { 0 };
+	char control[128];
+
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+
+	if (recvmsg(sk, &msg, MSG_ERRQUEUE) < 0)
+		return -1;
+
+	cm = CMSG_FIRSTHDR(&msg);
+	if (! cm)
+		return 0;
+
+	ee = (struct sock_extended_err *)CMSG_DATA(cm);
+	if (ee->ee_errno || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+		return 0;
+
+	*lo = ee->ee_info;
+	*hi = ee->ee_data;
+	*copied = (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+	return 1;
+}
+
+static_inline
+void * sk_zc_alloc(size_t len)
+{
+	void * p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+static_inline
+void sk_zc_free(void * p, size_t len)
+{
+	munmap(p, len);
+}
+
 /*
  * 		int sk_conn_fatal(int err);   // boolean return
  * 		int sk_recv_fatal(int err);
@@ -245,6 +343,23 @@ int sk_error(int sk)
  *		int sk_conn_timeout(int err);
  */
 
+/*
+ *		int sk_unlink(const char * path);
+ */
+static_inline
+int sk_unlink(const char * path)
+{
+	struct stat st;
+
+	if (lstat(path, &st) < 0)
+		return (errno == ENOENT) ? 0 : -1;
+
+	if (! S_ISSOCK(st.st_mode))
+		return -1;
+
+	return unlink(path);
+}
+
 static_inline
 int sk_conn_fatal(int err)
 {
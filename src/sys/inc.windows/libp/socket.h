@@ -12,6 +12,7 @@
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <afunix.h>
 
 #define SHUT_RD    SD_RECEIVE  /* 0 */
 #define SHUT_WR    SD_SEND     /* 1 */
@@ -22,7 +23,7 @@
  *
  * 		-- constants --
  *
- * 		AF_INET, SOCK_STREAM, SOCK_DGRAM
+ * 		AF_INET, AF_INET6, AF_UNIX, SOCK_STREAM, SOCK_DGRAM
  *
  * 		SOL_SOCKET
  * 			SO_ERROR         int
@@ -34,6 +35,9 @@
  * 		IPPROTO_IP
  * 			IP_TTL           int
  *
+ * 		IPPROTO_IPV6
+ * 			IPV6_V6ONLY      int
+ *
  * 		IPPROTO_TCP
  * 			TCP_NODELAY      int
  *
@@ -47,10 +51,14 @@
  *		socklen_t
  * 		sockaddr
  * 		sockaddr_in
+ * 		sockaddr_in6
+ * 		sockaddr_un
  *		linger
  */
 typedef struct sockaddr  sockaddr;
 typedef struct sockaddr_in  sockaddr_in;
+typedef struct sockaddr_in6 sockaddr_in6;
+typedef struct sockaddr_un  sockaddr_un;
 
 /*		ip4_addr_t
  *
@@ -230,6 +238,87 @@ int sk_error(int sk)
 	return (sk_getsockopt(sk, SOL_SOCKET, SO_ERROR, &e, sizeof e) < 0) ? -1 : e;
 }
 
+/*
+ *		int sk_notsent_lowat(int sk, int bytes);
+ *		int sk_unsent(int sk);
+ *
+ *	Not supported, both fail.
+ */
+
+static_inline
+int sk_notsent_lowat(int sk, int bytes)
+{
+	return -1;
+}
+
+static_inline
+int sk_unsent(int sk)
+{
+	return -1;
+}
+
+/*
+ *		int sk_zerocopy(int sk);
+ *		int sk_send_zc(int sk, const void * p, size_t n);
+ *		int sk_zc_done(int sk, uint32_t * lo, uint32_t * hi, int * copied);
+ *
+ *		void * sk_zc_alloc(size_t n);
+ *		void   sk_zc_free(void * p, size_t n);
+ *
+ *	Not supported, sk_zerocopy() always fails.
+ */
+
+static_inline
+int sk_zerocopy(int sk)
+{
+	return -1;
+}
+
+static_inline
+int sk_send_zc(int sk, const void * buf, size_t len)
+{
+	return sk_send(sk, buf, len);
+}
+
+static_inline
+int sk_zc_done(int sk, uint32_t * lo, uint32_t * hi, int * copied)
+{
+	return -1;
+}
+
+static_inline
+void * sk_zc_alloc(size_t len)
+{
+	return VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+static_inline
+void sk_zc_free(void * p, size_t len)
+{
+	VirtualFree(p, 0, MEM_RELEASE);
+}
+
+/*
+ *		int sk_unlink(const char * path);
+ *
+ *	AF_UNIX sockets show up as reparse points.
+ */
+
+static_inline
+int sk_unlink(const char * path)
+{
+	DWORD attr = GetFileAttributesA(path);
+
+	if (attr == INVALID_FILE_ATTRIBUTES)
+		return (GetLastError() == ERROR_FILE_NOT_FOUND) ? 0 : -1;
+
+	if (! (attr & FILE_ATTRIBUTE_REPARSE_POINT) ||
+	      (attr & FILE_ATTRIBUTE_DIRECTORY))
+		return -1;
+
+	return DeleteFileA(path) ? 0 : -1;
+}
+
 /*
  * 		int sk_conn_fatal(int err);   // boolean return
  * 		int sk_recv_fatal(int err);
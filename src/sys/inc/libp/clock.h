@@ -0,0 +1,48 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_CLOCK_H_
+#define _LIBP_CLOCK_H_
+
+#include "libp/types.h"
+#include "libp/macros.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(__linux__)
+#include <time.h>
+#endif
+
+/*
+ *	Monotonic clock, in microseconds since some unspecified
+ *	point in the past. Not affected by the wall clock changes.
+ */
+uint64_t clock_usec();
+
+/*
+ *	A raw counter of unspecified frequency that is as cheap
+ *	to read as it gets - the TSC on x86, a coarse monotonic
+ *	clock elsewhere. Meant for timestamping, not timing, as
+ *	it needs to be calibrated against clock_usec().
+ */
+static_inline
+uint64_t clock_ticks()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__linux__)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return clock_usec();
+#endif
+}
+
+#endif
+
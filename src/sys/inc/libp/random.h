@@ -0,0 +1,18 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_RANDOM_H_
+#define _LIBP_RANDOM_H_
+
+#include "libp/types.h"
+
+/*
+ *	Fills 'buf' with cryptographically secure random bytes
+ *	from the OS. Returns 0 on success and -1 on failure.
+ */
+int random_bytes(void * buf, size_t len);
+
+#endif
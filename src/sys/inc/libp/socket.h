@@ -79,6 +79,19 @@
  *		int sk_errno();       // aka "fast", errno
  *		int sk_error(int sk); // aka "slow", getsockopt(so_error)
  *
+ *		int sk_notsent_lowat(int sk, int bytes);
+ *		int sk_unsent(int sk);    // bytes not yet sent, -1 if unknown
+ *
+ *		int sk_zerocopy(int sk);  // enable MSG_ZEROCOPY, if any
+ *		int sk_send_zc(int sk, const void * p, size_t n);
+ *		int sk_zc_done(int sk, uint32_t * lo, uint32_t * hi,
+ *		               int * copied);
+ *
+ *		void * sk_zc_alloc(size_t n);
+ *		void   sk_zc_free(void * p, size_t n);
+ *
+ *		int sk_unlink(const char * path); // a unix socket's file
+ *
  * 		int sk_conn_fatal(int err); // boolean return
  * 		int sk_recv_fatal(int err);
  * 		int sk_send_fatal(int err);
@@ -104,6 +117,27 @@
  *		So for the sake of portability, it should be assumed that
  *		if a socket enters a 'reset' (or 'error') state, all its
  *		buffers - both inbound and outbound - are cleared by the OS.
+ *
+ *		sk_send_zc() leaves the data where it is until the kernel
+ *		is done with it and it reports that via the error queue.
+ *		sk_zc_done() retrieves these reports - it returns 1 with
+ *		[lo, hi] range of sk_send_zc() calls that completed, as
+ *		counted from 0 since sk_zerocopy(), 0 for other entries
+ *		and -1 once the queue is empty. 'copied' is set if the
+ *		kernel ended up copying the data anyway, e.g. over the
+ *		loopback.
+ *
+ *		Note that a pending error queue entry makes the socket
+ *		test as both readable and writable.
+ *
+ *		sk_zc_alloc() memory is mapped in pages of its own, so
+ *		that sk_zc_free() leaves any data that is still being
+ *		sent out of it intact.
+ *
+ *		sk_unlink() removes what's at 'path' only if it is a
+ *		socket, so that a mistyped path doesn't cost a file.
+ *		It returns 0 if the socket is gone or there was none
+ *		and -1 if there is something else there.
  */
 
 #error Set your Include paths to use platform-specific version of this file
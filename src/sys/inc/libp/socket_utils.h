@@ -49,6 +49,73 @@ int sk_getpeername_ip4(int sk, sockaddr_in * addr)
 	return getpeername(sk, (sockaddr*)addr, &alen);
 }
 
+static_inline
+int sk_bind_unix(int sk, const sockaddr_un * addr)
+{
+	return sk_bind(sk, (sockaddr*)addr, sizeof(*addr));
+}
+
+static_inline
+int sk_connect_unix(int sk, const sockaddr_un * addr)
+{
+	return sk_connect(sk, (sockaddr*)addr, sizeof(*addr));
+}
+
+/*
+ *	An address of any supported family - IPv4, IPv6 or
+ *	AF_UNIX for same-host setups
+ */
+typedef union sockaddr_any sockaddr_any;
+
+union sockaddr_any
+{
+	sockaddr     sa;
+	sockaddr_in  in;
+	sockaddr_in6 in6;
+	sockaddr_un  un;
+};
+
+static_inline
+socklen_t sockaddr_any_len(const sockaddr_any * addr)
+{
+	return (addr->sa.sa_family == AF_UNIX)  ? sizeof(addr->un) :
+	       (addr->sa.sa_family == AF_INET6) ? sizeof(addr->in6) :
+	                                          sizeof(addr->in);
+}
+
+static_inline
+int sk_bind_any(int sk, const sockaddr_any * addr)
+{
+	return sk_bind(sk, &addr->sa, sockaddr_any_len(addr));
+}
+
+static_inline
+int sk_connect_any(int sk, const sockaddr_any * addr)
+{
+	return sk_connect(sk, &addr->sa, sockaddr_any_len(addr));
+}
+
+static_inline
+int sk_accept_any(int sk, sockaddr_any * addr)
+{
+	socklen_t alen = sizeof(*addr);
+	return sk_accept(sk, &addr->sa, &alen);
+}
+
+static_inline
+int sk_getsockname_any(int sk, sockaddr_any * addr)
+{
+	socklen_t alen = sizeof(*addr);
+	return sk_getsockname(sk, &addr->sa, &alen);
+}
+
+static_inline
+int sk_getpeername_any(int sk, sockaddr_any * addr)
+{
+	socklen_t alen = sizeof(*addr);
+	return sk_getpeername(sk, &addr->sa, &alen);
+}
+
 static_inline
 int sk_no_delay(int sk)
 {
@@ -57,9 +124,31 @@ int sk_no_delay(int sk)
 }
 
 /*
+ *	Let an AF_INET6 socket take IPv4 connections too
+ */
+static_inline
+int sk_dual_stack(int sk)
+{
+	static const int no = 0;
+	return sk_setsockopt(sk, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof no);
+}
+
+/*
+ *	sa_to_str() formats an address of any family, IPv6 ones
+ *	as [addr]:port.
+ *
+ *	sockaddr_un_init() returns -1 if the path doesn't fit
  *
+ *	sockaddr_any_init() takes an IPv4 or IPv6 literal, the
+ *	latter with or without the brackets, or a path to a unix
+ *	socket if there's a slash in it, in which case the 'port'
+ *	is ignored. NULL 'addr' is the wildcard IPv6 address.
+ *	Returns -1 if 'addr' is no good. Doesn't do DNS.
  */
-const char * sa_to_str(const sockaddr_in * sa, char * buf, size_t max);
+const char * sa_to_str(const sockaddr * sa, char * buf, size_t max);
+
+int sockaddr_un_init(sockaddr_un * sa, const char * path);
+int sockaddr_any_init(sockaddr_any * sa, const char * addr, uint16_t port);
 
 
 #endif
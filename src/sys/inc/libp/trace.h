@@ -0,0 +1,152 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#ifndef _LIBP_TRACE_H_
+#define _LIBP_TRACE_H_
+
+#include "libp/types.h"
+#include "libp/macros.h"
+#include "libp/clock.h"
+
+/*
+ *	Binary event trace.
+ *
+ *	trace() appends a fixed-size record to the calling thread's
+ *	own ring buffer. Rings are not shared, so there's no locking
+ *	and recording boils down to reading the clock and storing
+ *	24 bytes. Once a ring wraps around, the oldest records are
+ *	overwritten.
+ *
+ *	trace() is compiled in only if LIBP_TRACE is defined and
+ *	it does nothing until trace_start() is called. Without
+ *	LIBP_TRACE it expands to nothing at all.
+ *
+ *	trace_dump() writes all rings into a file that can be
+ *	decoded with tools/trace-decode. Dumping does not stop
+ *	other threads from recording, so their most recent
+ *	records may come out garbled.
+ *
+ *	trace_dump_on_assert() arranges for a dump to be taken
+ *	when an assert() fails.
+ */
+enum trace_event
+{
+	TR_NONE = 0,
+
+	/*
+	 *	io_pipe, 'obj' is the pipe, 'state' is get_pipe_state()
+	 *	after the call and 'val' is its return value or, for
+	 *	the activity, the event mask.
+	 */
+	TR_PIPE_INIT,
+	TR_PIPE_RECV,
+	TR_PIPE_SEND,
+	TR_PIPE_SEND_FIN,
+	TR_PIPE_ACTIVITY,
+	TR_PIPE_DISCARD,
+
+	TR_EVENT_MAX
+};
+
+typedef struct trace_rec   trace_rec;
+typedef struct trace_ring  trace_ring;
+
+struct trace_rec
+{
+	uint64_t     ticks;    /* clock_ticks() */
+	uint32_t     obj;      /* lower 32 bits of the pointer */
+	int32_t      val;
+	uint16_t     event;
+	uint16_t     state;
+	uint32_t     arg;
+};
+
+struct trace_ring
+{
+	trace_ring * next;     /* see trace_dump() */
+	uint32_t     thread;   /* sequential, starting with 1 */
+	size_t       mask;     /* capacity - 1 */
+	size_t       head;     /* total recorded */
+	trace_rec    rec[1];
+};
+
+/*
+ *	capacity is in records per thread, rounded up to a power
+ *	of two
+ */
+int  trace_start(size_t capacity);
+int  trace_dump(const char * filename);
+void trace_dump_on_assert(const char * filename);
+
+/*
+ *	the innards
+ */
+extern size_t trace_capacity;
+extern thread_var trace_ring * trace_self;
+
+trace_ring * trace_attach();
+
+static_inline
+void trace_add(uint event, const void * obj, int val, uint state, uint arg)
+{
+	trace_ring * r = trace_self;
+	trace_rec  * t;
+
+	if (! r)
+	{
+		if (! trace_capacity || ! (r = trace_attach()))
+			return;
+	}
+
+	t = r->rec + (r->head++ & r->mask);
+
+	t->ticks = clock_ticks();
+	t->obj   = (uint32_t)(size_t)obj;
+	t->val   = val;
+	t->event = (uint16_t)event;
+	t->state = (uint16_t)state;
+	t->arg   = arg;
+}
+
+#ifdef LIBP_TRACE
+#define trace(ev, obj, val, state, arg) trace_add(ev, obj, val, state, arg)
+#else
+#define trace(ev, obj, val, state, arg) ((void)0)
+#endif
+
+/*
+ *	the dump format - the header, then for each ring
+ *	the ring header followed by 'count' records, the
+ *	oldest first
+ */
+#define TRACE_FILE_MAGIC    0x4352544c  /* "LTRC" */
+#define TRACE_FILE_VERSION  1
+
+typedef struct trace_file_hdr   trace_file_hdr;
+typedef struct trace_file_ring  trace_file_ring;
+
+struct trace_file_hdr
+{
+	uint32_t     magic;
+	uint32_t     version;
+	uint32_t     rec_size;
+	uint32_t     rings;
+
+	/* for converting ticks into usec */
+	uint64_t     ticks0;
+	uint64_t     usec0;
+	uint64_t     ticks1;
+	uint64_t     usec1;
+};
+
+struct trace_file_ring
+{
+	uint32_t     thread;
+	uint32_t     count;
+};
+
+#endif
+
@@ -0,0 +1,25 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/clock.h"
+
+#include <time.h>
+
+/*
+ *
+ */
+uint64_t clock_usec()
+{
+	struct timespec ts;
+	uint64_t us;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	us = ts.tv_sec;
+	us *= 1000*1000;
+	return us + ts.tv_nsec / 1000;
+}
+
@@ -0,0 +1,41 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/random.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ *
+ */
+int random_bytes(void * buf, size_t len)
+{
+	uint8_t * p = (uint8_t *)buf;
+	ssize_t r;
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	while (len)
+	{
+		r = read(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (r <= 0)
+			break;
+
+		p += r;
+		len -= r;
+	}
+
+	close(fd);
+	return len ? -1 : 0;
+}
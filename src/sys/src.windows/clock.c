@@ -0,0 +1,27 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/clock.h"
+
+#include <windows.h>
+
+/*
+ *
+ */
+uint64_t clock_usec()
+{
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER now;
+
+	if (! freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+
+	QueryPerformanceCounter(&now);
+
+	return (now.QuadPart / freq.QuadPart) * 1000000 +
+	       (now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
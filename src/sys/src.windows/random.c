@@ -0,0 +1,25 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/random.h"
+
+#include <windows.h>
+#include <bcrypt.h>
+
+#pragma comment(lib, "bcrypt.lib")
+
+/*
+ *
+ */
+int random_bytes(void * buf, size_t len)
+{
+	NTSTATUS r;
+
+	r = BCryptGenRandom(NULL, (PUCHAR)buf, (ULONG)len,
+	                    BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+
+	return (r == 0) ? 0 : -1;
+}
@@ -7,14 +7,250 @@
 #include "libp/socket_utils.h"
 #include "libp/stdio.h"
 
-const char * sa_to_str(const sockaddr_in * sa, char * buf, size_t max)
+#include <string.h>
+
+/*
+ *	IPv4 and IPv6 literals
+ */
+static
+const char * parse_ip4(const char * str, uint8_t * addr)
+{
+	uint val;
+	int i, n;
+
+	for (i = 0; i < 4; i++)
+	{
+		if (i && *str++ != '.')
+			return NULL;
+
+		for (val = 0, n = 0; '0' <= *str && *str <= '9'; n++)
+			val = val*10 + (*str++ - '0');
+
+		if (! n || n > 3 || val > 255)
+			return NULL;
+
+		if (n > 1 && str[-n] == '0')
+			return NULL; /* would be octal for inet_addr() */
+
+		addr[i] = (uint8_t)val;
+	}
+
+	return str;
+}
+
+static
+int hex_digit(char c)
+{
+	return ('0' <= c && c <= '9') ? c - '0' :
+	       ('a' <= c && c <= 'f') ? c - 'a' + 10 :
+	       ('A' <= c && c <= 'F') ? c - 'A' + 10 : -1;
+}
+
+static
+const char * parse_ip6(const char * str, uint8_t * addr)
+{
+	uint16_t word[8];
+	int n = 0, gap = -1;
+	int i, d, digits;
+	uint val;
+
+	if (str[0] == ':')
+	{
+		if (str[1] != ':')
+			return NULL;
+
+		str += 2;
+		gap = 0;
+	}
+
+	while (hex_digit(*str) >= 0)
+	{
+		if (n == 8)
+			return NULL;
+
+		/* trailing dotted quad, e.g. ::ffff:1.2.3.4 */
+		for (i = 0; hex_digit(str[i]) >= 0; i++);
+
+		if (str[i] == '.')
+		{
+			if (n > 6 || ! (str = parse_ip4(str, (uint8_t*)(word + n))))
+				return NULL;
+
+			word[n] = ntohs(word[n]);
+			word[n+1] = ntohs(word[n+1]);
+			n += 2;
+			break;
+		}
+
+		for (val = 0, digits = 0; (d = hex_digit(*str)) >= 0; digits++, str++)
+			val = (val << 4) | d;
+
+		if (digits > 4)
+			return NULL;
+
+		word[n++] = (uint16_t)val;
+
+		if (str[0] != ':')
+			break;
+
+		if (str[1] == ':')
+		{
+			if (gap >= 0)
+				return NULL;
+
+			gap = n;
+			str++;
+		}
+		else
+		if (hex_digit(str[1]) < 0)
+			return NULL;
+
+		str++;
+	}
+
+	if (gap < 0 ? (n != 8) : (n > 7))
+		return NULL;
+
+	/* expand the :: */
+	for (i = 0; i < 8; i++)
+	{
+		val = (gap < 0 || i < gap) ? word[i] :
+		      (i < gap + 8 - n)    ? 0 : word[i - 8 + n];
+
+		addr[2*i]   = (uint8_t)(val >> 8);
+		addr[2*i+1] = (uint8_t)(val);
+	}
+
+	return str;
+}
+
+/*
+ *	RFC 5952 - lowercase, the longest run of zeros is
+ *	collapsed, IPv4-mapped addresses are dotted.
+ */
+static
+void ip6_to_str(const uint8_t * addr, char * buf, size_t max)
 {
-	uint32_t addr = htonl( SOCKADDR_IN_ADDR(sa) );
-	uint16_t port = htons( SOCKADDR_IN_PORT(sa) );
+	static const uint8_t mapped[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xFF,0xFF };
+	size_t len = 0;
+	int best = -1, best_n = 1;
+	int i, n;
+
+	if (! memcmp(addr, mapped, sizeof mapped))
+	{
+		snprintf(buf, max, "::ffff:%u.%u.%u.%u",
+			addr[12], addr[13], addr[14], addr[15]);
+		return;
+	}
+
+	for (i = 0; i < 8; i += n ? n : 1)
+	{
+		for (n = 0; i+n < 8 && ! addr[2*(i+n)] && ! addr[2*(i+n)+1]; n++);
+
+		if (n > best_n)
+		{
+			best = i;
+			best_n = n;
+		}
+	}
+
+	buf[0] = 0;
+
+	for (i = 0; i < 8 && len < max; i++)
+	{
+		if (i == best)
+		{
+			len += snprintf(buf + len, max - len, "::");
+			i += best_n - 1;
+			continue;
+		}
+
+		len += snprintf(buf + len, max - len, "%s%x",
+			(i && i != best + best_n) ? ":" : "",
+			(addr[2*i] << 8) | addr[2*i+1]);
+	}
+}
+
+/*
+ *
+ */
+const char * sa_to_str(const sockaddr * sa, char * buf, size_t max)
+{
+	const sockaddr_any * any = (const sockaddr_any *)sa;
+	const uint8_t * addr;
+	char ip6[48];
+
+	switch (sa->sa_family)
+	{
+	case AF_INET:
+		addr = (const uint8_t *)&SOCKADDR_IN_ADDR(&any->in);
+		snprintf(buf, max, "%u.%u.%u.%u:%hu",
+			addr[0], addr[1], addr[2], addr[3],
+			ntohs( SOCKADDR_IN_PORT(&any->in) ));
+		break;
+
+	case AF_INET6:
+		ip6_to_str(any->in6.sin6_addr.s6_addr, ip6, sizeof ip6);
+		snprintf(buf, max, "[%s]:%hu", ip6, ntohs(any->in6.sin6_port));
+		break;
 
-	snprintf(buf, max, "%u.%u.%u.%u:%hu",
-		(addr >> 24) & 0xFF,(addr >> 16) & 0xFF,
-		(addr >>  8) & 0xFF,(addr >>  0) & 0xFF, port);
+	case AF_UNIX:
+		snprintf(buf, max, "%s", any->un.sun_path);
+		break;
+
+	default:
+		snprintf(buf, max, "<af %d>", sa->sa_family);
+	}
 
 	return buf;
 }
+
+int sockaddr_un_init(sockaddr_un * sa, const char * path)
+{
+	size_t len = strlen(path);
+
+	memset(sa, 0, sizeof *sa);
+	sa->sun_family = AF_UNIX;
+
+	if (len >= sizeof sa->sun_path)
+		return -1;
+
+	memcpy(sa->sun_path, path, len);
+	return 0;
+}
+
+int sockaddr_any_init(sockaddr_any * sa, const char * addr, uint16_t port)
+{
+	const char * end;
+
+	memset(sa, 0, sizeof *sa);
+
+	if (! addr)
+	{
+		sa->in6.sin6_family = AF_INET6;
+		sa->in6.sin6_port = htons(port);
+		return 0;
+	}
+
+	if (strchr(addr, '/'))
+		return sockaddr_un_init(&sa->un, addr);
+
+	if (strchr(addr, ':'))
+	{
+		sa->in6.sin6_family = AF_INET6;
+		sa->in6.sin6_port = htons(port);
+
+		end = parse_ip6(addr + (addr[0] == '['), sa->in6.sin6_addr.s6_addr);
+		if (end && addr[0] == '[' && *end++ != ']')
+			return -1;
+	}
+	else
+	{
+		sockaddr_in_init(&sa->in);
+		SOCKADDR_IN_PORT(&sa->in) = htons(port);
+
+		end = parse_ip4(addr, (uint8_t*)&SOCKADDR_IN_ADDR(&sa->in));
+	}
+
+	return (end && ! *end) ? 0 : -1;
+}
@@ -0,0 +1,160 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/trace.h"
+
+#include "libp/alloc.h"
+#include "libp/assert.h"
+#include "libp/stdio.h"
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#endif
+
+/*
+ *
+ */
+size_t trace_capacity = 0;
+thread_var trace_ring * trace_self = NULL;
+
+static trace_ring * volatile rings = NULL;
+static uint32_t   threads = 0;
+
+static uint64_t   ticks0;
+static uint64_t   usec0;
+
+static const char * assert_dump = NULL;
+static void (* assert_next)(const char * exp, const char * file, int line);
+
+/*
+ *
+ */
+static
+int trace_push_ring(trace_ring * r)
+{
+	trace_ring * head;
+
+	do
+	{
+		head = rings;
+		r->next = head;
+	}
+#if defined(_MSC_VER)
+	while (InterlockedCompareExchangePointer((void**)&rings, r, head) != head);
+	return InterlockedIncrement((volatile LONG *)&threads);
+#else
+	while (! __sync_bool_compare_and_swap(&rings, head, r));
+	return __sync_add_and_fetch(&threads, 1);
+#endif
+}
+
+trace_ring * trace_attach()
+{
+	trace_ring * r;
+
+	assert(trace_capacity && ! trace_self);
+
+	r = heap_zalloc(sizeof *r + (trace_capacity - 1) * sizeof(trace_rec));
+	if (! r)
+		return NULL;
+
+	r->mask = trace_capacity - 1;
+	r->thread = trace_push_ring(r);
+
+	return trace_self = r;
+}
+
+/*
+ *
+ */
+int trace_start(size_t capacity)
+{
+	size_t n = 1;
+
+	if (trace_capacity)
+		return -1; /* already started */
+
+	while (n < capacity)
+		n <<= 1;
+
+	ticks0 = clock_ticks();
+	usec0 = clock_usec();
+
+	trace_capacity = n;
+	return 0;
+}
+
+int trace_dump(const char * filename)
+{
+	trace_file_hdr  hdr;
+	trace_file_ring frh;
+	trace_ring * r;
+	size_t head, count;
+	FILE * fh;
+
+	fh = fopen(filename, "wb");
+	if (! fh)
+		return -1;
+
+	hdr.magic = TRACE_FILE_MAGIC;
+	hdr.version = TRACE_FILE_VERSION;
+	hdr.rec_size = sizeof(trace_rec);
+	hdr.rings = 0;
+	hdr.ticks0 = ticks0;
+	hdr.usec0 = usec0;
+	hdr.ticks1 = clock_ticks();
+	hdr.usec1 = clock_usec();
+
+	for (r = rings; r; r = r->next)
+		hdr.rings++;
+
+	fwrite(&hdr, sizeof hdr, 1, fh);
+
+	for (r = rings; r; r = r->next)
+	{
+		head = r->head;
+		count = (head <= r->mask) ? head : r->mask + 1;
+
+		frh.thread = r->thread;
+		frh.count = (uint32_t)count;
+		fwrite(&frh, sizeof frh, 1, fh);
+
+		/* oldest first, i.e. possibly in two chunks */
+		head &= r->mask;
+
+		if (count > head)
+			fwrite(r->rec + head, sizeof(trace_rec), count - head, fh);
+
+		fwrite(r->rec, sizeof(trace_rec), (count > head) ? head : count, fh);
+	}
+
+	return fclose(fh) ? -1 : 0;
+}
+
+/*
+ *
+ */
+static
+void trace_on_assert(const char * exp, const char * file, int line)
+{
+	fprintf(stderr, "assert(%s) failed in %s, line %d, dumping trace to %s\n",
+		exp, file, line, assert_dump);
+
+	trace_dump(assert_dump);
+	assert_next(exp, file, line);
+}
+
+void trace_dump_on_assert(const char * filename)
+{
+	assert_dump = filename;
+
+	if (on_assert == trace_on_assert)
+		return;
+
+	assert_next = on_assert;
+	on_assert = trace_on_assert;
+}
+
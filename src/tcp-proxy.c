@@ -7,8 +7,18 @@
 #include "libp/event_loop.h"
 #include "libp/io_pipe.h"
 #include "libp/io_bridge.h"
+#include "libp/io_connect.h"
+#include "libp/io_mux.h"
+#include "libp/io_ctl.h"
+#include "libp/io_stats.h"
+#include "libp/evl_stats.h"
 #include "libp/socket.h"
 #include "libp/socket_utils.h"
+#include "libp/alloc.h"
+#include "libp/clock.h"
+#include "libp/list.h"
+#include "libp/trace.h"
+#include "libp/aead.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -19,41 +29,936 @@
 #include "libp/termio.h"
 
 /*
+ *	client:
  *
+ *	--[c2p][app][p2s]--[datagram]-->
+ *
+ *	server:
+ *
+ *	--[datagram]--[c2p][app][p2s]-->
+ *
+ *	With -m all sessions share a single carrier instead,
+ *	each as a stream of the io_mux running over it:
+ *
+ *	--[c2p][app][p2s.stream]--[mux]--[datagram]-->
+ *
+ *	--[datagram]--[mux]--[c2p.stream][app][p2s]-->
+ *
+ *	With -z the proxy-to-proxy leg is compressed, i.e. there's
+ *	a zip pipe right under the datagram one.
+ *
+ *	With -k it is also encrypted, i.e. there's an aead pipe
+ *	right over the datagram one. With -w the encryption is
+ *	done by a pool of worker threads.
  */
+#define CONNECT_STAGGER_MS   250
+#define CONNECT_TIMEOUT_MS   10000
+
+typedef struct layer   layer;
+typedef struct session session;
+typedef struct carrier carrier;
+
+struct layer
+{
+	const char * name;
+	io_pipe    * pipe;
+};
+
+struct session
+{
+	dlist_item   link;
+	uint         id;
+	uint64_t     started;
+
+	int          c2p;
+	io_pipe    * stream; /* instead of c2p, -m server */
+	io_connect * conn;   /* while connecting */
+	io_bridge  * br;     /* once connected */
+	io_pipe    * zip;    /* -z */
+
+	/* -v */
+	layer        layers[8];
+	size_t       layer_count;
+};
+
+struct carrier
+{
+	dlist_item   link;
+	uint         id;
+
+	io_connect * conn;   /* client, while connecting */
+	io_mux     * mux;    /* once connected */
+	io_pipe    * zip;    /* -z */
+};
+
+struct proxy
+{
+	event_loop * evl;
+	evl_stats  * evl_stats;
+
+	io_connect_path srv[8];  /* raced by io_connect */
+	size_t          srv_count;
+
+	int          client;
+	int          multiplex; /* -m */
+	int          compress;  /* -z */
+	int          zip_level; /* -Z, ZIP_FAST by default */
+	int          crc;       /* -i */
+	int          encrypt;   /* -k */
+	uint8_t      key[AEAD_KEY_SIZE];
+	size_t       threads;   /* -w */
+	work_pool  * pool;
+	size_t       zerocopy;  /* -y, bytes */
+	size_t       lowat;     /* -q, bytes */
+	int          verbose;
+	rl_bucket  * tx;     /* -r, shared by all sessions */
+	rl_bucket  * rx;
+
+	dlist_head   sessions;
+	size_t       active;
+	uint         total;
+	uint         limit;  /* exit after this many, 0 - never */
+
+	dlist_head   carriers;
+	carrier    * carrier; /* client's, -m */
+	uint         carriers_total;
+
+	/* from the sessions that are gone */
+	uint64_t     tx_bytes;
+	uint64_t     rx_bytes;
+	uint64_t     congestions;
+	uint64_t     deferrals;
+	zip_stats    zip;
+
+	const char * trace;  /* -T, the dump file */
+};
+
+struct proxy proxy;
 int enough = 0;
 
-void on_bridge_down(void * context, int graceful)
+/*
+ *	-v, per-layer stats
+ */
+void watch(session * s, io_pipe * p, const char * name)
+{
+	if (! proxy.verbose || s->layer_count == sizeof_array(s->layers))
+		return;
+
+	if (! io_pipe_enable_stats(p))
+		return;
+
+	s->layers[s->layer_count].name = name;
+	s->layers[s->layer_count].pipe = p;
+	s->layer_count++;
+}
+
+/*
+ *	legs can be unix sockets, and those don't do TCP options
+ */
+int is_tcp(int sk)
+{
+	sockaddr_any sa;
+
+	if (sk_getsockname_any(sk, &sa) < 0)
+		return 0;
+
+	return sa.sa.sa_family == AF_INET ||
+	       sa.sa.sa_family == AF_INET6;
+}
+
+/*
+ *	-y
+ */
+void zerocopy(io_pipe * tcp, int sk)
+{
+	if (! proxy.zerocopy || ! is_tcp(sk))
+		return;
+
+	if (tcp_pipe_set_zerocopy(tcp, proxy.zerocopy) < 0)
+		printf("%s: zero-copy sends are not supported, errno %d\n",
+			tcp->_tag, sk_errno());
+}
+
+/*
+ *	-q
+ */
+void lowat(io_pipe * tcp, int sk)
+{
+	if (! proxy.lowat || ! is_tcp(sk))
+		return;
+
+	if (tcp_pipe_set_lowat(tcp, proxy.lowat) < 0)
+		printf("%s: TCP_NOTSENT_LOWAT is not supported, errno %d\n",
+			tcp->_tag, sk_errno());
+}
+
+void dump_layers(session * s)
+{
+	char buf[512];
+	size_t i;
+
+	for (i=0; i<s->layer_count; i++)
+		printf("  %-8s %s\n", s->layers[i].name,
+			io_stats_to_str(s->layers[i].pipe->stats, buf, sizeof buf));
+}
+
+void dump_evl_stats()
+{
+	const evl_stats * es = proxy.evl_stats;
+	const evl_slow_cb * slow;
+	char buf[512];
+	size_t i;
+
+	if (! es)
+		return;
+
+	printf("evl %s\n", evl_stats_to_str(es, buf, sizeof buf));
+
+	for (i=0; i<EVL_SLOWEST; i++)
+	{
+		slow = es->slowest + i;
+		if (! slow->usec)
+			break;
+
+		printf("  slow   %8llu us  sk %3d  ev %x  %s\n",
+			(unsigned long long)slow->usec, slow->sk, slow->events,
+			slow->tag ? slow->tag : "-");
+	}
+}
+
+/*
+ *	-z
+ */
+void add_zip_stats(zip_stats * sum, const io_pipe * zip)
+{
+	const zip_stats * zs;
+
+	if (! zip)
+		return;
+
+	zs = zip_pipe_stats(zip);
+
+	sum->raw_tx     += zs->raw_tx;
+	sum->zip_tx     += zs->zip_tx;
+	sum->blocks     += zs->blocks;
+	sum->stored     += zs->stored;
+	sum->skipped    += zs->skipped;
+	sum->fast       += zs->fast;
+	sum->strong     += zs->strong;
+	sum->switches   += zs->switches;
+	sum->congested_usec += zs->congested_usec;
+	sum->zip_usec   += zs->zip_usec;
+	sum->zip_rx     += zs->zip_rx;
+	sum->raw_rx     += zs->raw_rx;
+	sum->unzip_usec += zs->unzip_usec;
+}
+
+/*
+ *	sessions
+ */
+void check_limit()
 {
-	printf("\n-- bridge_down, graceful = %d --\n", graceful);
+	if (! proxy.limit || proxy.total < proxy.limit || proxy.active)
+		return;
+
+	/* -m server, let the client close the carrier first */
+	if (! proxy.client && ! dlist_empty(&proxy.carriers))
+		return;
+
 	enough = 1;
 }
 
-int main(int argc, char ** argv)
+void end_session(session * s)
 {
-	event_loop * evl;
+	dlist_del(&s->link);
+	proxy.active--;
+
+	check_limit();
+	heap_free(s);
+}
+
+void on_bridge_down(void * context, int graceful)
+{
+	session * s = (session *)context;
+	io_bridge * br = s->br;
+
+	printf("session %u down, graceful = %d, tx %llu / %llu\n",
+		s->id, graceful,
+		(unsigned long long)br->l->tx,
+		(unsigned long long)br->r->tx);
+
+	dump_layers(s);
+
+	proxy.tx_bytes += br->l->tx + br->r->tx;
+	proxy.rx_bytes += br->l->rx + br->r->rx;
+	proxy.congestions += br->l->congestions + br->r->congestions;
+	proxy.deferrals += br->l->deferrals + br->r->deferrals;
+	add_zip_stats(&proxy.zip, s->zip);
+
+	end_session(s);
+	br->discard(br);
+}
+
+io_bridge * new_session_bridge(session * s, io_pipe * io_c2p, io_pipe * io_p2s)
+{
+	io_bridge * br;
+
+	s->br = br = new_io_bridge(io_c2p, io_p2s);
+	br->on_shutdown = on_bridge_down;
+	br->on_context = s;
+	/* adapt, but see below for datagrams */
+	br->l->recv_size = br->r->recv_size = 64*1024;
+	br->l->recv_min  = br->r->recv_min  = 16*1024;
+	br->l->recv_max  = br->r->recv_max  = 512*1024;
+
+	return br;
+}
+
+void on_connected(void * context, int p2s)
+{
+	session * s = (session *)context;
 	io_pipe * io_c2p;
 	io_pipe * io_p2s;
 	io_bridge * br;
-	sockaddr_in sa;
+	sockaddr_any sa;
 	char buf[128];
-	int sk, c2p, p2s;
+
+	s->conn = NULL;
+
+	if (p2s < 0)
+	{
+		printf("session %u failed to connect\n", s->id);
+
+		if (s->stream)
+			s->stream->discard(s->stream);
+		else
+			sk_close(s->c2p);
+
+		end_session(s);
+		return;
+	}
+
+	if (sk_getpeername_any(p2s, &sa) == 0)
+		printf("session %u connected to %s, %llu ms\n",
+			s->id, sa_to_str(&sa.sa, buf, sizeof buf),
+			(unsigned long long)(clock_usec() - s->started) / 1000);
+
+	//
+	io_p2s = new_tcp_pipe(p2s);    io_p2s->_tag = "p2s";
+	watch(s, io_p2s, "p2s.tcp");
+	zerocopy(io_p2s, p2s);
+	lowat(io_p2s, p2s);
+
+	if (s->stream)
+	{
+		/* -m server, carrier's stack is shared by all sessions */
+		io_c2p = s->stream;
+		watch(s, io_c2p, "c2p.mux");
+
+		br = new_session_bridge(s, io_c2p, io_p2s);
+		br->init(br, proxy.evl);
+		return;
+	}
+
+	io_c2p = new_tcp_pipe(s->c2p); io_c2p->_tag = "c2p";
+	watch(s, io_c2p, "c2p.tcp");
+	zerocopy(io_c2p, s->c2p);
+	lowat(io_c2p, s->c2p);
+
+	if (proxy.tx)
+	{
+		/* cap the proxy-to-proxy leg */
+		if (proxy.client)
+		{
+			io_p2s = new_ratelimit_pipe(io_p2s, proxy.tx, proxy.rx);
+			watch(s, io_p2s, "p2s.rate");
+		}
+		else
+		{
+			io_c2p = new_ratelimit_pipe(io_c2p, proxy.tx, proxy.rx);
+			watch(s, io_c2p, "c2p.rate");
+		}
+	}
+
+	if (proxy.compress)
+	{
+		/* zip pipe does its own coalescing, Nagle only delays it */
+		sk_no_delay(proxy.client ? p2s : s->c2p);
+
+		if (proxy.client)
+		{
+			io_p2s = s->zip = new_zip_pipe(io_p2s);
+			zip_pipe_set_level(io_p2s, proxy.zip_level);
+			watch(s, io_p2s, "p2s.zip");
+		}
+		else
+		{
+			io_c2p = s->zip = new_zip_pipe(io_c2p);
+			zip_pipe_set_level(io_c2p, proxy.zip_level);
+			watch(s, io_c2p, "c2p.zip");
+		}
+	}
+
+	if (proxy.client)
+	{
+		io_p2s = new_dgm_pipe(io_p2s, 512*1024 + AEAD_OVERHEAD);
+		io_p2s->_tag = "p2s";
+		dgm_pipe_set_crc(io_p2s, proxy.crc);
+		watch(s, io_p2s, "p2s.dgm");
+
+		if (proxy.encrypt)
+		{
+			io_p2s = new_aead_pipe(io_p2s, proxy.key);
+			xform_pipe_set_pool(io_p2s, proxy.pool, 512*1024);
+			watch(s, io_p2s, "p2s.aead");
+		}
+	}
+	else
+	{
+		io_c2p = new_dgm_pipe(io_c2p, 512*1024 + AEAD_OVERHEAD);
+		io_c2p->_tag = "c2p";
+		dgm_pipe_set_crc(io_c2p, proxy.crc);
+		watch(s, io_c2p, "c2p.dgm");
+
+		if (proxy.encrypt)
+		{
+			io_c2p = new_aead_pipe(io_c2p, proxy.key);
+			xform_pipe_set_pool(io_c2p, proxy.pool, 512*1024);
+			watch(s, io_c2p, "c2p.aead");
+		}
+	}
+
+	//
+	br = new_session_bridge(s, io_c2p, io_p2s);
+
+	/* datagrams must be read whole, so no adapting on that side */
+	if (proxy.client)
+		br->r->recv_size = br->r->recv_min = br->r->recv_max;
+	else
+		br->l->recv_size = br->l->recv_min = br->l->recv_max;
+
+	br->init(br, proxy.evl);
+}
+
+session * new_session()
+{
+	session * s;
+
+	s = heap_zalloc(sizeof *s);
+	if (! s)
+		return NULL;
+
+	s->id = ++proxy.total;
+	s->started = clock_usec();
+	s->c2p = -1;
+
+	dlist_add_back(&proxy.sessions, &s->link);
+	proxy.active++;
+
+	return s;
+}
+
+/*
+ *	-m, carriers
+ */
+void start_carrier();
+
+void mux_session(session * s)
+{
+	io_pipe * io_c2p;
+	io_pipe * io_p2s;
+	io_bridge * br;
+
+	printf("session %u on carrier %u, %llu ms\n",
+		s->id, proxy.carrier->id,
+		(unsigned long long)(clock_usec() - s->started) / 1000);
+
+	io_c2p = new_tcp_pipe(s->c2p); io_c2p->_tag = "c2p";
+	watch(s, io_c2p, "c2p.tcp");
+	zerocopy(io_c2p, s->c2p);
+	lowat(io_c2p, s->c2p);
+
+	io_p2s = proxy.carrier->mux->open(proxy.carrier->mux);
+	io_p2s->_tag = "p2s";
+	watch(s, io_p2s, "p2s.mux");
+
+	br = new_session_bridge(s, io_c2p, io_p2s);
+	br->init(br, proxy.evl);
+}
+
+void end_carrier(carrier * c)
+{
+	dlist_del(&c->link);
+
+	if (proxy.carrier == c)
+		proxy.carrier = NULL;
+
+	if (c->conn)
+		io_connect_cancel(c->conn);
+
+	add_zip_stats(&proxy.zip, c->zip);
+
+	if (c->mux)
+		c->mux->discard(c->mux);
+
+	heap_free(c);
+	check_limit();
+}
+
+void on_mux_down(void * context)
+{
+	carrier * c = (carrier *)context;
+
+	printf("carrier %u down, %llu streams\n",
+		c->id, (unsigned long long)c->mux->opened);
+
+	end_carrier(c);
+}
+
+void on_stream(void * context, io_pipe * stream)
+{
+	carrier * c = (carrier *)context;
+	session * s;
+
+	if (proxy.limit && proxy.total == proxy.limit)
+		goto err;
+
+	s = new_session();
+	if (! s)
+		goto err;
+
+	s->stream = stream;
+
+	printf("session %u up on carrier %u, connecting ...\n", s->id, c->id);
+
+	s->conn = new_io_connect(proxy.evl, proxy.srv, proxy.srv_count,
+	                         CONNECT_STAGGER_MS, CONNECT_TIMEOUT_MS,
+	                         on_connected, s);
+	if (s->conn)
+		return;
+
+	end_session(s);
+err:
+	stream->discard(stream);
+}
+
+void setup_carrier(carrier * c, int sk)
+{
+	io_pipe * io;
+
+	if (proxy.compress)
+		sk_no_delay(sk);
+
+	io = new_tcp_pipe(sk);
+	io->_tag = "mux";
+	lowat(io, sk);
+
+	if (proxy.tx)
+		io = new_ratelimit_pipe(io, proxy.tx, proxy.rx);
+
+	if (proxy.compress)
+	{
+		io = c->zip = new_zip_pipe(io);
+		zip_pipe_set_level(io, proxy.zip_level);
+	}
+
+	io = new_dgm_pipe(io, IO_MUX_MTU + AEAD_OVERHEAD);
+	dgm_pipe_set_crc(io, proxy.crc);
+
+	if (proxy.encrypt)
+	{
+		io = new_aead_pipe(io, proxy.key);
+		xform_pipe_set_pool(io, proxy.pool, IO_MUX_MTU);
+	}
+
+	c->mux = new_io_mux(io, proxy.client);
+	c->mux->on_shutdown = on_mux_down;
+	c->mux->on_context = c;
+
+	if (! proxy.client)
+		c->mux->on_stream = on_stream;
+
+	c->mux->init(c->mux, proxy.evl);
+}
+
+void on_carrier_connected(void * context, int sk)
+{
+	carrier * c = (carrier *)context;
+	dlist_item * pos, * next;
+	session * s;
+
+	c->conn = NULL;
+
+	if (sk < 0)
+	{
+		printf("carrier %u failed to connect\n", c->id);
+		end_carrier(c);
+	}
+	else
+	{
+		printf("carrier %u connected\n", c->id);
+		setup_carrier(c, sk);
+	}
+
+	/* sessions that were waiting for it */
+	for (pos = proxy.sessions.next; pos != &proxy.sessions; pos = next)
+	{
+		next = pos->next;
+		s = struct_of(pos, session, link);
+
+		if (s->br)
+			continue;
+
+		if (proxy.carrier)
+		{
+			mux_session(s);
+			continue;
+		}
+
+		sk_close(s->c2p);
+		end_session(s);
+	}
+}
+
+carrier * new_carrier()
+{
+	carrier * c;
+
+	c = heap_zalloc(sizeof *c);
+	if (! c)
+		return NULL;
+
+	c->id = ++proxy.carriers_total;
+	dlist_add_back(&proxy.carriers, &c->link);
+
+	return c;
+}
+
+void start_carrier()
+{
+	carrier * c;
+
+	c = new_carrier();
+	if (! c)
+		return;
+
+	printf("carrier %u connecting ...\n", c->id);
+
+	proxy.carrier = c;
+
+	c->conn = new_io_connect(proxy.evl, proxy.srv, proxy.srv_count,
+	                         CONNECT_STAGGER_MS, CONNECT_TIMEOUT_MS,
+	                         on_carrier_connected, c);
+	if (! c->conn)
+		end_carrier(c);
+}
+
+void accept_carrier(int sk)
+{
+	carrier * c;
+
+	if (sk_unblock(sk) < 0 || ! (c = new_carrier()))
+	{
+		sk_close(sk);
+		return;
+	}
+
+	printf("carrier %u up\n", c->id);
+	setup_carrier(c, sk);
+}
+
+/*
+ *	listener
+ */
+void start_session(int c2p)
+{
+	session * s;
+
+	if (sk_unblock(c2p) < 0)
+		goto err;
+
+	s = new_session();
+	if (! s)
+		goto err;
+
+	s->c2p = c2p;
+
+	if (proxy.multiplex)
+	{
+		/* the carrier gets restarted if it went down */
+		if (! proxy.carrier)
+			start_carrier();
+
+		if (! proxy.carrier)
+		{
+			end_session(s);
+			goto err;
+		}
+
+		printf("session %u up\n", s->id);
+
+		if (proxy.carrier->mux)
+			mux_session(s);
+
+		return;
+	}
+
+	printf("session %u up, connecting ...\n", s->id);
+
+	s->conn = new_io_connect(proxy.evl, proxy.srv, proxy.srv_count,
+	                         CONNECT_STAGGER_MS, CONNECT_TIMEOUT_MS,
+	                         on_connected, s);
+	if (! s->conn)
+	{
+		end_session(s);
+		goto err;
+	}
+
+	return;
+
+err:
+	sk_close(c2p);
+}
+
+void on_accept(void * context, uint events)
+{
+	int sk = *(int*)context;
+	sockaddr_any sa;
+	int c2p;
+
+	for (;;)
+	{
+		if (proxy.limit && proxy.total == proxy.limit)
+		{
+			/* else select() keeps waking up for the backlog */
+			proxy.evl->del_socket(proxy.evl, sk);
+			break;
+		}
+
+		c2p = sk_accept_any(sk, &sa);
+		if (c2p < 0)
+			break;
+
+		/* select() can't watch it */
+		if (c2p >= FD_SETSIZE)
+		{
+			printf("dropped a connection, out of descriptors\n");
+			sk_close(c2p);
+			continue;
+		}
+
+		if (proxy.multiplex && ! proxy.client)
+			accept_carrier(c2p);
+		else
+			start_session(c2p);
+	}
+}
+
+/*
+ *	-S, the stats socket
+ */
+void print_br_pipe(io_ctl_reply * reply, const char * name, br_pipe * bp)
+{
+	io_ctl_printf(reply,
+		" %s.tx=%llu %s.rx=%llu %s.congestions=%llu %s.deferrals=%llu"
+		" %s.state=%c%c",
+		name, (unsigned long long)bp->tx,
+		name, (unsigned long long)bp->rx,
+		name, (unsigned long long)bp->congestions,
+		name, (unsigned long long)bp->deferrals,
+		name,
+		bp->pipe->writable ? 'w' : bp->pipe->fin_sent ? 'x' : '-',
+		bp->pipe->readable ? 'r' : bp->pipe->fin_rcvd ? 'x' : '-');
+}
+
+void print_stats(io_ctl_reply * reply, int sessions)
+{
+	uint64_t tx = proxy.tx_bytes;
+	uint64_t rx = proxy.rx_bytes;
+	uint64_t congestions = proxy.congestions;
+	uint64_t deferrals = proxy.deferrals;
+	zip_stats zip = proxy.zip;
+	uint64_t now = clock_usec();
+	size_t count, bytes, peak;
+	dlist_item * pos;
+	char buf[512];
+
+	for (pos = NULL; (pos = dlist_walk(&proxy.sessions, pos)); )
+	{
+		io_bridge * br = struct_of(pos, session, link)->br;
+
+		if (! br)
+			continue;
+
+		tx += br->l->tx + br->r->tx;
+		rx += br->l->rx + br->r->rx;
+		congestions += br->l->congestions + br->r->congestions;
+		deferrals += br->l->deferrals + br->r->deferrals;
+		add_zip_stats(&zip, struct_of(pos, session, link)->zip);
+	}
+
+	for (pos = NULL; (pos = dlist_walk(&proxy.carriers, pos)); )
+		add_zip_stats(&zip, struct_of(pos, carrier, link)->zip);
+
+	io_buffer_usage(&count, &bytes, &peak);
+
+	io_ctl_printf(reply,
+		"global sessions=%u sessions_total=%u tx=%llu rx=%llu"
+		" congestions=%llu deferrals=%llu"
+		" buffers=%llu buffer_bytes=%llu buffer_peak=%llu\n",
+		(uint)proxy.active, proxy.total,
+		(unsigned long long)tx, (unsigned long long)rx,
+		(unsigned long long)congestions, (unsigned long long)deferrals,
+		(unsigned long long)count, (unsigned long long)bytes,
+		(unsigned long long)peak);
+
+	if (proxy.compress)
+		io_ctl_printf(reply, "zip raw_tx=%llu zip_tx=%llu ratio=%.3f"
+			" blocks=%llu stored=%llu skipped=%llu fast=%llu strong=%llu"
+			" switches=%llu congested_usec=%llu zip_usec=%llu"
+			" zip_rx=%llu raw_rx=%llu unzip_usec=%llu\n",
+			(unsigned long long)zip.raw_tx, (unsigned long long)zip.zip_tx,
+			zip.raw_tx ? (double)zip.zip_tx / zip.raw_tx : 1.0,
+			(unsigned long long)zip.blocks, (unsigned long long)zip.stored,
+			(unsigned long long)zip.skipped, (unsigned long long)zip.fast,
+			(unsigned long long)zip.strong, (unsigned long long)zip.switches,
+			(unsigned long long)zip.congested_usec,
+			(unsigned long long)zip.zip_usec,
+			(unsigned long long)zip.zip_rx, (unsigned long long)zip.raw_rx,
+			(unsigned long long)zip.unzip_usec);
+
+	if (proxy.evl_stats)
+		io_ctl_printf(reply, "evl %s\n",
+			evl_stats_to_str(proxy.evl_stats, buf, sizeof buf));
+
+	for (pos = NULL; (pos = dlist_walk(&proxy.carriers, pos)); )
+	{
+		carrier * c = struct_of(pos, carrier, link);
+
+		if (! c->mux)
+			continue;
+
+		io_ctl_printf(reply, "carrier id=%u streams=%u streams_total=%llu"
+			" frames_tx=%llu frames_rx=%llu blocked=%u\n",
+			c->id, (uint)c->mux->streams,
+			(unsigned long long)c->mux->opened,
+			(unsigned long long)c->mux->frames_tx,
+			(unsigned long long)c->mux->frames_rx,
+			(uint)c->mux->blocked);
+	}
+
+	if (! sessions)
+		return;
+
+	for (pos = NULL; (pos = dlist_walk(&proxy.sessions, pos)); )
+	{
+		session * s = struct_of(pos, session, link);
+
+		if (! s->br)
+			continue;
+
+		io_ctl_printf(reply, "bridge id=%u age=%llu", s->id,
+			(unsigned long long)(now - s->started) / 1000000);
+
+		print_br_pipe(reply, "l", s->br->l);
+		print_br_pipe(reply, "r", s->br->r);
+
+		io_ctl_printf(reply, "\n");
+	}
+}
+
+void on_ctl_request(void * context, const char * req, io_ctl_reply * reply)
+{
+	if (! *req || ! strcmp(req, "stats"))
+		print_stats(reply, 1);
+	else
+	if (! strcmp(req, "global"))
+		print_stats(reply, 0);
+	else
+	if (! strcmp(req, "trace") && proxy.trace)
+		io_ctl_printf(reply, (trace_dump(proxy.trace) < 0) ?
+			"error can't write %s\n" : "trace %s\n", proxy.trace);
+	else
+		io_ctl_printf(reply, "error unknown request, "
+		                     "try 'stats', 'global' or 'trace'\n");
+}
+
+/*
+ *	<srv_addr> is a comma-separated list of addresses
+ *	to try, in parallel, see io_connect.h
+ */
+int parse_srv(const char * list, uint16_t port)
+{
+	char buf[256];
+	char * addr;
+
+	snprintf(buf, sizeof buf, "%s", list);
+
+	for (addr = strtok(buf, ","); addr; addr = strtok(NULL, ","))
+	{
+		if (proxy.srv_count == sizeof_array(proxy.srv) ||
+		    sockaddr_any_init(&proxy.srv[proxy.srv_count].remote, addr, port) < 0)
+			return -1;
+
+		proxy.srv_count++;
+	}
+
+	return proxy.srv_count ? 0 : -1;
+}
+
+/*
+ *	-k, the key file is 64 hex digits, whitespace is ignored
+ */
+int load_key(const char * path)
+{
+	FILE * f;
+	size_t n = 0;
+	int c, v;
+
+	f = fopen(path, "r");
+	if (! f)
+		return -1;
+
+	while ((c = fgetc(f)) != EOF)
+	{
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+			continue;
+
+		if      (c >= '0' && c <= '9') v = c - '0';
+		else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+		else break;
+
+		if (n == 2*AEAD_KEY_SIZE)
+			break;
+
+		proxy.key[n/2] = (n & 1) ? (proxy.key[n/2] | v) : (v << 4);
+		n++;
+	}
+
+	fclose(f);
+	return (c == EOF && n == 2*AEAD_KEY_SIZE) ? 0 : -1;
+}
+
+/*
+ *
+ */
+int main(int argc, char ** argv)
+{
+	sockaddr_any sa;
+	char buf[128];
+	int sk = -1;
 	int i, yes = 1;
 
-	int          client   = 1;
-	uint16_t     pxy_port = 55555;
+	const char * pxy_addr = "55555";
 	const char * srv_addr = "127.0.0.1";
 	uint16_t     srv_port = 22;
+	size_t       max_rate = 0;
+	const char * ctl_path = NULL;
+	io_ctl     * ctl = NULL;
 
-	/*
-	 *	client:
-	 *
-	 *	--[c2p][app][p2s]--[datagram]-->
-	 *
-	 *	server:
-	 *
-	 *	--[datagram]--[c2p][app][p2s]-->
-	 */
+	proxy.client = 1;
+	proxy.zip_level = ZIP_FAST;
 
 	//
 	for (i=1; i<argc; i++)
@@ -63,8 +968,8 @@ int main(int argc, char ** argv)
 			if (++i == argc)
 				goto syntax;
 
-			client = 1;
-			pxy_port = atoi(argv[i]);
+			proxy.client = 1;
+			pxy_addr = argv[i];
 		}
 		else
 		if (strcmp(argv[i], "-s") == 0)
@@ -72,12 +977,116 @@ int main(int argc, char ** argv)
 			if (++i == argc)
 				goto syntax;
 
-			client = 0;
-			pxy_port = atoi(argv[i]);
+			proxy.client = 0;
+			pxy_addr = argv[i];
+		}
+		else
+		if (strcmp(argv[i], "-r") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			max_rate = atoi(argv[i]) * 1024;
+		}
+		else
+		if (strcmp(argv[i], "-n") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			proxy.limit = atoi(argv[i]);
+		}
+		else
+		if (strcmp(argv[i], "-S") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			ctl_path = argv[i];
+		}
+		else
+		if (strcmp(argv[i], "-v") == 0)
+		{
+			proxy.verbose = 1;
+		}
+		else
+		if (strcmp(argv[i], "-m") == 0)
+		{
+			proxy.multiplex = 1;
+		}
+		else
+		if (strcmp(argv[i], "-z") == 0)
+		{
+			proxy.compress = 1;
+		}
+		else
+		if (strcmp(argv[i], "-i") == 0)
+		{
+			proxy.crc = 1;
+		}
+		else
+		if (strcmp(argv[i], "-k") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			if (load_key(argv[i]) < 0)
+			{
+				printf("%s - no key in there\n", argv[i]);
+				return 1;
+			}
+
+			proxy.encrypt = 1;
+		}
+		else
+		if (strcmp(argv[i], "-w") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			proxy.threads = atoi(argv[i]);
+		}
+		else
+		if (strcmp(argv[i], "-y") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			proxy.zerocopy = atoi(argv[i]) * 1024;
+		}
+		else
+		if (strcmp(argv[i], "-q") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			proxy.lowat = atoi(argv[i]) * 1024;
+		}
+		else
+		if (strcmp(argv[i], "-Z") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			proxy.compress = 1;
+			proxy.zip_level = atoi(argv[i]);
+			if (proxy.zip_level < ZIP_NONE || proxy.zip_level > ZIP_AUTO)
+				goto syntax;
+		}
+		else
+		if (strcmp(argv[i], "-T") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			proxy.trace = argv[i];
 		}
 		else
 		{
 			srv_addr = argv[i];
+			if (strchr(srv_addr, '/'))
+				continue; /* unix socket, no port */
+
 			if (++i == argc)
 				goto syntax;
 
@@ -89,104 +1098,135 @@ int main(int argc, char ** argv)
 	signal(SIGPIPE, SIG_IGN);
 
 	//
-	evl = new_event_loop_select();
+	proxy.evl = new_event_loop_select();
+	dlist_init(&proxy.sessions);
+	dlist_init(&proxy.carriers);
+
+	if (proxy.verbose)
+		proxy.evl_stats = proxy.evl->enable_stats(proxy.evl);
+
+	if (proxy.trace)
+	{
+		trace_start(64*1024);
+		trace_dump_on_assert(proxy.trace);
+	}
+
+	if (proxy.threads && proxy.encrypt)
+		proxy.pool = new_work_pool(proxy.evl, proxy.threads);
+
+	if (max_rate)
+	{
+		proxy.tx = new_rl_bucket(max_rate, max_rate / 8);
+		proxy.rx = new_rl_bucket(max_rate, max_rate / 8);
+	}
+
+	if (parse_srv(srv_addr, srv_port) < 0)
+		goto syntax;
 
 	//
-	sk = sk_create(AF_INET, SOCK_STREAM, 0);
+	if (strchr(pxy_addr, '/'))
+	{
+		if (sockaddr_un_init(&sa.un, pxy_addr) < 0)
+			goto syntax;
+
+		/* stale from a previous run, but nothing else */
+		if (sk_unlink(pxy_addr) < 0)
+		{
+			printf("%s is in the way, not removing it\n", pxy_addr);
+			return 2;
+		}
+	}
+	else
+	{
+		/* dual-stack if we can, IPv4-only if not */
+		sockaddr_any_init(&sa, NULL, atoi(pxy_addr));
+
+		sk = sk_create(AF_INET6, SOCK_STREAM, 0);
+		if (sk < 0 || sk_dual_stack(sk) < 0)
+		{
+			if (sk >= 0)
+				sk_close(sk);
+
+			sk = -1;
+			sockaddr_any_init(&sa, "0.0.0.0", atoi(pxy_addr));
+		}
+	}
+
 	if (sk < 0)
-		return 1;
+		sk = sk_create(sa.sa.sa_family, SOCK_STREAM, 0);
 
-	sockaddr_in_init(&sa);
-	SOCKADDR_IN_PORT(&sa) = htons(pxy_port);
+	if (sk < 0)
+		return 1;
 
 	if (sk_setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) < 0 ||
-	    sk_bind_ip4(sk, &sa) < 0 ||
-	    sk_listen(sk, 8) < 0)
+	    sk_bind_any(sk, &sa) < 0 ||
+	    sk_listen(sk, 64) < 0 ||
+	    sk_unblock(sk) < 0)
 		return 2;
 
-	printf("listening on %s as %s ...\n", 
-		sa_to_str(&sa, buf, sizeof buf),
-		client ? "client" : "server");
-	printf("forwarding to %s:%u\n", srv_addr, srv_port);
+	if (proxy.evl->add_socket(proxy.evl, sk, SK_EV_readable, on_accept, &sk) < 0)
+		return 2;
 
-	//
-	c2p = sk_accept_ip4(sk, &sa);
-	if (c2p < 0)
-		return 3;
-	
-	printf("accepted\n");
-	sk_unblock(c2p);
+	printf("listening on %s as %s ...\n",
+		sa_to_str(&sa.sa, buf, sizeof buf),
+		proxy.client ? "client" : "server");
+	for (i=0; i<proxy.srv_count; i++)
+		printf("forwarding to %s\n",
+			sa_to_str(&proxy.srv[i].remote.sa, buf, sizeof buf));
 
 	//
-	SOCKADDR_IN_ADDR(&sa) = inet_addr(srv_addr);
-	SOCKADDR_IN_PORT(&sa) = htons(srv_port);
-	
-	p2s = sk_create(AF_INET, SOCK_STREAM, 0);
-	if (p2s < 0)
-		return 4;
+	if (ctl_path)
+	{
+		ctl = new_io_ctl(proxy.evl, ctl_path, on_ctl_request, NULL);
+		if (! ctl)
+			return 3;
 
-	if (sk_unblock(p2s) < 0)
-		return 5;
-	
-	printf("connecting to %s ...\n", sa_to_str(&sa, buf, sizeof buf));
+		printf("stats on %s\n", ctl_path);
+	}
 
-	if (sk_connect_ip4(p2s, &sa) < 0 &&
-	    sk_conn_fatal(sk_errno(p2s)))
-	    	return 6;
+	/* pre-warm the carrier */
+	if (proxy.multiplex && proxy.client)
+		start_carrier();
 
-	//
-	io_c2p = new_tcp_pipe(c2p); io_c2p->_tag = "c2p";
-	io_p2s = new_tcp_pipe(p2s); io_p2s->_tag = "p2s";
+	fflush(stdout);
 
-	if (client)
-	{
-		io_p2s = new_dgm_pipe(io_p2s, 512*1024);
-		io_p2s->_tag = "p2s";
-	}
-	else
+	while (! enough)
 	{
-		io_c2p = new_dgm_pipe(io_c2p, 512*1024);
-		io_c2p->_tag = "c2p";
+		proxy.evl->monitor(proxy.evl, 1000);
+		fflush(stdout);
 	}
 
-	br = new_io_bridge(io_c2p, io_p2s);
-	br->on_shutdown = on_bridge_down;
-	br->l->recv_size = 512*1024;
-	br->r->recv_size = 512*1024;
-
-	br->init(br, evl);
+	dump_evl_stats();
 
-	while (! enough)
-	{
-		static uint tick = 0;
-		evl->monitor(evl, 100);
+	if (proxy.trace)
+		trace_dump(proxy.trace);
 
-		if (tick++ % 17)
-			continue;
-		
-		printf("\r%u  |  [%c%c %10llu %10llu %4u] [%c%c %10llu %10llu %4u]", 
-			tick++, 
-			br->l->pipe->writable ? 'w' :
-			br->l->pipe->fin_sent ? 'x' : '-',
-			br->l->pipe->readable ? 'r' : 
-			br->l->pipe->fin_rcvd ? 'x' : '-',
-			br->l->tx, br->l->rx, br->l->congestions,
-			br->r->pipe->writable ? 'w' : 
-			br->r->pipe->fin_sent ? 'x' : '-',
-			br->r->pipe->readable ? 'r' : 
-			br->r->pipe->fin_rcvd ? 'x' : '-',
-			br->r->tx, br->r->rx, br->r->congestions);
+	if (ctl)
+		io_ctl_discard(ctl);
 
-		fflush(stdout);
-	}
+	sk_close(sk);
+	if (sa.sa.sa_family == AF_UNIX)
+		sk_unlink(sa.un.sun_path);
 
-	printf("\n");
+	if (proxy.tx) rl_bucket_release(proxy.tx);
+	if (proxy.rx) rl_bucket_release(proxy.rx);
 
 	return 0;
 
 syntax:
-	printf("Syntax: %s [-c <pxy_port>] [-s <pxy_port>] [<srv_addr> [<srv_port]]\n",
-		argv[0]);
+	printf("Syntax: %s [-c <pxy_port>] [-s <pxy_port>] [-r <KB/s>] [-n <sessions>] "
+	       "[-S <stats_socket>] [-T <trace_file>] [-m] [-z] [-Z <level>] [-i] [-k <key_file>] [-w <threads>] [-y <KB>] [-q <KB>] [-v] [<srv_addr> [<srv_port]]\n"
+	       "\n"
+	       "  -m runs all sessions over a single proxy-to-proxy connection\n"
+	       "  -z compresses proxy-to-proxy traffic, must be set on both ends\n"
+	       "  -Z is -z with a level - 0 none, 1 fast (-z), 2 strong, 3 adapts to the link\n"
+	       "  -i adds CRC-32C to proxy-to-proxy datagrams, must be set on both ends\n"
+	       "  -k encrypts proxy-to-proxy traffic with a key from the file, 64 hex digits\n"
+	       "  -w does -k encryption on this many worker threads\n"
+	       "  -y sends chunks of this many KB and up to sockets with MSG_ZEROCOPY\n"
+	       "  -q keeps no more than about this many KB unsent in each socket\n"
+	       "  Either of <pxy_port> and <srv_addr> can also be a path to a unix socket\n"
+	       "  <srv_addr> can be a comma-separated list, the first to connect is used\n",
+	       argv[0]);
 	return 1;
 }
-
@@ -7,8 +7,14 @@
 #include "libp/event_loop.h"
 #include "libp/io_pipe.h"
 #include "libp/io_bridge.h"
+#include "libp/io_connect.h"
+#include "libp/io_ctl.h"
+#include "libp/io_stats.h"
 #include "libp/socket.h"
 #include "libp/socket_utils.h"
+#include "libp/alloc.h"
+#include "libp/clock.h"
+#include "libp/list.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -21,109 +27,433 @@
 /*
  *
  */
+#define CONNECT_STAGGER_MS   250
+#define CONNECT_TIMEOUT_MS   10000
+
+typedef struct session session;
+
+struct session
+{
+	dlist_item   link;
+	uint         id;
+	uint64_t     started;
+
+	int          c2p;
+	io_connect * conn;   /* while connecting */
+	io_bridge  * br;     /* once connected */
+};
+
+struct relay
+{
+	event_loop * evl;
+
+	io_connect_path srv[8];  /* raced by io_connect */
+	size_t          srv_count;
+
+	dlist_head   sessions;
+	size_t       active;
+	uint         total;
+	uint         limit;  /* exit after this many, 0 - never */
+
+	/* from the sessions that are gone */
+	uint64_t     tx;
+	uint64_t     rx;
+	uint64_t     congestions;
+	uint64_t     deferrals;
+};
+
+struct relay relay;
 int enough = 0;
 
+/*
+ *
+ */
+void end_session(session * s)
+{
+	dlist_del(&s->link);
+	relay.active--;
+
+	if (relay.limit && relay.total == relay.limit && ! relay.active)
+		enough = 1;
+
+	heap_free(s);
+}
+
 void on_bridge_down(void * context, int graceful)
 {
-	printf("\n-- bridge_down, graceful = %d --\n", graceful);
-	enough = 1;
+	session * s = (session *)context;
+	io_bridge * br = s->br;
+
+	printf("session %u down, graceful = %d, tx %llu / %llu\n",
+		s->id, graceful,
+		(unsigned long long)br->l->tx,
+		(unsigned long long)br->r->tx);
+
+	relay.tx += br->l->tx + br->r->tx;
+	relay.rx += br->l->rx + br->r->rx;
+	relay.congestions += br->l->congestions + br->r->congestions;
+	relay.deferrals += br->l->deferrals + br->r->deferrals;
+
+	end_session(s);
+	br->discard(br);
 }
 
-int main(int argc, char ** argv)
+void on_connected(void * context, int p2s)
 {
-	event_loop * evl;
+	session * s = (session *)context;
 	io_pipe * io_c2p;
 	io_pipe * io_p2s;
-	io_bridge * br;
-	sockaddr_in sa;
+	sockaddr_any sa;
 	char buf[128];
-	int sk, c2p, p2s;
+
+	s->conn = NULL;
+
+	if (p2s < 0)
+	{
+		printf("session %u failed to connect\n", s->id);
+		sk_close(s->c2p);
+		end_session(s);
+		return;
+	}
+
+	if (sk_getpeername_any(p2s, &sa) == 0)
+		printf("session %u connected to %s, %llu ms\n",
+			s->id, sa_to_str(&sa.sa, buf, sizeof buf),
+			(unsigned long long)(clock_usec() - s->started) / 1000);
+
+	io_c2p = new_tcp_pipe(s->c2p); io_c2p->_tag = "c2p";
+	io_p2s = new_tcp_pipe(p2s);    io_p2s->_tag = "p2s";
+
+	s->br = new_io_bridge(io_c2p, io_p2s);
+	s->br->on_shutdown = on_bridge_down;
+	s->br->on_context = s;
+
+	s->br->init(s->br, relay.evl);
+}
+
+void start_session(int c2p)
+{
+	session * s;
+
+	if (sk_unblock(c2p) < 0)
+		goto err;
+
+	s = heap_zalloc(sizeof *s);
+	if (! s)
+		goto err;
+
+	s->id = ++relay.total;
+	s->started = clock_usec();
+	s->c2p = c2p;
+
+	dlist_add_back(&relay.sessions, &s->link);
+	relay.active++;
+
+	printf("session %u up, connecting ...\n", s->id);
+
+	s->conn = new_io_connect(relay.evl, relay.srv, relay.srv_count,
+	                         CONNECT_STAGGER_MS, CONNECT_TIMEOUT_MS,
+	                         on_connected, s);
+	if (! s->conn)
+	{
+		end_session(s);
+		goto err;
+	}
+
+	return;
+
+err:
+	sk_close(c2p);
+}
+
+void on_accept(void * context, uint events)
+{
+	int sk = *(int*)context;
+	sockaddr_any sa;
+	int c2p;
+
+	for (;;)
+	{
+		if (relay.limit && relay.total == relay.limit)
+		{
+			/* else select() keeps waking up for the backlog */
+			relay.evl->del_socket(relay.evl, sk);
+			break;
+		}
+
+		c2p = sk_accept_any(sk, &sa);
+		if (c2p < 0)
+			break;
+
+		/* select() can't watch it */
+		if (c2p >= FD_SETSIZE)
+		{
+			printf("dropped a connection, out of descriptors\n");
+			sk_close(c2p);
+			continue;
+		}
+
+		start_session(c2p);
+	}
+}
+
+/*
+ *	-S, the stats socket
+ */
+void print_br_pipe(io_ctl_reply * reply, const char * name, br_pipe * bp)
+{
+	io_ctl_printf(reply,
+		" %s.tx=%llu %s.rx=%llu %s.congestions=%llu %s.deferrals=%llu"
+		" %s.state=%c%c",
+		name, (unsigned long long)bp->tx,
+		name, (unsigned long long)bp->rx,
+		name, (unsigned long long)bp->congestions,
+		name, (unsigned long long)bp->deferrals,
+		name,
+		bp->pipe->writable ? 'w' : bp->pipe->fin_sent ? 'x' : '-',
+		bp->pipe->readable ? 'r' : bp->pipe->fin_rcvd ? 'x' : '-');
+}
+
+void print_stats(io_ctl_reply * reply, int sessions)
+{
+	uint64_t tx = relay.tx;
+	uint64_t rx = relay.rx;
+	uint64_t congestions = relay.congestions;
+	uint64_t deferrals = relay.deferrals;
+	uint64_t now = clock_usec();
+	size_t count, bytes, peak;
+	dlist_item * pos;
+
+	for (pos = NULL; (pos = dlist_walk(&relay.sessions, pos)); )
+	{
+		io_bridge * br = struct_of(pos, session, link)->br;
+
+		if (! br)
+			continue;
+
+		tx += br->l->tx + br->r->tx;
+		rx += br->l->rx + br->r->rx;
+		congestions += br->l->congestions + br->r->congestions;
+		deferrals += br->l->deferrals + br->r->deferrals;
+	}
+
+	io_buffer_usage(&count, &bytes, &peak);
+
+	io_ctl_printf(reply,
+		"global sessions=%u sessions_total=%u tx=%llu rx=%llu"
+		" congestions=%llu deferrals=%llu"
+		" buffers=%llu buffer_bytes=%llu buffer_peak=%llu\n",
+		(uint)relay.active, relay.total,
+		(unsigned long long)tx, (unsigned long long)rx,
+		(unsigned long long)congestions, (unsigned long long)deferrals,
+		(unsigned long long)count, (unsigned long long)bytes,
+		(unsigned long long)peak);
+
+	if (! sessions)
+		return;
+
+	for (pos = NULL; (pos = dlist_walk(&relay.sessions, pos)); )
+	{
+		session * s = struct_of(pos, session, link);
+
+		if (! s->br)
+			continue;
+
+		io_ctl_printf(reply, "bridge id=%u age=%llu", s->id,
+			(unsigned long long)(now - s->started) / 1000000);
+
+		print_br_pipe(reply, "l", s->br->l);
+		print_br_pipe(reply, "r", s->br->r);
+
+		io_ctl_printf(reply, "\n");
+	}
+}
+
+void on_ctl_request(void * context, const char * req, io_ctl_reply * reply)
+{
+	if (! *req || ! strcmp(req, "stats"))
+		print_stats(reply, 1);
+	else
+	if (! strcmp(req, "global"))
+		print_stats(reply, 0);
+	else
+		io_ctl_printf(reply, "error unknown request, "
+		                     "try 'stats' or 'global'\n");
+}
+
+/*
+ *	<srv_addr> is a comma-separated list of addresses
+ *	to try, in parallel, see io_connect.h
+ */
+int parse_srv(const char * list, uint16_t port)
+{
+	char buf[256];
+	char * addr;
+
+	snprintf(buf, sizeof buf, "%s", list);
+
+	for (addr = strtok(buf, ","); addr; addr = strtok(NULL, ","))
+	{
+		if (relay.srv_count == sizeof_array(relay.srv) ||
+		    sockaddr_any_init(&relay.srv[relay.srv_count].remote, addr, port) < 0)
+			return -1;
+
+		relay.srv_count++;
+	}
+
+	return relay.srv_count ? 0 : -1;
+}
+
+/*
+ *
+ */
+int main(int argc, char ** argv)
+{
+	sockaddr_any sa;
+	char buf[128];
+	int sk = -1, i;
 	int yes = 1;
 
+	const char * addr     = "55555";
+	const char * srv_addr = "127.0.0.1";
+	uint16_t     srv_port = 22;
+	const char * ctl_path = NULL;
+	io_ctl     * ctl = NULL;
+
 	//
-//	signal(SIGPIPE, SIG_IGN);
+	for (i=1; i<argc; i++)
+	{
+		if (strcmp(argv[i], "-l") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			addr = argv[i];
+		}
+		else
+		if (strcmp(argv[i], "-n") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			relay.limit = atoi(argv[i]);
+		}
+		else
+		if (strcmp(argv[i], "-S") == 0)
+		{
+			if (++i == argc)
+				goto syntax;
+
+			ctl_path = argv[i];
+		}
+		else
+		{
+			srv_addr = argv[i];
+			if (strchr(srv_addr, '/'))
+				continue; /* unix socket, no port */
+
+			if (++i < argc)
+				srv_port = atoi(argv[i]);
+		}
+	}
 
 	//
-	evl = new_event_loop_select();
+#ifdef SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	//
+	relay.evl = new_event_loop_select();
+	dlist_init(&relay.sessions);
+
+	if (parse_srv(srv_addr, srv_port) < 0)
+		goto syntax;
 
 	//
 	if (sk_init() < 0)
 		return 1;
 
-	sk = sk_create(AF_INET, SOCK_STREAM, 0);
-	if (sk < 0)
-		return 2;
+	if (strchr(addr, '/'))
+	{
+		if (sockaddr_un_init(&sa.un, addr) < 0)
+			goto syntax;
 
-	sockaddr_in_init(&sa);
-	SOCKADDR_IN_PORT(&sa) = htons(55555);
+		/* stale from a previous run, but nothing else */
+		if (sk_unlink(addr) < 0)
+		{
+			printf("%s is in the way, not removing it\n", addr);
+			return 3;
+		}
+	}
+	else
+	{
+		/* dual-stack if we can, IPv4-only if not */
+		sockaddr_any_init(&sa, NULL, atoi(addr));
 
-	if (sk_setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) < 0 ||
-	    sk_bind_ip4(sk, &sa) < 0 ||
-	    sk_listen(sk, 8) < 0)
-		return 3;
+		sk = sk_create(AF_INET6, SOCK_STREAM, 0);
+		if (sk < 0 || sk_dual_stack(sk) < 0)
+		{
+			if (sk >= 0)
+				sk_close(sk);
 
-	printf("listening on %s ...\n", sa_to_str(&sa, buf, sizeof buf));
+			sk = -1;
+			sockaddr_any_init(&sa, "0.0.0.0", atoi(addr));
+		}
+	}
 
-	//
-	c2p = sk_accept_ip4(sk, &sa);
-	if (c2p < 0)
-		return 4;
-	
-	printf("accepted\n");
-	sk_unblock(c2p);
+	if (sk < 0)
+		sk = sk_create(sa.sa.sa_family, SOCK_STREAM, 0);
 
-	//
-	SOCKADDR_IN_ADDR(&sa) = inet_addr(argc > 1 ? argv[1] : "127.0.0.1");
-	SOCKADDR_IN_PORT(&sa) = htons( (argc > 2) ? atoi(argv[2]) : 22 );
-	
-	p2s = sk_create(AF_INET, SOCK_STREAM, 0);
-	if (p2s < 0)
-		return 5;
+	if (sk < 0)
+		return 2;
 
-	if (sk_unblock(p2s) < 0)
-		return 6;
-	
-	printf("connecting to %s ...\n", sa_to_str(&sa, buf, sizeof buf));
+	if (sk_setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) < 0 ||
+	    sk_bind_any(sk, &sa) < 0 ||
+	    sk_listen(sk, 64) < 0 ||
+	    sk_unblock(sk) < 0)
+		return 3;
+
+	if (relay.evl->add_socket(relay.evl, sk, SK_EV_readable, on_accept, &sk) < 0)
+		return 3;
 
-	if (sk_connect_ip4(p2s, &sa) < 0 &&
-	    sk_conn_fatal(sk_errno(p2s)))
-		return 7;
+	printf("listening on %s ...\n", sa_to_str(&sa.sa, buf, sizeof buf));
+	for (i=0; i<relay.srv_count; i++)
+		printf("forwarding to %s\n",
+			sa_to_str(&relay.srv[i].remote.sa, buf, sizeof buf));
 
 	//
-	io_c2p = new_tcp_pipe(c2p);
-	io_p2s = new_tcp_pipe(p2s);
+	if (ctl_path)
+	{
+		ctl = new_io_ctl(relay.evl, ctl_path, on_ctl_request, NULL);
+		if (! ctl)
+			return 4;
 
-	br = new_io_bridge(io_c2p, io_p2s);
-	br->on_shutdown = on_bridge_down;
+		printf("stats on %s\n", ctl_path);
+	}
 
-	br->init(br, evl);
+	fflush(stdout);
 
 	while (! enough)
 	{
-		static uint tick = 0;
-		evl->monitor(evl, 100);
-		
-		if ( (tick++ % 17) && ! enough )
-			continue;
-
-		printf("\r%u  |  [%c%c %10llu %10llu %4u] [%c%c %10llu %10llu %4u]", 
-			tick++, 
-			br->l->pipe->writable ? 'w' :
-			br->l->pipe->fin_sent ? 'x' : '-',
-			br->l->pipe->readable ? 'r' : 
-			br->l->pipe->fin_rcvd ? 'x' : '-',
-			br->l->tx, br->l->rx, br->l->congestions,
-			br->r->pipe->writable ? 'w' : 
-			br->r->pipe->fin_sent ? 'x' : '-',
-			br->r->pipe->readable ? 'r' : 
-			br->r->pipe->fin_rcvd ? 'x' : '-',
-			br->r->tx, br->r->rx, br->r->congestions);
-
+		relay.evl->monitor(relay.evl, 1000);
 		fflush(stdout);
 	}
 
-	printf("\n");
+	if (ctl)
+		io_ctl_discard(ctl);
+
+	sk_close(sk);
+	if (sa.sa.sa_family == AF_UNIX)
+		sk_unlink(sa.un.sun_path);
 
 	return 0;
-}
 
+syntax:
+	printf("Syntax: %s [-l <port>] [-n <sessions>] [-S <stats_socket>] "
+	       "[<srv_addr> [<srv_port>]]\n"
+	       "\n"
+	       "  Either of <port> and <srv_addr> can also be a path to a unix socket\n"
+	       "  <srv_addr> can be a comma-separated list, the first to connect is used\n",
+	       argv[0]);
+	return 1;
+}
@@ -0,0 +1,262 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/aead.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+#include "libp/clock.h"
+#include "libp/assert.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ *	Checks ChaCha20-Poly1305 against RFC 8439 test vectors
+ *	and checks that all ChaCha20 kernels agree, then measures
+ *	how fast each kernel and the whole seal() are at typical
+ *	datagram sizes.
+ */
+size_t chacha20_blocks_ref (const uint32_t * state, uint8_t * dst, const uint8_t * src, size_t blocks);
+size_t chacha20_blocks_sse2(const uint32_t * state, uint8_t * dst, const uint8_t * src, size_t blocks);
+size_t chacha20_blocks_avx2(const uint32_t * state, uint8_t * dst, const uint8_t * src, size_t blocks);
+int    chacha20_has_avx2();
+
+typedef size_t (* chacha20_fn)(const uint32_t * state, uint8_t * dst,
+                               const uint8_t * src, size_t blocks);
+
+#define BUF_SIZE  (512*1024)
+
+/*
+ *
+ */
+static
+void unhex(const char * hex, uint8_t * out)
+{
+	uint v;
+
+	for ( ; *hex; hex += 2)
+	{
+		while (*hex == ' ')
+			hex++;
+
+		sscanf(hex, "%2x", &v);
+		*out++ = v;
+	}
+}
+
+static
+void expect(const char * what, const uint8_t * got, const char * hex, size_t len)
+{
+	uint8_t want[256];
+
+	unhex(hex, want);
+
+	if (memcmp(got, want, len))
+	{
+		printf("%s - mismatch\n", what);
+		exit(1);
+	}
+
+	printf("%s - ok\n", what);
+}
+
+/*
+ *	RFC 8439, 2.4.2, 2.5.2 and 2.8.2
+ */
+static const char * sunscreen =
+	"Ladies and Gentlemen of the class of '99: If I could offer you "
+	"only one tip for the future, sunscreen would be it.";
+
+void check_vectors()
+{
+	uint8_t key[32], nonce[12], ad[12], buf[128], tag[16];
+	size_t len = strlen(sunscreen);
+	int i;
+
+	/* chacha20 */
+	for (i=0; i<32; i++)
+		key[i] = i;
+
+	unhex("000000000000004a00000000", nonce);
+	chacha20_xor(key, 1, nonce, buf, sunscreen, len);
+
+	expect("chacha20", buf,
+		"6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0b"
+		"f91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+		"07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab7793736"
+		"5af90bbf74a35be6b40b8eedf2785e42874d", len);
+
+	/* poly1305 */
+	unhex("85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b", key);
+	poly1305(key, "Cryptographic Forum Research Group", 34, tag);
+
+	expect("poly1305", tag, "a8061dc1305136c6c22b8baf0c0127a9", 16);
+
+	/* aead */
+	unhex("808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f", key);
+	unhex("070000004041424344454647", nonce);
+	unhex("50515253c0c1c2c3c4c5c6c7", ad);
+
+	aead_seal(key, nonce, ad, sizeof ad, buf, sunscreen, len, tag);
+
+	expect("aead seal", buf,
+		"d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+		"3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+		"92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+		"3ff4def08e4b7a9de576d26586cec64b6116", len);
+
+	expect("aead tag", tag, "1ae10b594f09e26a7e902ecbd0600691", 16);
+
+	assert(aead_open(key, nonce, ad, sizeof ad, buf, buf, len, tag) == 0);
+	assert(! memcmp(buf, sunscreen, len));
+
+	buf[7] ^= 1;
+	assert(aead_open(key, nonce, ad, sizeof ad, buf, buf, len, tag) < 0);
+
+	printf("aead open - ok\n");
+}
+
+/*
+ *
+ */
+void init_state(uint32_t * state)
+{
+	int i;
+
+	for (i=0; i<16; i++)
+		state[i] = rand();
+}
+
+void check_kernels(const uint8_t * buf)
+{
+	static uint8_t ref[64*64], out[64*64];
+	uint32_t state[16];
+	size_t blocks, n;
+	int i;
+
+	for (i=0; i<10000; i++)
+	{
+		init_state(state);
+		state[12] = (i & 1) ? rand() : 0xfffffffc; /* counter wrap */
+		blocks = 8 * (1 + rand() % 8);
+
+		chacha20_blocks_ref(state, ref, buf + i % 64, blocks);
+
+		n = chacha20_blocks_sse2(state, out, buf + i % 64, blocks);
+		if (n != blocks || memcmp(ref, out, 64*blocks))
+		{
+			printf("sse2 kernel mismatch\n");
+			exit(1);
+		}
+
+		if (! chacha20_has_avx2())
+			continue;
+
+		n = chacha20_blocks_avx2(state, out, buf + i % 64, blocks);
+		if (n != blocks || memcmp(ref, out, 64*blocks))
+		{
+			printf("avx2 kernel mismatch\n");
+			exit(1);
+		}
+	}
+
+	printf("kernels agree\n");
+}
+
+/*
+ *
+ */
+double bench_kernel(chacha20_fn fn, uint8_t * buf, size_t size)
+{
+	uint64_t started, elapsed;
+	uint32_t state[16];
+	size_t total = 0;
+	size_t off;
+
+	init_state(state);
+	started = clock_usec();
+
+	do
+	{
+		for (off = 0; off + size <= BUF_SIZE; off += size)
+			fn(state, buf + off, buf + off, size / 64);
+
+		total += off;
+		elapsed = clock_usec() - started;
+	}
+	while (elapsed < 200000);
+
+	return (double)total / elapsed / 1000;
+}
+
+double bench_seal(uint8_t * buf, size_t size)
+{
+	uint64_t started, elapsed;
+	uint8_t key[32], nonce[12] = { 0 }, tag[16];
+	size_t total = 0;
+	size_t off;
+
+	memset(key, 0x5a, sizeof key);
+	started = clock_usec();
+
+	do
+	{
+		for (off = 0; off + size <= BUF_SIZE; off += size)
+		{
+			nonce[0]++;
+			aead_seal(key, nonce, NULL, 0, buf + off, buf + off, size, tag);
+		}
+
+		total += off;
+		elapsed = clock_usec() - started;
+	}
+	while (elapsed < 200000);
+
+	return (double)total / elapsed / 1000;
+}
+
+int main(int argc, char ** argv)
+{
+	static const size_t sizes[] = { 64, 512, 1536, 4096, 16*1024, 64*1024 };
+	uint8_t * buf;
+	int avx2;
+	size_t i;
+
+	buf = heap_malloc(BUF_SIZE + 64);
+	for (i=0; i<BUF_SIZE + 64; i++)
+		buf[i] = rand();
+
+	avx2 = chacha20_has_avx2();
+	printf("avx2 is %s\n", avx2 ? "there" : "not there");
+
+	check_vectors();
+	check_kernels(buf);
+
+	printf("\n   size      ref GB/s  sse2 GB/s  avx2 GB/s  seal GB/s\n");
+
+	for (i=0; i<sizeof_array(sizes); i++)
+	{
+		printf("%7u   %11.2f ", (uint)sizes[i],
+			bench_kernel(chacha20_blocks_ref, buf, sizes[i]));
+
+		/* the vector kernels only do whole multiples of their width */
+		if (sizes[i] >= 4*64)
+			printf("%10.2f ", bench_kernel(chacha20_blocks_sse2, buf, sizes[i]));
+		else
+			printf("%10s ", "-");
+
+		if (avx2 && sizes[i] >= 8*64)
+			printf("%10.2f ", bench_kernel(chacha20_blocks_avx2, buf, sizes[i]));
+		else
+			printf("%10s ", "-");
+
+		printf("%10.2f\n", bench_seal(buf, sizes[i]));
+	}
+
+	heap_free(buf);
+	return 0;
+}
@@ -0,0 +1,564 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/event_loop.h"
+#include "libp/io_pipe.h"
+#include "libp/alloc.h"
+#include "libp/clock.h"
+#include "libp/assert.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ *	Runs a trunking pipe over in-memory carriers, one of which
+ *	keeps stalling on the receiving end as if it was going
+ *	through TCP's retransmission timeouts -
+ *
+ *	  [gen] -> [agg] => [dgm] x N => [agg] -> [sink]
+ *
+ *	In the default mode gen sends a timestamped message every
+ *	millisecond and sink measures how long it took to arrive,
+ *	so it's the tail latency with and without -f that's of
+ *	interest. With -b gen sends as fast as it can instead and
+ *	sink checks that all of it arrives intact and in order.
+ */
+struct bench_cfg
+{
+	size_t   carriers;
+	size_t   group;      /* fec */
+	int      uc;
+	size_t   count;      /* messages */
+	size_t   msg_size;
+	size_t   interval;   /* ms */
+	size_t   stall_every;
+	size_t   stall_for;
+	size_t   bulk;       /* bytes, -b */
+};
+
+struct bench_stats
+{
+	uint64_t   started;
+	uint64_t   sent;      /* messages or bytes */
+	uint64_t   rcvd;
+	size_t     failures;
+	int        done;
+
+	uint32_t * lat;
+	size_t     lat_num;
+};
+
+typedef struct bench_cfg   bench_cfg;
+typedef struct bench_stats bench_stats;
+
+static bench_cfg     cfg;
+static bench_stats   stats;
+static event_loop  * evl;
+
+static io_pipe     * gen;
+static io_pipe     * sink;
+static agg_pipe    * gen_agg;
+static agg_pipe    * sink_agg;
+
+static evl_timer     tick;
+static int           fin;      /* gen's, sent or on its way */
+static uint8_t     * msg;
+static uint8_t     * rx_buf;
+static size_t        rx_off;
+
+/*
+ *	A pipe that now and then stops passing the data up for
+ *	a while, same as TCP would while waiting for a resend
+ */
+struct stall_pipe
+{
+	io_pipe     base;
+	io_pipe   * io;
+	evl_timer   timer;
+	int         stalled;
+	size_t      stalls;
+};
+
+typedef struct stall_pipe stall_pipe;
+
+static
+void stall_clone_state(stall_pipe * p)
+{
+	p->base.ready    = p->io->ready;
+	p->base.broken   = p->io->broken;
+	p->base.readable = p->io->readable && ! p->stalled;
+	p->base.writable = p->io->writable;
+	p->base.fin_sent = p->io->fin_sent;
+	p->base.fin_rcvd = p->io->fin_rcvd;
+}
+
+static
+void stall_on_timer(void * context, uint unused)
+{
+	stall_pipe * p = (stall_pipe *)context;
+	int was = p->base.readable;
+
+	p->stalled = ! p->stalled;
+	p->stalls += p->stalled;
+
+	evl->set_timer(evl, &p->timer,
+		p->stalled ? cfg.stall_for : cfg.stall_every - cfg.stall_for);
+
+	stall_clone_state(p);
+
+	if (p->base.readable && ! was)
+		p->base.on_activity(p->base.on_context, IO_EV_readable);
+}
+
+static
+void stall_on_activity(void * context, uint events)
+{
+	stall_pipe * p = (stall_pipe *)context;
+
+	stall_clone_state(p);
+
+	if (p->stalled)
+		events &= ~IO_EV_readable;
+
+	if (events)
+		p->base.on_activity(p->base.on_context, events);
+}
+
+static
+void stall_init(io_pipe * self, event_loop * evl)
+{
+	stall_pipe * p = struct_of(self, stall_pipe, base);
+
+	p->io->init(p->io, evl);
+	stall_clone_state(p);
+
+	evl->set_timer(evl, &p->timer, cfg.stall_every - cfg.stall_for);
+}
+
+static
+int stall_recv(io_pipe * self, void * buf, size_t len)
+{
+	stall_pipe * p = struct_of(self, stall_pipe, base);
+	int r = -1;
+
+	if (! p->stalled)
+		r = p->io->recv(p->io, buf, len);
+
+	stall_clone_state(p);
+	return r;
+}
+
+static
+int stall_send(io_pipe * self, const void * buf, size_t len)
+{
+	stall_pipe * p = struct_of(self, stall_pipe, base);
+	int r;
+
+	r = p->io->send(p->io, buf, len);
+	stall_clone_state(p);
+	return r;
+}
+
+static
+int stall_send_fin(io_pipe * self)
+{
+	stall_pipe * p = struct_of(self, stall_pipe, base);
+	int r;
+
+	r = p->io->send_fin(p->io);
+	stall_clone_state(p);
+	return r;
+}
+
+static
+void stall_discard(io_pipe * self)
+{
+	stall_pipe * p = struct_of(self, stall_pipe, base);
+
+	evl->kill_timer(evl, &p->timer);
+	p->io->discard(p->io);
+	heap_free(p);
+}
+
+static
+io_pipe * new_stall_pipe(io_pipe * io)
+{
+	stall_pipe * p;
+
+	p = (stall_pipe *)heap_zalloc(sizeof *p);
+
+	p->base.init     = stall_init;
+	p->base.recv     = stall_recv;
+	p->base.send     = stall_send;
+	p->base.send_fin = stall_send_fin;
+	p->base.discard  = stall_discard;
+
+	p->io = io;
+	p->io->on_activity = stall_on_activity;
+	p->io->on_context = p;
+
+	evl_timer_init(&p->timer, stall_on_timer, p);
+
+	return &p->base;
+}
+
+/*
+ *	gen
+ */
+static
+uint8_t bulk_byte(uint64_t pos)
+{
+	return (uint8_t)(pos % 251);
+}
+
+static
+void gen_bulk()
+{
+	size_t len, i;
+	int r;
+
+	while (stats.sent < cfg.bulk && gen->writable)
+	{
+		len = cfg.bulk - stats.sent;
+		if (len > cfg.msg_size)
+			len = cfg.msg_size;
+
+		for (i=0; i<len; i++)
+			msg[i] = bulk_byte(stats.sent + i);
+
+		r = gen->send(gen, msg, len);
+		if (r <= 0)
+			break;
+
+		stats.sent += r;
+	}
+
+	if (stats.sent == cfg.bulk && ! fin)
+	{
+		fin = 1;
+		gen->send_fin(gen);
+	}
+}
+
+static
+void gen_messages()
+{
+	uint64_t now = clock_usec();
+	uint64_t due;
+
+	due = (now - stats.started) / 1000 / cfg.interval + 1;
+	if (due > cfg.count)
+		due = cfg.count;
+
+	while (stats.sent < due && gen->writable)
+	{
+		memcpy(msg, &now, 8);
+		memcpy(msg + 8, &stats.sent, 8);
+
+		if (gen->send(gen, msg, cfg.msg_size) < 0)
+			break;
+
+		stats.sent++;
+	}
+
+	if (stats.sent == cfg.count && ! fin)
+	{
+		fin = 1;
+		gen->send_fin(gen);
+	}
+}
+
+static
+void gen_run()
+{
+	if (gen->broken)
+	{
+		stats.failures++;
+		stats.done = 1;
+		return;
+	}
+
+	if (! gen->ready || fin)
+		return;
+
+	if (cfg.bulk)
+		gen_bulk();
+	else
+		gen_messages();
+}
+
+static
+void gen_on_activity(void * context, uint events)
+{
+	gen_run();
+}
+
+static
+void gen_on_tick(void * context, uint unused)
+{
+	if (! fin)
+		evl->set_timer(evl, &tick, cfg.interval);
+
+	gen_run();
+}
+
+/*
+ *	sink
+ */
+static
+void sink_message()
+{
+	uint64_t sent, index;
+
+	memcpy(&sent, rx_buf, 8);
+	memcpy(&index, rx_buf + 8, 8);
+
+	if (index != stats.rcvd)
+		stats.failures++;
+
+	stats.lat[stats.lat_num++] = (uint32_t)(clock_usec() - sent);
+	stats.rcvd++;
+}
+
+static
+void sink_on_activity(void * context, uint events)
+{
+	size_t i;
+	int r;
+
+	if (sink->broken)
+	{
+		stats.failures++;
+		stats.done = 1;
+		return;
+	}
+
+	while (sink->readable)
+	{
+		r = sink->recv(sink, rx_buf + rx_off, cfg.msg_size - rx_off);
+		if (r < 0)
+			break;
+
+		if (r == 0)
+		{
+			if (stats.rcvd != (cfg.bulk ? cfg.bulk : cfg.count))
+				stats.failures++;
+
+			stats.done = 1;
+			break;
+		}
+
+		if (cfg.bulk)
+		{
+			for (i=0; i<(size_t)r; i++)
+				if (rx_buf[i] != bulk_byte(stats.rcvd + i))
+					break;
+
+			if (i < (size_t)r)
+				stats.failures++;
+
+			stats.rcvd += r;
+			continue;
+		}
+
+		rx_off += r;
+		if (rx_off < cfg.msg_size)
+			continue;
+
+		sink_message();
+		rx_off = 0;
+	}
+}
+
+/*
+ *
+ */
+static
+void setup()
+{
+	const size_t capacity = 256*1024;
+	io_pipe * a, * b;
+	size_t i;
+
+	for (i=0; i<cfg.carriers; i++)
+	{
+		new_mem_pipe_pair(capacity, &a, &b);
+
+		a = new_dgm_pipe(a, AGG_MTU + AGG_OVERHEAD);
+
+		if (i == 0 && cfg.stall_for)
+			b = new_stall_pipe(b);
+
+		b = new_dgm_pipe(b, AGG_MTU + AGG_OVERHEAD);
+
+		if (i == 0)
+		{
+			gen  = new_agg_pipe(a, &gen_agg);
+			sink = new_agg_pipe(b, &sink_agg);
+		}
+		else
+		{
+			agg_pipe_add_pipe(gen_agg, a);
+			agg_pipe_add_pipe(sink_agg, b);
+		}
+	}
+
+	agg_pipe_set_mode(gen_agg, ! cfg.uc);
+	agg_pipe_set_fec(gen_agg, cfg.group);
+
+	gen->on_activity = gen_on_activity;
+	sink->on_activity = sink_on_activity;
+
+	gen->init(gen, evl);
+	sink->init(sink, evl);
+
+	evl_timer_init(&tick, gen_on_tick, NULL);
+	evl->set_timer(evl, &tick, 0);
+}
+
+static
+int lat_comp(const void * a, const void * b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+static
+uint32_t lat_percentile(double p)
+{
+	size_t i;
+
+	if (! stats.lat_num)
+		return 0;
+
+	i = (size_t)(p * stats.lat_num);
+	if (i >= stats.lat_num)
+		i = stats.lat_num - 1;
+
+	return stats.lat[i];
+}
+
+int main(int argc, char ** argv)
+{
+	const agg_stats * tx, * rx;
+	double sec;
+	int i;
+
+	cfg.carriers = 3;
+	cfg.count = 2000;
+	cfg.msg_size = 1000;
+	cfg.interval = 1;
+	cfg.stall_every = 100;
+	cfg.stall_for = 40;
+
+	for (i=1; i<argc; i++)
+	{
+		if (! strcmp(argv[i], "-l") && i+1 < argc)
+			cfg.carriers = atoi(argv[++i]);
+		else
+		if (! strcmp(argv[i], "-f") && i+1 < argc)
+			cfg.group = atoi(argv[++i]);
+		else
+		if (! strcmp(argv[i], "-u"))
+			cfg.uc = 1;
+		else
+		if (! strcmp(argv[i], "-n") && i+1 < argc)
+			cfg.count = atoi(argv[++i]);
+		else
+		if (! strcmp(argv[i], "-z") && i+1 < argc)
+			cfg.msg_size = atoi(argv[++i]);
+		else
+		if (! strcmp(argv[i], "-s") && i+1 < argc &&
+		    sscanf(argv[i+1], "%zu/%zu", &cfg.stall_for, &cfg.stall_every) == 2)
+			i++;
+		else
+		if (! strcmp(argv[i], "-b") && i+1 < argc)
+			cfg.bulk = (size_t)atoi(argv[++i]) * 1024*1024;
+		else
+			goto syntax;
+	}
+
+	if (cfg.carriers < 1 || cfg.carriers > AGG_PIPES_MAX)
+	{
+		printf("Carriers must be between 1 and %u\n", AGG_PIPES_MAX);
+		return 1;
+	}
+
+	if (cfg.bulk)
+		cfg.msg_size = 64*1024;
+
+	if (cfg.msg_size < 16 || cfg.msg_size > 64*1024)
+	{
+		printf("Message size must be between 16 and 64K\n");
+		return 1;
+	}
+
+	if (cfg.stall_for >= cfg.stall_every)
+	{
+		printf("Stalls must be shorter than their period\n");
+		return 1;
+	}
+
+	evl = new_event_loop_select();
+
+	msg = heap_zalloc(cfg.msg_size);
+	rx_buf = heap_malloc(cfg.msg_size);
+	stats.lat = heap_malloc((cfg.count + 1) * sizeof *stats.lat);
+
+	stats.started = clock_usec();
+	setup();
+
+	while (! stats.done)
+		evl->monitor(evl, 100);
+
+	sec = (clock_usec() - stats.started) / 1e6;
+
+	qsort(stats.lat, stats.lat_num, sizeof *stats.lat, lat_comp);
+
+	tx = agg_pipe_stats(gen_agg);
+	rx = agg_pipe_stats(sink_agg);
+
+	printf("%-5s %s  carriers %u  fec %u  stall %u/%u | ",
+		cfg.bulk ? "bulk" : "msg", cfg.uc ? "uc" : "rr",
+		(uint)cfg.carriers, (uint)cfg.group,
+		(uint)cfg.stall_for, (uint)cfg.stall_every);
+
+	if (cfg.bulk)
+		printf("%7.3f Gbit/s", stats.rcvd * 8 / sec / 1e9);
+	else
+		printf("lat %u/%u/%u us",
+			lat_percentile(0.50), lat_percentile(0.99), lat_percentile(1.0));
+
+	printf("  data %llu  parity %llu  recovered %llu  late %llu  %s\n",
+		(unsigned long long)tx->data_tx,
+		(unsigned long long)tx->parity_tx,
+		(unsigned long long)rx->recovered,
+		(unsigned long long)rx->late,
+		stats.failures ? "FAILED" : "ok");
+
+	gen->discard(gen);
+	sink->discard(sink);
+	evl->discard(evl);
+
+	heap_free(msg);
+	heap_free(rx_buf);
+	heap_free(stats.lat);
+
+	return stats.failures ? 2 : 0;
+
+syntax:
+	printf("Syntax: %s [-l <carriers>] [-f <group>] [-u] [-n <messages>] [-z <message size>]\n"
+	       "          [-s <stall ms>/<every ms>] [-b <MB>]\n"
+	       "\n"
+	       "  -f  send a parity packet for every <group> packets\n"
+	       "  -u  until-congested mode instead of round-robin\n"
+	       "  -s  how long and how often the first carrier stalls, 0/<any> for never\n"
+	       "  -b  send this much as fast as possible and check it\n",
+		argv[0]);
+	return 1;
+}
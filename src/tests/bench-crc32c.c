@@ -0,0 +1,109 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/crc32c.h"
+#include "libp/macros.h"
+#include "libp/alloc.h"
+#include "libp/clock.h"
+#include "libp/assert.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ *	Checks that both CRC-32C implementations agree, then
+ *	measures how fast each is at typical datagram sizes.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void * buf, size_t len);
+uint32_t crc32c_hw(uint32_t crc, const void * buf, size_t len);
+int      crc32c_has_hw();
+
+typedef uint32_t (* crc_fn)(uint32_t crc, const void * buf, size_t len);
+
+#define BUF_SIZE  (512*1024)
+
+/*
+ *
+ */
+void check(const uint8_t * buf)
+{
+	size_t i, off, len, cut;
+	uint32_t sw, hw, two;
+
+	assert(crc32c_sw(0, "123456789", 9) == 0xe3069283);
+	assert(crc32c_hw(0, "123456789", 9) == 0xe3069283);
+
+	for (i=0; i<100000; i++)
+	{
+		off = rand() % 64;
+		len = rand() % 4096;
+		cut = len ? rand() % len : 0;
+
+		sw  = crc32c_sw(0, buf + off, len);
+		hw  = crc32c_hw(0, buf + off, len);
+		two = crc32c_hw(crc32c_sw(0, buf + off, cut), buf + off + cut, len - cut);
+
+		if (sw != hw || sw != two)
+		{
+			printf("mismatch at %u, len %u, cut %u\n",
+				(uint)off, (uint)len, (uint)cut);
+			exit(1);
+		}
+	}
+
+	printf("sw and hw agree\n");
+}
+
+double bench(crc_fn fn, const uint8_t * buf, size_t size)
+{
+	uint64_t started, elapsed;
+	size_t total = 0;
+	size_t off = 0;
+	uint32_t crc = 0;
+
+	started = clock_usec();
+
+	do
+	{
+		for (off = 0; off + size <= BUF_SIZE; off += size)
+			crc ^= fn(0, buf + off, size);
+
+		total += off;
+		elapsed = clock_usec() - started;
+	}
+	while (elapsed < 200000);
+
+	/* keep the compiler from dropping the calls */
+	if (crc == 0x12345678)
+		printf(" ");
+
+	return (double)total / elapsed / 1000;
+}
+
+int main(int argc, char ** argv)
+{
+	static const size_t sizes[] = { 64, 512, 1500, 4096, 16*1024, 64*1024, 512*1024 };
+	uint8_t * buf;
+	size_t i;
+
+	buf = heap_malloc(BUF_SIZE + 64);
+	for (i=0; i<BUF_SIZE + 64; i++)
+		buf[i] = rand();
+
+	printf("sse 4.2 is %s\n", crc32c_has_hw() ? "there" : "not there, hw is sw");
+	check(buf);
+
+	printf("\n   size       sw GB/s   hw GB/s\n");
+
+	for (i=0; i<sizeof_array(sizes); i++)
+		printf("%7u   %11.2f %9.2f\n", (uint)sizes[i],
+			bench(crc32c_sw, buf, sizes[i]),
+			bench(crc32c_hw, buf, sizes[i]));
+
+	heap_free(buf);
+	return 0;
+}
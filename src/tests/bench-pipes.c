@@ -0,0 +1,782 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/event_loop.h"
+#include "libp/io_pipe.h"
+#include "libp/io_bridge.h"
+#include "libp/socket.h"
+#include "libp/socket_utils.h"
+#include "libp/alloc.h"
+#include "libp/clock.h"
+#include "libp/assert.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+/*
+ *	Runs both tcp-proxy's in-process and pushes traffic through
+ *
+ *	  [gen] -> [client proxy] -> [server proxy] -> [sink]
+ *
+ *	over loopback sockets or, with -u, over unix sockets or,
+ *	with -m, over in-memory pipes.
+ *
+ *	Patterns:
+ *
+ *	  bulk     - a stream of 64K blocks from gen to sink
+ *	  small    - a stream of small messages from gen to sink
+ *	  pingpong - gen sends a message, sink echoes it back, etc.
+ *	  many     - pingpong over lots of concurrent sessions
+ *
+ *	Each message carries a timestamp, so the latency is either
+ *	one-way (bulk and small) or a round-trip (pingpong, many).
+ */
+enum
+{
+	PT_bulk,
+	PT_small,
+	PT_pingpong,
+};
+
+struct bench_cfg
+{
+	int     pattern;
+	int     dgm;        /* dgm pipes between the proxies */
+	int     mem;        /* mem pipes instead of sockets */
+	int     local;      /* unix sockets instead of loopback tcp */
+	size_t  sessions;
+	size_t  count;      /* messages per session */
+	size_t  msg_size;
+};
+
+struct bench_stats
+{
+	size_t    sessions_done;
+	size_t    failures;
+
+	uint64_t  started;  /* usec */
+	uint64_t  bytes;    /* payload, one-way */
+	uint64_t  messages;
+
+	uint32_t * lat;     /* usec */
+	size_t     lat_num;
+	size_t     lat_max;
+};
+
+typedef struct bench_cfg   bench_cfg;
+typedef struct bench_stats bench_stats;
+
+static bench_cfg     cfg;
+static bench_stats   stats;
+static event_loop  * evl;
+
+/*
+ *	gen and sink
+ */
+struct endpoint
+{
+	io_pipe * io;
+	int       gen;
+
+	size_t    todo;     /* messages to send */
+	size_t    tx_off;   /* offset into the chunk being sent */
+	size_t    tx_size;  /* chunk size */
+	size_t    rx_off;   /* offset into the message being received */
+
+	uint8_t   rx_ts[8]; /* timestamp of the message being received */
+
+	int       waiting;  /* pingpong, for the echo */
+
+	uint8_t * chunk;
+};
+
+typedef struct endpoint endpoint;
+
+static
+void record_latency(uint64_t sent)
+{
+	uint64_t now = clock_usec();
+
+	stats.messages++;
+
+	if (stats.lat_num == stats.lat_max)
+	{
+		stats.lat_max = stats.lat_max ? 2*stats.lat_max : 64*1024;
+		stats.lat = heap_realloc(stats.lat, stats.lat_max * sizeof *stats.lat);
+		assert(stats.lat);
+	}
+
+	stats.lat[stats.lat_num++] = (uint32_t)(now - sent);
+}
+
+/*
+ *	Fill the chunk with as many timestamped messages as
+ *	there is left to send, up to 64K worth.
+ */
+static
+void ep_fill_chunk(endpoint * ep)
+{
+	uint64_t now = clock_usec();
+	size_t n;
+
+	n = (cfg.pattern == PT_pingpong) ? 1 : 64*1024 / cfg.msg_size;
+	if (! n)
+		n = 1;
+
+	if (n > ep->todo)
+		n = ep->todo;
+
+	ep->todo -= n;
+	ep->tx_off = 0;
+	ep->tx_size = n * cfg.msg_size;
+
+	while (n--)
+		memcpy(ep->chunk + n * cfg.msg_size, &now, sizeof now);
+
+	if (! stats.started)
+		stats.started = now;
+}
+
+/*
+ *	Consume 'len' bytes of the incoming message stream and
+ *	record the latency for each completed message
+ */
+static
+void ep_parse(endpoint * ep, const uint8_t * buf, size_t len)
+{
+	size_t n;
+
+	while (len)
+	{
+		if (ep->rx_off < 8)
+		{
+			n = 8 - ep->rx_off;
+			if (n > len)
+				n = len;
+
+			memcpy(ep->rx_ts + ep->rx_off, buf, n);
+		}
+		else
+		{
+			n = cfg.msg_size - ep->rx_off;
+			if (n > len)
+				n = len;
+		}
+
+		buf += n;
+		len -= n;
+		ep->rx_off += n;
+
+		if (ep->rx_off < cfg.msg_size)
+			continue;
+
+		if (cfg.pattern != PT_pingpong || ep->gen)
+		{
+			uint64_t ts;
+			memcpy(&ts, ep->rx_ts, sizeof ts);
+			record_latency(ts);
+		}
+
+		ep->rx_off = 0;
+		ep->waiting = 0;
+	}
+}
+
+static
+void ep_discard(endpoint * ep)
+{
+	ep->io->discard(ep->io);
+	heap_free(ep->chunk);
+	heap_free(ep);
+}
+
+static
+int ep_send(endpoint * ep)
+{
+	io_pipe * io = ep->io;
+	int r;
+
+	while (io->writable && ep->tx_off < ep->tx_size)
+	{
+		r = io->send(io, ep->chunk + ep->tx_off, ep->tx_size - ep->tx_off);
+		if (r < 0)
+			return io->broken ? -1 : 0;
+
+		ep->tx_off += r;
+	}
+
+	return 0;
+}
+
+static
+void gen_on_activity(void * context, uint events)
+{
+	endpoint * ep = (endpoint *)context;
+	io_pipe * io = ep->io;
+	uint8_t buf[64*1024];
+	int r;
+
+	if (events & IO_EV_broken)
+		goto err;
+
+	while (io->readable)
+	{
+		r = io->recv(io, buf, sizeof buf);
+		if (r < 0)
+		{
+			if (io->broken)
+				goto err;
+			break;
+		}
+
+		if (r == 0)
+		{
+			/* all done */
+			stats.sessions_done++;
+			ep_discard(ep);
+			return;
+		}
+
+		ep_parse(ep, buf, r);
+	}
+
+	for (;;)
+	{
+		if (ep_send(ep) < 0)
+			goto err;
+
+		if (ep->tx_off < ep->tx_size)
+			break; /* congested */
+
+		if (ep->waiting)
+			break; /* for the echo */
+
+		if (! ep->todo)
+		{
+			if (! io->fin_sent && io->writable &&
+			    io->send_fin(io) < 0 && io->broken)
+				goto err;
+			break;
+		}
+
+		ep_fill_chunk(ep);
+		ep->waiting = (cfg.pattern == PT_pingpong);
+	}
+
+	return;
+
+err:
+	stats.failures++;
+	stats.sessions_done++;
+	ep_discard(ep);
+}
+
+static
+void sink_on_activity(void * context, uint events)
+{
+	endpoint * ep = (endpoint *)context;
+	io_pipe * io = ep->io;
+	int r;
+
+	if (events & IO_EV_broken)
+		goto err;
+
+	for (;;)
+	{
+		/* flush the echo, if any */
+		if (ep->tx_off < ep->tx_size)
+		{
+			if (ep_send(ep) < 0)
+				goto err;
+
+			if (ep->tx_off < ep->tx_size)
+				break;
+		}
+
+		if (! io->readable)
+			break;
+
+		r = io->recv(io, ep->chunk, 64*1024);
+		if (r < 0)
+		{
+			if (io->broken)
+				goto err;
+			break;
+		}
+
+		if (r == 0)
+		{
+			/* echo the FIN and we are done */
+			if (io->send_fin(io) < 0 && io->broken)
+				goto err;
+
+			ep_discard(ep);
+			return;
+		}
+
+		ep_parse(ep, ep->chunk, r);
+
+		if (cfg.pattern != PT_pingpong)
+		{
+			stats.bytes += r;
+			continue;
+		}
+
+		ep->tx_off = 0;
+		ep->tx_size = r;
+	}
+
+	return;
+
+err:
+	stats.failures++;
+	ep_discard(ep);
+}
+
+static
+endpoint * new_endpoint(io_pipe * io, int gen)
+{
+	endpoint * ep;
+
+	ep = heap_zalloc(sizeof *ep);
+	assert(ep);
+
+	ep->io = io;
+	ep->gen = gen;
+	ep->todo = gen ? cfg.count : 0;
+	ep->chunk = heap_malloc(64*1024 + cfg.msg_size);
+	assert(ep->chunk);
+
+	io->on_activity = gen ? gen_on_activity : sink_on_activity;
+	io->on_context = ep;
+	io->init(io, evl);
+
+	return ep;
+}
+
+/*
+ *	proxies
+ */
+static
+void on_bridge_down(void * context, int graceful)
+{
+	io_bridge * br = (io_bridge *)context;
+
+	if (! graceful)
+		stats.failures++;
+
+	br->discard(br);
+}
+
+static
+void start_bridge(io_pipe * l, int l_dgm, io_pipe * r, int r_dgm)
+{
+	io_bridge * br;
+
+	if (l_dgm)
+		l = new_dgm_pipe(l, 512*1024);
+
+	if (r_dgm)
+		r = new_dgm_pipe(r, 512*1024);
+
+	br = new_io_bridge(l, r);
+	br->on_shutdown = on_bridge_down;
+	br->on_context = br;
+
+	br->l->recv_size = br->r->recv_size = 64*1024;
+	br->l->recv_min  = br->r->recv_min  = 16*1024;
+	br->l->recv_max  = br->r->recv_max  = 512*1024;
+
+	/* datagrams must be read whole */
+	if (l_dgm)
+		br->l->recv_size = br->l->recv_min = br->l->recv_max;
+
+	if (r_dgm)
+		br->r->recv_size = br->r->recv_min = br->r->recv_max;
+
+	br->init(br, evl);
+}
+
+struct bench_listener
+{
+	int          sk;
+	sockaddr_any addr;
+
+	/* proxy */
+	sockaddr_any next;
+	int          dgm_in;
+	int          dgm_out;
+	int          sink;
+};
+
+typedef struct bench_listener bench_listener;
+
+static
+int bench_connect(const sockaddr_any * sa)
+{
+	int sk;
+
+	sk = sk_create(sa->sa.sa_family, SOCK_STREAM, 0);
+	if (sk < 0)
+		return -1;
+
+	sk_unblock(sk);
+	if (! cfg.local)
+		sk_no_delay(sk);
+
+	if (sk_connect_any(sk, sa) < 0 &&
+	    sk_conn_fatal(sk_errno()))
+	{
+		sk_close(sk);
+		return -1;
+	}
+
+	return sk;
+}
+
+static
+void on_accept(void * context, uint events)
+{
+	bench_listener * bl = (bench_listener *)context;
+	sockaddr_any sa;
+	int in, out;
+
+	while ( (in = sk_accept_any(bl->sk, &sa)) >= 0 )
+	{
+		sk_unblock(in);
+		if (! cfg.local)
+			sk_no_delay(in);
+
+		if (bl->sink)
+		{
+			new_endpoint(new_tcp_pipe(in), 0);
+			continue;
+		}
+
+		out = bench_connect(&bl->next);
+		if (out < 0)
+		{
+			stats.failures++;
+			sk_close(in);
+			continue;
+		}
+
+		start_bridge(new_tcp_pipe(in), bl->dgm_in,
+		             new_tcp_pipe(out), bl->dgm_out);
+	}
+}
+
+static
+int bench_listen(bench_listener * bl)
+{
+	static const int yes = 1;
+	static int seq = 0;
+	char path[64];
+
+	if (cfg.local)
+	{
+		snprintf(path, sizeof path, "/tmp/bench-pipes.%d.%d", (int)getpid(), seq++);
+		sockaddr_un_init(&bl->addr.un, path);
+		remove(path);
+	}
+	else
+	{
+		sockaddr_in_init(&bl->addr.in);
+		SOCKADDR_IN_ADDR(&bl->addr.in) = htonl(INADDR_LOOPBACK);
+	}
+
+	bl->sk = sk_create(bl->addr.sa.sa_family, SOCK_STREAM, 0);
+	if (bl->sk < 0)
+		return -1;
+
+	if (sk_setsockopt(bl->sk, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) < 0 ||
+	    sk_bind_any(bl->sk, &bl->addr) < 0 ||
+	    sk_listen(bl->sk, 1024) < 0 ||
+	    (! cfg.local && sk_getsockname_ip4(bl->sk, &bl->addr.in) < 0) ||
+	    sk_unblock(bl->sk) < 0)
+		return -1;
+
+	evl->add_socket(evl, bl->sk, SK_EV_readable, on_accept, bl);
+	return 0;
+}
+
+/*
+ *	setup
+ */
+static bench_listener cli, srv, sink;
+
+static
+void stop_sockets()
+{
+	bench_listener * bl[] = { &cli, &srv, &sink };
+	size_t i;
+
+	for (i=0; i<sizeof_array(bl); i++)
+	{
+		if (! bl[i]->addr.sa.sa_family)
+			continue;
+
+		evl->del_socket(evl, bl[i]->sk);
+		sk_close(bl[i]->sk);
+
+		if (cfg.local)
+			remove(bl[i]->addr.un.sun_path);
+	}
+}
+
+static
+int start_sockets()
+{
+	size_t i;
+	int sk;
+
+	sink.sink = 1;
+
+	if (bench_listen(&sink) < 0)
+		return -1;
+
+	srv.next = sink.addr;
+	srv.dgm_in = cfg.dgm;
+
+	if (bench_listen(&srv) < 0)
+		return -1;
+
+	cli.next = srv.addr;
+	cli.dgm_out = cfg.dgm;
+
+	if (bench_listen(&cli) < 0)
+		return -1;
+
+	for (i=0; i<cfg.sessions; i++)
+	{
+		sk = bench_connect(&cli.addr);
+		if (sk < 0)
+			return -1;
+
+		new_endpoint(new_tcp_pipe(sk), 1);
+	}
+
+	return 0;
+}
+
+static
+int start_mem()
+{
+	const size_t capacity = 256*1024;
+	io_pipe * gen, * c2p, * p2p_c, * p2p_s, * p2s, * sink;
+	size_t i;
+
+	for (i=0; i<cfg.sessions; i++)
+	{
+		new_mem_pipe_pair(capacity, &gen, &c2p);
+		new_mem_pipe_pair(capacity, &p2p_c, &p2p_s);
+		new_mem_pipe_pair(capacity, &p2s, &sink);
+
+		start_bridge(c2p, 0, p2p_c, cfg.dgm);
+		start_bridge(p2p_s, cfg.dgm, p2s, 0);
+
+		new_endpoint(gen, 1);
+		new_endpoint(sink, 0);
+	}
+
+	return 0;
+}
+
+/*
+ *	report
+ */
+static
+int lat_comp(const void * a, const void * b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+static
+uint32_t lat_percentile(double p)
+{
+	size_t i;
+
+	if (! stats.lat_num)
+		return 0;
+
+	i = (size_t)(p * stats.lat_num);
+	if (i >= stats.lat_num)
+		i = stats.lat_num - 1;
+
+	return stats.lat[i];
+}
+
+static
+double cpu_sec()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static
+const char * pattern_name[] = { "bulk", "small", "pingpong" };
+
+int main(int argc, char ** argv)
+{
+	const char * pattern = "bulk";
+	double cpu0, cpu1, sec;
+	uint64_t t1;
+	int i;
+
+	cfg.sessions = 0;
+	cfg.count = 0;
+	cfg.msg_size = 0;
+
+	for (i=1; i<argc; i++)
+	{
+		if (! strcmp(argv[i], "-p") && i+1 < argc)
+			pattern = argv[++i];
+		else
+		if (! strcmp(argv[i], "-s") && i+1 < argc)
+			cfg.sessions = atoi(argv[++i]);
+		else
+		if (! strcmp(argv[i], "-n") && i+1 < argc)
+			cfg.count = atoi(argv[++i]);
+		else
+		if (! strcmp(argv[i], "-z") && i+1 < argc)
+			cfg.msg_size = atoi(argv[++i]);
+		else
+		if (! strcmp(argv[i], "-d"))
+			cfg.dgm = 1;
+		else
+		if (! strcmp(argv[i], "-m"))
+			cfg.mem = 1;
+		else
+		if (! strcmp(argv[i], "-u"))
+			cfg.local = 1;
+		else
+			goto syntax;
+	}
+
+	if (! strcmp(pattern, "bulk"))
+	{
+		cfg.pattern = PT_bulk;
+		if (! cfg.msg_size) cfg.msg_size = 64*1024;
+		if (! cfg.count)    cfg.count = 16*1024;
+	}
+	else
+	if (! strcmp(pattern, "small"))
+	{
+		cfg.pattern = PT_small;
+		if (! cfg.msg_size) cfg.msg_size = 64;
+		if (! cfg.count)    cfg.count = 1000*1000;
+	}
+	else
+	if (! strcmp(pattern, "pingpong"))
+	{
+		cfg.pattern = PT_pingpong;
+		if (! cfg.msg_size) cfg.msg_size = 64;
+		if (! cfg.count)    cfg.count = 20*1000;
+	}
+	else
+	if (! strcmp(pattern, "many"))
+	{
+		cfg.pattern = PT_pingpong;
+		if (! cfg.sessions) cfg.sessions = 128;
+		if (! cfg.msg_size) cfg.msg_size = 64;
+		if (! cfg.count)    cfg.count = 1000;
+	}
+	else
+		goto syntax;
+
+	if (! cfg.sessions)
+		cfg.sessions = 1;
+
+	if (cfg.msg_size < 8 || cfg.msg_size > 64*1024)
+	{
+		printf("Message size must be between 8 and 64K\n");
+		return 1;
+	}
+
+	/* 6 sockets per session, and select() can only do so many */
+	if (! cfg.mem && cfg.sessions * 6 + 16 > FD_SETSIZE)
+	{
+		printf("Too many sessions for select(), max is %u\n",
+			(uint)(FD_SETSIZE - 16) / 6);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (sk_init() < 0)
+		return 1;
+
+	evl = new_event_loop_select();
+
+	cpu0 = cpu_sec();
+
+	if ( (cfg.mem ? start_mem() : start_sockets()) < 0 )
+	{
+		printf("Failed to set up, errno %d\n", sk_errno());
+		return 1;
+	}
+
+	while (stats.sessions_done < cfg.sessions)
+		evl->monitor(evl, 100);
+
+	t1 = clock_usec();
+	cpu1 = cpu_sec();
+
+	/*
+	 *
+	 */
+	if (cfg.pattern == PT_pingpong)
+		stats.bytes = stats.messages * cfg.msg_size;
+
+	sec = (t1 - stats.started) / 1e6;
+
+	qsort(stats.lat, stats.lat_num, sizeof *stats.lat, lat_comp);
+
+	printf("%-8s %-3s %-4s  sessions %-4u  msg %-6u | "
+	       "%7.3f Gbit/s  %9.0f msg/s  "
+	       "lat %u/%u/%u us  cpu %.2f s/GB  %s\n",
+		pattern_name[cfg.pattern],
+		cfg.dgm ? "dgm" : "tcp",
+		cfg.mem ? "mem" : cfg.local ? "unix" : "sock",
+		(uint)cfg.sessions,
+		(uint)cfg.msg_size,
+		stats.bytes * 8 / sec / 1e9,
+		stats.messages / sec,
+		lat_percentile(0.50),
+		lat_percentile(0.99),
+		lat_percentile(0.999),
+		stats.bytes ? (cpu1 - cpu0) / (stats.bytes / 1e9) : 0.,
+		stats.failures ? "FAILED" : "ok");
+
+	if (! cfg.mem)
+		stop_sockets();
+
+	evl->discard(evl);
+	heap_free(stats.lat);
+
+	return stats.failures ? 2 : 0;
+
+syntax:
+	printf("Syntax: %s [-p bulk|small|pingpong|many] [-s <sessions>]\n"
+	       "          [-n <messages per session>] [-z <message size>]\n"
+	       "          [-d] [-m] [-u]\n"
+	       "\n"
+	       "  -d  use dgm pipes between the proxies, atx comes with them\n"
+	       "  -m  use in-memory pipes instead of loopback sockets\n"
+	       "  -u  use unix sockets instead of loopback tcp\n",
+		argv[0]);
+	return 1;
+}
+
@@ -0,0 +1,386 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/event_loop.h"
+#include "libp/io_pipe.h"
+#include "libp/socket.h"
+#include "libp/socket_utils.h"
+#include "libp/alloc.h"
+#include "libp/clock.h"
+#include "libp/assert.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+ *	Pushes a stream through a tcp_pipe in chunks of the same
+ *	size, first with plain sends and then with MSG_ZEROCOPY,
+ *	for each chunk size from 4K to 1M, and measures how much
+ *	CPU time each takes -
+ *
+ *	  [gen] -> [tcp_pipe] -> [sink]
+ *
+ *	The sink is a child process on the loopback by default.
+ *	Note that the kernel copies zero-copy data there anyway,
+ *	so for meaningful numbers run the sink on another box
+ *	with -l and point the bench at it with -a.
+ *
+ *	The sink acks each stream with a byte once it gets its
+ *	FIN, so the time is that of the whole transfer. The CPU
+ *	time is that of the gen only.
+ */
+struct bench_cfg
+{
+	size_t        bytes;      /* per run */
+	size_t        chunk;      /* 0 - all sizes */
+	sockaddr_any  sink;
+};
+
+struct bench_run
+{
+	io_pipe     * io;
+	size_t        chunk;
+	size_t        sent;
+	const uint8_t * tail;     /* unsent part of the last chunk */
+	size_t        tail_len;
+	int           done;
+	int           failed;
+};
+
+typedef struct bench_cfg bench_cfg;
+typedef struct bench_run bench_run;
+
+static bench_cfg     cfg;
+static event_loop  * evl;
+static uint8_t     * scratch;
+
+/*
+ *	sink
+ */
+static
+void sink_loop(int lsk)
+{
+	static uint8_t buf[1024*1024];
+	int sk, r;
+
+	while ( (sk = sk_accept(lsk, NULL, NULL)) >= 0 )
+	{
+		while ( (r = sk_recv(sk, buf, sizeof buf)) > 0 );
+
+		if (r == 0)
+			sk_send(sk, "!", 1);
+
+		sk_close(sk);
+	}
+}
+
+static
+int sink_listen(sockaddr_any * sa)
+{
+	int sk;
+
+	sk = sk_create(sa->sa.sa_family, SOCK_STREAM, 0);
+	if (sk < 0)
+		return -1;
+
+	if (sk_bind_any(sk, sa) < 0 ||
+	    sk_listen(sk, 8) < 0 ||
+	    sk_getsockname_any(sk, sa) < 0)
+	{
+		sk_close(sk);
+		return -1;
+	}
+
+	return sk;
+}
+
+/*
+ *	gen
+ */
+static
+void gen_push(bench_run * run)
+{
+	io_pipe * io = run->io;
+	uint8_t * buf;
+	int r;
+
+	while (io->writable && run->sent < cfg.bytes)
+	{
+		if (! run->tail_len)
+		{
+			buf = io->get_buffer ?
+				io->get_buffer(io, run->chunk) : NULL;
+
+			if (! buf)
+				buf = scratch;
+
+			/* as if it was just recv'd into */
+			memcpy(buf, &run->sent, sizeof run->sent);
+
+			run->tail = buf;
+			run->tail_len = run->chunk;
+
+			if (run->tail_len > cfg.bytes - run->sent)
+				run->tail_len = cfg.bytes - run->sent;
+		}
+
+		r = io->send(io, run->tail, run->tail_len);
+		if (r < 0)
+		{
+			if (io->broken)
+				run->failed = 1;
+			return;
+		}
+
+		run->tail += r;
+		run->tail_len -= r;
+		run->sent += r;
+	}
+
+	if (run->sent == cfg.bytes && ! io->fin_sent)
+		if (io->send_fin(io) < 0 && io->broken)
+			run->failed = 1;
+}
+
+static
+void gen_on_activity(void * context, uint events)
+{
+	bench_run * run = (bench_run *)context;
+	io_pipe * io = run->io;
+	uint8_t ack;
+
+	if (events & IO_EV_broken)
+	{
+		run->failed = 1;
+		return;
+	}
+
+	if (io->writable)
+		gen_push(run);
+
+	if (io->readable && io->recv(io, &ack, 1) == 1)
+		run->done = 1;
+}
+
+static
+double cpu_sec()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ *	returns CPU seconds per GB, or -1
+ */
+static
+double gen_run(size_t chunk, int zerocopy, double * gbps, tcp_zc_stats * zs)
+{
+	bench_run run = { 0 };
+	double cpu0, cpu1;
+	uint64_t t0, t1;
+	int sk;
+
+	sk = sk_create(cfg.sink.sa.sa_family, SOCK_STREAM, 0);
+	if (sk < 0)
+		return -1;
+
+	if (sk_connect_any(sk, &cfg.sink) < 0 || sk_unblock(sk) < 0)
+	{
+		sk_close(sk);
+		return -1;
+	}
+
+	run.io = new_tcp_pipe(sk);
+	run.chunk = chunk;
+
+	if (zerocopy && tcp_pipe_set_zerocopy(run.io, chunk) < 0)
+	{
+		run.io->discard(run.io);
+		return -1;
+	}
+
+	run.io->on_activity = gen_on_activity;
+	run.io->on_context = &run;
+	run.io->init(run.io, evl);
+
+	t0 = clock_usec();
+	cpu0 = cpu_sec();
+
+	while (! run.done && ! run.failed)
+		evl->monitor(evl, 100);
+
+	t1 = clock_usec();
+	cpu1 = cpu_sec();
+
+	memset(zs, 0, sizeof *zs);
+	if (zerocopy)
+		tcp_pipe_zc_stats(run.io, zs);
+
+	run.io->discard(run.io);
+
+	if (run.failed)
+		return -1;
+
+	*gbps = cfg.bytes * 8. / (t1 - t0) / 1e3;
+	return (cpu1 - cpu0) / (cfg.bytes / 1e9);
+}
+
+/*
+ *
+ */
+int main(int argc, char ** argv)
+{
+	const char * addr = NULL;
+	int listen_port = 0;
+	int port = 0;
+	size_t chunk, crossover = 0;
+	pid_t sink = 0;
+	int lsk = -1;
+	int i;
+
+	cfg.bytes = 256;
+
+	for (i=1; i<argc; i++)
+	{
+		if (! strcmp(argv[i], "-n") && i+1 < argc)
+			cfg.bytes = atoi(argv[++i]);
+		else
+		if (! strcmp(argv[i], "-z") && i+1 < argc)
+			cfg.chunk = atoi(argv[++i]) * 1024;
+		else
+		if (! strcmp(argv[i], "-a") && i+2 < argc)
+		{
+			addr = argv[++i];
+			port = atoi(argv[++i]);
+		}
+		else
+		if (! strcmp(argv[i], "-l") && i+1 < argc)
+			listen_port = atoi(argv[++i]);
+		else
+			goto syntax;
+	}
+
+	cfg.bytes *= 1024*1024;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (sk_init() < 0)
+		return 1;
+
+	/*
+	 *	sink
+	 */
+	if (listen_port || ! addr)
+	{
+		sockaddr_any_init(&cfg.sink, listen_port ? NULL : "127.0.0.1", listen_port);
+
+		lsk = sink_listen(&cfg.sink);
+		if (lsk < 0)
+		{
+			printf("Failed to set up the sink, errno %d\n", sk_errno());
+			return 1;
+		}
+
+		if (listen_port)
+		{
+			sink_loop(lsk);
+			return 0;
+		}
+
+		sink = fork();
+		if (sink == 0)
+		{
+			sink_loop(lsk);
+			_exit(0);
+		}
+
+		sk_close(lsk);
+	}
+	else
+	if (sockaddr_any_init(&cfg.sink, addr, port) < 0)
+	{
+		printf("Bad address - %s\n", addr);
+		return 1;
+	}
+
+	/*
+	 *	gen
+	 */
+	evl = new_event_loop_select();
+	scratch = heap_malloc(1024*1024);
+
+	for (chunk = cfg.chunk ? cfg.chunk : 4*1024;
+	     chunk <= (cfg.chunk ? cfg.chunk : 1024*1024);
+	     chunk *= 2)
+	{
+		tcp_zc_stats zs;
+		double copy, zc;
+		double copy_gbps, zc_gbps;
+
+		copy = gen_run(chunk, 0, &copy_gbps, &zs);
+		zc   = gen_run(chunk, 1, &zc_gbps, &zs);
+
+		if (copy < 0 || zc < 0)
+		{
+			printf("chunk %4uK | failed, errno %d\n",
+				(uint)(chunk / 1024), sk_errno());
+			break;
+		}
+
+		printf("chunk %4uK | copy %7.3f Gbit/s  cpu %.3f s/GB | "
+		       "zc %7.3f Gbit/s  cpu %.3f s/GB  copied %3u%%  no buffer %llu | %s\n",
+			(uint)(chunk / 1024),
+			copy_gbps, copy,
+			zc_gbps, zc,
+			zs.completed ? (uint)(zs.copied * 100 / zs.completed) : 0,
+			(unsigned long long)zs.no_buffer,
+			zc < copy ? "zc" : "copy");
+
+		if (zc < copy && ! crossover)
+			crossover = chunk;
+
+		if (zc >= copy)
+			crossover = 0;
+
+		fflush(stdout);
+	}
+
+	if (! cfg.chunk)
+	{
+		if (crossover)
+			printf("zero-copy wins from %uK up\n", (uint)(crossover / 1024));
+		else
+			printf("zero-copy doesn't win at any size\n");
+	}
+
+	if (sink)
+	{
+		kill(sink, SIGTERM);
+		waitpid(sink, NULL, 0);
+	}
+
+	heap_free(scratch);
+	evl->discard(evl);
+
+	return 0;
+
+syntax:
+	printf("Syntax: %s [-n <MB per run>] [-z <chunk KB>] [-a <addr> <port> | -l <port>]\n"
+	       "\n"
+	       "  -z  try just this chunk size instead of 4K to 1M\n"
+	       "  -a  send to a sink that runs elsewhere\n"
+	       "  -l  run as a sink\n",
+		argv[0]);
+	return 1;
+}
@@ -36,6 +36,46 @@ int io_store_size_generic (uint8_t * buf, size_t len, size_t val);
 int io_parse_size_unrolled(const uint8_t * buf, size_t len, size_t * ret);
 int io_parse_size_generic (const uint8_t * buf, size_t len, size_t * ret);
 
+/*
+ *	round trips for the rest of the serializers
+ */
+void check_u64()
+{
+	uint8_t buf[16];
+	uint64_t v, w, tx_prev = 0, rx_prev = 0, seq = 0;
+	uint32_t v32;
+	uint16_t v16;
+	int i, r;
+
+	for (i=0; i<1000000; i++)
+	{
+		v = ((uint64_t)mrand48() << 32 | (uint32_t)mrand48()) >> (i & 63);
+
+		r = io_store_u64(buf, sizeof buf, v);
+		assert(r > 0 && r <= 10 && r == io_store_u64(NULL, 0, v));
+		assert(io_parse_u64(buf, r, &w) == r && w == v);
+		assert(io_parse_u64(buf, r-1, &w) == 0);
+
+		assert(io_store_be64(buf, sizeof buf, v) == 8);
+		assert(io_parse_be64(buf, 8, &w) == 8 && w == v);
+
+		assert(io_store_be32(buf, sizeof buf, (uint32_t)v) == 4);
+		assert(io_parse_be32(buf, 4, &v32) == 4 && v32 == (uint32_t)v);
+
+		assert(io_store_be16(buf, sizeof buf, (uint16_t)v) == 2);
+		assert(io_parse_be16(buf, 2, &v16) == 2 && v16 == (uint16_t)v);
+		assert(buf[0] == (uint8_t)(v >> 8));
+
+		seq += 1 + (i & 255);
+		r = io_store_seq(buf, sizeof buf, seq, &tx_prev);
+		assert(r > 0 && (i == 0 || r <= 2));
+		assert(io_parse_seq(buf, r, &w, &rx_prev) == r && w == seq);
+	}
+
+	memset(buf, 0xFF, sizeof buf);
+	assert(io_parse_u64(buf, sizeof buf, &w) == -1);
+}
+
 int main(int argc, char ** argv)
 {
 	uint64_t t0, t1;
@@ -47,6 +87,10 @@ int main(int argc, char ** argv)
 
 	srand48(usec());
 
+	printf("io_store_u64() and friends...  ");
+	check_u64();
+	printf("ok\n");
+
 	/*
 	 *
 	 */
@@ -63,7 +107,7 @@ int main(int argc, char ** argv)
 			io_store_size(buf, sizeof(buf), samples[i & 1023]);
 		}
 		t1 = usec();
-		printf("%llu usec\n", t1-t0);
+		printf("%llu usec\n", (unsigned long long)(t1-t0));
 
 		/*
 		 *
@@ -88,7 +132,7 @@ int main(int argc, char ** argv)
 				pos = 0;
 		}
 		t1 = usec();
-		printf("%llu usec\n", t1-t0);
+		printf("%llu usec\n", (unsigned long long)(t1-t0));
 	}
 
 	return 0;
@@ -0,0 +1,180 @@
+/*
+ *	The code is distributed under terms of the BSD license.
+ *	Copyright (c) 2014 Alex Pankratov. All rights reserved.
+ *
+ *	http://swapped.cc/bsd-license
+ */
+#include "libp/trace.h"
+#include "libp/io_pipe.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ *	Decodes a dump produced by trace_dump() into text, one
+ *	record per line, all threads merged in time order.
+ *
+ *	    usec  thread  object  event  value  state
+ *
+ *	'state' is io_pipe's state bits - y(ready), b(roken),
+ *	r(eadable), w(ritable), s(ent fin), f(in received).
+ */
+typedef struct entry entry;
+
+struct entry
+{
+	trace_rec  rec;
+	uint32_t   thread;
+};
+
+static const char * event_names[TR_EVENT_MAX] =
+{
+	"-",
+	"init",
+	"recv",
+	"send",
+	"send_fin",
+	"activity",
+	"discard"
+};
+
+static
+int by_ticks(const void * a, const void * b)
+{
+	uint64_t x = ((const entry *)a)->rec.ticks;
+	uint64_t y = ((const entry *)b)->rec.ticks;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static
+const char * state_to_str(uint state, char * buf)
+{
+	static const char flags[] = "ybrwsf";
+	size_t i;
+
+	for (i=0; i<6; i++)
+		buf[i] = (state & (1 << i)) ? flags[i] : '-';
+
+	buf[i] = 0;
+	return buf;
+}
+
+static
+const char * events_to_str(uint events, char * buf)
+{
+	char * p = buf;
+
+	if (events & IO_EV_ready)    *p++ = 'y';
+	if (events & IO_EV_broken)   *p++ = 'b';
+	if (events & IO_EV_readable) *p++ = 'r';
+	if (events & IO_EV_writable) *p++ = 'w';
+	if (events & IO_EV_fin_sent) *p++ = 's';
+
+	*p = 0;
+	return buf;
+}
+
+int main(int argc, char ** argv)
+{
+	trace_file_hdr  hdr;
+	trace_file_ring frh;
+	entry * all = NULL;
+	size_t total = 0;
+	double usec_per_tick;
+	uint64_t base;
+	char state[8], events[8];
+	FILE * fh;
+	size_t i, j;
+
+	if (argc != 2)
+	{
+		printf("Syntax: %s <trace-file>\n", argv[0]);
+		return 1;
+	}
+
+	fh = fopen(argv[1], "rb");
+	if (! fh)
+	{
+		printf("can't open %s\n", argv[1]);
+		return 2;
+	}
+
+	if (fread(&hdr, sizeof hdr, 1, fh) != 1 ||
+	    hdr.magic != TRACE_FILE_MAGIC ||
+	    hdr.version != TRACE_FILE_VERSION ||
+	    hdr.rec_size != sizeof(trace_rec))
+	{
+		printf("%s is not a trace file or it's of a different version\n", argv[1]);
+		return 3;
+	}
+
+	/*
+	 *	slurp
+	 */
+	for (i=0; i<hdr.rings; i++)
+	{
+		if (fread(&frh, sizeof frh, 1, fh) != 1)
+			break;
+
+		all = realloc(all, (total + frh.count) * sizeof *all);
+		if (! all)
+			return 4;
+
+		for (j=0; j<frh.count; j++, total++)
+		{
+			if (fread(&all[total].rec, sizeof(trace_rec), 1, fh) != 1)
+				break;
+
+			all[total].thread = frh.thread;
+		}
+	}
+
+	fclose(fh);
+
+	if (! total)
+	{
+		printf("no records\n");
+		return 0;
+	}
+
+	qsort(all, total, sizeof *all, by_ticks);
+
+	/*
+	 *	ticks -> usec
+	 */
+	usec_per_tick = 1.0;
+	if (hdr.ticks1 > hdr.ticks0)
+		usec_per_tick = (double)(hdr.usec1 - hdr.usec0) /
+		                (double)(hdr.ticks1 - hdr.ticks0);
+
+	base = all[0].rec.ticks;
+
+	printf("%u thread(s), %llu records, %.3f ms\n\n",
+		hdr.rings, (unsigned long long)total,
+		(all[total-1].rec.ticks - base) * usec_per_tick / 1000);
+
+	for (i=0; i<total; i++)
+	{
+		const trace_rec * r = &all[i].rec;
+		const char * name;
+
+		name = (r->event < TR_EVENT_MAX) ? event_names[r->event] : "?";
+
+		printf("%14.3f  t%-3u %08x  %-8s ",
+			(r->ticks - base) * usec_per_tick,
+			all[i].thread, r->obj, name);
+
+		if (r->event == TR_PIPE_ACTIVITY)
+			printf(" %-10s", events_to_str(r->val, events));
+		else
+			printf(" %-10d", r->val);
+
+		printf(" %s\n", state_to_str(r->state, state));
+	}
+
+	free(all);
+	return 0;
+}
+